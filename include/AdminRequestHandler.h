@@ -0,0 +1,134 @@
+#ifndef DEADLOCK_EXAMPLE_ADMIN_REQUESTHANDLER_INCLUDED
+#define DEADLOCK_EXAMPLE_ADMIN_REQUESTHANDLER_INCLUDED
+
+#include "General.h"
+
+#include "Common.h"
+#include "Database.h"
+#include "RequestHandler.h"
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace PapierMache {
+
+    inline std::string lockEventTypeName(const DbStuff::LockEvent::Type type)
+    {
+        switch (type) {
+        case DbStuff::LockEvent::Type::WAIT:
+            return "WAIT";
+        case DbStuff::LockEvent::Type::ABANDONED:
+            return "ABANDONED";
+        case DbStuff::LockEvent::Type::DEADLOCK:
+            return "DEADLOCK";
+        default:
+            return "UNKNOWN";
+        }
+    }
+
+    inline HandlerResult jsonResult(const std::string &json)
+    {
+        HandlerResult hr{};
+        hr.status = HttpResponseStatusCode::OK;
+        hr.mediaType = "application/json";
+        hr.responseBody = toBytesFromString(json);
+        return hr;
+    }
+
+    // 直近のロックの待ちとデッドロックを古い順に返す
+    class AdminLockEventsHandler : public RequestHandler {
+    public:
+        AdminLockEventsHandler(std::initializer_list<HttpRequestMethod> supportMethods)
+            : RequestHandler{supportMethods}
+        {
+        }
+
+        virtual ~AdminLockEventsHandler() {}
+
+        virtual HandlerResult handle(const HttpRequest request)
+        {
+            DEBUG_LOG << "----------------------AdminLockEventsHandler::handle";
+            if (!isSupport(request.method)) {
+                HandlerResult hr{};
+                hr.status = HttpResponseStatusCode::METHOD_NOT_ALLOWED;
+                return hr;
+            }
+
+            std::ostringstream data{""};
+            data << "[";
+            bool isFirst = true;
+            for (const DbStuff::LockEvent &e : db().lockEvents()) {
+                if (!isFirst) {
+                    data << ",";
+                }
+                isFirst = false;
+                data << "{\"type\": " << setDq(lockEventTypeName(e.type))
+                     << ", \"time\": " << setDq(e.time)
+                     << ", \"table\": " << setDq(e.tableName)
+                     << ", \"transactions\": [";
+                for (size_t i = 0; i < e.transactions.size(); ++i) {
+                    if (i != 0) {
+                        data << ",";
+                    }
+                    data << e.transactions[i];
+                }
+                data << "], \"row\": " << e.rowIndex
+                     << ", \"waitMilliseconds\": " << e.waitMilliseconds
+                     << ", \"victim\": " << e.victim << "}";
+            }
+            data << "]";
+            return jsonResult("{\"result\": 0, \"data\": " + data.str() + "}");
+        }
+    };
+
+    // 直近のロックの待ちをテーブルと行ごとに集計して返す
+    // 行番号が-1のものは表ロックの待ち
+    class AdminHeatmapHandler : public RequestHandler {
+    public:
+        AdminHeatmapHandler(std::initializer_list<HttpRequestMethod> supportMethods)
+            : RequestHandler{supportMethods}
+        {
+        }
+
+        virtual ~AdminHeatmapHandler() {}
+
+        virtual HandlerResult handle(const HttpRequest request)
+        {
+            DEBUG_LOG << "----------------------AdminHeatmapHandler::handle";
+            if (!isSupport(request.method)) {
+                HandlerResult hr{};
+                hr.status = HttpResponseStatusCode::METHOD_NOT_ALLOWED;
+                return hr;
+            }
+
+            std::ostringstream data{""};
+            data << "{";
+            bool isFirstTable = true;
+            for (const auto &table : db().lockHeatmap()) {
+                if (!isFirstTable) {
+                    data << ",";
+                }
+                isFirstTable = false;
+                data << setDq(table.first) << ": [";
+                bool isFirstRow = true;
+                for (const auto &row : table.second) {
+                    if (!isFirstRow) {
+                        data << ",";
+                    }
+                    isFirstRow = false;
+                    data << "{\"row\": " << row.first
+                         << ", \"waits\": " << row.second.waits
+                         << ", \"waitMilliseconds\": " << row.second.waitMilliseconds << "}";
+                }
+                data << "]";
+            }
+            data << "}";
+            return jsonResult("{\"result\": 0, \"data\": " + data.str() + "}");
+        }
+    };
+
+} // namespace PapierMache
+
+#endif // DEADLOCK_EXAMPLE_ADMIN_REQUESTHANDLER_INCLUDED
@@ -0,0 +1,355 @@
+#ifndef DEADLOCK_EXAMPLE_BINARY_PROTOCOL_INCLUDED
+#define DEADLOCK_EXAMPLE_BINARY_PROTOCOL_INCLUDED
+
+#include "General.h"
+
+#include "Common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace PapierMache::DbStuff::BinaryProtocol {
+
+    // DriverとDatabaseの間のバイナリ形式の処理結果
+    // コネクションごとにPLEASE:PROTOCOL BINARYで切り替える(既定はテキスト形式)
+    // 整数はリトルエンディアン 値は列のバイト数の固定長で文字列の場合は後ろを0で埋める
+    // [u32 以降のバイト数][u8 形式の版][i8 結果コード]
+    // [u16 テーブル名のバイト数][テーブル名]
+    // [u16 列数] 列ごとに [u8 型][u16 列名のバイト数][列名][u32 列のバイト数]
+    // [u32 行数] 行ごとに列の順に各列の値(行優先)
+    // [u32 メッセージのバイト数][メッセージ]
+    constexpr std::uint8_t VERSION = 1;
+
+    enum class ColumnType : std::uint8_t {
+        UNKNOWN = 0,
+        STRING = 1,
+        PASSWORD = 2,
+        DATETIME = 3
+    };
+
+    // tables.iniの型名から変換する
+    inline ColumnType toColumnType(const std::string &type)
+    {
+        if (type == "string") {
+            return ColumnType::STRING;
+        }
+        if (type == "password") {
+            return ColumnType::PASSWORD;
+        }
+        if (type == "datetime") {
+            return ColumnType::DATETIME;
+        }
+        return ColumnType::UNKNOWN;
+    }
+
+    struct ColumnDescriptor {
+        std::string name;
+        ColumnType type;
+        std::uint32_t size;
+    };
+
+    struct Frame {
+        char code = 0;
+        std::string tableName;
+        std::vector<ColumnDescriptor> columns;
+        std::uint32_t rowCount = 0;
+        // 全ての行の値を行優先で並べたもの
+        std::vector<std::byte> rows;
+        std::string message;
+
+        // 1行のバイト数
+        size_t rowSize() const
+        {
+            size_t size = 0;
+            for (const ColumnDescriptor &c : columns) {
+                size += c.size;
+            }
+            return size;
+        }
+    };
+
+    // outの内容を置き換えて書き込む
+    // 送受信用のバッファを渡せば確保済みの領域をそのまま使う
+    class Writer {
+    public:
+        explicit Writer(std::vector<std::byte> &out)
+            : bytes_{out}
+        {
+            bytes_.clear();
+            // 先頭にフレームのバイト数を書き込む場所を確保する
+            bytes_.resize(4);
+        }
+
+        void u8(const std::uint8_t v)
+        {
+            bytes_.push_back(static_cast<std::byte>(v));
+        }
+
+        void u16(const std::uint16_t v)
+        {
+            u8(static_cast<std::uint8_t>(v & 0xFF));
+            u8(static_cast<std::uint8_t>((v >> 8) & 0xFF));
+        }
+
+        void u32(const std::uint32_t v)
+        {
+            for (int i = 0; i < 4; ++i) {
+                u8(static_cast<std::uint8_t>((v >> (8 * i)) & 0xFF));
+            }
+        }
+
+        // 先頭からsize分を書き込む 足りない分は0で埋める
+        void bytes(const void *p, const size_t length, const size_t size)
+        {
+            const size_t current = bytes_.size();
+            bytes_.resize(current + size);
+            std::memcpy(bytes_.data() + current, p, length < size ? length : size);
+        }
+
+        void reserve(const size_t size)
+        {
+            bytes_.reserve(size);
+        }
+
+        // 先頭にフレームのバイト数を書き込む
+        void finish()
+        {
+            const size_t length = bytes_.size() - 4;
+            if (length > UINT32_MAX) {
+                throw std::runtime_error{"binary frame is too large." + FILE_INFO};
+            }
+            for (int i = 0; i < 4; ++i) {
+                bytes_[i] = static_cast<std::byte>((length >> (8 * i)) & 0xFF);
+            }
+        }
+
+    private:
+        std::vector<std::byte> &bytes_;
+    };
+
+    class Reader {
+    public:
+        explicit Reader(const std::vector<std::byte> &data)
+            : data_{data},
+              position_{0}
+        {
+        }
+
+        std::uint8_t u8()
+        {
+            require(1);
+            return static_cast<std::uint8_t>(data_[position_++]);
+        }
+
+        std::uint16_t u16()
+        {
+            const std::uint16_t low = u8();
+            const std::uint16_t high = u8();
+            return static_cast<std::uint16_t>(low | (high << 8));
+        }
+
+        std::uint32_t u32()
+        {
+            std::uint32_t v = 0;
+            for (int i = 0; i < 4; ++i) {
+                v |= static_cast<std::uint32_t>(u8()) << (8 * i);
+            }
+            return v;
+        }
+
+        std::string str(const size_t length)
+        {
+            require(length);
+            std::string s(reinterpret_cast<const char *>(data_.data() + position_), length);
+            position_ += length;
+            return s;
+        }
+
+        // length分をoutの末尾にまとめて写す
+        void bytes(const size_t length, std::vector<std::byte> &out)
+        {
+            require(length);
+            out.insert(out.end(), data_.begin() + position_, data_.begin() + position_ + length);
+            position_ += length;
+        }
+
+    private:
+        void require(const size_t length) const
+        {
+            if (data_.size() < position_ || data_.size() - position_ < length) {
+                throw std::runtime_error{"binary frame is truncated." + FILE_INFO};
+            }
+        }
+
+        const std::vector<std::byte> &data_;
+        size_t position_;
+    };
+
+    // frame.rowsの代わりにrowsを行の値としてoutに書き込む
+    // データファイルから読み込んだ行の内容をFrameに写さずにそのまま送る場合に用いる
+    inline void encode(const Frame &frame, const std::vector<std::byte> &rows, std::vector<std::byte> &out)
+    {
+        Writer w{out};
+        w.reserve(64 + frame.tableName.size() + frame.message.size() + rows.size() + frame.columns.size() * 16);
+        w.u8(VERSION);
+        w.u8(static_cast<std::uint8_t>(frame.code));
+        w.u16(static_cast<std::uint16_t>(frame.tableName.size()));
+        w.bytes(frame.tableName.data(), frame.tableName.size(), frame.tableName.size());
+        w.u16(static_cast<std::uint16_t>(frame.columns.size()));
+        for (const ColumnDescriptor &c : frame.columns) {
+            w.u8(static_cast<std::uint8_t>(c.type));
+            w.u16(static_cast<std::uint16_t>(c.name.size()));
+            w.bytes(c.name.data(), c.name.size(), c.name.size());
+            w.u32(c.size);
+        }
+        w.u32(frame.rowCount);
+        w.bytes(rows.data(), rows.size(), rows.size());
+        w.u32(static_cast<std::uint32_t>(frame.message.size()));
+        w.bytes(frame.message.data(), frame.message.size(), frame.message.size());
+        w.finish();
+    }
+
+    inline std::vector<std::byte> encode(const Frame &frame)
+    {
+        std::vector<std::byte> out;
+        encode(frame, frame.rows, out);
+        return out;
+    }
+
+    inline Frame decode(const std::vector<std::byte> &data)
+    {
+        Reader r{data};
+        const std::uint32_t length = r.u32();
+        if (length != data.size() - 4) {
+            throw std::runtime_error{"binary frame length does not match." + FILE_INFO};
+        }
+        const std::uint8_t version = r.u8();
+        if (version != VERSION) {
+            throw std::runtime_error{"unsupported binary frame version: " + std::to_string(version) + FILE_INFO};
+        }
+        Frame frame{};
+        frame.code = static_cast<char>(r.u8());
+        frame.tableName = r.str(r.u16());
+        const std::uint16_t columnCount = r.u16();
+        for (std::uint16_t i = 0; i < columnCount; ++i) {
+            ColumnDescriptor c{};
+            c.type = static_cast<ColumnType>(r.u8());
+            c.name = r.str(r.u16());
+            c.size = r.u32();
+            frame.columns.push_back(std::move(c));
+        }
+        frame.rowCount = r.u32();
+        r.bytes(frame.rowCount * frame.rowSize(), frame.rows);
+        frame.message = r.str(r.u32());
+        return frame;
+    }
+
+    // 受信した行を列名と値のマップにせずに読む
+    // 値は受信したバイト列を指すので このオブジェクトより長く保持しないこと
+    class RowView {
+    public:
+        RowView()
+            : frame_{},
+              offsets_{},
+              rowSize_{0}
+        {
+        }
+
+        explicit RowView(Frame &&frame)
+            : frame_{std::move(frame)},
+              offsets_{},
+              rowSize_{0}
+        {
+            for (const ColumnDescriptor &c : frame_.columns) {
+                offsets_.push_back(rowSize_);
+                rowSize_ += c.size;
+            }
+        }
+
+        // 行数
+        size_t size() const { return frame_.rowCount; }
+        bool empty() const { return frame_.rowCount == 0; }
+        const std::vector<ColumnDescriptor> &columns() const { return frame_.columns; }
+
+        // 列名から列の添字を返す
+        size_t columnIndex(const std::string &name) const
+        {
+            for (size_t i = 0; i < frame_.columns.size(); ++i) {
+                if (frame_.columns[i].name == name) {
+                    return i;
+                }
+            }
+            throw std::runtime_error{"cannot find column: " + name + FILE_INFO};
+        }
+
+        // 固定長の値をそのまま返す 文字列の後ろの0も含む
+        std::string_view value(const size_t row, const size_t column) const
+        {
+            if (row >= size() || column >= frame_.columns.size()) {
+                throw std::runtime_error{"row or column is out of range." + FILE_INFO};
+            }
+            const char *p = reinterpret_cast<const char *>(frame_.rows.data()) + row * rowSize_ + offsets_[column];
+            return std::string_view{p, frame_.columns[column].size};
+        }
+
+        std::string_view value(const size_t row, const std::string &name) const
+        {
+            return value(row, columnIndex(name));
+        }
+
+        // 後ろの0を除いた文字列
+        std::string str(const size_t row, const std::string &name) const
+        {
+            const std::string_view v = value(row, name);
+            const size_t end = v.find('\0');
+            return std::string{end == std::string_view::npos ? v : v.substr(0, end)};
+        }
+
+    private:
+        Frame frame_;
+        // 列ごとの行頭からのオフセット
+        std::vector<size_t> offsets_;
+        size_t rowSize_;
+    };
+
+    // PLEASE:BATCHの処理結果 処理結果の形式によらずこの形式で返す
+    // [u32 以降のバイト数][u32 処理結果の数] 処理結果ごとに [u32 処理結果のバイト数][処理結果]
+    inline void encodeBatch(const std::vector<std::vector<std::byte>> &responses, std::vector<std::byte> &out)
+    {
+        Writer w{out};
+        size_t size = 4;
+        for (const std::vector<std::byte> &r : responses) {
+            size += 4 + r.size();
+        }
+        w.reserve(4 + size);
+        w.u32(static_cast<std::uint32_t>(responses.size()));
+        for (const std::vector<std::byte> &r : responses) {
+            w.u32(static_cast<std::uint32_t>(r.size()));
+            w.bytes(r.data(), r.size(), r.size());
+        }
+        w.finish();
+    }
+
+    inline std::vector<std::vector<std::byte>> decodeBatch(const std::vector<std::byte> &data)
+    {
+        Reader r{data};
+        const std::uint32_t length = r.u32();
+        if (length != data.size() - 4) {
+            throw std::runtime_error{"batch frame length does not match." + FILE_INFO};
+        }
+        const std::uint32_t count = r.u32();
+        std::vector<std::vector<std::byte>> responses(count);
+        for (std::uint32_t i = 0; i < count; ++i) {
+            r.bytes(r.u32(), responses[i]);
+        }
+        return responses;
+    }
+
+} // namespace PapierMache::DbStuff::BinaryProtocol
+
+#endif // DEADLOCK_EXAMPLE_BINARY_PROTOCOL_INCLUDED
@@ -8,7 +8,9 @@
 #include "Database.h"
 #include "RequestHandler.h"
 
+#include <chrono>
 #include <map>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -80,6 +82,94 @@ namespace PapierMache {
         return result;
     }
 
+    // デッドロックや競合で中止されたトランザクションを再実行する際の設定
+    inline DbStuff::Driver::RetryPolicy retryPolicy()
+    {
+        return DbStuff::Driver::RetryPolicy{getValue<int>(webConfiguration, "retry", "MAX_ATTEMPTS"),
+                                            std::chrono::milliseconds{getValue<long long>(webConfiguration, "retry", "BASE_DELAY_MILLISECONDS")},
+                                            std::chrono::milliseconds{getValue<long long>(webConfiguration, "retry", "MAX_DELAY_MILLISECONDS")}};
+    }
+
+    // データベースのセッションを要求をまたいで使い回す
+    // パスワードのハッシュ値を計算するPLEASE:USERを送るのは最初の要求とセッションの期限切れの後だけになる
+    class DbSession {
+    public:
+        // driverのコネクションを認証する
+        static DbStuff::Driver::Result authenticate(DbStuff::Driver &driver)
+        {
+            const std::string token = current();
+            if (token != "") {
+                DbStuff::Driver::Result r = driver.resumeSession(token);
+                if (r.code != static_cast<char>(DbStuff::ResultCode::UNAUTHENTICATED)) {
+                    return r;
+                }
+                invalidate(token);
+            }
+            return open(driver);
+        }
+
+        // 認証する文を送信の先頭に加えられるようにfに渡して実行する
+        // fはdriverで送る最初の送信の先頭に引数の文を加えること 認証済みであれば空が渡される
+        // セッションの期限切れで失敗した場合は発行し直してから1度だけやり直す
+        template <typename F>
+        static DbStuff::Driver::Result execute(DbStuff::Driver &driver, F f)
+        {
+            const std::string token = current();
+            if (token != "") {
+                DbStuff::Driver::Result r = f(std::vector<std::string>{"please:session " + token});
+                if (r.code != static_cast<char>(DbStuff::ResultCode::UNAUTHENTICATED)) {
+                    return r;
+                }
+                invalidate(token);
+            }
+            DbStuff::Driver::Result r = open(driver);
+            if (!r.isSucceed) {
+                return r;
+            }
+            return f(std::vector<std::string>{});
+        }
+
+    private:
+        // ユーザー名とパスワードで認証してセッションを発行する
+        static DbStuff::Driver::Result open(DbStuff::Driver &driver)
+        {
+            DbStuff::Driver::Result r = driver.openSession(getValue<std::string>(webConfiguration, "database", "USER_NAME"),
+                                                           getValue<std::string>(webConfiguration, "database", "PASSWORD"));
+            if (r.isSucceed) {
+                std::lock_guard<std::mutex> lock{mt()};
+                token() = r.message;
+            }
+            return r;
+        }
+
+        // 他の要求が既に発行し直していればそのセッションは残す
+        static void invalidate(const std::string &expired)
+        {
+            std::lock_guard<std::mutex> lock{mt()};
+            if (token() == expired) {
+                token() = "";
+            }
+        }
+
+        static std::string current()
+        {
+            std::lock_guard<std::mutex> lock{mt()};
+            return token();
+        }
+
+        static std::mutex &mt()
+        {
+            static std::mutex mt;
+            return mt;
+        }
+
+        static std::string &token()
+        {
+            static std::string token;
+            return token;
+        }
+    };
+
     class Cleaner {
     public:
         Cleaner(DbStuff::Connection &con)
@@ -116,21 +206,11 @@ namespace PapierMache {
             DbStuff::Connection con = db().getConnection();
             Cleaner cleaner{con};
             DbStuff::Driver driver(con);
-            std::string user = getValue<std::string>(webConfiguration, "database", "USER_NAME");
-            std::string password = getValue<std::string>(webConfiguration, "database", "USER_NAME");
-            DbStuff::Driver::Result r = driver.sendQuery("please:user " + getValue<std::string>(webConfiguration, "database", "USER_NAME") +
-                                                         " " + getValue<std::string>(webConfiguration, "database", "PASSWORD"));
-
-            r = driver.sendQuery("please:transaction");
-            if (!r.isSucceed) {
-                std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_1")) + "}";
-                HandlerResult hr{};
-                hr.status = HttpResponseStatusCode::OK;
-                hr.mediaType = "application/json";
-                hr.responseBody = toBytesFromString(resultJson);
-                return hr;
-            }
-            r = driver.sendQuery("please: select order");
+            // セッションでの認証からコミットまでを1回の送受信で行う
+            // 読み込みだけなのでread onlyで開始し トランザクションIDの採番とテーブルごとのコミットを省く
+            DbStuff::Driver::Result r = DbSession::execute(driver, [&driver](const std::vector<std::string> &preamble) {
+                return driver.executeBatchTransaction({"please: select order"}, "read only", retryPolicy(), preamble);
+            });
             if (!r.isSucceed) {
                 std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_1")) + "}";
                 HandlerResult hr{};
@@ -216,30 +296,11 @@ namespace PapierMache {
             DbStuff::Connection con = db().getConnection();
             Cleaner cleaner{con};
             DbStuff::Driver driver(con);
-            std::string user = getValue<std::string>(webConfiguration, "database", "USER_NAME");
-            std::string password = getValue<std::string>(webConfiguration, "database", "USER_NAME");
-            DbStuff::Driver::Result r = driver.sendQuery("please:user " + getValue<std::string>(webConfiguration, "database", "USER_NAME") +
-                                                         " " + getValue<std::string>(webConfiguration, "database", "PASSWORD"));
-
-            r = driver.sendQuery("please:transaction");
-            if (!r.isSucceed) {
-                std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_2")) + "}";
-                HandlerResult hr{};
-                hr.status = HttpResponseStatusCode::OK;
-                hr.mediaType = "application/json";
-                hr.responseBody = toBytesFromString(resultJson);
-                return hr;
-            }
-            r = driver.sendQuery("please:insert  order (ORDER_NAME=" + setDq(data.at("orderName")) + ", CUSTOMER_NAME=" + setDq(data.at("customerName")) + ", PRODUCT_NAME=" + setDq(data.at("productName")) + ")");
-            if (!r.isSucceed) {
-                std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_2")) + "}";
-                HandlerResult hr{};
-                hr.status = HttpResponseStatusCode::OK;
-                hr.mediaType = "application/json";
-                hr.responseBody = toBytesFromString(resultJson);
-                return hr;
-            }
-            r = driver.sendQuery("please:commit");
+            // セッションでの認証からコミットまでを1回の送受信で行う
+            const std::string query = "please:insert  order (ORDER_NAME=" + setDq(data.at("orderName")) + ", CUSTOMER_NAME=" + setDq(data.at("customerName")) + ", PRODUCT_NAME=" + setDq(data.at("productName")) + ")";
+            DbStuff::Driver::Result r = DbSession::execute(driver, [&driver, &query](const std::vector<std::string> &preamble) {
+                return driver.executeBatchTransaction({query}, "", retryPolicy(), preamble);
+            });
             if (!r.isSucceed) {
                 std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_2")) + "}";
                 HandlerResult hr{};
@@ -281,30 +342,10 @@ namespace PapierMache {
             DbStuff::Connection con = db().getConnection();
             Cleaner cleaner{con};
             DbStuff::Driver driver(con);
-            std::string user = getValue<std::string>(webConfiguration, "database", "USER_NAME");
-            std::string password = getValue<std::string>(webConfiguration, "database", "USER_NAME");
-            DbStuff::Driver::Result r = driver.sendQuery("please:user " + getValue<std::string>(webConfiguration, "database", "USER_NAME") +
-                                                         " " + getValue<std::string>(webConfiguration, "database", "PASSWORD"));
-
-            r = driver.sendQuery("please:transaction");
-            if (!r.isSucceed) {
-                std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_4")) + "}";
-                HandlerResult hr{};
-                hr.status = HttpResponseStatusCode::OK;
-                hr.mediaType = "application/json";
-                hr.responseBody = toBytesFromString(resultJson);
-                return hr;
-            }
-            r = driver.sendQuery("please:delete  order )");
-            if (!r.isSucceed) {
-                std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_4")) + "}";
-                HandlerResult hr{};
-                hr.status = HttpResponseStatusCode::OK;
-                hr.mediaType = "application/json";
-                hr.responseBody = toBytesFromString(resultJson);
-                return hr;
-            }
-            r = driver.sendQuery("please:commit");
+            // セッションでの認証からコミットまでを1回の送受信で行う
+            DbStuff::Driver::Result r = DbSession::execute(driver, [&driver](const std::vector<std::string> &preamble) {
+                return driver.executeBatchTransaction({"please:delete  order )"}, "", retryPolicy(), preamble);
+            });
             if (!r.isSucceed) {
                 std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_4")) + "}";
                 HandlerResult hr{};
@@ -389,34 +430,7 @@ namespace PapierMache {
             controller.add(con);
             Cleaner cleaner{con};
             DbStuff::Driver driver(con);
-            std::string user = getValue<std::string>(webConfiguration, "database", "USER_NAME");
-            std::string password = getValue<std::string>(webConfiguration, "database", "USER_NAME");
-            DbStuff::Driver::Result r = driver.sendQuery("please:user " + getValue<std::string>(webConfiguration, "database", "USER_NAME") +
-                                                         " " + getValue<std::string>(webConfiguration, "database", "PASSWORD"));
-
-            r = driver.sendQuery("please:transaction");
-            if (!r.isSucceed) {
-                std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_3")) + "}";
-                HandlerResult hr{};
-                hr.status = HttpResponseStatusCode::OK;
-                hr.mediaType = "application/json";
-                hr.responseBody = toBytesFromString(resultJson);
-                return hr;
-            }
-            std::string now = getLocalTimeStr();
-            r = driver.sendQuery("please:update  order (PRODUCT_NAME=" + setDq(data1.at("productName")) + ", DATETIME=" + setDq(now) + ") (ORDER_NAME=" + setDq(data1.at("orderName")) + ")");
-            if (!r.isSucceed) {
-                std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_3")) + "}";
-                HandlerResult hr{};
-                hr.status = HttpResponseStatusCode::OK;
-                hr.mediaType = "application/json";
-                hr.responseBody = toBytesFromString(resultJson);
-                return hr;
-            }
-            // デッドロックを起こしやすくするためにsleepする
-            std::this_thread::sleep_for(std::chrono::seconds(2));
-            now = getLocalTimeStr();
-            r = driver.sendQuery("please:update  order (PRODUCT_NAME=" + setDq(data2.at("productName")) + ", DATETIME=" + setDq(now) + ") (ORDER_NAME=" + setDq(data2.at("orderName")) + ")");
+            DbStuff::Driver::Result r = DbSession::authenticate(driver);
             if (!r.isSucceed) {
                 std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_3")) + "}";
                 HandlerResult hr{};
@@ -425,7 +439,20 @@ namespace PapierMache {
                 hr.responseBody = toBytesFromString(resultJson);
                 return hr;
             }
-            r = driver.sendQuery("please:commit");
+
+            // デッドロックの犠牲者になった場合は相手のコミット後に最初からやり直す
+            auto operation = [&data1, &data2](DbStuff::Driver &d) {
+                std::string now = getLocalTimeStr();
+                DbStuff::Driver::Result result = d.sendQuery("please:update  order (PRODUCT_NAME=" + setDq(data1.at("productName")) + ", DATETIME=" + setDq(now) + ") (ORDER_NAME=" + setDq(data1.at("orderName")) + ")");
+                if (!result.isSucceed) {
+                    return result;
+                }
+                // デッドロックを起こしやすくするためにsleepする
+                std::this_thread::sleep_for(std::chrono::seconds(2));
+                now = getLocalTimeStr();
+                return d.sendQuery("please:update  order (PRODUCT_NAME=" + setDq(data2.at("productName")) + ", DATETIME=" + setDq(now) + ") (ORDER_NAME=" + setDq(data2.at("orderName")) + ")");
+            };
+            r = driver.executeTransaction(operation, "", retryPolicy());
             if (!r.isSucceed) {
                 std::string resultJson = "{\"result\": -1, \"message\": " + setDq(getValue<std::string>(webConfiguration, "messages", "ERROR_3")) + "}";
                 HandlerResult hr{};
@@ -4,25 +4,35 @@
 #include "General.h"
 
 #include "BCryptHash.h"
+#include "BinaryProtocol.h"
 #include "Common.h"
 #include "Datafile.h"
 #include "Logger.h"
-#include "ThreadsMap.h"
+#include "Mailbox.h"
 #include "UUID.h"
 #include "Utils.h"
+#include "WorkerPool.h"
 
 #include <algorithm>
-#include <array>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <exception>
+#include <limits>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <random>
+#include <set>
 #include <shared_mutex>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace PapierMache::DbStuff {
@@ -92,6 +102,119 @@ namespace PapierMache::DbStuff {
         std::mutex mt_;
     };
 
+    // IdGeneratorの再利用モードと同じ規則でidを払い出すロックを使わないジェネレータ
+    // 使用中のidをビットマップで管理しCASでビットを立てて取得する
+    // 前回払い出したidの次から探すので払い出し順はIdGeneratorと同様に昇順で一周したら先頭に戻る
+    // 同時に使用できるidの数はcapacityまで(valueTの最大値 - 1を超える分は切り詰める)
+    template <typename valueT>
+    class LockFreeIdGenerator {
+    public:
+        LockFreeIdGenerator(valueT initialValue, size_t capacity)
+            : initialValue_{initialValue},
+              size_{rangeSize(initialValue, capacity)},
+              bits_((size_ + BITS_PER_WORD - 1) / BITS_PER_WORD),
+              cursor_{0}
+        {
+            for (auto &w : bits_) {
+                w.store(0, std::memory_order_relaxed);
+            }
+            // 末尾の範囲外のビットは使用中にしておく
+            const size_t rest = size_ % BITS_PER_WORD;
+            if (rest != 0) {
+                bits_.back().store(~((std::uint64_t{1} << rest) - 1), std::memory_order_relaxed);
+            }
+        }
+
+        // コピー禁止
+        LockFreeIdGenerator(const LockFreeIdGenerator &) = delete;
+        LockFreeIdGenerator &operator=(const LockFreeIdGenerator &) = delete;
+        // ムーブ禁止
+        LockFreeIdGenerator(LockFreeIdGenerator &&) = delete;
+        LockFreeIdGenerator &operator=(LockFreeIdGenerator &&) = delete;
+
+        valueT getId()
+        {
+            const size_t wordCount = bits_.size();
+            const size_t start = cursor_.load(std::memory_order_relaxed) % size_;
+            const size_t startWord = start / BITS_PER_WORD;
+            // 開始位置のワードは前回の続きから探し 一周したら残りの下位ビットも探す
+            for (size_t n = 0; n <= wordCount; ++n) {
+                const size_t w = (startWord + n) % wordCount;
+                std::uint64_t lowerMask = 0;
+                if (n == 0) {
+                    lowerMask = (std::uint64_t{1} << (start % BITS_PER_WORD)) - 1;
+                }
+                std::uint64_t word = bits_[w].load(std::memory_order_relaxed);
+                while (true) {
+                    const std::uint64_t free = ~(word | lowerMask);
+                    if (free == 0) {
+                        break;
+                    }
+                    const std::uint64_t bit = free & (~free + 1);
+                    if (bits_[w].compare_exchange_weak(word, word | bit, std::memory_order_acquire, std::memory_order_relaxed)) {
+                        const size_t index = w * BITS_PER_WORD + bitIndex(bit);
+                        cursor_.store(index + 1, std::memory_order_relaxed);
+                        return static_cast<valueT>(initialValue_ + index);
+                    }
+                    // 失敗した場合wordには最新の値が入っている
+                }
+            }
+            throw std::runtime_error{"all id value is used."};
+        }
+
+        void release(valueT id)
+        {
+            if (id < initialValue_) {
+                return;
+            }
+            const size_t index = static_cast<size_t>(id - initialValue_);
+            if (index >= size_) {
+                return;
+            }
+            bits_[index / BITS_PER_WORD].fetch_and(~(std::uint64_t{1} << (index % BITS_PER_WORD)), std::memory_order_release);
+        }
+
+    private:
+        static constexpr size_t BITS_PER_WORD = 64;
+
+        static size_t rangeSize(valueT initialValue, size_t capacity)
+        {
+#pragma push_macro("max")
+#undef max
+            // IdGeneratorと同じくvalueTの最大値は払い出さない
+            const long long limits = static_cast<long long>(std::numeric_limits<valueT>::max()) - static_cast<long long>(initialValue);
+#pragma pop_macro("max")
+            if (capacity == 0 || limits <= 0) {
+                throw std::invalid_argument{"capacity of id is zero."};
+            }
+            if (static_cast<unsigned long long>(limits) < capacity) {
+                return static_cast<size_t>(limits);
+            }
+            return capacity;
+        }
+
+        // 1ビットだけ立っている値のビット位置を返す
+        static size_t bitIndex(std::uint64_t bit)
+        {
+            size_t index = 0;
+            if ((bit & 0xFFFFFFFF00000000ULL) != 0) index += 32;
+            if ((bit & 0xFFFF0000FFFF0000ULL) != 0) index += 16;
+            if ((bit & 0xFF00FF00FF00FF00ULL) != 0) index += 8;
+            if ((bit & 0xF0F0F0F0F0F0F0F0ULL) != 0) index += 4;
+            if ((bit & 0xCCCCCCCCCCCCCCCCULL) != 0) index += 2;
+            if ((bit & 0xAAAAAAAAAAAAAAAAULL) != 0) index += 1;
+            return index;
+        }
+
+        const valueT initialValue_;
+        // 払い出すidの数
+        const size_t size_;
+        // 使用中のidのビットが立つ
+        std::vector<std::atomic<std::uint64_t>> bits_;
+        // 次に探し始める位置 正確である必要はないのでrelaxedで更新する
+        std::atomic<size_t> cursor_;
+    };
+
     class Database;
 
     class Connection {
@@ -109,15 +232,23 @@ namespace PapierMache::DbStuff {
                 return *this;
             }
             id_ = rhs.id_;
+            uuid_ = rhs.uuid_;
             pDb_ = rhs.pDb_;
             isInUse_ = rhs.isInUse_;
+            pMailbox_ = rhs.pMailbox_;
             return *this;
         }
 
         // 引数のデータを送信する
         bool send(const std::vector<std::byte> &data);
+        // 引数のバッファをコピーせずに送信する
+        bool send(Buffer data);
         // 引数にデータを受信する
         bool receive(std::vector<std::byte> &out);
+        // 引数に受信したバッファをコピーせずに設定する
+        bool receive(Buffer &out);
+        // 送信用の空のバッファを返す 使い終わったバッファは再利用される
+        Buffer newBuffer();
         // 送信したデータの処理を依頼する
         bool request();
         // 処理結果を待つ
@@ -130,47 +261,429 @@ namespace PapierMache::DbStuff {
         bool isClosed();
 
         const std::string id() const { return id_; }
+        // idと同じIDの128ビットの値 文字列を比較せずに検索できる
+        const UUID &uuid() const { return uuid_; }
 
     private:
-        Connection(const std::string id, Database &refDb)
-            : id_{id},
+        Connection(const UUID &uuid, Database &refDb, std::shared_ptr<Mailbox> pMailbox)
+            : id_{uuid.str()},
+              uuid_{uuid},
               pDb_{&refDb},
-              isInUse_{false}
+              isInUse_{false},
+              pMailbox_{pMailbox}
         {
         }
 
         std::string id_;
+        UUID uuid_;
         Database *pDb_;
         bool isInUse_;
+        // ワーカーとの送受信用 セッションと共有する
+        std::shared_ptr<Mailbox> pMailbox_;
+    };
+
+    // 処理に失敗した場合に処理結果の先頭に設定するコード 0以上は成功
+    enum class ResultCode : char {
+        FAILED = -1,
+        // デッドロックの犠牲者として停止した 最初からやり直せば成功する可能性がある
+        DEADLOCK_VICTIM = -2,
+        // 並行するトランザクションとの競合で中止した 最初からやり直せば成功する可能性がある
+        SERIALIZATION_FAILURE = -3,
+        // デッドロック以外の理由で停止した
+        TERMINATED = -4,
+        // セッションが見つからないか期限が切れている ユーザー名とパスワードで認証し直すこと
+        UNAUTHENTICATED = -5
     };
 
     class DatabaseException : public std::runtime_error {
     public:
-        DatabaseException(const char *message)
-            : std::runtime_error(message)
+        DatabaseException(const char *message, const ResultCode code = ResultCode::FAILED)
+            : std::runtime_error(message),
+              code_{code}
         {
         }
 
-        DatabaseException(const std::string message)
-            : std::runtime_error(message)
+        DatabaseException(const std::string message, const ResultCode code = ResultCode::FAILED)
+            : std::runtime_error(message),
+              code_{code}
         {
         }
+
+        ResultCode code() const
+        {
+            return code_;
+        }
+
+    private:
+        ResultCode code_;
     };
 
-    class Database {
+    // デッドロックの犠牲者を選ぶ際に比較するトランザクションの作業量
+    struct TransactionCost {
+        TRANSACTION_ID id;
+        std::string connectionId;
+        // 制御情報にトランザクションIDを書き込んだ行数
+        size_t rowsStamped;
+        // 未コミットの変更内容のバイト数
+        size_t pendingBytes;
+        // トランザクション開始からの経過時間
+        long long elapsedMilliseconds;
+    };
+
+    // デッドロックを解消する際にロールバックするトランザクションを選ぶ方針
+    class VictimSelectionPolicy {
+    public:
+        virtual ~VictimSelectionPolicy() = default;
+        // 循環待ちになっているトランザクションの中から犠牲者の添字を返す candidatesは空ではない
+        virtual size_t select(const std::vector<TransactionCost> &candidates) const = 0;
+    };
+
+    // 作業量を重み付けして合計した値が最も小さいトランザクションを犠牲者とする
+    // 同じ値であれば後から開始したトランザクションを選ぶ
+    class LeastWorkVictimPolicy : public VictimSelectionPolicy {
+    public:
+        LeastWorkVictimPolicy(const long long rowWeight = 100, const long long byteWeight = 1, const long long millisecondWeight = 1)
+            : rowWeight_{rowWeight},
+              byteWeight_{byteWeight},
+              millisecondWeight_{millisecondWeight}
+        {
+        }
+
+        size_t select(const std::vector<TransactionCost> &candidates) const override
+        {
+            size_t victim = 0;
+            for (size_t i = 1; i < candidates.size(); ++i) {
+                const long long c = cost(candidates[i]);
+                const long long v = cost(candidates[victim]);
+                if (c < v || (c == v && candidates[i].elapsedMilliseconds < candidates[victim].elapsedMilliseconds)) {
+                    victim = i;
+                }
+            }
+            return victim;
+        }
+
+    private:
+        long long cost(const TransactionCost &c) const
+        {
+            return static_cast<long long>(c.rowsStamped) * rowWeight_ + static_cast<long long>(c.pendingBytes) * byteWeight_ + c.elapsedMilliseconds * millisecondWeight_;
+        }
+
+        long long rowWeight_;
+        long long byteWeight_;
+        long long millisecondWeight_;
+    };
+
+    // トランザクションの分離レベル
+    // SNAPSHOT: 開始時点のスナップショットを読む 書き込みは行のロックで直列化する
+    // SERIALIZABLE: SNAPSHOTに加えて読み書きの依存関係を追跡し 直列化できない組み合わせをコミット時に中止する
+    enum class IsolationLevel {
+        SNAPSHOT,
+        SERIALIZABLE
+    };
+
+    // SERIALIZABLEのトランザクション間の読み書きの依存関係(rw-antidependency)を追跡する
+    // 読み込みは条件に合った行の位置と条件を 書き込みは変更する行の位置と変更後の内容をテーブルごとに記録する
+    // 読んだ行を変更するか 変更後の内容が読み込みの条件に合う(phantom)場合に依存とする
+    // 表ロック取得後の条件のみの変更は行を特定できないので そのテーブルを読んだ全てのトランザクションとの依存とする
+    // Tin -> Tpivot -> Tout の依存があり Toutが最初にコミットした場合のみ直列化できない可能性があるとして中止する
+    class SerializableConflictTracker {
     public:
-        using DataStream = std::vector<std::byte>;
+        // 列名と値
+        using Columns = std::map<std::string, std::vector<std::byte>>;
+
+        SerializableConflictTracker()
+            : lastSerial_{0},
+              lastPrepareOrder_{0}
+        {
+        }
+
+        // コピー禁止
+        SerializableConflictTracker(const SerializableConflictTracker &) = delete;
+        SerializableConflictTracker &operator=(const SerializableConflictTracker &) = delete;
+        // ムーブ禁止
+        SerializableConflictTracker(SerializableConflictTracker &&) = delete;
+        SerializableConflictTracker &operator=(SerializableConflictTracker &&) = delete;
+
+        void begin(const TRANSACTION_ID id, const TIMESTAMP snapshot)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            const std::uint64_t serial = ++lastSerial_;
+            Entry e{};
+            e.snapshot = snapshot;
+            entries_.insert(std::make_pair(serial, std::move(e)));
+            active_[id] = serial;
+        }
+
+        bool isTracked(const TRANSACTION_ID id)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            return active_.find(id) != active_.end();
+        }
+
+        // idがtableのテーブルをpredicatesの条件で読み positionsの行が条件に合った
+        // 並行するトランザクションの書き込みと重なれば id -> 書き込んだトランザクション の依存となる
+        // isTableLevelがtrueであれば読んだ行を特定できないので表全体を読んだものとする
+        // matchesは変更後の内容が条件に合えばtrueを返す関数
+        template <typename F>
+        void recordRead(const TRANSACTION_ID id, const size_t table,
+                        const std::vector<Columns> &predicates, const std::vector<LONGLONG> &positions,
+                        const bool isTableLevel, F matches)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = active_.find(id);
+            if (it == active_.end()) {
+                return;
+            }
+            const std::uint64_t reader = it->second;
+            Reads added{};
+            added.positions.insert(positions.begin(), positions.end());
+            added.predicates = predicates;
+            added.isTableLevel = isTableLevel;
+            for (const auto &e : entries_) {
+                if (e.first == reader || !isConcurrent(entries_.at(reader), e.second)) {
+                    continue;
+                }
+                auto w = e.second.writes.find(table);
+                if (w != e.second.writes.end() && conflicts(added, w->second, matches)) {
+                    addEdge(reader, e.first);
+                }
+            }
+            Reads &r = entries_.at(reader).reads[table];
+            r.positions.insert(added.positions.begin(), added.positions.end());
+            r.predicates.insert(r.predicates.end(), added.predicates.begin(), added.predicates.end());
+            r.isTableLevel = r.isTableLevel || added.isTableLevel;
+        }
+
+        // idがtableのテーブルにwritesを書き込む
+        // 並行するトランザクションの読み込みと重なれば 読んだトランザクション -> id の依存となる
+        template <typename F>
+        void recordWrite(const TRANSACTION_ID id, const size_t table, const std::vector<Datafile::PendingWrite> &writes, F matches)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = active_.find(id);
+            if (it == active_.end() || writes.empty()) {
+                return;
+            }
+            const std::uint64_t writer = it->second;
+            Writes added{};
+            for (const Datafile::PendingWrite &pw : writes) {
+                if (pw.isTableLevel) {
+                    added.isTableLevel = true;
+                    continue;
+                }
+                if (pw.position >= 0) {
+                    added.positions.insert(pw.position);
+                }
+                if (!pw.after.empty()) {
+                    added.afters.push_back(pw.after);
+                }
+            }
+            for (const auto &e : entries_) {
+                if (e.first == writer || !isConcurrent(entries_.at(writer), e.second)) {
+                    continue;
+                }
+                auto r = e.second.reads.find(table);
+                if (r != e.second.reads.end() && conflicts(r->second, added, matches)) {
+                    addEdge(e.first, writer);
+                }
+            }
+            Writes &w = entries_.at(writer).writes[table];
+            w.positions.insert(added.positions.begin(), added.positions.end());
+            w.afters.insert(w.afters.end(), added.afters.begin(), added.afters.end());
+            w.isTableLevel = w.isTableLevel || added.isTableLevel;
+        }
+
+        // コミット前の検証 直列化できない可能性があればfalseを返す
+        // trueを返した後は以降の検証でコミット済みとして扱う
+        bool prepare(const TRANSACTION_ID id)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = active_.find(id);
+            if (it == active_.end()) {
+                return true;
+            }
+            Entry &self = entries_.at(it->second);
+            bool hasOutToPrepared = false;
+            for (const std::uint64_t out : self.outEdges) {
+                const Entry &o = entries_.at(out);
+                if (o.prepareOrder == 0) {
+                    continue;
+                }
+                hasOutToPrepared = true;
+                // 自身がTinで Tpivotが Toutより後にコミットしている
+                if (o.hasOutToEarlier) {
+                    return false;
+                }
+            }
+            // 自身がTpivotで Toutが既にコミットしている
+            if (hasOutToPrepared && !self.inEdges.empty()) {
+                return false;
+            }
+            self.prepareOrder = ++lastPrepareOrder_;
+            self.hasOutToEarlier = hasOutToPrepared;
+            return true;
+        }
+
+        // prepareに成功したトランザクションのコミットタイムスタンプを記録する
+        void commit(const TRANSACTION_ID id, const TIMESTAMP commitTimestamp)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = active_.find(id);
+            if (it == active_.end()) {
+                return;
+            }
+            entries_.at(it->second).commitTimestamp = commitTimestamp;
+            active_.erase(it);
+        }
+
+        // 中止したトランザクションの依存関係は残す必要がない
+        void abort(const TRANSACTION_ID id)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = active_.find(id);
+            if (it == active_.end()) {
+                return;
+            }
+            erase(it->second);
+            active_.erase(it);
+        }
+
+        // oldestSnapshot以前にコミットしたトランザクションは実行中のどのトランザクションとも並行しないので破棄する
+        void purge(const TIMESTAMP oldestSnapshot)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            std::vector<std::uint64_t> targets;
+            for (const auto &e : entries_) {
+                if (e.second.commitTimestamp != 0 && e.second.commitTimestamp <= oldestSnapshot) {
+                    targets.push_back(e.first);
+                }
+            }
+            for (const std::uint64_t serial : targets) {
+                erase(serial);
+            }
+        }
+
+    private:
+        // 1つのテーブルから読んだもの
+        struct Reads {
+            // 条件に合った行の行頭位置
+            std::set<LONGLONG> positions;
+            // 読み込みの条件
+            std::vector<Columns> predicates;
+            // 読んだ行を特定できない場合はtrue
+            bool isTableLevel = false;
+        };
+
+        // 1つのテーブルに書き込んだもの
+        struct Writes {
+            // 変更する既存の行の行頭位置
+            std::set<LONGLONG> positions;
+            // 追記または変更した後の行の内容
+            std::vector<Columns> afters;
+            // 表ロック取得後の条件のみの変更があればtrue
+            bool isTableLevel = false;
+        };
+
+        struct Entry {
+            TIMESTAMP snapshot;
+            // 0: 未コミット
+            TIMESTAMP commitTimestamp;
+            // prepareに成功した順序 0: 未検証
+            std::uint64_t prepareOrder;
+            // prepareの時点で先にコミットしたトランザクションへの依存があればtrue
+            bool hasOutToEarlier;
+            // key: 読み書きしたテーブルのdatafiles_の添字
+            std::map<size_t, Reads> reads;
+            std::map<size_t, Writes> writes;
+            // このトランザクションが読んだ後で書き込んだトランザクション
+            std::set<std::uint64_t> outEdges;
+            // このトランザクションが書き込む前に読んでいたトランザクション
+            std::set<std::uint64_t> inEdges;
+        };
+
+        // 一方が他方のスナップショットより前にコミットしていなければ並行している
+        bool isConcurrent(const Entry &a, const Entry &b) const
+        {
+            if (a.commitTimestamp != 0 && a.commitTimestamp <= b.snapshot) {
+                return false;
+            }
+            if (b.commitTimestamp != 0 && b.commitTimestamp <= a.snapshot) {
+                return false;
+            }
+            return true;
+        }
+
+        // 読んだ行を書き換えるか 書き込んだ後の内容が読み込みの条件に合えばtrue
+        template <typename F>
+        static bool conflicts(const Reads &r, const Writes &w, F matches)
+        {
+            if (r.isTableLevel || w.isTableLevel) {
+                return true;
+            }
+            for (const LONGLONG position : w.positions) {
+                if (r.positions.count(position) > 0) {
+                    return true;
+                }
+            }
+            for (const Columns &after : w.afters) {
+                for (const Columns &predicate : r.predicates) {
+                    if (matches(after, predicate)) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        void addEdge(const std::uint64_t reader, const std::uint64_t writer)
+        {
+            entries_.at(reader).outEdges.insert(writer);
+            entries_.at(writer).inEdges.insert(reader);
+        }
+
+        void erase(const std::uint64_t serial)
+        {
+            auto it = entries_.find(serial);
+            for (const std::uint64_t out : it->second.outEdges) {
+                entries_.at(out).inEdges.erase(serial);
+            }
+            for (const std::uint64_t in : it->second.inEdges) {
+                entries_.at(in).outEdges.erase(serial);
+            }
+            entries_.erase(it);
+        }
+
+        // トランザクションIDは再利用されるので内部では連番で区別する
+        std::uint64_t lastSerial_;
+        std::uint64_t lastPrepareOrder_;
+        // key: 連番
+        std::map<std::uint64_t, Entry> entries_;
+        // key: 実行中のトランザクションのID, value: 連番
+        std::map<TRANSACTION_ID, std::uint64_t> active_;
+        std::mutex mt_;
+    };
 
+    class Database {
+    public:
         // 0: ConnectionのId
         // 1: ミューテックス
         // 2: 条件変数
         // 3: クライアントから処理要求がある場合にtrue
-        // このセッションが終了した場合はConnectionのIdは空文字列になる
-        using SessionCondition = std::tuple<std::string, std::mutex, std::condition_variable, bool>;
+        // 4: Connectionとの送受信用のメールボックス
+        // 5: ConnectionのIdの文字列 要求ごとにUUIDから作り直さずにワーカーへ渡す
+        // このセッションが終了した場合はConnectionのIdは全て0のUUIDになる
+        using SessionCondition = std::tuple<UUID, std::mutex, std::condition_variable, bool, std::shared_ptr<Mailbox>, std::shared_ptr<const std::string>>;
 
         Database()
-            : tIdGenerator_{0, true},
+            : tIdGenerator_{0, TRANSACTION_ID_CAPACITY},
+              pVictimPolicy_{std::make_unique<LeastWorkVictimPolicy>()},
+              escalationThreshold_{Datafile::DEFAULT_ESCALATION_THRESHOLD},
+              sessionTimeout_{DEFAULT_SESSION_TIMEOUT},
+              lastTimestamp_{0},
               isRequiredConnection_{false},
+              minimumConnections_{DEFAULT_MINIMUM_CONNECTIONS},
+              connectionBatchSize_{DEFAULT_CONNECTION_BATCH_SIZE},
+              workerThreads_{DEFAULT_WORKER_THREADS},
               isStarted_{false},
               toBeStopped_{false}
         {
@@ -179,21 +692,27 @@ namespace PapierMache::DbStuff {
         {
             CATCH_ALL_EXCEPTIONS({
                 DB_LOG << "~Database()" << FILE_INFO;
-                toBeStopped_.store(true);
-                DB_LOG << "child threads notify_all() BEFORE" << FILE_INFO;
-                for (int i = 0; i < conditions_.size(); ++i) {
-                    { // Scoped Lock start
-                        std::lock_guard<std::mutex> lock{std::get<1>(conditions_[i])};
-                        std::get<3>(conditions_[i]) = true;
-                    } // Scoped Lock end
-                    std::get<2>(conditions_[i]).notify_all();
-                }
-                DB_LOG << "child threads notify_all() AFTER" << FILE_INFO;
+                { // Scoped Lock start
+                    // startServiceは条件変数で待っているのでmt_を取得して設定してから通知する
+                    std::lock_guard<std::mutex> lock{mt_};
+                    toBeStopped_.store(true);
+                } // Scoped Lock end
+                cond_.notify_all();
                 if (thread_.joinable()) {
                     DB_LOG << "thread_.join() BEFORE" << FILE_INFO;
                     thread_.join();
                 }
                 DB_LOG << "thread_.join() AFTER" << FILE_INFO;
+                // 以降の要求はnotifyImplがワーカーに入れずに応答する
+                std::unique_ptr<WorkerPool> pWorkers;
+                { // Scoped Lock start
+                    std::lock_guard<std::shared_mutex> lock(sharedMt_);
+                    pWorkers = std::move(pWorkers_);
+                } // Scoped Lock end
+                // キューに残っている要求に停止中であることを応答し 実行中の要求が終わるのを待つ
+                DB_LOG << "workers stop BEFORE" << FILE_INFO;
+                pWorkers.reset();
+                DB_LOG << "workers stop AFTER" << FILE_INFO;
                 // 全てのコネクションをクローズする
                 std::vector<std::string> connectionIds;
                 for (Connection &c : connectionList_) {
@@ -208,7 +727,7 @@ namespace PapierMache::DbStuff {
 
         void start()
         {
-            std::lock_guard<std::mutex> lock{mt_};
+            std::unique_lock<std::mutex> lock{mt_};
             if (isStarted_) {
                 return;
             }
@@ -216,31 +735,34 @@ namespace PapierMache::DbStuff {
             std::map<std::string, std::map<std::string, std::string>> tables{PapierMache::readConfiguration("./database/tables.ini")};
             for (const auto &e : tables) {
                 datafiles_.emplace_back(e.first, e.second);
+                datafiles_.back().setEscalationThreshold(escalationThreshold_);
+                datafiles_.back().setLockEventHistory(&lockEvents_);
             }
+            pWorkers_ = std::make_unique<WorkerPool>(workerThreads_);
             std::vector<std::byte> out;
             for (Datafile &f : datafiles_) {
                 if (f.tableName() == "user") {
                     Connection con = createConnection();
-                    Transaction t{tIdGenerator_.getId(), con.id()};
+                    Transaction t{tIdGenerator_.getId(), con.id(), currentSnapshot()};
                     transactionList_.push_back(t);
                     auto users = f.select(t.id(), std::vector<std::byte>{});
                     // ユーザーテーブルがゼロ件であれば次のユーザーを追加する
                     if (users.size() == 0) {
-                        std::string hash;
-                        toBCryptHash("adminpass", hash);
-                        toBytesDataFromString("USER_NAME=\"admin\"," + std::string("PASSWORD=") + hash + "," + "DATETIME=\"30827:12:31:23:59:59:999\"", out);
-                        f.insert(t.id(), out);
-                        hash = "";
-                        out.clear();
-                        toBCryptHash("user1pass", hash);
-                        toBytesDataFromString("USER_NAME=\"user1\"," + std::string("PASSWORD=") + hash + "," + "DATETIME=\"30827:12:31:23:59:59:999\"", out);
-                        f.insert(t.id(), out);
-                        hash = "";
-                    }
-                    f.commit(t.id());
+                        const std::vector<std::string> names{"admin", "user1"};
+                        std::vector<std::string> hashes;
+                        toBCryptHashes({"adminpass", "user1pass"}, hashes);
+                        for (size_t i = 0; i < names.size(); ++i) {
+                            out.clear();
+                            toBytesDataFromString("USER_NAME=\"" + names[i] + "\"," + std::string("PASSWORD=") + hashes[i] + "," + "DATETIME=\"30827:12:31:23:59:59:999\"", out);
+                            f.insert(t.id(), out);
+                        }
+                    }
+                    TIMESTAMP ts = issueCommitTimestamp();
+                    f.commit(t.id(), ts);
+                    completeCommit(ts);
 
                     out.clear();
-                    Transaction t1{tIdGenerator_.getId(), con.id()};
+                    Transaction t1{tIdGenerator_.getId(), con.id(), currentSnapshot()};
                     transactionList_.push_back(t1);
                     users = f.select(t1.id(), std::vector<std::byte>{});
                     DB_LOG << "users.size(): " << users.size();
@@ -260,7 +782,9 @@ namespace PapierMache::DbStuff {
                         u.setPassword(oss.str());
                         users_.push_back(u);
                     }
-                    f.commit(t1.id());
+                    ts = issueCommitTimestamp();
+                    f.commit(t1.id(), ts);
+                    completeCommit(ts);
 
                     auto result = std::remove_if(connectionList_.begin(), connectionList_.end(),
                                                  [connectionId = con.id()](Connection c) { return c.id() == connectionId; });
@@ -268,7 +792,7 @@ namespace PapierMache::DbStuff {
                         throw std::runtime_error{"cannot find connection. should not reach here." + FILE_INFO};
                     }
                     connectionList_.erase(result, connectionList_.end());
-                    dataStreams_.erase(con.id());
+                    openConnections_.erase(con.uuid());
                     transactionList_.clear();
                 }
             }
@@ -286,6 +810,8 @@ namespace PapierMache::DbStuff {
                 }
             }};
             isStarted_ = true;
+            // 最初のgetConnectionを待たせないように最小数のコネクションが作成されるまで待つ
+            cond_.wait(lock, [this] { return idleConnections() >= minimumConnections_; });
         }
 
         // コピー禁止
@@ -306,15 +832,20 @@ namespace PapierMache::DbStuff {
             for (Connection &rc : connectionList_) {
                 if (!rc.isInUse_) {
                     rc.isInUse_ = true;
+                    // 空きが最小数を下回ったのでstartServiceに補充させる
+                    cond_.notify_all();
                     return rc;
                 }
             }
             isRequiredConnection_ = true;
+            cond_.notify_all();
             // コネクションが作成されるまでwaitする
             cond_.wait(lock, [this] { return isRequiredConnection_ == false; });
             for (Connection &rc : connectionList_) {
                 if (!rc.isInUse_) {
                     rc.isInUse_ = true;
+                    // 空きが最小数を下回ったのでstartServiceに補充させる
+                    cond_.notify_all();
                     return rc;
                 }
             }
@@ -322,27 +853,11 @@ namespace PapierMache::DbStuff {
         }
 
         // コネクションとのインターフェース関数 ここから
-        bool getData(const std::string connectionId, std::vector<std::byte> &out)
-        {
-            std::lock_guard<std::mutex> lock{mt_};
-            DEBUG_LOG << "connectionId: " << connectionId << " getData" << FILE_INFO;
-            DataStream ds;
-            swap(connectionId, ds);
-            ds.swap(out);
-            return true;
-        }
-
-        bool setData(const std::string connectionId, const std::vector<std::byte> &data)
-        {
-            std::lock_guard<std::mutex> lock{mt_};
-            DEBUG_LOG << "connectionId: " << connectionId << " setData" << FILE_INFO;
-            return swap(connectionId, data);
-        }
-
+        // データの送受信はConnectionとセッションが共有するMailboxで行う
         // 引数のコネクションIDに対応するコネクションに処理完了を通知する
         // 第2引数がtrueの場合はコネクション側からの処理依頼になる
         // 戻り値: 通知が設定されればtrue
-        bool toNotify(const std::string connectionId, const bool b = false)
+        bool toNotify(const UUID &connectionId, const bool b = false)
         {
             return notifyImpl(connectionId, b);
         }
@@ -353,32 +868,22 @@ namespace PapierMache::DbStuff {
         // 0: 成功
         // -1: まだ対応する処理のためのセッションが開始していない
         // -2: その他のエラー
-        int wait(const std::string connectionId)
+        int wait(const UUID &connectionId)
         {
-            int i = 0;
-            { // 読み込みロック
-                std::shared_lock<std::shared_mutex> lock(sharedMt_);
-                for (i = 0; i < conditions_.size(); ++i) {
-                    const SessionCondition &sc = conditions_.at(i);
-                    if (std::get<0>(sc) == connectionId) {
-                        DEBUG_LOG << connectionId << " ------------------------------wait 1." << FILE_INFO;
-                        break;
-                    }
-                }
-            }
-            if (i == conditions_.size()) {
-                DEBUG_LOG << "Session for connection id:" << connectionId << " is not found." << FILE_INFO;
+            SessionCondition *pSc = findSession(connectionId);
+            if (pSc == nullptr) {
+                DEBUG_LOG << "Session for connection id:" << connectionId.str() << " is not found." << FILE_INFO;
                 return -1;
             }
-            DEBUG_LOG << connectionId << " ------------------------------wait 2." << FILE_INFO;
-            std::unique_lock<std::mutex> lock{std::get<1>(conditions_.at(i))};
-            if (std::get<3>(conditions_.at(i))) {
-                DEBUG_LOG << connectionId << " ------------------------------wait 3." << FILE_INFO;
-                std::get<2>(conditions_.at(i)).wait(lock, [&refB = std::get<3>(conditions_.at(i))] {
+            DEBUG_LOG << connectionId.str() << " ------------------------------wait 2." << FILE_INFO;
+            std::unique_lock<std::mutex> lock{std::get<1>(*pSc)};
+            if (std::get<3>(*pSc)) {
+                DEBUG_LOG << connectionId.str() << " ------------------------------wait 3." << FILE_INFO;
+                std::get<2>(*pSc).wait(lock, [&refB = std::get<3>(*pSc)] {
                     return refB == false;
                 });
             }
-            DEBUG_LOG << connectionId << " ------------------------------wait 4." << FILE_INFO;
+            DEBUG_LOG << connectionId.str() << " ------------------------------wait 4." << FILE_INFO;
             return 0;
         }
 
@@ -388,70 +893,249 @@ namespace PapierMache::DbStuff {
             return terminateImpl(connectionId);
         }
 
-        bool close(const std::string connectionId)
+        // 1つのテーブルで書き込んだ行数がthresholdを超えたトランザクションは表ロックに切り替える
+        void setLockEscalationThreshold(const size_t threshold)
         {
-            { // Scoped Lock start
-                std::lock_guard<std::mutex> lock{mt_};
-                terminateImpl(connectionId);
-                auto result = std::remove_if(connectionList_.begin(), connectionList_.end(),
-                                             [connectionId](Connection c) { return c.id() == connectionId; });
+            std::lock_guard<std::mutex> lock{mt_};
+            escalationThreshold_ = threshold;
+            for (Datafile &f : datafiles_) {
+                f.setEscalationThreshold(threshold);
+            }
+        }
 
-                if (result == connectionList_.end()) {
-                    return false;
-                }
-                connectionList_.erase(result, connectionList_.end());
-                dataStreams_.erase(connectionId);
-                connectedUsers_.erase(connectionId);
-            } // Scoped Lock end
+        std::vector<std::string> tableNames()
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            std::vector<std::string> names;
+            for (const Datafile &f : datafiles_) {
+                names.push_back(f.tableName());
+            }
+            return names;
+        }
 
-            // このコネクションを処理しているスレッドに通知する
-            int i = 0;
+        // tableNameのテーブルから削除済みの行を取り除いてファイルを詰める
+        // 詰めた内容を作る間は表ロックSでこのテーブルへの書き込みを待たせ 書き込む間だけXで読み込みも待たせる
+        // 他のテーブルを操作するトランザクションは止めない
+        // 取り除いた行数を返す
+        size_t compact(const std::string tableName)
+        {
+            Datafile *pDatafile = nullptr;
+            TRANSACTION_ID maintenanceId = -1;
             { // Scoped Lock start
-                // 書き込みロック
-                std::lock_guard<std::shared_mutex> wl(sharedMt_);
-                for (; i < conditions_.size(); ++i) {
-                    if (std::get<0>(conditions_.at(i)) == connectionId) {
-                        std::get<0>(conditions_.at(i)) = "";
-                        break;
-                    }
+                std::lock_guard<std::mutex> lock{mt_};
+                auto it = std::find_if(datafiles_.begin(), datafiles_.end(),
+                                       [tableName](const Datafile &ref) { return ref.tableName() == tableName; });
+                if (it == datafiles_.end()) {
+                    throw DatabaseException{"cannot find table: " + tableName};
+                }
+                pDatafile = &(*it);
+                maintenanceId = tIdGenerator_.getId();
+                maintenanceIds_.insert(maintenanceId);
+                for (Datafile &f : datafiles_) {
+                    f.clearTerminated(maintenanceId);
                 }
             } // Scoped Lock end
-            if (i == conditions_.size()) {
-                return false;
+            size_t removed = 0;
+            try {
+                removed = pDatafile->compact(maintenanceId);
             }
-            { // Scoped Lock start
-                std::lock_guard<std::mutex> lock{std::get<1>(conditions_.at(i))};
-                std::get<3>(conditions_.at(i)) = true;
-            } // Scoped Lock end
-            std::get<2>(conditions_.at(i)).notify_one();
-            LOG << "connection id: " << connectionId << " is closed." << FILE_INFO;
-            return true;
+            catch (...) {
+                std::lock_guard<std::mutex> lock{mt_};
+                maintenanceIds_.erase(maintenanceId);
+                tIdGenerator_.release(maintenanceId);
+                throw;
+            }
+            std::lock_guard<std::mutex> lock{mt_};
+            maintenanceIds_.erase(maintenanceId);
+            tIdGenerator_.release(maintenanceId);
+            return removed;
         }
 
-        bool isClosed(const std::string connectionId)
+        // 使われていないコネクションをminimum個以上保持し 足りなくなった場合はbatchSize個ずつ作成する
+        // start()の前に呼び出す
+        void setConnectionPoolSize(const size_t minimum, const size_t batchSize)
         {
             std::lock_guard<std::mutex> lock{mt_};
-            return connectionList_.end() == std::find_if(connectionList_.begin(),
-                                                         connectionList_.end(),
-                                                         [connectionId](const Connection c) { return c.id() == connectionId; });
+            minimumConnections_ = minimum;
+            connectionBatchSize_ = batchSize;
+            if (connectionBatchSize_ == 0) {
+                connectionBatchSize_ = 1;
+            }
         }
-        // コネクションとのインターフェース関数 ここまで
 
-    private:
-        class Transaction {
-        public:
-            Transaction(const short id, const std::string connectionId)
-                : id_{id},
-                  connectionId_{connectionId}
-            {
-            }
+        // 取得されずにプールで待っているコネクションの数
+        size_t idleConnectionCount()
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            return idleConnections();
+        }
 
-            ~Transaction()
-            {
-                DB_LOG << " ~Transaction()" << FILE_INFO;
-            }
+        // クライアントの要求を処理するワーカースレッドの数 コネクションの数によらない
+        // 行や表の解放を待っているワーカーの分はこの数とは別に予備のワーカーが処理する
+        // start()の前に呼び出す
+        void setWorkerThreads(const size_t count)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            workerThreads_ = count;
+        }
 
-            const short id() const
+        // PLEASE:SESSIONで発行したセッションはこの時間使われなければ期限切れとする
+        void setSessionTimeout(const std::chrono::seconds timeout)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            sessionTimeout_ = timeout;
+        }
+
+        // ロックの待ちとデッドロックの記録を保持する件数
+        void setLockEventCapacity(const size_t capacity)
+        {
+            lockEvents_.setCapacity(capacity);
+        }
+
+        // 直近のロックの待ちとデッドロックを古い順に返す
+        std::vector<LockEvent> lockEvents()
+        {
+            return lockEvents_.events();
+        }
+
+        // 直近のロックの待ちをテーブルと行ごとに集計して返す
+        std::map<std::string, std::map<LONGLONG, LockEventHistory::HotRow>> lockHeatmap()
+        {
+            return lockEvents_.heatmap();
+        }
+
+        void setVictimSelectionPolicy(std::unique_ptr<VictimSelectionPolicy> pPolicy)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            pVictimPolicy_ = std::move(pPolicy);
+        }
+
+        // 行の解放待ちの循環を探し 循環ごとに犠牲者を1つ選んでそのトランザクションを停止する
+        // 停止したトランザクションのConnectionのIdを返す
+        std::vector<std::string> resolveDeadlocks()
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            // トランザクションが待つ行は同時に1つなので待ち先は1つに決まる
+            std::map<TRANSACTION_ID, TRANSACTION_ID> edges;
+            for (Datafile &f : datafiles_) {
+                for (const auto &e : f.waitForEdges()) {
+                    edges[e.first] = e.second;
+                }
+            }
+            std::vector<std::string> victims;
+            // 0: 未訪問, 1: 辿っている途中, 2: 訪問済み
+            std::map<TRANSACTION_ID, int> state;
+            for (const auto &e : edges) {
+                std::vector<TRANSACTION_ID> path;
+                TRANSACTION_ID current = e.first;
+                while (true) {
+                    const int st = state[current];
+                    if (st == 1) {
+                        auto it = std::find(path.begin(), path.end(), current);
+                        std::vector<TRANSACTION_ID> cycle{it, path.end()};
+                        const std::string victim = selectVictim(cycle);
+                        LockEvent event{};
+                        event.type = LockEvent::Type::DEADLOCK;
+                        event.time = getLocalTimeStr();
+                        event.transactions = cycle;
+                        event.rowIndex = -1;
+                        event.waitMilliseconds = 0;
+                        event.victim = -1;
+                        if (victim.length() > 0) {
+                            DB_LOG << "deadlock is detected. victim connection id: " << victim << FILE_INFO;
+                            for (const Transaction &t : transactionList_) {
+                                if (t.connectionId() == victim) {
+                                    event.victim = t.id();
+                                }
+                            }
+                            terminateImpl(victim);
+                            deadlockVictims_.insert(victim);
+                            victims.push_back(victim);
+                        }
+                        lockEvents_.record(std::move(event));
+                        break;
+                    }
+                    if (st == 2) {
+                        break;
+                    }
+                    state[current] = 1;
+                    path.push_back(current);
+                    auto next = edges.find(current);
+                    if (next == edges.end()) {
+                        break;
+                    }
+                    current = next->second;
+                }
+                for (const TRANSACTION_ID id : path) {
+                    state[id] = 2;
+                }
+            }
+            return victims;
+        }
+
+        bool close(const std::string connectionId)
+        {
+            UUID uuid{};
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{mt_};
+                terminateImpl(connectionId);
+                auto result = std::find_if(connectionList_.begin(), connectionList_.end(),
+                                           [connectionId](const Connection &c) { return c.id() == connectionId; });
+
+                if (result == connectionList_.end()) {
+                    return false;
+                }
+                uuid = result->uuid();
+                connectionList_.erase(result);
+                openConnections_.erase(uuid);
+                connectedUsers_.erase(connectionId);
+                binaryConnections_.erase(connectionId);
+                preparedStatements_.erase(connectionId);
+            } // Scoped Lock end
+
+            // このコネクションのセッションを解放する
+            // ワーカーが処理中の要求があっても結果の通知先が見つからなくなるだけで問題ない
+            size_t index = 0;
+            { // Scoped Lock start
+                std::shared_lock<std::shared_mutex> lock(sharedMt_);
+                auto it = sessionIndex_.find(uuid);
+                if (it == sessionIndex_.end()) {
+                    return false;
+                }
+                index = it->second;
+            } // Scoped Lock end
+            releaseSession(index);
+            LOG << "connection id: " << connectionId << " is closed." << FILE_INFO;
+            return true;
+        }
+
+        bool isClosed(const UUID &connectionId)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            return openConnections_.find(connectionId) == openConnections_.end();
+        }
+        // コネクションとのインターフェース関数 ここまで
+
+    private:
+        class Transaction {
+        public:
+            Transaction(const TRANSACTION_ID id, const std::string connectionId, const TIMESTAMP snapshot, const bool isOptimistic = false,
+                        const IsolationLevel isolationLevel = IsolationLevel::SNAPSHOT)
+                : id_{id},
+                  connectionId_{connectionId},
+                  snapshot_{snapshot},
+                  isOptimistic_{isOptimistic},
+                  isolationLevel_{isolationLevel},
+                  startTime_{std::chrono::steady_clock::now()}
+            {
+            }
+
+            ~Transaction()
+            {
+                DB_LOG << " ~Transaction()" << FILE_INFO;
+            }
+
+            const TRANSACTION_ID id() const
             {
                 return id_;
             }
@@ -461,9 +1145,50 @@ namespace PapierMache::DbStuff {
                 return connectionId_;
             }
 
+            const TIMESTAMP snapshot() const
+            {
+                return snapshot_;
+            }
+
+            const bool isOptimistic() const
+            {
+                return isOptimistic_;
+            }
+
+            const IsolationLevel isolationLevel() const
+            {
+                return isolationLevel_;
+            }
+
+            const std::chrono::steady_clock::time_point startTime() const
+            {
+                return startTime_;
+            }
+
+            // このトランザクションが操作したテーブルとしてdatafiles_の添字を記録する
+            void touch(const size_t datafileIndex)
+            {
+                datafileIndexes_.insert(datafileIndex);
+            }
+
+            const std::set<size_t> &datafileIndexes() const
+            {
+                return datafileIndexes_;
+            }
+
         private:
-            short id_;
+            TRANSACTION_ID id_;
             std::string connectionId_;
+            // このトランザクションのSELECTが参照する時点
+            TIMESTAMP snapshot_;
+            // 楽観的トランザクションであればtrue
+            // 変更対象の行をロックせずにコミット時に競合を検証する
+            bool isOptimistic_;
+            IsolationLevel isolationLevel_;
+            // デッドロックの犠牲者を選ぶ際に経過時間を求めるための開始時刻
+            std::chrono::steady_clock::time_point startTime_;
+            // 操作したテーブルのdatafiles_の添字 コミットとロールバックはこのテーブルのみを対象とする
+            std::set<size_t> datafileIndexes_;
         };
 
         class User {
@@ -478,6 +1203,22 @@ namespace PapierMache::DbStuff {
             std::string password_;
         };
 
+        // PLEASE:SESSIONで発行したセッション
+        struct Session {
+            std::string userName;
+            // 最後に使われた時刻
+            std::chrono::steady_clock::time_point lastUsed;
+        };
+
+        // PLEASE:PREPAREで解析した文 列名は列の定義と照合済み
+        struct PreparedStatement {
+            std::string operationName;
+            std::string tableName;
+            std::vector<Datafile::PreparedColumn> data;
+            std::vector<Datafile::PreparedColumn> where;
+            int parameterCount = 0;
+        };
+
         class Result {
         public:
             Result(const char flag,
@@ -487,7 +1228,25 @@ namespace PapierMache::DbStuff {
                 : flag_{flag},
                   tableName_{tableName},
                   tableInfo_{tableInfo},
-                  data_{data}
+                  data_{data},
+                  columns_{},
+                  rowCount_{0},
+                  images_{}
+            {
+            }
+
+            // バイナリ形式のselectの結果 imagesはDatafile::selectImagesで並べた行の内容
+            Result(const std::string tableName,
+                   const std::vector<BinaryProtocol::ColumnDescriptor> columns,
+                   const size_t rowCount,
+                   std::vector<std::byte> &&images)
+                : flag_{0},
+                  tableName_{tableName},
+                  tableInfo_{},
+                  data_{},
+                  columns_{columns},
+                  rowCount_{rowCount},
+                  images_{std::move(images)}
             {
             }
 
@@ -497,7 +1256,8 @@ namespace PapierMache::DbStuff {
                    const std::string message)
                 : flag_{flag},
                   tableName_{tableName},
-                  tableInfo_{tableInfo}
+                  tableInfo_{tableInfo},
+                  rowCount_{0}
             {
                 std::vector<std::byte> v;
                 for (const char c : message) {
@@ -508,9 +1268,10 @@ namespace PapierMache::DbStuff {
                 data_.push_back(m);
             }
 
-            std::vector<std::byte> toBytes() const
+            // テキスト形式でbytesの内容を置き換える
+            void toBytes(std::vector<std::byte> &bytes) const
             {
-                std::vector<std::byte> bytes;
+                bytes.clear();
                 bytes.push_back(static_cast<std::byte>(flag_));
                 bytes.push_back(static_cast<std::byte>(' '));
                 for (const char c : tableName_) {
@@ -532,7 +1293,44 @@ namespace PapierMache::DbStuff {
                         }
                     }
                 }
-                return bytes;
+            }
+
+            // isBinaryがtrueであればバイナリ形式 falseであればテキスト形式でoutの内容を置き換える
+            // 応答用のバッファを渡せば確保済みの領域に書き込む
+            void toBytes(const bool isBinary, std::vector<std::byte> &out) const
+            {
+                if (isBinary) {
+                    toBinary(out);
+                }
+                else {
+                    toBytes(out);
+                }
+            }
+
+            // BinaryProtocol.hの形式 行の値はデータファイルの行の内容をそのまま送る
+            void toBinary(std::vector<std::byte> &out) const
+            {
+                BinaryProtocol::Frame frame{};
+                frame.code = flag_;
+                frame.tableName = tableName_;
+                if (flag_ == 0) {
+                    if (rowCount_ > UINT32_MAX) {
+                        throw std::runtime_error{"too many rows for binary frame." + FILE_INFO};
+                    }
+                    frame.columns = columns_;
+                    frame.rowCount = static_cast<std::uint32_t>(rowCount_);
+                    BinaryProtocol::encode(frame, images_, out);
+                    return;
+                }
+                else {
+                    for (const auto &e : data_) {
+                        auto it = e.find("message");
+                        if (it != e.end()) {
+                            frame.message.assign(reinterpret_cast<const char *>(it->second.data()), it->second.size());
+                        }
+                    }
+                }
+                BinaryProtocol::encode(frame, frame.rows, out);
             }
 
         private:
@@ -542,70 +1340,146 @@ namespace PapierMache::DbStuff {
             // 列名=データサイズ,列名=データサイズ,列名=データサイズ...
             std::string tableInfo_;
             std::vector<std::map<std::string, std::vector<std::byte>>> data_;
+            // バイナリ形式の場合の列の情報
+            std::vector<BinaryProtocol::ColumnDescriptor> columns_;
+            // バイナリ形式のselectの結果の行数と行の内容
+            size_t rowCount_;
+            std::vector<std::byte> images_;
         };
 
-        bool swap(const std::string connectionId, const std::vector<std::byte> &data)
-        {
-            DataStream temp{data};
-            DEBUG_LOG << "connectionId: " << connectionId << " const swap BEFOER" << FILE_INFO;
-            dataStreams_.at(connectionId).swap(temp);
-            DEBUG_LOG << "connectionId: " << connectionId << " const swap AFTER" << FILE_INFO;
-            return true;
-        }
-
-        bool swap(const std::string connectionId, std::vector<std::byte> &data)
+        // 使われていないコネクションの数 mt_を取得して呼び出す
+        size_t idleConnections() const
         {
-            DEBUG_LOG << "connectionId: " << connectionId << " swap BEFOER" << FILE_INFO;
-            dataStreams_.at(connectionId).swap(data);
-            DEBUG_LOG << "connectionId: " << connectionId << " swap AFTER" << FILE_INFO;
-            return true;
+            size_t count = 0;
+            for (const Connection &c : connectionList_) {
+                if (!c.isInUse_) {
+                    ++count;
+                }
+            }
+            return count;
         }
 
         const Connection createConnection()
         {
-            std::string connectionId = UUID::create().str();
-            Connection con{connectionId, *this};
+            Connection con{UUID::create(), *this, std::make_shared<Mailbox>()};
             connectionList_.push_back(con);
-            DataStream ds;
-            dataStreams_.insert(std::make_pair(con.id(), ds));
+            openConnections_.insert(con.uuid());
             return con;
         }
 
         // 処理が完了したことをコネクションに通知する
-        bool notifyImpl(const std::string connectionId, const bool b)
-        {
-            // 読み込みロック
-            std::shared_lock<std::shared_mutex> shLock(sharedMt_);
-            for (int i = 0; i < conditions_.size(); ++i) {
-                const SessionCondition &sc = conditions_.at(i);
-                if (std::get<0>(sc) == connectionId) {
-                    // ここからは書き込み操作
-                    { // Scoped Lock start
-                        std::lock_guard<std::mutex> lock{std::get<1>(conditions_.at(i))};
-                        std::get<3>(conditions_.at(i)) = b;
-                    } // Scoped Lock end
-                    std::get<2>(conditions_.at(i)).notify_one();
-                    DB_LOG << connectionId << " notifyImpl: OK" << b << FILE_INFO;
-                    return true;
+        bool notifyImpl(const UUID &connectionId, const bool b)
+        {
+            // 停止中でワーカーに入れられなかった要求
+            std::shared_ptr<Mailbox> pRejected{};
+            std::shared_ptr<const std::string> pRejectedId{};
+            { // Scoped Lock start
+                // 読み込みロック
+                std::shared_lock<std::shared_mutex> shLock(sharedMt_);
+                auto it = sessionIndex_.find(connectionId);
+                if (it == sessionIndex_.end()) {
+                    DB_LOG << connectionId.str() << " notifyImpl: NG" << b << FILE_INFO;
+                    return false;
+                }
+                SessionCondition &sc = *conditions_.at(it->second);
+                // ここからは書き込み操作
+                { // Scoped Lock start
+                    std::lock_guard<std::mutex> lock{std::get<1>(sc)};
+                    std::get<3>(sc) = b;
+                } // Scoped Lock end
+                std::get<2>(sc).notify_one();
+                if (b) {
+                    // クライアントからの処理要求はワーカーが処理する
+                    // 同じセッションの要求は同じワーカーのキューに入れて 空いている他のワーカーがあれば盗ませる
+                    std::shared_ptr<Mailbox> pMailbox = std::get<4>(sc);
+                    std::shared_ptr<const std::string> pId = std::get<5>(sc);
+                    if (pWorkers_ != nullptr) {
+                        pWorkers_->submit([this, connectionId, pId, pMailbox] { processRequest(connectionId, *pId, pMailbox); }, it->second);
+                    }
+                    else {
+                        pRejected = pMailbox;
+                        pRejectedId = pId;
+                    }
                 }
+            } // Scoped Lock end
+            if (pRejected != nullptr) {
+                // ワーカーは停止済みなので呼び出し元のスレッドで停止中であることを応答する
+                // processRequestは応答を通知するためにsharedMt_を取得するのでロックの外で呼び出す
+                processRequest(connectionId, *pRejectedId, pRejected);
             }
-            DB_LOG << connectionId << " notifyImpl: NG" << b << FILE_INFO;
-            return false;
+            DB_LOG << connectionId.str() << " notifyImpl: OK" << b << FILE_INFO;
+            return true;
+        }
+
+        // 引数のコネクションのセッションを返す なければnullptr
+        // セッションはunique_ptrで保持しているのでconditions_が伸長してもアドレスは変わらない
+        SessionCondition *findSession(const UUID &connectionId)
+        {
+            std::shared_lock<std::shared_mutex> lock(sharedMt_);
+            auto it = sessionIndex_.find(connectionId);
+            if (it == sessionIndex_.end()) {
+                return nullptr;
+            }
+            return conditions_.at(it->second).get();
+        }
+
+        // 空いているセッションをコネクションに割り当てて添字を返す
+        // 空きがなければセッションを追加する
+        size_t acquireSession(const UUID &connectionId, const std::string &id, std::shared_ptr<Mailbox> pMailbox)
+        {
+            std::lock_guard<std::shared_mutex> lock(sharedMt_);
+            size_t index = 0;
+            if (!freeSessions_.empty()) {
+                index = freeSessions_.back();
+                freeSessions_.pop_back();
+            }
+            else {
+                conditions_.push_back(std::make_unique<SessionCondition>());
+                index = conditions_.size() - 1;
+            }
+            SessionCondition &sc = *conditions_.at(index);
+            { // Scoped Lock start
+                // 前のコネクションの処理要求が残っていれば新しいコネクションのwaitが終わらない
+                std::lock_guard<std::mutex> lk{std::get<1>(sc)};
+                std::get<3>(sc) = false;
+            } // Scoped Lock end
+            std::get<0>(sc) = connectionId;
+            std::get<4>(sc) = pMailbox;
+            std::get<5>(sc) = std::make_shared<const std::string>(id);
+            sessionIndex_[connectionId] = index;
+            return index;
+        }
+
+        // コネクションをクローズする際に呼び出す
+        void releaseSession(const size_t index)
+        {
+            std::lock_guard<std::shared_mutex> lock(sharedMt_);
+            SessionCondition &sc = *conditions_.at(index);
+            auto it = sessionIndex_.find(std::get<0>(sc));
+            if (it != sessionIndex_.end() && it->second == index) {
+                sessionIndex_.erase(it);
+            }
+            std::get<0>(sc) = UUID{};
+            std::get<4>(sc).reset();
+            std::get<5>(sc).reset();
+            freeSessions_.push_back(index);
         }
 
         bool terminateImpl(const std::string connectionId)
         {
+            readOnlyTransactions_.erase(connectionId);
             TRANSACTION_ID id = -1;
+            std::set<size_t> indexes;
             for (const Transaction &t : transactionList_) {
                 if (t.connectionId() == connectionId) {
                     id = t.id();
+                    indexes = t.datafileIndexes();
                 }
             }
-            for (int i = 0; i < datafiles_.size(); ++i) {
-                if (id != -1) {
-                    datafiles_[i].setToTerminate(id);
-                }
+            for (const size_t i : indexes) {
+                datafiles_[i].setToTerminate(id);
             }
+            conflictTracker_.abort(id);
             auto it = std::remove_if(transactionList_.begin(), transactionList_.end(),
                                      [tId = id](Transaction &t) { return t.id() == tId; });
             transactionList_.erase(it, transactionList_.end());
@@ -613,10 +1487,57 @@ namespace PapierMache::DbStuff {
             return true;
         }
 
-        bool addTransaction(const std::string connectionId)
+        // 循環待ちのトランザクションの作業量を集めて方針に従い犠牲者を選ぶ
+        // 既に終了したトランザクションを含む場合は循環が解けているので空文字列を返す
+        // メンテナンスは犠牲者にしない
+        std::string selectVictim(const std::vector<TRANSACTION_ID> &cycle)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            std::vector<TransactionCost> candidates;
+            for (const TRANSACTION_ID id : cycle) {
+                if (maintenanceIds_.find(id) != maintenanceIds_.end()) {
+                    continue;
+                }
+                auto it = std::find_if(transactionList_.begin(), transactionList_.end(),
+                                       [id](const Transaction &t) { return t.id() == id; });
+                if (it == transactionList_.end()) {
+                    return "";
+                }
+                TransactionCost c{id, it->connectionId(), 0, 0,
+                                  std::chrono::duration_cast<std::chrono::milliseconds>(now - it->startTime()).count()};
+                for (const size_t i : it->datafileIndexes()) {
+                    const PendingCost pc = datafiles_[i].pendingCost(id);
+                    c.rowsStamped += pc.rowsStamped;
+                    c.pendingBytes += pc.pendingBytes;
+                }
+                candidates.push_back(c);
+            }
+            if (candidates.empty()) {
+                return "";
+            }
+            const size_t victim = pVictimPolicy_->select(candidates);
+            if (victim >= candidates.size()) {
+                throw DatabaseException{"victim selection policy returned invalid index." + FILE_INFO};
+            }
+            for (const TransactionCost &c : candidates) {
+                DB_LOG << "transaction id: " << c.id << " rows: " << c.rowsStamped << " bytes: " << c.pendingBytes << " ms: " << c.elapsedMilliseconds << FILE_INFO;
+            }
+            return candidates[victim].connectionId;
+        }
+
+        bool addTransaction(const std::string connectionId, const bool isOptimistic = false,
+                            const IsolationLevel isolationLevel = IsolationLevel::SNAPSHOT)
         {
             std::lock_guard<std::mutex> lock{mt_};
-            Transaction t{tIdGenerator_.getId(), connectionId};
+            Transaction t{tIdGenerator_.getId(), connectionId, currentSnapshot(), isOptimistic, isolationLevel};
+            deadlockVictims_.erase(connectionId);
+            if (isolationLevel == IsolationLevel::SERIALIZABLE) {
+                conflictTracker_.begin(t.id(), t.snapshot());
+            }
+            // 同じIDで以前に停止したトランザクションの記録を消す
+            for (Datafile &f : datafiles_) {
+                f.clearTerminated(t.id());
+            }
             transactionList_.push_back(t);
             return true;
         }
@@ -632,85 +1553,369 @@ namespace PapierMache::DbStuff {
             throw std::runtime_error{"transaction is not found. connection id: " + connectionId + FILE_INFO};
         }
 
-        Datafile &getDatafile(const std::string tableName)
+        // 読み取り専用トランザクションはIDを割り当てずスナップショットのみを保持する
+        bool addReadOnlyTransaction(const std::string connectionId)
         {
             std::lock_guard<std::mutex> lock{mt_};
-            auto it = std::find_if(datafiles_.begin(), datafiles_.end(),
-                                   [tableName](const Datafile &ref) { return ref.tableName() == tableName; });
-            return *it;
+            readOnlyTransactions_.insert(std::make_pair(connectionId, currentSnapshot()));
+            return true;
         }
 
-        bool isTransactionExists(const std::string connectionId)
+        void removeReadOnlyTransaction(const std::string connectionId)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            readOnlyTransactions_.erase(connectionId);
+        }
+
+        bool isReadOnly(const std::string connectionId)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            return readOnlyTransactions_.find(connectionId) != readOnlyTransactions_.end();
+        }
+
+        bool isOptimistic(const std::string connectionId)
         {
             std::lock_guard<std::mutex> lock{mt_};
             for (const Transaction &t : transactionList_) {
                 if (t.connectionId() == connectionId) {
-                    return true;
+                    return t.isOptimistic();
                 }
             }
-            return false;
+            throw std::runtime_error{"transaction is not found. connection id: " + connectionId + FILE_INFO};
         }
 
-        void commitTransaction(const TRANSACTION_ID id)
+        bool isSerializable(const std::string connectionId)
         {
-            for (int i = 0; i < datafiles_.size(); ++i) {
-                std::lock_guard<std::mutex> lock{mt_};
-                datafiles_[i].commit(id);
-            }
             std::lock_guard<std::mutex> lock{mt_};
-            auto it = std::remove_if(transactionList_.begin(), transactionList_.end(),
-                                     [tId = id](Transaction &t) { return t.id() == tId; });
-            transactionList_.erase(it, transactionList_.end());
-            tIdGenerator_.release(id);
+            for (const Transaction &t : transactionList_) {
+                if (t.connectionId() == connectionId) {
+                    return t.isolationLevel() == IsolationLevel::SERIALIZABLE;
+                }
+            }
+            throw std::runtime_error{"transaction is not found. connection id: " + connectionId + FILE_INFO};
         }
 
-        void rollbackTransaction(const TRANSACTION_ID id)
+        // SERIALIZABLEのトランザクションがtableNameのテーブルを読み書きしたことを記録する
+        // SERIALIZABLEのトランザクションがtableNameのテーブルをpredicatesの条件で読み positionsの行が合ったことを記録する
+        void recordSerializableRead(const std::string connectionId, const std::string tableName,
+                                    const std::vector<std::map<std::string, std::vector<std::byte>>> &predicates,
+                                    const std::vector<LONGLONG> &positions, const bool isTableLevel)
         {
-            for (int i = 0; i < datafiles_.size(); ++i) {
-                std::lock_guard<std::mutex> lock{mt_};
-                datafiles_[i].rollback(id);
+            TRANSACTION_ID id = -1;
+            size_t index = 0;
+            findSerializableTarget(connectionId, tableName, id, index);
+            Datafile *pDatafile = &datafiles_[index];
+            conflictTracker_.recordRead(id, index, predicates, positions, isTableLevel,
+                                        [pDatafile](const auto &values, const auto &where) { return pDatafile->matchesValues(values, where); });
+        }
+
+        // SERIALIZABLEのトランザクションがtableNameのテーブルのfrom番目以降に記録した変更を書き込みとして記録する
+        // fromは文の前に取得したDatafile::pendingCount predicatesは変更する行を探した条件で 走査も読み込みとして記録する
+        void recordSerializableWrite(const std::string connectionId, const std::string tableName,
+                                     const std::vector<std::map<std::string, std::vector<std::byte>>> &predicates, const size_t from)
+        {
+            TRANSACTION_ID id = -1;
+            size_t index = 0;
+            findSerializableTarget(connectionId, tableName, id, index);
+            Datafile *pDatafile = &datafiles_[index];
+            auto matches = [pDatafile](const auto &values, const auto &where) { return pDatafile->matchesValues(values, where); };
+            const std::vector<Datafile::PendingWrite> writes = pDatafile->pendingWrites(id, from);
+            if (!predicates.empty()) {
+                std::vector<LONGLONG> positions;
+                bool isTableLevel = false;
+                for (const Datafile::PendingWrite &w : writes) {
+                    if (w.isTableLevel) {
+                        isTableLevel = true;
+                    }
+                    else if (w.position >= 0) {
+                        positions.push_back(w.position);
+                    }
+                }
+                conflictTracker_.recordRead(id, index, predicates, positions, isTableLevel, matches);
             }
-            std::lock_guard<std::mutex> lock{mt_};
-            auto it = std::remove_if(transactionList_.begin(), transactionList_.end(),
-                                     [tId = id](Transaction &t) { return t.id() == tId; });
-            transactionList_.erase(it, transactionList_.end());
-            tIdGenerator_.release(id);
+            conflictTracker_.recordWrite(id, index, writes, matches);
         }
 
-        void toBytesDataFromString(const std::string &s, std::vector<std::byte> &out)
+        // connectionIdのトランザクションのIDとtableNameのテーブルのdatafiles_の添字を返す
+        void findSerializableTarget(const std::string &connectionId, const std::string &tableName, TRANSACTION_ID &id, size_t &index)
         {
-            for (const char c : s) {
-                out.push_back(static_cast<std::byte>(c));
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = std::find_if(datafiles_.begin(), datafiles_.end(),
+                                   [&tableName](const Datafile &ref) { return ref.tableName() == tableName; });
+            if (it == datafiles_.end()) {
+                throw DatabaseException{"cannot find table: " + tableName};
+            }
+            index = static_cast<size_t>(std::distance(datafiles_.begin(), it));
+            for (const Transaction &t : transactionList_) {
+                if (t.connectionId() == connectionId) {
+                    id = t.id();
+                }
             }
         }
 
-        // 引数の先頭から'('以外が出現するまでにある'('を削除する
-        // 引数の末尾から')'以外が出現するまでにある')'を削除する
-        void trimParentheses(std::vector<std::byte> &bytes)
+        // SERIALIZABLEのトランザクションが変更する行を他のトランザクションが先にコミットしていれば中止する(first-updater-wins)
+        void assertFirstUpdater(const std::string connectionId, const std::string tableName)
         {
-            if (bytes.size() == 0) {
-                return;
+            const TRANSACTION_ID id = getTransactionId(connectionId);
+            if (getDatafile(tableName).isUpdatedAfter(id, getSnapshot(connectionId))) {
+                rollbackTransaction(id);
+                throw DatabaseException{"transaction is aborted. could not serialize access due to concurrent update.", ResultCode::SERIALIZATION_FAILURE};
             }
+        }
 
-            auto it = bytes.begin();
-            while (static_cast<char>(*it) == '(' || static_cast<char>(*it) == ' ') {
-                ++it;
+        TIMESTAMP getSnapshot(const std::string connectionId)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = readOnlyTransactions_.find(connectionId);
+            if (it != readOnlyTransactions_.end()) {
+                return it->second;
             }
-            bytes.erase(bytes.begin(), it);
+            for (const Transaction &t : transactionList_) {
+                if (t.connectionId() == connectionId) {
+                    return t.snapshot();
+                }
+            }
+            throw std::runtime_error{"transaction is not found. connection id: " + connectionId + FILE_INFO};
+        }
 
-            auto rit = bytes.rbegin();
-            while (static_cast<char>(*rit) == ')' || static_cast<char>(*rit) == ' ') {
-                ++rit;
+        // コネクションのトランザクションがtableNameのテーブルを操作することを記録する
+        // 操作の前に呼び出すこと(操作中に終了させる場合もこの記録を使う)
+        void touch(const std::string connectionId, const std::string tableName)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = std::find_if(datafiles_.begin(), datafiles_.end(),
+                                   [tableName](const Datafile &ref) { return ref.tableName() == tableName; });
+            if (it == datafiles_.end()) {
+                throw DatabaseException{"cannot find table: " + tableName};
             }
-            bytes.erase(rit.base(), bytes.end());
+            for (Transaction &t : transactionList_) {
+                if (t.connectionId() == connectionId) {
+                    t.touch(static_cast<size_t>(std::distance(datafiles_.begin(), it)));
+                    return;
+                }
+            }
+            throw std::runtime_error{"transaction is not found. connection id: " + connectionId + FILE_INFO};
         }
 
-        void separate(const std::vector<std::byte> &data,
-                      size_t &start,
-                      std::vector<std::byte> &v,
-                      std::vector<std::byte> &where)
+        // 引数のテーブル名のDatafile なければnullptr
+        Datafile *findDatafile(const std::string &tableName)
         {
-            // 直前がエスケープシーケンスであった場合にtrue
+            std::lock_guard<std::mutex> lock{mt_};
+            for (Datafile &f : datafiles_) {
+                if (f.tableName() == tableName) {
+                    return &f;
+                }
+            }
+            return nullptr;
+        }
+
+        Datafile &getDatafile(const std::string tableName)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = std::find_if(datafiles_.begin(), datafiles_.end(),
+                                   [tableName](const Datafile &ref) { return ref.tableName() == tableName; });
+            return *it;
+        }
+
+        bool isTransactionExists(const std::string connectionId)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            if (readOnlyTransactions_.find(connectionId) != readOnlyTransactions_.end()) {
+                return true;
+            }
+            for (const Transaction &t : transactionList_) {
+                if (t.connectionId() == connectionId) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void commitTransaction(const TRANSACTION_ID id)
+        {
+            bool optimistic = false;
+            bool serializable = false;
+            TIMESTAMP snapshot = 0;
+            const std::set<size_t> indexes = touchedDatafiles(id);
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{mt_};
+                for (const Transaction &t : transactionList_) {
+                    if (t.id() == id) {
+                        optimistic = t.isOptimistic();
+                        serializable = t.isolationLevel() == IsolationLevel::SERIALIZABLE;
+                        snapshot = t.snapshot();
+                    }
+                }
+            } // Scoped Lock end
+            if (serializable && !conflictTracker_.prepare(id)) {
+                rollbackTransaction(id);
+                throw DatabaseException{"transaction is aborted. could not serialize access due to read/write dependencies among transactions.", ResultCode::SERIALIZATION_FAILURE};
+            }
+            if (optimistic) {
+                // 全てのテーブルで検証に成功した場合のみ書き込む
+                bool isValid = true;
+                for (const size_t i : indexes) {
+                    std::lock_guard<std::mutex> lock{mt_};
+                    isValid = datafiles_[i].prepare(id, snapshot);
+                    if (!isValid) {
+                        break;
+                    }
+                }
+                if (!isValid) {
+                    rollbackTransaction(id);
+                    throw DatabaseException{"transaction is aborted. conflict is detected on commit.", ResultCode::SERIALIZATION_FAILURE};
+                }
+            }
+            const TIMESTAMP ts = issueCommitTimestamp();
+            for (const size_t i : indexes) {
+                std::lock_guard<std::mutex> lock{mt_};
+                datafiles_[i].commit(id, ts);
+            }
+            conflictTracker_.commit(id, ts);
+            completeCommit(ts);
+            TIMESTAMP oldest = 0;
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{mt_};
+                auto it = std::remove_if(transactionList_.begin(), transactionList_.end(),
+                                         [tId = id](Transaction &t) { return t.id() == tId; });
+                transactionList_.erase(it, transactionList_.end());
+                tIdGenerator_.release(id);
+
+                // 実行中のトランザクションのうち最も古いスナップショットより前の版は不要になる
+                oldest = currentSnapshot();
+                for (const Transaction &t : transactionList_) {
+                    if (t.snapshot() < oldest) {
+                        oldest = t.snapshot();
+                    }
+                }
+                for (const auto &e : readOnlyTransactions_) {
+                    if (e.second < oldest) {
+                        oldest = e.second;
+                    }
+                }
+            } // Scoped Lock end
+            // 版は書き込んだテーブルにしか増えないので書き込んだテーブルだけを対象にする
+            // 他のテーブルに残っている版はそのテーブルへの次のコミットで破棄する
+            // 版の走査はVersionStoreのロックだけで行い mt_を保持したまま他のトランザクションを待たせない
+            for (const size_t i : indexes) {
+                datafiles_[i].purgeVersions(oldest);
+            }
+            conflictTracker_.purge(oldest);
+        }
+
+        std::set<size_t> touchedDatafiles(const TRANSACTION_ID id)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            for (const Transaction &t : transactionList_) {
+                if (t.id() == id) {
+                    return t.datafileIndexes();
+                }
+            }
+            return std::set<size_t>{};
+        }
+
+        // コミットタイムスタンプを発行する
+        // 発行したタイムスタンプはcompleteCommitを呼び出すまで書き込み中として扱う
+        TIMESTAMP issueCommitTimestamp()
+        {
+            std::lock_guard<std::mutex> lock{timestampMt_};
+            ++lastTimestamp_;
+            committing_.insert(lastTimestamp_);
+            return lastTimestamp_;
+        }
+
+        void completeCommit(const TIMESTAMP ts)
+        {
+            std::lock_guard<std::mutex> lock{timestampMt_};
+            committing_.erase(ts);
+        }
+
+        // 新しく開始するトランザクションのスナップショットを返す
+        // 書き込み中のコミットがあればそれより前の全てのコミットが完了している時点となる
+        TIMESTAMP currentSnapshot()
+        {
+            std::lock_guard<std::mutex> lock{timestampMt_};
+            if (committing_.empty()) {
+                return lastTimestamp_;
+            }
+            return *committing_.begin() - 1;
+        }
+
+        // デッドロックの犠牲者として停止したことをまだ伝えていなければtrueを返す
+        bool takeDeadlockVictim(const std::string connectionId)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            return deadlockVictims_.erase(connectionId) > 0;
+        }
+
+        // 文の実行中にトランザクションが停止された場合に呼び出す
+        // トランザクションが残っていればロールバックして 停止した理由に応じたコードで例外を投げる
+        [[noreturn]] void throwTerminated(const std::string connectionId)
+        {
+            TRANSACTION_ID id = -1;
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{mt_};
+                for (const Transaction &t : transactionList_) {
+                    if (t.connectionId() == connectionId) {
+                        id = t.id();
+                    }
+                }
+            } // Scoped Lock end
+            if (id >= 0) {
+                rollbackTransaction(id);
+            }
+            const ResultCode code = takeDeadlockVictim(connectionId) ? ResultCode::DEADLOCK_VICTIM : ResultCode::TERMINATED;
+            throw DatabaseException{"transaction is terminated.", code};
+        }
+
+        void rollbackTransaction(const TRANSACTION_ID id)
+        {
+            for (const size_t i : touchedDatafiles(id)) {
+                std::lock_guard<std::mutex> lock{mt_};
+                datafiles_[i].rollback(id);
+            }
+            conflictTracker_.abort(id);
+            std::lock_guard<std::mutex> lock{mt_};
+            auto it = std::remove_if(transactionList_.begin(), transactionList_.end(),
+                                     [tId = id](Transaction &t) { return t.id() == tId; });
+            transactionList_.erase(it, transactionList_.end());
+            tIdGenerator_.release(id);
+        }
+
+        void toBytesDataFromString(const std::string &s, std::vector<std::byte> &out)
+        {
+            for (const char c : s) {
+                out.push_back(static_cast<std::byte>(c));
+            }
+        }
+
+        // 引数の先頭から'('以外が出現するまでにある'('を削除する
+        // 引数の末尾から')'以外が出現するまでにある')'を削除する
+        void trimParentheses(std::vector<std::byte> &bytes)
+        {
+            if (bytes.size() == 0) {
+                return;
+            }
+
+            auto it = bytes.begin();
+            while (static_cast<char>(*it) == '(' || static_cast<char>(*it) == ' ') {
+                ++it;
+            }
+            bytes.erase(bytes.begin(), it);
+
+            auto rit = bytes.rbegin();
+            while (static_cast<char>(*rit) == ')' || static_cast<char>(*rit) == ' ') {
+                ++rit;
+            }
+            bytes.erase(rit.base(), bytes.end());
+        }
+
+        void separate(const std::vector<std::byte> &data,
+                      size_t &start,
+                      std::vector<std::byte> &v,
+                      std::vector<std::byte> &where)
+        {
+            // 直前がエスケープシーケンスであった場合にtrue
             bool isESMode = false;
             // ""の内部にいる場合にtrue
             bool isInnerDq = false;
@@ -772,435 +1977,887 @@ namespace PapierMache::DbStuff {
             start = i;
         }
 
-        std::thread startChildThread(const std::string connectionId, ThreadsMap &threadsMapRef)
+        // startから後ろにある(...)の並びを先頭から順に取り出してそれぞれの括弧を取り除く
+        std::vector<std::vector<std::byte>> separateAll(const std::vector<std::byte> &data, const size_t start)
         {
-            // クライアントとやり取りするスレッドを作成
-            bool reuse = false;
-            for (int i = 0; i < conditions_.size(); ++i) {
-                const SessionCondition &sc = conditions_.at(i);
-                if (std::get<0>(sc) == "") {
-                    { // 書き込みロック
-                        std::lock_guard<std::shared_mutex> lock(sharedMt_);
-                        std::get<0>(conditions_.at(i)) = connectionId;
-                    }
-                    reuse = true;
+            std::vector<std::vector<std::byte>> result;
+            std::vector<std::byte> rest{data.begin() + start, data.end()};
+            while (!rest.empty()) {
+                std::vector<std::byte> v;
+                std::vector<std::byte> next;
+                size_t i = 0;
+                separate(rest, i, v, next);
+                trimParentheses(v);
+                result.push_back(std::move(v));
+                rest = std::move(next);
+            }
+            return result;
+        }
+
+        // PLEASE:PROTOCOL binary|textであればtrueを返してprotocolに小文字で設定する
+        bool isProtocolRequest(const std::vector<std::byte> &data, std::string &protocol)
+        {
+            const std::string prefix = "please:protocol";
+            if (data.size() < prefix.length()) {
+                return false;
+            }
+            const std::string query = toLower(std::string(reinterpret_cast<const char *>(data.data()), data.size()));
+            if (query.compare(0, prefix.length(), prefix) != 0) {
+                return false;
+            }
+            protocol = trim(query.substr(prefix.length()), ' ');
+            return true;
+        }
+
+        // PLEASE:BATCHであればtrue
+        bool isBatchRequest(const std::vector<std::byte> &data)
+        {
+            return startsWith(data, "please:batch");
+        }
+
+        // PLEASE:BATCH 文のバイト数 文 文のバイト数 文...を文ごとに分ける
+        // 文の中身は調べないので文の中に空白や改行があってもよい
+        std::vector<std::vector<std::byte>> separateBatch(const std::vector<std::byte> &data)
+        {
+            std::vector<std::vector<std::byte>> statements = separateLengthPrefixed(data, std::string{"please:batch"}.length());
+            if (statements.empty()) {
+                throw DatabaseException{"batch has no statement."};
+            }
+            return statements;
+        }
+
+        // startからのバイト数 値 バイト数 値...を値ごとに分ける
+        std::vector<std::vector<std::byte>> separateLengthPrefixed(const std::vector<std::byte> &data, const size_t start)
+        {
+            std::vector<std::vector<std::byte>> values;
+            size_t i = start;
+            while (true) {
+                while (i < data.size() && (static_cast<char>(data[i]) == ' ' || static_cast<char>(data[i]) == '\r' || static_cast<char>(data[i]) == '\n')) {
+                    ++i;
+                }
+                if (i == data.size()) {
                     break;
                 }
+                size_t length = 0;
+                size_t digits = 0;
+                for (; i < data.size() && static_cast<char>(data[i]) >= '0' && static_cast<char>(data[i]) <= '9'; ++i, ++digits) {
+                    length = length * 10 + static_cast<size_t>(static_cast<char>(data[i]) - '0');
+                    if (digits > 9) {
+                        throw DatabaseException{"length is too large."};
+                    }
+                }
+                if (digits == 0 || i == data.size() || static_cast<char>(data[i]) != ' ') {
+                    throw DatabaseException{"length prefixed values parse error."};
+                }
+                ++i;
+                if (data.size() - i < length) {
+                    throw DatabaseException{"length prefixed values are truncated."};
+                }
+                values.emplace_back(data.begin() + i, data.begin() + i + length);
+                i += length;
             }
-            if (!reuse) {
-                throw std::runtime_error{"number of sessions is upper limits." + FILE_INFO};
+            return values;
+        }
+
+        // PLEASE:BATCHの文を順に処理して処理結果をまとめてresponseに書き込む
+        // 失敗した文があればそこで止めるので 処理結果の数は実行した文の数になる
+        void executeBatch(const std::string &id, const std::vector<std::byte> &data, std::vector<std::byte> &response)
+        {
+            // 処理結果の形式はバッチの途中で切り替えられない
+            const bool isBinary = isBinaryProtocol(id);
+            std::vector<std::vector<std::byte>> responses;
+            try {
+                std::vector<std::vector<std::byte>> statements = separateBatch(data);
+                DB_LOG << "connection id: " << id << " batch size: " << statements.size() << FILE_INFO;
+                for (std::vector<std::byte> &statement : statements) {
+                    std::string protocol;
+                    if (isProtocolRequest(statement, protocol) || isBatchRequest(statement)) {
+                        throw DatabaseException{"PLEASE:PROTOCOL and PLEASE:BATCH cannot be batched."};
+                    }
+                    responses.emplace_back();
+                    executeStatement(id, statement, responses.back());
+                    if (resultCode(responses.back(), isBinary) < 0) {
+                        break;
+                    }
+                }
+            }
+            catch (DatabaseException &e) {
+                DB_LOG << e.what() << FILE_INFO;
+                Result r{static_cast<char>(e.code()), "", "", e.what()};
+                responses.emplace_back();
+                r.toBytes(isBinary, responses.back());
             }
+            BinaryProtocol::encodeBatch(responses, response);
+        }
 
-            int i = 0;
-            for (i = 0; i < conditions_.size(); ++i) {
-                const SessionCondition &sc = conditions_.at(i);
-                if (std::get<0>(sc) == connectionId) {
-                    break;
+        // 処理結果の先頭の結果コード
+        char resultCode(const std::vector<std::byte> &response, const bool isBinary)
+        {
+            // バイナリ形式では[u32 以降のバイト数][u8 形式の版]の後にある
+            const size_t position = isBinary ? 5 : 0;
+            if (response.size() <= position) {
+                return static_cast<char>(ResultCode::FAILED);
+            }
+            return static_cast<char>(response[position]);
+        }
+
+        bool isBinaryProtocol(const std::string &connectionId)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            return binaryConnections_.find(connectionId) != binaryConnections_.end();
+        }
+
+        void setBinaryProtocol(const std::string &connectionId, const bool isBinary)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            if (isBinary) {
+                binaryConnections_.insert(connectionId);
+            }
+            else {
+                binaryConnections_.erase(connectionId);
+            }
+        }
+
+        // 解析済みのselect insert update deleteを実行して処理結果をresponseに書き込む
+        // mDataとmWhereの列名はDatafileの解析結果と同じもの
+        void runStatement(const std::string &id,
+                          const std::string &userName,
+                          const std::string &operationName,
+                          const std::string &tableName,
+                          const std::map<std::string, std::vector<std::byte>> &mData,
+                          const std::map<std::string, std::vector<std::byte>> &mWhere,
+                          const bool isBinary,
+                          std::vector<std::byte> &response)
+        {
+            if (!getDatafile(tableName).isPermitted(operationName, userName)) {
+                throw DatabaseException{"operation: " + operationName + " to " + tableName + " is not permitted. user: " + userName};
+            }
+            const bool readOnly = isReadOnly(id);
+            if (readOnly && operationName != "select") {
+                throw DatabaseException{"operation: " + operationName + " is not permitted in read only transaction."};
+            }
+            if (operationName == "select") {
+                const bool optimistic = !readOnly && isOptimistic(id);
+                // SERIALIZABLEでは読んだ行の位置を依存関係の追跡に用いる
+                const bool serializable = !readOnly && !optimistic && isSerializable(id);
+                std::vector<LONGLONG> positions;
+                if (!readOnly) {
+                    // 表ロックISはコミットまで保持するので終了時にこのテーブルでも解放する
+                    // 楽観的トランザクションでは読み込んだ行がコミット時の検証対象となる
+                    touch(id, tableName);
+                }
+                if (isBinary) {
+                    // バイナリ形式では行の内容を列ごとに分けずにそのまま送る
+                    std::vector<std::byte> images;
+                    size_t count = 0;
+                    if (readOnly) {
+                        count = getDatafile(tableName).selectReadOnlyImages(mWhere, getSnapshot(id), images);
+                    }
+                    else if (optimistic || serializable) {
+                        count = getDatafile(tableName).selectOptimisticImages(getTransactionId(id), mWhere, getSnapshot(id), images, &positions);
+                    }
+                    else {
+                        count = getDatafile(tableName).selectImages(getTransactionId(id), mWhere, getSnapshot(id), images);
+                    }
+                    if (serializable) {
+                        recordSerializableRead(id, tableName, {mWhere}, positions, false);
+                    }
+                    Result r{tableName, getDatafile(tableName).columnDescriptors(), count, std::move(images)};
+                    r.toBinary(response);
+                    return;
+                }
+                std::vector<std::map<std::string, std::vector<std::byte>>> result;
+                if (readOnly) {
+                    result = getDatafile(tableName).selectReadOnly(mWhere, getSnapshot(id));
+                }
+                else if (optimistic || serializable) {
+                    result = getDatafile(tableName).selectOptimistic(getTransactionId(id), mWhere, getSnapshot(id), &positions);
+                }
+                else {
+                    result = getDatafile(tableName).select(getTransactionId(id), mWhere, getSnapshot(id));
+                }
+                if (serializable) {
+                    recordSerializableRead(id, tableName, {mWhere}, positions, false);
+                }
+                std::string tableInfo = getDatafile(tableName).tableInfo();
+                Result r{0, tableName, tableInfo, result};
+                r.toBytes(response);
+                return;
+            }
+            if (operationName == "insert") {
+                touch(id, tableName);
+                const bool serializable = isSerializable(id);
+                const size_t from = serializable ? getDatafile(tableName).pendingCount(getTransactionId(id)) : 0;
+                bool result = getDatafile(tableName).insert(getTransactionId(id), mData);
+                if (!result) {
+                    throwTerminated(id);
+                }
+                if (serializable) {
+                    // 追記した行は条件に合う並行するトランザクションの走査の結果を変えるので書き込みとして記録する
+                    recordSerializableWrite(id, tableName, {}, from);
                 }
+                std::string tableInfo = getDatafile(tableName).tableInfo();
+                Result r{1, tableName, tableInfo, "insert success."};
+                r.toBytes(isBinary, response);
+                return;
+            }
+            // updateとdelete deleteは更新内容が空のupdateとなる
+            const std::map<std::string, std::vector<std::byte>> empty{};
+            const std::map<std::string, std::vector<std::byte>> &m = operationName == "delete" ? empty : mData;
+            touch(id, tableName);
+            const bool serializable = isSerializable(id);
+            const size_t from = serializable ? getDatafile(tableName).pendingCount(getTransactionId(id)) : 0;
+            bool result = isOptimistic(id) ? getDatafile(tableName).updateOptimistic(getTransactionId(id), m, mWhere, getSnapshot(id))
+                                           : getDatafile(tableName).update(getTransactionId(id), m, mWhere);
+            if (!result) {
+                throwTerminated(id);
             }
-            if (i == conditions_.size()) {
-                throw std::runtime_error{"cannot find connection. should not reach here." + FILE_INFO};
+            if (serializable) {
+                assertFirstUpdater(id, tableName);
+                // 条件に合う行を探すための走査も読み込みとして記録する
+                recordSerializableWrite(id, tableName, {mWhere}, from);
             }
+            std::string tableInfo = getDatafile(tableName).tableInfo();
+            Result r{1, tableName, tableInfo, operationName + " success."};
+            r.toBytes(isBinary, response);
+        }
 
-            std::thread t{[&condition = conditions_.at(i), &threadsMap = threadsMapRef, this] {
-                std::string id;
-                try {
-                    { // 読み込みロック
-                        std::shared_lock<std::shared_mutex> lock(sharedMt_);
-                        id = std::get<0>(condition);
-                    }
-                    while (true) {
-                        if (toBeStopped_.load() || isClosed(id)) {
-                            DB_LOG << "child thread return." << FILE_INFO;
-                            threadsMap.setFinishedFlag(std::this_thread::get_id());
-                            return;
+        // dataが引数のprefixで始まればtrue 大文字小文字は区別しない
+        bool startsWith(const std::vector<std::byte> &data, const std::string &prefix)
+        {
+            if (data.size() < prefix.length()) {
+                return false;
+            }
+            return toLower(std::string(reinterpret_cast<const char *>(data.data()), prefix.length())) == prefix;
+        }
+
+        // userNameのセッションを発行してトークンを返す mt_を取得して呼び出す
+        std::string issueSessionImpl(const std::string &userName)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            for (auto it = sessions_.begin(); it != sessions_.end();) {
+                if (now - it->second.lastUsed > sessionTimeout_) {
+                    it = sessions_.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+            if (sessions_.size() >= MAX_SESSIONS) {
+                auto oldest = sessions_.begin();
+                for (auto it = sessions_.begin(); it != sessions_.end(); ++it) {
+                    if (it->second.lastUsed < oldest->second.lastUsed) {
+                        oldest = it;
+                    }
+                }
+                sessions_.erase(oldest);
+            }
+            // 暗号論的な乱数から生成するのでトークンは推測できない
+            std::string token = UUID::createSecure().str();
+            sessions_.insert(std::make_pair(token, Session{userName, now}));
+            return token;
+        }
+
+        // セッションのユーザーをコネクションに設定する
+        // セッションが見つからないか期限切れであればfalse mt_を取得して呼び出す
+        bool resumeSessionImpl(const std::string &id, const std::string &token)
+        {
+            auto it = sessions_.find(token);
+            if (it == sessions_.end()) {
+                return false;
+            }
+            const auto now = std::chrono::steady_clock::now();
+            if (now - it->second.lastUsed > sessionTimeout_) {
+                sessions_.erase(it);
+                return false;
+            }
+            it->second.lastUsed = now;
+            connectedUsers_.insert(std::make_pair(id, it->second.userName));
+            return true;
+        }
+
+        // iから空白までの語を取り出してiを語の後の空白を読み飛ばした位置に進める
+        std::string nextToken(const std::vector<std::byte> &data, size_t &i)
+        {
+            for (; i < data.size() && static_cast<char>(data[i]) == ' '; ++i) {
+            }
+            std::string token;
+            for (; i < data.size() && static_cast<char>(data[i]) != ' '; ++i) {
+                token.push_back(static_cast<char>(data[i]));
+            }
+            for (; i < data.size() && static_cast<char>(data[i]) == ' '; ++i) {
+            }
+            return token;
+        }
+
+        // PLEASE:PREPARE name operation tableName (...) (...)を解析してこのコネクションの文として保存する
+        // 同じ名前の文があれば置き換える
+        void prepareStatement(const std::string &id, const std::vector<std::byte> &data)
+        {
+            size_t i = std::string{"please:prepare"}.length();
+            const std::string name = nextToken(data, i);
+            if (name == "" || !std::all_of(name.begin(), name.end(), [](const char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; })) {
+                throw DatabaseException{"invalid prepared statement name: " + name};
+            }
+            auto pStatement = std::make_shared<PreparedStatement>();
+            pStatement->operationName = toLower(nextToken(data, i));
+            pStatement->tableName = toLower(nextToken(data, i));
+            const std::string &operationName = pStatement->operationName;
+            if (operationName != "select" && operationName != "insert" && operationName != "update" && operationName != "delete") {
+                throw DatabaseException{"operation: " + operationName + " cannot be prepared."};
+            }
+            Datafile *pDatafile = findDatafile(pStatement->tableName);
+            if (pDatafile == nullptr) {
+                throw DatabaseException{"cannot find table: " + pStatement->tableName};
+            }
+            std::vector<std::byte> v;
+            std::vector<std::byte> where;
+            if (operationName == "update") {
+                separate(data, i, v, where);
+            }
+            else {
+                for (; i < data.size(); ++i) {
+                    (operationName == "insert" ? v : where).push_back(data[i]);
+                }
+            }
+            trimParentheses(v);
+            trimParentheses(where);
+            int parameterCount = 0;
+            pStatement->data = pDatafile->prepareKeyValues(v, parameterCount);
+            pStatement->where = pDatafile->prepareKeyValues(where, parameterCount);
+            pStatement->parameterCount = parameterCount;
+
+            std::lock_guard<std::mutex> lock{mt_};
+            auto &statements = preparedStatements_[id];
+            if (statements.find(name) == statements.end() && statements.size() >= MAX_PREPARED_STATEMENTS) {
+                throw DatabaseException{"too many prepared statements. limit: " + std::to_string(MAX_PREPARED_STATEMENTS)};
+            }
+            statements[name] = pStatement;
+        }
+
+        // PLEASE:EXECUTE name パラメータのバイト数 パラメータ...で保存した文を実行する
+        // 文は解析済みなのでパラメータを当てはめるだけで実行できる
+        void executePrepared(const std::string &id, const std::string &userName, const std::vector<std::byte> &data, const bool isBinary,
+                             std::vector<std::byte> &response)
+        {
+            size_t i = std::string{"please:execute"}.length();
+            const std::string name = nextToken(data, i);
+            std::shared_ptr<const PreparedStatement> pStatement;
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{mt_};
+                auto statements = preparedStatements_.find(id);
+                if (statements != preparedStatements_.end()) {
+                    auto it = statements->second.find(name);
+                    if (it != statements->second.end()) {
+                        pStatement = it->second;
+                    }
+                }
+            } // Scoped Lock end
+            if (!pStatement) {
+                throw DatabaseException{"cannot find prepared statement: " + name};
+            }
+            const std::vector<std::vector<std::byte>> parameters = separateLengthPrefixed(data, i);
+            if (parameters.size() != static_cast<size_t>(pStatement->parameterCount)) {
+                throw DatabaseException{"prepared statement: " + name + " requires " + std::to_string(pStatement->parameterCount) +
+                                        " parameters but " + std::to_string(parameters.size()) + " are given."};
+            }
+            auto bind = [&parameters](const std::vector<Datafile::PreparedColumn> &columns) {
+                std::map<std::string, std::vector<std::byte>> m;
+                for (const Datafile::PreparedColumn &c : columns) {
+                    m[c.name] = c.parameter < 0 ? c.value : parameters[static_cast<size_t>(c.parameter)];
+                }
+                return m;
+            };
+            runStatement(id, userName, pStatement->operationName, pStatement->tableName, bind(pStatement->data), bind(pStatement->where), isBinary, response);
+        }
+
+        // クライアントからの1つの要求を処理して結果を通知する ワーカーで実行する
+        // idはuuidと同じConnectionのIdの文字列 以降の表はこれで引く
+        void processRequest(const UUID uuid, const std::string &id, const std::shared_ptr<Mailbox> pMailbox)
+        {
+            if (isClosed(uuid)) {
+                DB_LOG << "connection id: " << id << " is closed." << FILE_INFO;
+                return;
+            }
+            // 処理結果の形式 PLEASE:PROTOCOLへの応答は切り替える前の形式で返す
+            const bool isBinary = isBinaryProtocol(id);
+            try {
+                if (toBeStopped_.load()) {
+                    // 要求を待っているクライアントが戻れるように処理せずに応答する
+                    pMailbox->take();
+                    throw DatabaseException{"database is stopping."};
+                }
+                DB_LOG << "connection id: " << id << " is processing." << FILE_INFO;
+                Buffer request = pMailbox->take();
+                // 応答はメールボックスのプールのバッファに直接書き込み 確保済みの領域を使い回す
+                Buffer response = pMailbox->newBuffer();
+                if (isBatchRequest(request.bytes())) {
+                    executeBatch(id, request.bytes(), response.bytes());
+                }
+                else {
+                    executeStatement(id, request.bytes(), response.bytes());
+                }
+                pMailbox->put(std::move(response));
+                toNotify(uuid);
+                DB_LOG << "notify to id: " << id << FILE_INFO;
+            }
+            catch (std::exception &e) {
+                CATCH_ALL_EXCEPTIONS({
+                    Result r({-1, "", "", e.what()});
+                    Buffer response = pMailbox->newBuffer();
+                    r.toBytes(isBinary, response.bytes());
+                    pMailbox->put(std::move(response));
+                    toNotify(uuid);
+                    LOG << e.what() << FILE_INFO;
+                })
+            }
+            catch (...) {
+                CATCH_ALL_EXCEPTIONS({
+                    Result r({-1, "", "", "unexpected error or SEH exception."});
+                    Buffer response = pMailbox->newBuffer();
+                    r.toBytes(isBinary, response.bytes());
+                    pMailbox->put(std::move(response));
+                    toNotify(uuid);
+                    LOG << "unexpected error or SEH exception." << FILE_INFO;
+                })
+            }
+        }
+
+        // 1つの文を処理して処理結果をresponseに書き込む
+        void executeStatement(const std::string &id, std::vector<std::byte> &data, std::vector<std::byte> &response)
+        {
+            // 処理結果の形式 PLEASE:PROTOCOLへの応答は切り替える前の形式で返す
+            const bool isBinary = isBinaryProtocol(id);
+            try {
+                // 処理結果の形式の切り替えはユーザーの設定の前後どちらでも受け付ける
+                std::string protocol;
+                if (isProtocolRequest(data, protocol)) {
+                    if (protocol != "binary" && protocol != "text") {
+                        Result r{-1, "", "", "unknown protocol: " + protocol};
+                        r.toBytes(isBinary, response);
+                    }
+                    else {
+                        Result r{1, "", "", "protocol is changed to " + protocol + "."};
+                        r.toBytes(isBinary, response);
+                        setBinaryProtocol(id, protocol == "binary");
+                    }
+                    return;
+                }
+
+                // 最初の要求はユーザーのセットであること
+                bool setUserOperation = false;
+                { // Scoped Lock start
+                    std::lock_guard<std::mutex> lock{mt_};
+                    if (connectedUsers_.find(id) == connectedUsers_.end()) {
+                        setUserOperation = true;
+                    }
+                } // Scoped Lock end
+                if (setUserOperation && startsWith(data, "please:session ")) {
+                    // 発行済みのセッションのユーザーを設定する パスワードのハッシュ値は計算しない
+                    size_t i = std::string{"please:session"}.length();
+                    const std::string token = nextToken(data, i);
+                    bool isResumed = false;
+                    { // Scoped Lock start
+                        std::lock_guard<std::mutex> lock{mt_};
+                        isResumed = resumeSessionImpl(id, token);
+                    } // Scoped Lock end
+                    if (!isResumed) {
+                        Result r{static_cast<char>(ResultCode::UNAUTHENTICATED), "", "", "session is not found or expired."};
+                        r.toBytes(isBinary, response);
+                        return;
+                    }
+                    Result r{1, "", "", "session is resumed."};
+                    r.toBytes(isBinary, response);
+                    return;
+                }
+                if (setUserOperation) {
+                    // ユーザーの設定
+                    std::ostringstream oss{""};
+                    size_t i = 0;
+                    for (i = 0; i < data.size() && i < 7; ++i) {
+                        oss << static_cast<char>(data[i]);
+                    }
+                    if (toLower(oss.str()) != "please:") {
+                        Result r{-1, "", "", "parse error."};
+                        r.toBytes(isBinary, response);
+                        return;
+                    }
+                    oss.str("");
+                    for (; i < data.size() && i < 7 + 4; ++i) {
+                        oss << static_cast<char>(data[i]);
+                    }
+                    if (toLower(oss.str()) != "user") {
+                        Result r{-1, "", "", "operation PLEASE:USER is not done."};
+                        r.toBytes(isBinary, response);
+                        return;
+                    }
+                    oss.str("");
+                    std::string userName;
+                    std::string password;
+                    // iを空白文字が終わるまで進める
+                    for (; i < data.size(); ++i) {
+                        if (static_cast<char>(data[i]) != ' ') {
+                            break;
+                        }
+                    }
+                    for (; i < data.size(); ++i) {
+                        if (static_cast<char>(data[i]) != ' ') {
+                            oss << static_cast<char>(data[i]);
+                        }
+                        else {
+                            break;
+                        }
+                    }
+                    userName = oss.str();
+                    oss.str("");
+                    // iを空白文字が終わるまで進める
+                    for (; i < data.size(); ++i) {
+                        if (static_cast<char>(data[i]) != ' ') {
+                            break;
+                        }
+                    }
+                    for (; i < data.size(); ++i) {
+                        if (static_cast<char>(data[i]) != ' ') {
+                            oss << static_cast<char>(data[i]);
                         }
-                        { // Scoped Lock start
-                            std::unique_lock<std::mutex> lock{std::get<1>(condition)};
-                            if (!std::get<3>(condition)) {
-                                DB_LOG << "wait for request from client." << FILE_INFO;
-                                std::get<2>(condition).wait(lock, [&refB = std::get<3>(condition)] {
-                                    return refB;
-                                });
+                        else {
+                            break;
+                        }
+                    }
+                    password = oss.str();
+                    bool isSuccess = false;
+                    for (const User &u : users_) {
+                        DB_LOG << "u.userName(): " << u.userName();
+                        if (u.userName() == userName) {
+                            std::string hash;
+                            toBCryptHash(password, hash);
+                            if (u.password() == hash) {
+                                { // Scoped Lock start
+                                    std::lock_guard<std::mutex> lock{mt_};
+                                    connectedUsers_.insert(std::make_pair(id, userName));
+                                } // Scoped Lock end
+                                DB_LOG << "User: " << userName << " authentication is success." << FILE_INFO;
+                                Result r{1, "", "", "User authentication is success."};
+                                r.toBytes(isBinary, response);
+                                isSuccess = true;
+                                break;
                             }
-                        } // Scoped Lock end
-                        if (toBeStopped_.load() || isClosed(id)) {
-                            DB_LOG << "child thread return." << FILE_INFO;
-                            threadsMap.setFinishedFlag(std::this_thread::get_id());
-                            return;
                         }
+                    }
 
-                        std::vector<std::byte> data;
-                        std::vector<std::byte> response;
-                        try {
-                            DB_LOG << "connection id: " << id << " is processing." << FILE_INFO;
-                            getData(id, data);
-
-                            // 最初の要求はユーザーのセットであること
-                            bool setUserOperation = false;
-                            { // Scoped Lock start
-                                std::lock_guard<std::mutex> lock{mt_};
-                                if (connectedUsers_.find(id) == connectedUsers_.end()) {
-                                    setUserOperation = true;
-                                }
-                            } // Scoped Lock end
-                            if (setUserOperation) {
-                                // ユーザーの設定
-                                std::ostringstream oss{""};
-                                size_t i = 0;
-                                for (i = 0; i < data.size() && i < 7; ++i) {
-                                    oss << static_cast<char>(data[i]);
-                                }
-                                if (toLower(oss.str()) != "please:") {
-                                    Result r{-1, "", "", "parse error."};
-                                    response = r.toBytes();
-                                    setData(id, std::cref(response));
-                                    toNotify(id);
-                                    continue;
-                                }
-                                oss.str("");
-                                for (; i < data.size() && i < 7 + 4; ++i) {
-                                    oss << static_cast<char>(data[i]);
-                                }
-                                if (toLower(oss.str()) != "user") {
-                                    Result r{-1, "", "", "operation PLEASE:USER is not done."};
-                                    response = r.toBytes();
-                                    setData(id, std::cref(response));
-                                    toNotify(id);
-                                    continue;
-                                }
-                                oss.str("");
-                                std::string userName;
-                                std::string password;
-                                // iを空白文字が終わるまで進める
-                                for (; i < data.size(); ++i) {
-                                    if (static_cast<char>(data[i]) != ' ') {
-                                        break;
-                                    }
-                                }
-                                for (; i < data.size(); ++i) {
-                                    if (static_cast<char>(data[i]) != ' ') {
-                                        oss << static_cast<char>(data[i]);
-                                    }
-                                    else {
-                                        break;
-                                    }
-                                }
-                                userName = oss.str();
-                                oss.str("");
-                                // iを空白文字が終わるまで進める
-                                for (; i < data.size(); ++i) {
-                                    if (static_cast<char>(data[i]) != ' ') {
-                                        break;
-                                    }
-                                }
-                                for (; i < data.size(); ++i) {
-                                    if (static_cast<char>(data[i]) != ' ') {
-                                        oss << static_cast<char>(data[i]);
-                                    }
-                                    else {
-                                        break;
-                                    }
-                                }
-                                password = oss.str();
-                                bool isSuccess = false;
-                                for (const User &u : users_) {
-                                    DB_LOG << "u.userName(): " << u.userName();
-                                    if (u.userName() == userName) {
-                                        std::string hash;
-                                        toBCryptHash(password, hash);
-                                        if (u.password() == hash) {
-                                            { // Scoped Lock start
-                                                std::lock_guard<std::mutex> lock{mt_};
-                                                connectedUsers_.insert(std::make_pair(id, userName));
-                                            } // Scoped Lock end
-                                            DB_LOG << "User: " << userName << " authentication is success." << FILE_INFO;
-                                            Result r{1, "", "", "User authentication is success."};
-                                            response = r.toBytes();
-                                            setData(id, std::cref(response));
-                                            toNotify(id);
-                                            isSuccess = true;
-                                            break;
-                                        }
-                                    }
-                                }
+                    // 成功していれば次のループへ進む
+                    // 失敗していればエラーメッセージを送信してから次のループへ進む
+                    if (isSuccess) {
+                        return;
+                    }
+                    else {
+                        Result r{-1, "", "", "User authentication is failed."};
+                        r.toBytes(isBinary, response);
+                        return;
+                    }
+                }
+                // ユーザーが既に設定されていれば以下で処理継続
+                std::string userName;
+                { // Scoped Lock start
+                    std::lock_guard<std::mutex> lock{mt_};
+                    userName = connectedUsers_.at(id);
+                } // Scoped Lock end
+
+                // セッションの発行はトランザクションの有無によらず受け付ける
+                // 処理結果のメッセージがトークンで 以降のコネクションはPLEASE:SESSION トークンで認証できる
+                const size_t sessionLength = std::string{"please:session"}.length();
+                if (startsWith(data, "please:session") &&
+                    std::all_of(data.begin() + sessionLength, data.end(), [](const std::byte b) { return static_cast<char>(b) == ' '; })) {
+                    std::string token;
+                    { // Scoped Lock start
+                        std::lock_guard<std::mutex> lock{mt_};
+                        token = issueSessionImpl(userName);
+                    } // Scoped Lock end
+                    Result r{1, "", "", token};
+                    r.toBytes(isBinary, response);
+                    return;
+                }
 
-                                // 成功していれば次のループへ進む
-                                // 失敗していればエラーメッセージを送信してから次のループへ進む
-                                if (isSuccess) {
-                                    continue;
-                                }
-                                else {
-                                    Result r{-1, "", "", "User authentication is failed."};
-                                    response = r.toBytes();
-                                    setData(id, std::cref(response));
-                                    toNotify(id);
-                                    continue;
-                                }
-                            }
-                            // ユーザーが既に設定されていれば以下で処理継続
-                            std::string userName;
-                            { // Scoped Lock start
-                                std::lock_guard<std::mutex> lock{mt_};
-                                userName = connectedUsers_.at(id);
-                            } // Scoped Lock end
-
-                            // ユーザーがセットされてから最初の要求はトランザクションの開始であること
-                            // 続く要求はこのコネクションのユーザーに許可された処理であること
-                            // トランザクションがない状態で他の要求が来た場合はエラー
-                            // またトランザクションがある状態でトランザクションの要求が来た場合もエラーとする
-                            std::ostringstream oss{""};
-                            size_t i = 0;
-                            for (i = 0; i < data.size() && i < 7; ++i) {
-                                oss << static_cast<char>(data[i]);
-                            }
-                            if (toLower(oss.str()) != "please:") {
-                                Result r{-1, "", "", "parse error."};
-                                response = r.toBytes();
-                                setData(id, std::cref(response));
-                                toNotify(id);
-                                continue;
-                            }
-                            oss.str("");
-                            for (; i < data.size() && i < 7 + 11; ++i) {
-                                oss << static_cast<char>(data[i]);
-                            }
-                            if (isTransactionExists(id) && toLower(oss.str()) == "transaction") {
-                                Result r{-1, "", "", "transaction is already exists."};
-                                response = r.toBytes();
-                                setData(id, std::cref(response));
-                                toNotify(id);
-                                continue;
-                            }
-                            if (!isTransactionExists(id) && toLower(oss.str()) != "transaction") {
-                                Result r{-1, "", "", "cannot find transaction."};
-                                response = r.toBytes();
-                                setData(id, std::cref(response));
-                                toNotify(id);
-                                continue;
-                            }
-                            if (!isTransactionExists(id) && toLower(oss.str()) == "transaction") {
-                                if (addTransaction(id)) {
-                                    Result r{1, "", "", "transaction start is succeed."};
-                                    response = r.toBytes();
-                                    setData(id, std::cref(response));
-                                    toNotify(id);
-                                }
-                                else {
-                                    Result r{-1, "", "", "transaction start is failed."};
-                                    response = r.toBytes();
-                                    setData(id, std::cref(response));
-                                    toNotify(id);
-                                }
-                                continue;
-                            }
-                            // ここに到達した場合はトランザクションは存在しているので実際の要求を処理する
-                            // 操作名を取り出す
-                            oss.str("");
-                            i = 7;
-                            // iを空白文字が終わるまで進める
-                            for (; i < data.size(); ++i) {
-                                if (static_cast<char>(data[i]) != ' ') {
-                                    break;
-                                }
-                            }
-                            for (; i < data.size(); ++i) {
-                                if (static_cast<char>(data[i]) != ' ') {
-                                    oss << static_cast<char>(data[i]);
-                                }
-                                else {
-                                    break;
-                                }
-                            }
-                            const std::string operationName = toLower(trim(oss.str(), '"'));
-
-                            // テーブル名を取り出す
-                            // iを空白文字が終わるまで進める
-                            oss.str("");
-                            for (; i < data.size(); ++i) {
-                                if (static_cast<char>(data[i]) != ' ') {
-                                    break;
-                                }
-                            }
-                            for (; i < data.size(); ++i) {
-                                if (static_cast<char>(data[i]) != ' ') {
-                                    oss << static_cast<char>(data[i]);
-                                }
-                                else {
-                                    break;
-                                }
-                            }
-                            const std::string tableName = toLower(oss.str());
-                            oss.str("");
-                            // iを空白文字が終わるまで進める
-                            for (; i < data.size(); ++i) {
-                                if (static_cast<char>(data[i]) != ' ') {
-                                    break;
-                                }
-                            }
-                            if (operationName == "select") {
-                                if (!getDatafile(tableName).isPermitted(operationName, userName)) {
-                                    throw DatabaseException{"operation: " + operationName + " to " + tableName + " is not permitted. user: " + userName};
-                                }
-                                std::vector<std::byte> where;
-                                for (; i < data.size(); ++i) {
-                                    where.push_back(data[i]);
-                                }
-                                trimParentheses(where);
-                                auto result = getDatafile(tableName).select(getTransactionId(id), where);
-                                std::string tableInfo = getDatafile(tableName).tableInfo();
-                                Result r{0, tableName, tableInfo, result};
-                                response = r.toBytes();
-                            }
-                            else if (operationName == "insert") {
-                                if (!getDatafile(tableName).isPermitted(operationName, userName)) {
-                                    throw DatabaseException{"operation: " + operationName + " to " + tableName + " is not permitted. user: " + userName};
-                                }
-                                std::vector<std::byte> v;
-                                for (; i < data.size(); ++i) {
-                                    v.push_back(data[i]);
-                                }
-                                trimParentheses(v);
-                                bool result = getDatafile(tableName).insert(getTransactionId(id), v);
-                                if (!result) {
-                                    rollbackTransaction(getTransactionId(id));
-                                    throw DatabaseException{"transaction is terminated."};
-                                }
-                                std::string tableInfo = getDatafile(tableName).tableInfo();
-                                Result r{1, tableName, tableInfo, "insert success."};
-                                response = r.toBytes();
-                            }
-                            else if (operationName == "update") {
-                                if (!getDatafile(tableName).isPermitted(operationName, userName)) {
-                                    throw DatabaseException{"operation: " + operationName + " to " + tableName + " is not permitted. user: " + userName};
-                                }
-                                std::vector<std::byte> v;
-                                std::vector<std::byte> where;
-                                separate(data, i, v, where);
-                                trimParentheses(v);
-                                trimParentheses(where);
-                                bool result = getDatafile(tableName).update(getTransactionId(id), v, where);
-                                if (!result) {
-                                    rollbackTransaction(getTransactionId(id));
-                                    throw DatabaseException{"transaction is terminated."};
-                                }
-                                std::string tableInfo = getDatafile(tableName).tableInfo();
-                                Result r{1, tableName, tableInfo, "update success."};
-                                response = r.toBytes();
-                            }
-                            else if (operationName == "delete") {
-                                if (!getDatafile(tableName).isPermitted(operationName, userName)) {
-                                    throw DatabaseException{"operation: " + operationName + " to " + tableName + " is not permitted. user: " + userName};
-                                }
-                                std::vector<std::byte> where;
-                                for (; i < data.size(); ++i) {
-                                    where.push_back(data[i]);
-                                }
-                                trimParentheses(where);
-                                bool result = getDatafile(tableName).update(getTransactionId(id), where);
-                                if (!result) {
-                                    rollbackTransaction(getTransactionId(id));
-                                    throw DatabaseException{"transaction is terminated."};
-                                }
-                                std::string tableInfo = getDatafile(tableName).tableInfo();
-                                Result r{1, tableName, tableInfo, "delete success."};
-                                response = r.toBytes();
-                            }
-                            else if (operationName == "commit") {
-                                commitTransaction(getTransactionId(id));
-                                Result r{1, tableName, "", "commit success."};
-                                response = r.toBytes();
-                            }
-                            else if (operationName == "rollback") {
-                                rollbackTransaction(getTransactionId(id));
-                                Result r{1, tableName, "", "rollback success."};
-                                response = r.toBytes();
-                            }
-                            else if (operationName == "user") {
-                                throw DatabaseException{"operation PLEASE:USER is already done."};
-                            }
-                            else {
-                                throw DatabaseException{"unknown operation name: " + operationName};
-                            }
+                // 文の準備はトランザクションの有無によらず受け付ける
+                if (startsWith(data, "please:prepare ")) {
+                    prepareStatement(id, data);
+                    Result r{1, "", "", "prepare success."};
+                    r.toBytes(isBinary, response);
+                    return;
+                }
+
+                // ユーザーがセットされてから最初の要求はトランザクションの開始であること
+                // 続く要求はこのコネクションのユーザーに許可された処理であること
+                // トランザクションがない状態で他の要求が来た場合はエラー
+                // またトランザクションがある状態でトランザクションの要求が来た場合もエラーとする
+                std::ostringstream oss{""};
+                size_t i = 0;
+                for (i = 0; i < data.size() && i < 7; ++i) {
+                    oss << static_cast<char>(data[i]);
+                }
+                if (toLower(oss.str()) != "please:") {
+                    Result r{-1, "", "", "parse error."};
+                    r.toBytes(isBinary, response);
+                    return;
+                }
+                oss.str("");
+                for (; i < data.size() && i < 7 + 11; ++i) {
+                    oss << static_cast<char>(data[i]);
+                }
+                if (isTransactionExists(id) && toLower(oss.str()) == "transaction") {
+                    Result r{-1, "", "", "transaction is already exists."};
+                    r.toBytes(isBinary, response);
+                    return;
+                }
+                if (!isTransactionExists(id) && toLower(oss.str()) != "transaction") {
+                    // デッドロックの犠牲者として文の実行中以外に停止した場合は次の要求で伝える
+                    Result r = takeDeadlockVictim(id) ? Result{static_cast<char>(ResultCode::DEADLOCK_VICTIM), "", "", "transaction is terminated."}
+                                                      : Result{-1, "", "", "cannot find transaction."};
+                    r.toBytes(isBinary, response);
+                    return;
+                }
+                if (!isTransactionExists(id) && toLower(oss.str()) == "transaction") {
+                    // トランザクションのモード指定
+                    oss.str("");
+                    for (; i < data.size(); ++i) {
+                        oss << static_cast<char>(data[i]);
+                    }
+                    std::string mode = toLower(trim(oss.str(), ' '));
+                    // 分離レベルは"isolation level serializable"のようにも指定できる
+                    const std::string isolationPrefix = "isolation level ";
+                    if (mode.rfind(isolationPrefix, 0) == 0) {
+                        mode = trim(mode.substr(isolationPrefix.length()), ' ');
+                    }
+                    if (mode != "" && mode != "snapshot" && mode != "serializable" && mode != "optimistic" && mode != "read only") {
+                        Result r{-1, "", "", "unknown transaction mode: " + mode};
+                        r.toBytes(isBinary, response);
+                        return;
+                    }
+                    const IsolationLevel level = mode == "serializable" ? IsolationLevel::SERIALIZABLE : IsolationLevel::SNAPSHOT;
+                    if (mode == "read only" ? addReadOnlyTransaction(id) : addTransaction(id, mode == "optimistic", level)) {
+                        Result r{1, "", "", "transaction start is succeed."};
+                        r.toBytes(isBinary, response);
+                    }
+                    else {
+                        Result r{-1, "", "", "transaction start is failed."};
+                        r.toBytes(isBinary, response);
+                    }
+                    return;
+                }
+                // ここに到達した場合はトランザクションは存在しているので実際の要求を処理する
+                if (startsWith(data, "please:execute ")) {
+                    executePrepared(id, userName, data, isBinary, response);
+                    return;
+                }
+                // 操作名を取り出す
+                oss.str("");
+                i = 7;
+                // iを空白文字が終わるまで進める
+                for (; i < data.size(); ++i) {
+                    if (static_cast<char>(data[i]) != ' ') {
+                        break;
+                    }
+                }
+                for (; i < data.size(); ++i) {
+                    if (static_cast<char>(data[i]) != ' ') {
+                        oss << static_cast<char>(data[i]);
+                    }
+                    else {
+                        break;
+                    }
+                }
+                std::string operationName = toLower(trim(oss.str(), '"'));
+
+                // テーブル名を取り出す
+                // iを空白文字が終わるまで進める
+                oss.str("");
+                for (; i < data.size(); ++i) {
+                    if (static_cast<char>(data[i]) != ' ') {
+                        break;
+                    }
+                }
+                for (; i < data.size(); ++i) {
+                    if (static_cast<char>(data[i]) != ' ') {
+                        oss << static_cast<char>(data[i]);
+                    }
+                    else {
+                        break;
+                    }
+                }
+                std::string tableName = toLower(oss.str());
+                oss.str("");
+                if (operationName == "update" && tableName == "many") {
+                    // UPDATE MANYの場合はその次がテーブル名
+                    operationName = "update many";
+                    for (; i < data.size(); ++i) {
+                        if (static_cast<char>(data[i]) != ' ') {
+                            break;
                         }
-                        catch (DatafileException &e) {
-                            DB_LOG << e.what() << FILE_INFO;
-                            Result r{-1, "", "", e.what()};
-                            response = r.toBytes();
-                            setData(id, std::cref(response));
-                            toNotify(id);
-                            continue;
+                    }
+                    for (; i < data.size(); ++i) {
+                        if (static_cast<char>(data[i]) != ' ') {
+                            oss << static_cast<char>(data[i]);
                         }
-                        catch (DatabaseException &e) {
-                            DB_LOG << e.what() << FILE_INFO;
-                            Result r{-1, "", "", e.what()};
-                            response = r.toBytes();
-                            setData(id, std::cref(response));
-                            toNotify(id);
-                            continue;
+                        else {
+                            break;
                         }
-
-                        setData(id, std::cref(response));
-                        toNotify(id);
-                        DB_LOG << "notify to id: " << id << FILE_INFO;
                     }
+                    tableName = toLower(oss.str());
+                    oss.str("");
                 }
-                catch (std::exception &e) {
-                    CATCH_ALL_EXCEPTIONS({
-                        Result r({-1, "", "", e.what()});
-                        std::vector<std::byte> response = r.toBytes();
-                        setData(id, std::cref(response));
-                        toNotify(id);
-                        LOG << e.what() << FILE_INFO;
-                    })
+                // iを空白文字が終わるまで進める
+                for (; i < data.size(); ++i) {
+                    if (static_cast<char>(data[i]) != ' ') {
+                        break;
+                    }
                 }
-                catch (...) {
-                    CATCH_ALL_EXCEPTIONS({
-                        Result r({-1, "", "", "unexpected error or SEH exception."});
-                        std::vector<std::byte> response = r.toBytes();
-                        setData(id, std::cref(response));
-                        toNotify(id);
-                        LOG << "unexpected error or SEH exception." << FILE_INFO;
-                    })
+                const bool readOnly = isReadOnly(id);
+                if (readOnly && (operationName == "insert" || operationName == "update" || operationName == "update many" || operationName == "delete")) {
+                    throw DatabaseException{"operation: " + operationName + " is not permitted in read only transaction."};
                 }
-            }};
-            return std::move(t);
+                if (operationName == "select" || operationName == "insert" || operationName == "update" || operationName == "delete") {
+                    // 列名と値を解析してから実行する PLEASE:EXECUTEは解析済みのものを使う
+                    std::map<std::string, std::vector<std::byte>> mData;
+                    std::map<std::string, std::vector<std::byte>> mWhere;
+                    if (operationName == "update") {
+                        std::vector<std::byte> v;
+                        std::vector<std::byte> where;
+                        separate(data, i, v, where);
+                        trimParentheses(v);
+                        trimParentheses(where);
+                        mData = getDatafile(tableName).keyValues(v);
+                        mWhere = getDatafile(tableName).keyValues(where);
+                    }
+                    else {
+                        std::vector<std::byte> v;
+                        for (; i < data.size(); ++i) {
+                            v.push_back(data[i]);
+                        }
+                        trimParentheses(v);
+                        if (operationName == "insert") {
+                            mData = getDatafile(tableName).keyValues(v);
+                        }
+                        else {
+                            mWhere = getDatafile(tableName).keyValues(v);
+                        }
+                    }
+                    runStatement(id, userName, operationName, tableName, mData, mWhere, isBinary, response);
+                }
+                else if (operationName == "update many") {
+                    if (!getDatafile(tableName).isPermitted("update", userName)) {
+                        throw DatabaseException{"operation: " + operationName + " to " + tableName + " is not permitted. user: " + userName};
+                    }
+                    // (更新内容) (条件)の組の並び
+                    const std::vector<std::vector<std::byte>> groups = separateAll(data, i);
+                    if (groups.empty() || groups.size() % 2 != 0) {
+                        throw DatabaseException{"operation: " + operationName + " requires pairs of (data) (where)."};
+                    }
+                    std::vector<std::pair<std::vector<std::byte>, std::vector<std::byte>>> statements;
+                    for (size_t k = 0; k < groups.size(); k += 2) {
+                        statements.emplace_back(groups[k], groups[k + 1]);
+                    }
+                    touch(id, tableName);
+                    bool result = true;
+                    const bool serializable = isSerializable(id);
+                    const size_t from = serializable ? getDatafile(tableName).pendingCount(getTransactionId(id)) : 0;
+                    if (isOptimistic(id)) {
+                        // 楽観的トランザクションは行を待たないので組の順に更新する
+                        for (const auto &e : statements) {
+                            if (!getDatafile(tableName).updateOptimistic(getTransactionId(id), e.first, e.second, getSnapshot(id))) {
+                                result = false;
+                                break;
+                            }
+                        }
+                    }
+                    else {
+                        result = getDatafile(tableName).updateMany(getTransactionId(id), statements);
+                    }
+                    if (!result) {
+                        throwTerminated(id);
+                    }
+                    if (serializable) {
+                        assertFirstUpdater(id, tableName);
+                        std::vector<std::map<std::string, std::vector<std::byte>>> predicates;
+                        for (const auto &e : statements) {
+                            predicates.push_back(getDatafile(tableName).keyValues(e.second));
+                        }
+                        recordSerializableWrite(id, tableName, predicates, from);
+                    }
+                    std::string tableInfo = getDatafile(tableName).tableInfo();
+                    Result r{1, tableName, tableInfo, "update success."};
+                    r.toBytes(isBinary, response);
+                }
+                else if (operationName == "commit" && readOnly) {
+                    // 読み取り専用トランザクションは書き込むものがない
+                    removeReadOnlyTransaction(id);
+                    Result r{1, tableName, "", "commit success."};
+                    r.toBytes(isBinary, response);
+                }
+                else if (operationName == "rollback" && readOnly) {
+                    removeReadOnlyTransaction(id);
+                    Result r{1, tableName, "", "rollback success."};
+                    r.toBytes(isBinary, response);
+                }
+                else if (operationName == "commit") {
+                    commitTransaction(getTransactionId(id));
+                    Result r{1, tableName, "", "commit success."};
+                    r.toBytes(isBinary, response);
+                }
+                else if (operationName == "rollback") {
+                    rollbackTransaction(getTransactionId(id));
+                    Result r{1, tableName, "", "rollback success."};
+                    r.toBytes(isBinary, response);
+                }
+                else if (operationName == "user") {
+                    throw DatabaseException{"operation PLEASE:USER is already done."};
+                }
+                else if (operationName == "session") {
+                    throw DatabaseException{"user of this connection is already set."};
+                }
+                else {
+                    throw DatabaseException{"unknown operation name: " + operationName};
+                }
+            }
+            catch (DatafileException &e) {
+                DB_LOG << e.what() << FILE_INFO;
+                Result r{-1, "", "", e.what()};
+                r.toBytes(isBinary, response);
+                return;
+            }
+            catch (DatabaseException &e) {
+                DB_LOG << e.what() << FILE_INFO;
+                Result r{static_cast<char>(e.code()), "", "", e.what()};
+                r.toBytes(isBinary, response);
+            }
         }
 
         void startService()
         {
             try {
-                for (SessionCondition &sc : conditions_) {
-                    std::get<0>(sc) = "";
-                    std::get<3>(sc) = false;
-                }
-                ThreadsMap threadsMap;
                 while (true) {
-                    if (toBeStopped_.load()) {
-                        DB_LOG << "toBeStopped_: " << toBeStopped_.load() << FILE_INFO;
-                        return;
-                    }
-                    std::this_thread::sleep_for(std::chrono::seconds(1));
-                    std::string connectionId;
                     { // Scoped Lock start
-                        std::lock_guard<std::mutex> lock{mt_};
-                        if (!isRequiredConnection_) {
-                            continue;
+                        std::unique_lock<std::mutex> lock{mt_};
+                        // コネクションの作成要求か空きの不足か終了の要求があるまで待つ
+                        cond_.wait(lock, [this] {
+                            return toBeStopped_.load() || isRequiredConnection_ || idleConnections() < minimumConnections_;
+                        });
+                        if (toBeStopped_.load()) {
+                            DB_LOG << "toBeStopped_: " << toBeStopped_.load() << FILE_INFO;
+                            return;
+                        }
+                        // まとめて作成する 空きが最小数に満たない場合は最小数になるまで作成する
+                        size_t count = connectionBatchSize_;
+                        const size_t idle = idleConnections();
+                        if (idle < minimumConnections_ && minimumConnections_ - idle > count) {
+                            count = minimumConnections_ - idle;
+                        }
+                        for (size_t i = 0; i < count; ++i) {
+                            Connection con = createConnection();
+                            acquireSession(con.uuid(), con.id_, con.pMailbox_);
                         }
-                        Connection con = createConnection();
-                        connectionId = con.id();
-
                         isRequiredConnection_ = false;
                     } // Scoped Lock end
                     cond_.notify_all();
-
-                    std::thread t;
-                    { // Scoped Lock start
-                        std::lock_guard<std::mutex> lock{mt_};
-                        t = startChildThread(connectionId, threadsMap);
-                    } // Scoped Lock end
-                    threadsMap.addThread(std::move(t));
-                    threadsMap.cleanUp();
                 }
             }
             catch (std::exception &e) {
@@ -1208,25 +2865,81 @@ namespace PapierMache::DbStuff {
             }
         }
 
-        IdGenerator<TRANSACTION_ID> tIdGenerator_;
+        // 同時に実行できるトランザクション数の上限
+        static constexpr size_t TRANSACTION_ID_CAPACITY = 65536;
+        // 保持する使われていないコネクションの最小数
+        static constexpr size_t DEFAULT_MINIMUM_CONNECTIONS = 4;
+        // 1度に作成するコネクションの数
+        static constexpr size_t DEFAULT_CONNECTION_BATCH_SIZE = 4;
+        // クライアントの要求を処理するワーカースレッドの数
+        static constexpr size_t DEFAULT_WORKER_THREADS = 8;
+        // 1つのコネクションで保存できる準備済みの文の数
+        static constexpr size_t MAX_PREPARED_STATEMENTS = 64;
+        // 同時に有効なセッションの数 超えた場合は最も長く使われていないものを捨てる
+        static constexpr size_t MAX_SESSIONS = 1024;
+        // セッションの既定の有効期間
+        static constexpr std::chrono::seconds DEFAULT_SESSION_TIMEOUT{1800};
+
+        LockFreeIdGenerator<TRANSACTION_ID> tIdGenerator_;
         std::vector<Datafile> datafiles_;
         std::vector<Connection> connectionList_;
+        // クローズしていないコネクションのId 要求ごとのisClosedでconnectionList_を走査しない
+        std::unordered_set<UUID, UUID::Hash> openConnections_;
         std::vector<Transaction> transactionList_;
+        // デッドロックの犠牲者を選ぶ方針
+        std::unique_ptr<VictimSelectionPolicy> pVictimPolicy_;
+        // 表ロックに切り替える行数
+        size_t escalationThreshold_;
+        // 実行中のメンテナンスに割り当てたトランザクションID
+        std::set<TRANSACTION_ID> maintenanceIds_;
+        // SERIALIZABLEのトランザクション間の依存関係
+        SerializableConflictTracker conflictTracker_;
+        // ロックの待ちとデッドロックの記録 各Datafileからも記録する
+        LockEventHistory lockEvents_;
+        // デッドロックの犠牲者として停止したことをまだ伝えていないConnectionのId
+        std::set<std::string> deadlockVictims_;
+        // key: ConnectionのId, value: 読み取り専用トランザクションのスナップショット
+        std::map<std::string, TIMESTAMP> readOnlyTransactions_;
         std::vector<User> users_;
         // key: ConnectionのId, value: ユーザー名
         std::map<std::string, std::string> connectedUsers_;
-        // key: ConnectionのId, value: 送受信データ
-        std::map<std::string, DataStream> dataStreams_;
-
-        // クライアントと子スレッドのセッションの状態
-        std::array<SessionCondition, 50> conditions_;
-        // SessionConditionのConnectionのIdを設定する際に用いるミューテックス
+        // key: セッションのトークン, value: セッション
+        std::map<std::string, Session> sessions_;
+        std::chrono::seconds sessionTimeout_;
+        // 処理結果をバイナリ形式で返すConnectionのId
+        std::set<std::string> binaryConnections_;
+        // key: ConnectionのId, value: 名前とPLEASE:PREPAREで解析済みの文
+        std::map<std::string, std::map<std::string, std::shared_ptr<const PreparedStatement>>> preparedStatements_;
+
+        // クライアントとワーカーのセッションの状態
+        // セッション数に上限はなく必要に応じて追加する
+        std::vector<std::unique_ptr<SessionCondition>> conditions_;
+        // key: ConnectionのId, value: conditions_の添字
+        std::unordered_map<UUID, size_t, UUID::Hash> sessionIndex_;
+        // どのコネクションにも割り当てられていないconditions_の添字
+        std::vector<size_t> freeSessions_;
+        // 上記セッションのテーブルを操作する際に用いるミューテックス
         std::shared_mutex sharedMt_;
 
+        // 最後に発行したコミットタイムスタンプ
+        TIMESTAMP lastTimestamp_;
+        // 書き込み中のコミットのタイムスタンプ
+        std::set<TIMESTAMP> committing_;
+        // 上記タイムスタンプ用のミューテックス
+        std::mutex timestampMt_;
+
         // コネクション作成要求がある場合にtrue
         bool isRequiredConnection_;
-        // 上記bool用の条件変数
+        // 上記bool用の条件変数 コネクションの作成を待つ側とstartServiceの両方が待つ
         std::condition_variable cond_;
+        // 保持する使われていないコネクションの最小数
+        size_t minimumConnections_;
+        // 1度に作成するコネクションの数
+        size_t connectionBatchSize_;
+        // クライアントの要求を処理するワーカースレッドの数
+        size_t workerThreads_;
+        // クライアントの要求を処理するワーカー startで作成する
+        std::unique_ptr<WorkerPool> pWorkers_;
 
         // データベースを終了すべき場合にtrue
         std::atomic_bool toBeStopped_;
@@ -1245,24 +2958,52 @@ namespace PapierMache::DbStuff {
     // Connection
     inline bool Connection::send(const std::vector<std::byte> &data)
     {
-        // クライアントからの情報送信はDB内部の送受信用バッファに情報を入れる
-        return pDb_->setData(id_, data);
+        Buffer buffer = pMailbox_->newBuffer();
+        buffer.bytes() = data;
+        return send(std::move(buffer));
+    }
+
+    inline bool Connection::send(Buffer data)
+    {
+        // クライアントからの情報送信はセッションと共有するメールボックスにバッファを置く
+        pMailbox_->put(std::move(data));
+        return true;
     }
 
     inline bool Connection::receive(std::vector<std::byte> &out)
     {
-        // クライアントはDB内部の送受信用バッファから情報を取り出すことで受信する
-        return pDb_->getData(id_, out);
+        Buffer buffer;
+        receive(buffer);
+        if (buffer.isUnique()) {
+            // 他に参照がなければ中身を入れ替える outの領域はプールで再利用される
+            out.swap(buffer.bytes());
+        }
+        else {
+            out = buffer.bytes();
+        }
+        return true;
+    }
+
+    inline bool Connection::receive(Buffer &out)
+    {
+        // クライアントはメールボックスからバッファを取り出すことで受信する
+        out = pMailbox_->take();
+        return true;
+    }
+
+    inline Buffer Connection::newBuffer()
+    {
+        return pMailbox_->newBuffer();
     }
 
     inline bool Connection::request()
     {
-        return pDb_->toNotify(id_, true);
+        return pDb_->toNotify(uuid_, true);
     }
 
     inline int Connection::wait()
     {
-        return pDb_->wait(id_);
+        return pDb_->wait(uuid_);
     }
 
     inline bool Connection::terminate()
@@ -1277,7 +3018,7 @@ namespace PapierMache::DbStuff {
 
     inline bool Connection::isClosed()
     {
-        return pDb_->isClosed(id_);
+        return pDb_->isClosed(uuid_);
     }
 
     // データベースドライバー
@@ -1285,23 +3026,223 @@ namespace PapierMache::DbStuff {
     public:
         struct Result {
             bool isSucceed;
+            // テキスト形式の場合の行 バイナリ形式の場合は空でviewから読む
             std::vector<std::map<std::string, std::string>> rows;
             std::string message;
+            // データベースが返した処理結果のコード 送受信に失敗した場合はResultCode::FAILED
+            char code;
+            // バイナリ形式の場合の行 受信した固定長の行をそのまま保持する
+            BinaryProtocol::RowView view;
+
+            Result(const bool b, std::vector<std::map<std::string, std::string>> v, const std::string s,
+                   const char c = static_cast<char>(ResultCode::FAILED))
+                : isSucceed{b}, rows{v}, message{s}, code{c}
+            {
+            }
 
-            Result(const bool b, std::vector<std::map<std::string, std::string>> v, const std::string s)
-                : isSucceed{b}, rows{v}, message{s}
+            // 最初からやり直せば成功する可能性がある失敗であればtrue
+            bool isRetryable() const
             {
+                return !isSucceed && (code == static_cast<char>(ResultCode::DEADLOCK_VICTIM) || code == static_cast<char>(ResultCode::SERIALIZATION_FAILURE));
             }
         };
 
+        // executeTransactionの再実行の設定
+        struct RetryPolicy {
+            // 最初の実行を含む実行回数の上限
+            int maxAttempts;
+            // n回目の再実行の前には0からbaseDelay * 2^(n-1)(maxDelayが上限)の間のランダムな時間待つ
+            std::chrono::milliseconds baseDelay;
+            std::chrono::milliseconds maxDelay;
+        };
+
         Driver(const Connection con)
-            : con_{con}
+            : con_{con},
+              isBinary_{false}
+        {
+        }
+
+        // 以降の処理結果をバイナリ形式で受け取る
+        // 行の値を区切り文字を探さずに固定長で取り出せる
+        Result useBinaryProtocol()
+        {
+            Result r = sendQuery("please:protocol binary");
+            if (r.isSucceed) {
+                isBinary_ = true;
+            }
+            return r;
+        }
+
+        // ユーザー名とパスワードでこのコネクションを認証し セッションを発行する
+        // 成功した場合は処理結果のmessageがセッションのトークンになる
+        Result openSession(const std::string &userName, const std::string &password)
+        {
+            std::vector<Result> results = sendBatch({"please:user " + userName + " " + password, "please:session"});
+            return results.back();
+        }
+
+        // openSessionで発行したセッションでこのコネクションを認証する
+        // パスワードのハッシュ値を計算しないので要求ごとにPLEASE:USERを送るより速い
+        // 期限切れなどで失敗した場合の結果コードはResultCode::UNAUTHENTICATED
+        Result resumeSession(const std::string &token)
+        {
+            return sendQuery("please:session " + token);
+        }
+
+        // PLEASE:TRANSACTIONでトランザクションを開始してfを実行し 成功すればPLEASE:COMMITする
+        // fはこのDriverを引数に取り 最後に実行した文の結果を返す 失敗を返した場合はロールバックする
+        // デッドロックの犠牲者になった場合と競合で中止された場合は待ってから最初からやり直す
+        // fは再実行されるのでトランザクションの外に影響を与えないこと
+        // 成功した場合はfの結果を返し それ以外の場合は最後の失敗の結果を返す
+        template <typename F>
+        Result executeTransaction(F f, const std::string mode = "", const RetryPolicy policy = RetryPolicy{5, std::chrono::milliseconds{50}, std::chrono::milliseconds{2000}})
+        {
+            Result r{false, {}, "transaction is not executed."};
+            for (int attempt = 1; attempt <= policy.maxAttempts; ++attempt) {
+                r = sendQuery("please:transaction " + mode);
+                if (!r.isSucceed) {
+                    return r;
+                }
+                r = f(*this);
+                if (r.isSucceed) {
+                    Result c = sendQuery("please:commit");
+                    if (c.isSucceed) {
+                        return r;
+                    }
+                    r = c;
+                }
+                else {
+                    // 停止されたトランザクションは既に存在しないのでこの結果は無視する
+                    sendQuery("please:rollback");
+                }
+                if (!r.isRetryable()) {
+                    return r;
+                }
+                if (attempt < policy.maxAttempts) {
+                    DB_LOG << "transaction is retried. attempt: " << attempt << " code: " << static_cast<int>(r.code) << FILE_INFO;
+                    std::this_thread::sleep_for(backoff(attempt, policy));
+                }
+            }
+            return r;
+        }
+
+        // 文を解析してこのコネクションにnameで保存する statementはPLEASE:の後の部分で 値の代わりに?を書くと実行時にパラメータで置き換える
+        // 同じ形の文を繰り返し実行する場合は以降の解析を省ける トランザクションの外でも準備できる
+        Result prepare(const std::string &name, const std::string &statement)
+        {
+            return sendQuery("please:prepare " + name + " " + statement);
+        }
+
+        // prepareで保存した文をパラメータを当てはめて実行する パラメータは引用符で囲まずにそのまま渡す
+        Result execute(const std::string &name, const std::vector<std::string> &parameters)
+        {
+            return sendQuery(executeQuery(name, parameters));
+        }
+
+        // executeで送る文 sendBatchやexecuteBatchTransactionに渡せる
+        static std::string executeQuery(const std::string &name, const std::vector<std::string> &parameters)
+        {
+            std::string query = "please:execute " + name;
+            for (const std::string &p : parameters) {
+                query += " " + std::to_string(p.length()) + " " + p;
+            }
+            return query;
+        }
+
+        // statementsをPLEASE:TRANSACTIONとPLEASE:COMMITで挟んでsendBatchで1度に送る
+        // 再実行の扱いはexecuteTransactionと同じで 失敗した場合のPLEASE:ROLLBACKだけは別に送る
+        // preambleはPLEASE:USERなどトランザクションの前に1度だけ実行する文で 最初の送信の先頭に加える
+        // 成功した場合は最後の文の結果を返し それ以外の場合は最後の失敗の結果を返す
+        Result executeBatchTransaction(const std::vector<std::string> &statements, const std::string mode = "",
+                                       const RetryPolicy policy = RetryPolicy{5, std::chrono::milliseconds{50}, std::chrono::milliseconds{2000}},
+                                       const std::vector<std::string> &preamble = {})
+        {
+            Result r{false, {}, "transaction is not executed."};
+            if (statements.empty()) {
+                return r;
+            }
+            for (int attempt = 1; attempt <= policy.maxAttempts; ++attempt) {
+                std::vector<std::string> batch;
+                if (attempt == 1) {
+                    batch = preamble;
+                }
+                const size_t begin = batch.size();
+                batch.push_back("please:transaction " + mode);
+                batch.insert(batch.end(), statements.begin(), statements.end());
+                batch.push_back("please:commit");
+                std::vector<Result> results = sendBatch(batch);
+                if (results.size() == batch.size() && results.back().isSucceed) {
+                    // PLEASE:COMMITの前の文の結果
+                    return results[results.size() - 2];
+                }
+                r = results.back();
+                const size_t failed = results.size() - 1;
+                if (failed <= begin) {
+                    // トランザクションを開始する前に失敗した
+                    return r;
+                }
+                if (failed < batch.size() - 1) {
+                    // 停止されたトランザクションは既に存在しないのでこの結果は無視する
+                    sendQuery("please:rollback");
+                }
+                if (!r.isRetryable()) {
+                    return r;
+                }
+                if (attempt < policy.maxAttempts) {
+                    DB_LOG << "transaction is retried. attempt: " << attempt << " code: " << static_cast<int>(r.code) << FILE_INFO;
+                    std::this_thread::sleep_for(backoff(attempt, policy));
+                }
+            }
+            return r;
+        }
+
+        // 複数のクエリを1回の送受信でデータベースに送る
+        // データベースは順に処理して失敗した文があればそこで止めるので 戻り値は実行した文の数だけの結果になる
+        // 送受信に失敗した場合は失敗を表す結果を1つだけ返す
+        // PLEASE:PROTOCOLとPLEASE:BATCHは含められない
+        // PLEASE:BATCH 文のバイト数 文 文のバイト数 文...
+        std::vector<Result> sendBatch(const std::vector<std::string> &queries)
         {
+            std::string error = "";
+            std::vector<Result> results;
+            try {
+                std::string batch = "please:batch";
+                for (const std::string &q : queries) {
+                    batch += " " + std::to_string(q.length()) + " " + q;
+                }
+                Buffer received;
+                if (!exchange(batch, received, error)) {
+                    results.push_back(Result{false, {}, error});
+                    return results;
+                }
+                error = "decode failed";
+                std::vector<std::vector<std::byte>> responses = BinaryProtocol::decodeBatch(received.bytes());
+                error = "";
+                for (const std::vector<std::byte> &response : responses) {
+                    results.push_back(toResult(response));
+                }
+                if (results.empty()) {
+                    results.push_back(Result{false, {}, "batch result is empty."});
+                }
+                return results;
+            }
+            catch (std::exception &e) {
+                if (error == "") {
+                    throw;
+                }
+                results.clear();
+                results.push_back(Result{false, {}, error + " : " + e.what()});
+                return results;
+            }
         }
 
         // 引数のクエリをコネクションを通じてデータベースに送る
         // ユーザーの設定
         // PLEASE:USER userName password
+        // 認証済みのコネクションのユーザーでセッションを発行する openSessionを用いること
+        // PLEASE:SESSION
+        // 発行済みのセッションでユーザーを設定する resumeSessionを用いること
+        // PLEASE:SESSION token
         // このコネクションにおけるトランザクションを開始する:
         // PLEASE:TRANSACTION
         // テーブルへのselect ()内が照会する列
@@ -1310,129 +3251,152 @@ namespace PapierMache::DbStuff {
         // PLEASE:INSERT tableName (key1="value1",key2="value2"...)
         // テーブルへのupdate 前半の()内が更新内容 後半の()内が更新する列
         // PLEASE:UPDATE tableName (key1="value1",key2="value2"...) (key1="value1",key2="value2"...)
+        // 複数のupdateをまとめて行う 対象行はファイル上の位置の順にロックするので組の順によらずデッドロックにならない
+        // PLEASE:UPDATE MANY tableName (data1) (where1) (data2) (where2) ...
         // テーブルへのdelete ()内が削除する列
         // PLEASE:DELETE tableName (key1="value1",key2="value2"...)
         // トランザクションをコミットする
         // PLEASE:COMMIT
         // トランザクションをロールバックする
         // PLEASE:ROLLBACK
+        // 処理結果の形式を切り替える(既定はtext) useBinaryProtocolを用いること
+        // PLEASE:PROTOCOL binary|text
+        // 複数の文をまとめて送る sendBatchを用いること
+        // PLEASE:BATCH 文のバイト数 文 文のバイト数 文...
+        // 文を解析して保存する 値の代わりの?は実行時のパラメータになる prepareを用いること
+        // PLEASE:PREPARE name UPDATE tableName (key1=?,key2="value2") (key3=?)
+        // 保存した文を実行する executeを用いること
+        // PLEASE:EXECUTE name パラメータのバイト数 パラメータ パラメータのバイト数 パラメータ...
         Result sendQuery(std::string query)
         {
             std::string error = "";
             std::vector<std::map<std::string, std::string>> rows;
             try {
-                std::vector<std::byte> data;
-                for (const char c : query) {
-                    data.push_back(static_cast<std::byte>(c));
-                }
-                // クエリ送信
-                error = "send failed";
-                if (!con_.send(data)) {
+                Buffer received;
+                if (!exchange(query, received, error)) {
                     return Result{false, rows, error};
                 }
-                // データベースに送信したクエリの処理のリクエストを送る
-                // リトライ含め3回
-                error = "request failed";
-                bool requestResult = con_.request();
+                error = "";
+                return toResult(received.bytes());
+            }
+            catch (std::exception &e) {
+                if (error == "") {
+                    throw;
+                }
+                return Result{false, rows, error + " : " + e.what()};
+            }
+        }
+
+    private:
+        // クエリを送信して処理を依頼し 処理結果をreceivedに受信する
+        // 失敗した場合は失敗した段階をerrorに設定してfalseを返す
+        bool exchange(const std::string &query, Buffer &received, std::string &error)
+        {
+            // 送受信するバッファは使い回されるのでクエリごとに領域を確保しない
+            Buffer request = con_.newBuffer();
+            request.bytes().reserve(query.size());
+            for (const char c : query) {
+                request.bytes().push_back(static_cast<std::byte>(c));
+            }
+            // クエリ送信
+            error = "send failed";
+            if (!con_.send(std::move(request))) {
+                return false;
+            }
+            // データベースに送信したクエリの処理のリクエストを送る
+            // リトライ含め3回
+            error = "request failed";
+            bool requestResult = con_.request();
+            if (!requestResult) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                requestResult = con_.request();
                 if (!requestResult) {
                     std::this_thread::sleep_for(std::chrono::milliseconds(500));
                     requestResult = con_.request();
-                    if (!requestResult) {
-                        std::this_thread::sleep_for(std::chrono::milliseconds(500));
-                        requestResult = con_.request();
-                    }
-                }
-                if (!requestResult) {
-                    return Result{false, rows, error};
                 }
-                // データベースの処理を待つ
-                error = "wait failed";
-                int waitResult = con_.wait();
-                if (waitResult == -1) {
-                    // このエラー時のみリトライする
-                    waitResult = con_.wait();
+            }
+            if (!requestResult) {
+                return false;
+            }
+            // データベースの処理を待つ
+            error = "wait failed";
+            int waitResult = con_.wait();
+            if (waitResult == -1) {
+                // このエラー時のみリトライする
+                waitResult = con_.wait();
+            }
+            // エラーがあった場合
+            if (waitResult != 0) {
+                return false;
+            }
+            // 結果受信
+            error = "receive failed";
+            if (!con_.receive(received)) {
+                return false;
+            }
+            return true;
+        }
+
+        Result toResult(const std::vector<std::byte> &data)
+        {
+            if (isBinary_) {
+                return fromBinary(data);
+            }
+            return fromText(data);
+        }
+
+        // テキスト形式の処理結果をResultにする
+        Result fromText(const std::vector<std::byte> &data)
+        {
+            std::string error = "";
+            std::vector<std::map<std::string, std::string>> rows;
+            bool b = false;
+            char flag = -1;
+            std::ostringstream oss{""};
+            auto it = data.begin();
+            for (; it != data.end(); ++it) {
+                // 結果コード
+                if (static_cast<char>(*it) == ' ') {
+                    // 次でこの空白は無関係のためインクリメントしてからbreak
+                    ++it;
+                    break;
                 }
-                // エラーがあった場合
-                if (waitResult != 0) {
-                    return Result{false, rows, error};
+                if (static_cast<char>(*it) >= 0) {
+                    b = true;
+                    flag = static_cast<char>(*it);
                 }
-                // 結果受信
-                error = "receive failed";
-                if (!con_.receive(data)) {
-                    return Result{false, rows, error};
+                else {
+                    error = "operation failed";
+                    flag = static_cast<char>(*it);
                 }
-                error = "";
-
-                bool b = false;
-                char flag = -1;
-                std::ostringstream oss{""};
-                auto it = data.begin();
-                for (; it != data.end(); ++it) {
-                    // 結果コード
-                    if (static_cast<char>(*it) == ' ') {
-                        // 次でこの空白は無関係のためインクリメントしてからbreak
-                        ++it;
-                        break;
-                    }
-                    if (static_cast<char>(*it) >= 0) {
-                        b = true;
-                        flag = static_cast<char>(*it);
-                    }
-                    else {
-                        error = "operation failed";
-                        flag = static_cast<char>(*it);
-                    }
+            }
+            std::string tableName;
+            for (; it != data.end(); ++it) {
+                // テーブル名
+                if (static_cast<char>(*it) == ' ') {
+                    // 次でこの空白は無関係のためインクリメントしてからbreak
+                    ++it;
+                    break;
                 }
-                std::string tableName;
-                for (; it != data.end(); ++it) {
-                    // テーブル名
-                    if (static_cast<char>(*it) == ' ') {
-                        // 次でこの空白は無関係のためインクリメントしてからbreak
-                        ++it;
-                        break;
-                    }
-                    oss << static_cast<char>(*it);
+                oss << static_cast<char>(*it);
+            }
+            tableName = oss.str();
+            oss.str("");
+            std::map<std::string, int> tableInfo;
+            bool sizeMode = false;
+            std::vector<std::byte> v;
+            for (; it != data.end(); ++it) {
+                // 列情報
+                if (static_cast<char>(*it) == ' ') {
+                    // 次でこの空白は無関係のためインクリメントしてからbreak
+                    ++it;
+                    break;
                 }
-                tableName = oss.str();
-                oss.str("");
-                std::map<std::string, int> tableInfo;
-                bool sizeMode = false;
-                std::vector<std::byte> v;
-                for (; it != data.end(); ++it) {
-                    // 列情報
-                    if (static_cast<char>(*it) == ' ') {
-                        // 次でこの空白は無関係のためインクリメントしてからbreak
-                        ++it;
-                        break;
-                    }
-                    if (static_cast<char>(*it) == '=') {
-                        sizeMode = true;
-                        continue;
-                    }
-                    if (static_cast<char>(*it) == ',') {
-                        if (v.size() > 0) {
-                            std::string sizeStr;
-                            sizeStr.resize(v.size());
-                            for (int i = 0; i < sizeStr.length(); ++i) {
-                                sizeStr[i] = static_cast<char>(v[i]);
-                            }
-                            int size = std::stoi(sizeStr);
-                            v.clear();
-                            tableInfo.insert(std::make_pair(oss.str(), size));
-                            oss.str("");
-                        }
-                        sizeMode = false;
-                        continue;
-                    }
-                    if (sizeMode) {
-                        v.push_back(*it);
-                    }
-                    else {
-                        oss << static_cast<char>(*it);
-                    }
+                if (static_cast<char>(*it) == '=') {
+                    sizeMode = true;
+                    continue;
                 }
-
-                if (flag == 0) {
+                if (static_cast<char>(*it) == ',') {
                     if (v.size() > 0) {
                         std::string sizeStr;
                         sizeStr.resize(v.size());
@@ -1444,39 +3408,37 @@ namespace PapierMache::DbStuff {
                         tableInfo.insert(std::make_pair(oss.str(), size));
                         oss.str("");
                     }
+                    sizeMode = false;
+                    continue;
+                }
+                if (sizeMode) {
+                    v.push_back(*it);
+                }
+                else {
+                    oss << static_cast<char>(*it);
+                }
+            }
 
-                    bool valueMode = false;
-                    int sizeCount = 0;
-                    int colCount = 0;
-                    std::string colName;
-                    std::map<std::string, std::string> row;
-                    for (; it != data.end(); ++it) {
-                        if (valueMode && sizeCount == 0) {
-                            row.insert(std::make_pair(colName, oss.str()));
-                            oss.str("");
-                            valueMode = false;
-                            if (++colCount == tableInfo.size()) {
-                                rows.push_back(row);
-                                row.clear();
-                                colCount = 0;
-                                sizeCount = 0;
-                            }
-                        }
-                        if (!valueMode && static_cast<char>(*it) == '=') {
-                            colName = oss.str();
-                            oss.str("");
-                            valueMode = true;
-                            sizeCount = tableInfo.at(colName);
-                        }
-                        else if (valueMode && sizeCount > 0) {
-                            oss << static_cast<char>(*it);
-                            --sizeCount;
-                        }
-                        else {
-                            oss << static_cast<char>(*it);
-                        }
+            if (flag == 0) {
+                if (v.size() > 0) {
+                    std::string sizeStr;
+                    sizeStr.resize(v.size());
+                    for (int i = 0; i < sizeStr.length(); ++i) {
+                        sizeStr[i] = static_cast<char>(v[i]);
                     }
-                    if (valueMode && oss.str().length() > 0) {
+                    int size = std::stoi(sizeStr);
+                    v.clear();
+                    tableInfo.insert(std::make_pair(oss.str(), size));
+                    oss.str("");
+                }
+
+                bool valueMode = false;
+                int sizeCount = 0;
+                int colCount = 0;
+                std::string colName;
+                std::map<std::string, std::string> row;
+                for (; it != data.end(); ++it) {
+                    if (valueMode && sizeCount == 0) {
                         row.insert(std::make_pair(colName, oss.str()));
                         oss.str("");
                         valueMode = false;
@@ -1487,35 +3449,91 @@ namespace PapierMache::DbStuff {
                             sizeCount = 0;
                         }
                     }
+                    if (!valueMode && static_cast<char>(*it) == '=') {
+                        colName = oss.str();
+                        oss.str("");
+                        valueMode = true;
+                        sizeCount = tableInfo.at(colName);
+                    }
+                    else if (valueMode && sizeCount > 0) {
+                        oss << static_cast<char>(*it);
+                        --sizeCount;
+                    }
+                    else {
+                        oss << static_cast<char>(*it);
+                    }
                 }
-                else {
-                    std::ostringstream msg{""};
-                    bool valueMode = false;
-                    for (; it != data.end(); ++it) {
-                        if (static_cast<char>(*it) == '=') {
-                            valueMode = true;
-                            continue;
-                        }
-                        if (valueMode) {
-                            msg << static_cast<char>(*it);
-                        }
+                if (valueMode && oss.str().length() > 0) {
+                    row.insert(std::make_pair(colName, oss.str()));
+                    oss.str("");
+                    valueMode = false;
+                    if (++colCount == tableInfo.size()) {
+                        rows.push_back(row);
+                        row.clear();
+                        colCount = 0;
+                        sizeCount = 0;
+                    }
+                }
+            }
+            else {
+                std::ostringstream msg{""};
+                bool valueMode = false;
+                for (; it != data.end(); ++it) {
+                    if (static_cast<char>(*it) == '=') {
+                        valueMode = true;
+                        continue;
                     }
-                    if (msg.str().length() > 0) {
-                        error += " " + msg.str();
+                    if (valueMode) {
+                        msg << static_cast<char>(*it);
                     }
                 }
-                return Result{b, rows, error};
+                if (msg.str().length() > 0) {
+                    error += " " + msg.str();
+                }
             }
-            catch (std::exception &e) {
-                if (error == "") {
-                    throw;
+            return Result{b, rows, error, flag};
+        }
+
+        // バイナリ形式の処理結果をResultにする
+        // 行は列名と値のマップにせずにResult::viewで受信した行をそのまま読む
+        Result fromBinary(const std::vector<std::byte> &data)
+        {
+            BinaryProtocol::Frame frame = BinaryProtocol::decode(data);
+            std::string error = "";
+            if (frame.code != 0) {
+                if (frame.code < 0) {
+                    error = "operation failed";
                 }
-                return Result{false, rows, error + " : " + e.what()};
+                if (frame.message.length() > 0) {
+                    error += " " + frame.message;
+                }
+            }
+            const char code = frame.code;
+            Result result{code >= 0, {}, error, code};
+            if (code == 0) {
+                result.view = BinaryProtocol::RowView{std::move(frame)};
             }
+            return result;
+        }
+
+        // 同時に再実行するトランザクションが同じ時刻に再び衝突しないように待ち時間をばらつかせる
+        std::chrono::milliseconds backoff(const int attempt, const RetryPolicy &policy)
+        {
+            thread_local std::mt19937 engine{std::random_device{}()};
+            long long ceiling = policy.baseDelay.count();
+            for (int i = 1; i < attempt && ceiling < policy.maxDelay.count(); ++i) {
+                ceiling *= 2;
+            }
+            if (ceiling > policy.maxDelay.count()) {
+                ceiling = policy.maxDelay.count();
+            }
+            std::uniform_int_distribution<long long> dist{0, ceiling};
+            return std::chrono::milliseconds{dist(engine)};
         }
 
-    private:
         Connection con_;
+        // 処理結果をバイナリ形式で受け取る場合にtrue
+        bool isBinary_;
     };
 
 } // namespace PapierMache::DbStuff
@@ -3,20 +3,28 @@
 
 #include "General.h"
 
+#include "BinaryProtocol.h"
 #include "Common.h"
 #include "Logger.h"
 #include "Utils.h"
+#include "WorkerPool.h"
 
 #include <windows.h>
 #include <winnt.h>
 
+#include <array>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
 #include <filesystem>
+#include <fstream>
 #include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <shared_mutex>
 #include <sstream>
 #include <string>
@@ -25,7 +33,10 @@
 
 namespace PapierMache::DbStuff {
 
-    using TRANSACTION_ID = short;
+    // データファイルの制御情報に書き込まれるので幅を変える場合はFORMAT_VERSIONを上げて移行処理を追加すること
+    using TRANSACTION_ID = std::int32_t;
+    // コミットの順序を表すタイムスタンプ 値はDatabaseが発行する
+    using TIMESTAMP = long long;
 
     class DatafileException : public std::runtime_error {
     public:
@@ -40,16 +51,158 @@ namespace PapierMache::DbStuff {
         }
     };
 
+    // トランザクションがテーブルに対して行った未コミットの作業量
+    struct PendingCost {
+        // 制御情報にトランザクションIDを書き込んだ行数
+        size_t rowsStamped;
+        // temp_に保持している変更内容のバイト数
+        size_t pendingBytes;
+    };
+
+    // ロックの解放待ちとデッドロックの記録
+    struct LockEvent {
+        enum class Type {
+            // 行ロックまたは表ロックの解放を待った
+            WAIT,
+            // 待っている間に停止対象となり待つのをやめた
+            ABANDONED,
+            // 循環待ちを検出した
+            DEADLOCK
+        };
+
+        Type type;
+        // getLocalTimeStr()の形式
+        std::string time;
+        // DEADLOCKは複数のテーブルにまたがるので空文字列
+        std::string tableName;
+        // WAIT, ABANDONED: 待ったトランザクションと待ち先のトランザクション
+        // DEADLOCK: 循環しているトランザクション
+        std::vector<TRANSACTION_ID> transactions;
+        // 待った行の番号(先頭行は0) 表ロックを待った場合とDEADLOCKは-1
+        LONGLONG rowIndex;
+        long long waitMilliseconds;
+        // DEADLOCKで停止したトランザクション 停止しなかった場合は-1
+        TRANSACTION_ID victim;
+    };
+
+    // 直近のLockEventを一定数だけ保持するリングバッファ
+    // 古いものから上書きするので記録によってメモリ使用量が増えることはない
+    class LockEventHistory {
+    public:
+        static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+        // 行ごとの待ちの集計
+        struct HotRow {
+            size_t waits;
+            long long waitMilliseconds;
+        };
+
+        explicit LockEventHistory(const size_t capacity = DEFAULT_CAPACITY)
+            : buffer_{},
+              next_{0},
+              size_{0}
+        {
+            buffer_.resize(capacity == 0 ? 1 : capacity);
+        }
+
+        // コピー禁止
+        LockEventHistory(const LockEventHistory &) = delete;
+        LockEventHistory &operator=(const LockEventHistory &) = delete;
+        // ムーブ禁止
+        LockEventHistory(LockEventHistory &&) = delete;
+        LockEventHistory &operator=(LockEventHistory &&) = delete;
+
+        void record(LockEvent &&event)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            buffer_[next_] = std::move(event);
+            next_ = (next_ + 1) % buffer_.size();
+            if (size_ < buffer_.size()) {
+                ++size_;
+            }
+        }
+
+        // 保持している記録を古い順に返す
+        std::vector<LockEvent> events()
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            return ordered();
+        }
+
+        // 保持している記録から待ちの多い行を集計する
+        // key: テーブル名, value: key: 行番号(表ロックは-1)
+        std::map<std::string, std::map<LONGLONG, HotRow>> heatmap()
+        {
+            std::map<std::string, std::map<LONGLONG, HotRow>> result;
+            for (const LockEvent &e : events()) {
+                if (e.type == LockEvent::Type::DEADLOCK) {
+                    continue;
+                }
+                HotRow &row = result[e.tableName][e.rowIndex];
+                ++row.waits;
+                row.waitMilliseconds += e.waitMilliseconds;
+            }
+            return result;
+        }
+
+        // 容量を変更する 新しい容量を超える分は古いものから捨てる
+        void setCapacity(const size_t capacity)
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            std::vector<LockEvent> current = ordered();
+            buffer_.clear();
+            buffer_.resize(capacity == 0 ? 1 : capacity);
+            next_ = 0;
+            size_ = 0;
+            const size_t skip = current.size() > buffer_.size() ? current.size() - buffer_.size() : 0;
+            for (size_t i = skip; i < current.size(); ++i) {
+                buffer_[next_] = std::move(current[i]);
+                next_ = (next_ + 1) % buffer_.size();
+                ++size_;
+            }
+        }
+
+    private:
+        // mt_を取得して呼び出す
+        std::vector<LockEvent> ordered() const
+        {
+            std::vector<LockEvent> result;
+            result.reserve(size_);
+            const size_t first = (next_ + buffer_.size() - size_) % buffer_.size();
+            for (size_t i = 0; i < size_; ++i) {
+                result.push_back(buffer_[(first + i) % buffer_.size()]);
+            }
+            return result;
+        }
+
+        std::vector<LockEvent> buffer_;
+        // 次に書き込む添字
+        size_t next_;
+        // 保持している記録の数
+        size_t size_;
+        std::mutex mt_;
+    };
+
     class Datafile {
     public:
+        // 表ロックに切り替えるまでに1つのトランザクションが書き込める行数の既定値
+        static constexpr size_t DEFAULT_ESCALATION_THRESHOLD = 1000;
+
         Datafile(const std::string dataFileName, const std::map<std::string, std::string> &tableInfo)
             : tableName_{toLower(dataFileName)},
               temp_{},
+              readSets_{},
               toTerminateList_{},
+              waitsFor_{},
+              stampedRows_{},
+              escalationThreshold_{DEFAULT_ESCALATION_THRESHOLD},
               pMt_{new std::mutex},
-              pControlMt_{new std::mutex},
-              pCond_{new std::condition_variable},
-              pDataSharedMt_{new std::shared_mutex}
+              pRowLatches_{new RowLatches},
+              pTableLock_{new TableLock},
+              pTableLockCond_{new std::condition_variable},
+              pFileMt_{new std::shared_mutex},
+              pLockEvents_{nullptr},
+              pVersions_{new VersionStore}
         {
             hFile_ = createHandle(tableName_);
             std::vector<std::tuple<std::string, std::string, int, int>> vec;
@@ -126,6 +279,7 @@ namespace PapierMache::DbStuff {
             }
 
             tableInfo_ = {vec, m};
+            prepareFile();
         }
 
         ~Datafile(){
@@ -134,6 +288,9 @@ namespace PapierMache::DbStuff {
                 for (auto &e : handles_) {
                     CloseHandle(e.second);
                 }
+                for (HANDLE h : readHandles_) {
+                    CloseHandle(h);
+                }
                 CloseHandle(hFile_);
                 DB_LOG << tableName_ << " CloseHandle AFTER" << FILE_INFO;
             })}
@@ -149,23 +306,37 @@ namespace PapierMache::DbStuff {
             : tableName_{std::move(rhs.tableName_)},
               tableInfo_{std::move(rhs.tableInfo_)},
               temp_{std::move(rhs.temp_)},
+              readSets_{std::move(rhs.readSets_)},
               toTerminateList_{std::move(rhs.toTerminateList_)},
+              waitsFor_{std::move(rhs.waitsFor_)},
+              stampedRows_{std::move(rhs.stampedRows_)},
+              escalationThreshold_{rhs.escalationThreshold_},
               pMt_{std::move(rhs.pMt_)},
-              pControlMt_{std::move(rhs.pControlMt_)},
-              pCond_{std::move(rhs.pCond_)},
-              pDataSharedMt_{std::move(rhs.pDataSharedMt_)},
+              pRowLatches_{std::move(rhs.pRowLatches_)},
+              pTableLock_{std::move(rhs.pTableLock_)},
+              pTableLockCond_{std::move(rhs.pTableLockCond_)},
+              pFileMt_{std::move(rhs.pFileMt_)},
+              pLockEvents_{rhs.pLockEvents_},
+              pVersions_{std::move(rhs.pVersions_)},
               hFile_{rhs.hFile_},
-              handles_{std::move(rhs.handles_)}
+              handles_{std::move(rhs.handles_)},
+              readHandles_{std::move(rhs.readHandles_)}
         {
             for (auto &e : rhs.handles_) {
                 e.second = INVALID_HANDLE_VALUE;
             }
+            rhs.readHandles_.clear();
             rhs.hFile_ = INVALID_HANDLE_VALUE;
         }
 
         bool insert(const TRANSACTION_ID transactionId, const std::vector<std::byte> &data)
         {
-            std::map<std::string, std::vector<std::byte>> m = parseKeyValueVector(data);
+            return insert(transactionId, parseKeyValueVector(data));
+        }
+
+        // 列名と値を解析済みのinsert
+        bool insert(const TRANSACTION_ID transactionId, std::map<std::string, std::vector<std::byte>> m)
+        {
             int max = -1;
             std::string name;
             for (const auto &e : tableInfo_.columnDefinitions()) {
@@ -185,8 +356,12 @@ namespace PapierMache::DbStuff {
                 m.insert(std::make_pair(name, value));
             }
 
+            // 追記はコミット時に行うが表全体を扱うメンテナンスと並行しないようにIXを取得する
+            if (!lockTable(transactionId, LockMode::IX)) {
+                return false;
+            }
             std::lock_guard<std::mutex> lock{*pMt_};
-            temp_.emplace_back(-1LL, transactionId, m);
+            temp_[transactionId].emplace_back(-1LL, std::move(m), false);
             return true;
         }
 
@@ -194,20 +369,40 @@ namespace PapierMache::DbStuff {
                     const std::vector<std::byte> &data,
                     const std::vector<std::byte> &where)
         {
+            return update(transactionId, parseKeyValueVector(data), parseKeyValueVector(where));
+        }
+
+        // 列名と値を解析済みのupdate mDataが空であればdeleteとなる
+        bool update(const TRANSACTION_ID transactionId,
+                    const std::map<std::string, std::vector<std::byte>> &mData,
+                    const std::map<std::string, std::vector<std::byte>> &mWhere)
+        {
 #pragma warning(push)
 #pragma warning(disable : 4267)
-            std::map<std::string, std::vector<std::byte>> mData = parseKeyValueVector(data);
-            std::map<std::string, std::vector<std::byte>> mWhere = parseKeyValueVector(where);
             HANDLE h;
             BOOL bErrorFlag = FALSE;
+            // 行に書き込む前にテーブルに対する意図を示す
+            if (!lockTable(transactionId, LockMode::IX)) {
+                return false;
+            }
+            // この文で追加するTemporaryDataの開始位置
+            size_t statementStart = 0;
             { // Scoped Lock start
                 std::lock_guard<std::mutex> lock{*pMt_};
                 h = getHandle(transactionId);
+                if (pTableLock_->mode(transactionId) == LockMode::X) {
+                    // 表ロックを持っていれば行ごとに記録せず条件のみを記録する
+                    temp_[transactionId].emplace_back(std::map<std::string, std::vector<std::byte>>{mData}, std::map<std::string, std::vector<std::byte>>{mWhere}, fileSize(h));
+                    return true;
+                }
+                statementStart = temp_[transactionId].size();
             } // Scoped Lock end
-            // ファイル先頭へ移動
+            // 先頭行へ移動
             LARGE_INTEGER zero;
             zero.QuadPart = 0LL;
-            bErrorFlag = SetFilePointerEx(getHandle(transactionId), zero, NULL, FILE_BEGIN);
+            LARGE_INTEGER first;
+            first.QuadPart = tableInfo_.firstRow();
+            bErrorFlag = SetFilePointerEx(h, first, NULL, FILE_BEGIN);
             if (FALSE == bErrorFlag) {
                 throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
             }
@@ -222,7 +417,7 @@ namespace PapierMache::DbStuff {
 
                 // 行頭位置退避
                 LARGE_INTEGER save;
-                bErrorFlag = SetFilePointerEx(getHandle(transactionId), zero, &save, FILE_CURRENT);
+                bErrorFlag = SetFilePointerEx(h, zero, &save, FILE_CURRENT);
                 if (FALSE == bErrorFlag) {
                     throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
                 }
@@ -230,10 +425,12 @@ namespace PapierMache::DbStuff {
                 dwBytesRead = 0;
                 dwBytesWritten = 0;
                 std::vector<std::byte> buffer;
-                buffer.resize(2);
+                buffer.resize(tableInfo_.controlDataSize());
                 { // Scoped Lock start
-                    // 書き込みロック
-                    std::unique_lock<std::mutex> lock{*pControlMt_};
+                    // この行が属するストライプの行ラッチ
+                    // 別のストライプの行は他のトランザクションが並行して更新できる
+                    RowLatches::Latch &latch = pRowLatches_->latch(tableInfo_.rowIndex(save.QuadPart));
+                    std::unique_lock<std::mutex> lock{latch.mt};
                     bResult = ReadFile(h, buffer.data(), buffer.size(), &dwBytesRead, NULL);
                     if (FALSE == bResult) {
                         throw std::runtime_error{"ReadFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
@@ -249,25 +446,19 @@ namespace PapierMache::DbStuff {
                     }
                     // 有効なデータであれば処理
                     if (static_cast<unsigned char>(buffer[0]) == 0) {
-                        // トランザクションidの位置退避
-                        LARGE_INTEGER tIdOffset;
-                        bErrorFlag = SetFilePointerEx(getHandle(transactionId), zero, &tIdOffset, FILE_CURRENT);
-                        if (FALSE == bErrorFlag) {
-                            throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                        }
                         // 更新処理開始
                         // 条件に合致する行であればトランザクションIDを書き込む
                         bool isMatch = true;
                         for (const auto &e : mWhere) {
                             // 行頭に戻る
-                            bErrorFlag = SetFilePointerEx(getHandle(transactionId), save, NULL, FILE_BEGIN);
+                            bErrorFlag = SetFilePointerEx(h, save, NULL, FILE_BEGIN);
                             if (FALSE == bErrorFlag) {
                                 throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
                             }
                             // 制御情報のサイズと対象列のオフセットを加える
                             LARGE_INTEGER offset;
                             offset.QuadPart = add(tableInfo_.offset(toLower(e.first)), tableInfo_.controlDataSize());
-                            bErrorFlag = SetFilePointerEx(getHandle(transactionId), offset, NULL, FILE_CURRENT);
+                            bErrorFlag = SetFilePointerEx(h, offset, NULL, FILE_CURRENT);
                             if (FALSE == bErrorFlag) {
                                 throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
                             }
@@ -294,113 +485,56 @@ namespace PapierMache::DbStuff {
                         }
                         if (isMatch) {
                             // 他のトランザクションの更新対象でないかを確認する
-                            bErrorFlag = SetFilePointerEx(getHandle(transactionId), tIdOffset, NULL, FILE_BEGIN);
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            buffer.clear();
-                            buffer.resize(2);
-                            bResult = ReadFile(h, buffer.data(), buffer.size(), &dwBytesRead, NULL);
-                            if (FALSE == bResult) {
-                                throw std::runtime_error{"ReadFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            else {
-                                if (dwBytesRead == 0) {
-                                    DB_LOG << "------------------EOF" << FILE_INFO;
-                                    break;
-                                }
-                                else if (dwBytesRead != buffer.size()) {
-                                    throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
-                                }
-                            }
-                            TRANSACTION_ID s = toShort(buffer);
+                            TRANSACTION_ID s = readTransactionId(h, save.QuadPart);
                             DEBUG_LOG << "s: " << s << FILE_INFO;
                             DEBUG_LOG << "transactionId: " << transactionId << FILE_INFO;
-                            if (s >= 0 && s != transactionId) {
-                                while (true) {
-                                    if (std::find(toTerminateList_.begin(), toTerminateList_.end(), transactionId) == toTerminateList_.end()) {
-                                        DB_LOG << "wait start." << transactionId << FILE_INFO;
-                                        DB_LOG << "s: " << s << FILE_INFO;
-                                        DB_LOG << "transactionId: " << transactionId << FILE_INFO;
-                                        pCond_->wait(lock);
-                                        DB_LOG << "wait end." << transactionId << FILE_INFO;
-                                    }
-                                    { // Scoped Lock start
-                                        std::lock_guard<std::mutex> lk{*pMt_};
-                                        if (std::find(toTerminateList_.begin(), toTerminateList_.end(), transactionId) != toTerminateList_.end()) {
-                                            auto result = std::remove(toTerminateList_.begin(), toTerminateList_.end(), transactionId);
-                                            toTerminateList_.erase(result, toTerminateList_.end());
-                                            DB_LOG << "terminated transactionId: " << transactionId << FILE_INFO;
-                                            return false;
-                                        }
-                                    } // Scoped Lock end
-                                    // 再びこの行のトランザクションの状態を確認する
-                                    bErrorFlag = SetFilePointerEx(getHandle(transactionId), tIdOffset, NULL, FILE_BEGIN);
-                                    if (FALSE == bErrorFlag) {
-                                        throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                                    }
-                                    buffer.clear();
-                                    buffer.resize(2);
-                                    bResult = ReadFile(h, buffer.data(), buffer.size(), &dwBytesRead, NULL);
-                                    if (FALSE == bResult) {
-                                        throw std::runtime_error{"ReadFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                                    }
-                                    else {
-                                        if (dwBytesRead == 0) {
-                                            DB_LOG << "------------------EOF" << FILE_INFO;
-                                            break;
-                                        }
-                                        else if (dwBytesRead != buffer.size()) {
-                                            throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
-                                        }
-                                    }
-                                    s = toShort(buffer);
-                                    DB_LOG << "s: " << s << FILE_INFO;
-                                    DB_LOG << "transactionId: " << transactionId << FILE_INFO;
-                                    if (s < 0) {
-                                        break;
-                                    }
+                            RowWait wait{};
+                            while (s >= 0 && s != transactionId) {
+                                if (!waitFor(transactionId, s, save.QuadPart, latch, lock, wait)) {
+                                    return false;
                                 }
-                                DB_LOG << "wait loop break." << transactionId << FILE_INFO;
-                            }
-                            // 行頭に戻る
-                            bErrorFlag = SetFilePointerEx(getHandle(transactionId), save, NULL, FILE_BEGIN);
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                                // 再びこの行のトランザクションの状態を確認する
+                                s = readTransactionId(h, save.QuadPart);
+                                DB_LOG << "s: " << s << FILE_INFO;
+                                DB_LOG << "transactionId: " << transactionId << FILE_INFO;
                             }
                             // 自身のトランザクションIDを制御情報に書き込む
-                            ControlData cd{0, transactionId};
-                            bErrorFlag = WriteFile(getHandle(transactionId), &cd, sizeof(cd), &dwBytesWritten, NULL);
+                            writeControlData(h, save.QuadPart, ControlData{0, transactionId});
                             DEBUG_LOG << "set transaction Id: " << transactionId;
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            else {
-                                if (dwBytesWritten != sizeof(cd)) {
-                                    throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
-                                }
-                                else {
-                                    DEBUG_LOG << "succeed. transactionId: " << transactionId << FILE_INFO;
+                            { // Scoped Lock start
+                                // TemporaryDataにこの行のポジションを設定して追加する
+                                std::lock_guard<std::mutex> lk{*pMt_};
+                                temp_[transactionId].emplace_back(save.QuadPart, std::map<std::string, std::vector<std::byte>>{mData}, true);
+                                ++stampedRows_[transactionId];
+                                finishWait(transactionId, wait);
+                            } // Scoped Lock end
+                            // 1つのテーブルで書き込んだ行数が閾値を超えたら表ロックに切り替える
+                            if (shouldEscalate(transactionId)) {
+                                // 行ラッチを持ったまま待つと他のトランザクションがコミットできないので先に解放する
+                                lock.unlock();
+                                // IXからXへの変換 他のトランザクションのIXが全て解放されるまで待つ
+                                if (!lockTable(transactionId, LockMode::X)) {
+                                    return false;
                                 }
+                                replaceWithTableLevel(transactionId, h, statementStart, mData, mWhere);
+                                DB_LOG << "lock escalation. transactionId: " << transactionId << FILE_INFO;
+                                return true;
                             }
-                            // TemporaryDataにこの行のポジションを設定して追加する
-                            std::lock_guard<std::mutex> lk{*pMt_};
-                            temp_.emplace_back(save.QuadPart, transactionId, mData);
                         }
                         isSucceed = true;
                     }
                 } // Scoped Lock end
 
+                if (isSucceed) {
+                    pRowLatches_->latch(tableInfo_.rowIndex(save.QuadPart)).cond.notify_all();
+                }
+
                 // 次の行に進む
                 save.QuadPart = tableInfo_.nextRow(save.QuadPart);
-                bErrorFlag = SetFilePointerEx(getHandle(transactionId), save, NULL, FILE_BEGIN);
+                bErrorFlag = SetFilePointerEx(h, save, NULL, FILE_BEGIN);
                 if (FALSE == bErrorFlag) {
                     throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
                 }
-
-                if (isSucceed) {
-                    pCond_->notify_all();
-                }
             } // while loop end
             return true;
 #pragma warning(pop)
@@ -414,252 +548,749 @@ namespace PapierMache::DbStuff {
             return update(transactionId, std::vector<std::byte>{}, where);
         }
 
-        std::vector<std::map<std::string, std::vector<std::byte>>> select(const TRANSACTION_ID transactionId, const std::vector<std::byte> &where)
+        // 複数の(更新内容, 条件)の組をまとめて更新する 更新内容が空の組は削除となる
+        // 全ての組の対象行を1回の走査でファイル上の位置の順にロックするので
+        // この関数同士では行の解放待ちが循環せずデッドロックにならない
+        // 1つの行が複数の組の条件に合う場合は組の順に適用する
+        bool updateMany(const TRANSACTION_ID transactionId,
+                        const std::vector<std::pair<std::vector<std::byte>, std::vector<std::byte>>> &statements)
         {
-#pragma warning(push)
-#pragma warning(disable : 4267)
-            std::map<std::string, std::vector<std::byte>> mWhere = parseKeyValueVector(where);
+            std::vector<std::pair<std::map<std::string, std::vector<std::byte>>, std::map<std::string, std::vector<std::byte>>>> parsed;
+            for (const auto &e : statements) {
+                parsed.emplace_back(parseKeyValueVector(e.first), parseKeyValueVector(e.second));
+            }
+            if (!lockTable(transactionId, LockMode::IX)) {
+                return false;
+            }
             HANDLE h;
-            BOOL bErrorFlag = FALSE;
             { // Scoped Lock start
                 std::lock_guard<std::mutex> lock{*pMt_};
                 h = getHandle(transactionId);
+                if (pTableLock_->mode(transactionId) == LockMode::X) {
+                    addMatchedRows(transactionId, h, tableInfo_.firstRow(), parsed);
+                    return true;
+                }
             } // Scoped Lock end
-            // ファイル先頭へ移動
-            LARGE_INTEGER zero;
-            zero.QuadPart = 0LL;
-            bErrorFlag = SetFilePointerEx(getHandle(transactionId), zero, NULL, FILE_BEGIN);
-            if (FALSE == bErrorFlag) {
-                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-            }
-
-            BOOL bResult = true;
-            DWORD dwBytesRead = 1;
-            // DWORD dwBytesWritten = 0;
-            std::vector<std::map<std::string, std::vector<std::byte>>> result;
-            while (bResult && dwBytesRead != 0) {
-                bResult = false;
-                // update処理が成功した場合にtrue(コミットは別)
-                // bool isSucceed = false;
-
-                // 行頭位置退避
-                LARGE_INTEGER save;
-                bErrorFlag = SetFilePointerEx(getHandle(transactionId), zero, &save, FILE_CURRENT);
-                if (FALSE == bErrorFlag) {
-                    throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            const LONGLONG rowSize = tableInfo_.rowSize();
+            std::vector<std::byte> row;
+            LONGLONG position = tableInfo_.firstRow();
+            RowWait wait{};
+            while (true) {
+                RowLatches::Latch &latch = pRowLatches_->latch(tableInfo_.rowIndex(position));
+                std::unique_lock<std::mutex> lock{latch.mt};
+                const DWORD dwBytesRead = readRow(h, position, row);
+                if (dwBytesRead == 0) {
+                    break;
                 }
-
-                dwBytesRead = 0;
-                // dwBytesWritten = 0;
-                std::vector<std::byte> buffer;
-                buffer.resize(2);
-                { // Scoped Lock start
-                    std::unique_lock<std::mutex> lock{*pControlMt_};
-                    bResult = ReadFile(h, buffer.data(), buffer.size(), &dwBytesRead, NULL);
-                    if (FALSE == bResult) {
-                        throw std::runtime_error{"ReadFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                    }
-                    else {
-                        if (dwBytesRead == 0) {
-                            DB_LOG << "------------------EOF" << FILE_INFO;
-                            break;
-                        }
-                        else if (dwBytesRead != buffer.size()) {
-                            throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
+                if (dwBytesRead != rowSize) {
+                    throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
+                }
+                std::vector<size_t> matched;
+                if (static_cast<unsigned char>(row[0]) == 0) {
+                    for (size_t i = 0; i < parsed.size(); ++i) {
+                        if (matches(row, parsed[i].second)) {
+                            matched.push_back(i);
                         }
                     }
-                } // Scoped Lock end
-                // 有効なデータであれば処理
-                if (static_cast<unsigned char>(buffer[0]) == 0) {
-                    // 条件に合致する行であれば戻り値に加える
-                    bool isMatch = true;
-                    for (const auto &e : mWhere) { // Scoped Lock start
-                        // 読み込みロック
-                        std::shared_lock<std::shared_mutex> lock{*pDataSharedMt_};
-                        // 行頭に戻る
-                        bErrorFlag = SetFilePointerEx(getHandle(transactionId), save, NULL, FILE_BEGIN);
-                        if (FALSE == bErrorFlag) {
-                            throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                        }
-                        // 制御情報のサイズと対象列のオフセットを加える
-                        LARGE_INTEGER offset;
-                        offset.QuadPart = add(tableInfo_.offset(toLower(e.first)), tableInfo_.controlDataSize());
-                        bErrorFlag = SetFilePointerEx(getHandle(transactionId), offset, NULL, FILE_CURRENT);
-                        if (FALSE == bErrorFlag) {
-                            throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                        }
-                        // 読み込んで値を確認する(whereでわたされた全ての列で等しければ更新対象となる)
-                        buffer.clear();
-                        buffer.resize(tableInfo_.columnSize(toLower(e.first)));
-                        assertSizeLimits<DWORD>(buffer.size());
-                        bResult = ReadFile(h, buffer.data(), buffer.size(), &dwBytesRead, NULL);
-                        if (FALSE == bResult) {
-                            throw std::runtime_error{"ReadFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                        }
-                        else {
-                            if (dwBytesRead == 0) {
-                                break;
-                            }
-                            else if (dwBytesRead != buffer.size()) {
-                                throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
-                            }
-                        }
-                        if (!tableInfo_.isEqual(toLower(e.first), e.second, buffer)) {
-                            isMatch = false;
-                            break;
-                        }
-                    } // Scoped Lock end
-
-                    if (isMatch) {
-                        std::map<std::string, std::vector<std::byte>> lines;
-                        for (const auto &e : tableInfo_.columnDefinitions()) { // Scoped Lock start
-                            // 読み込みロック
-                            std::shared_lock<std::shared_mutex> lock{*pDataSharedMt_};
-                            // 行頭に戻る
-                            bErrorFlag = SetFilePointerEx(getHandle(transactionId), save, NULL, FILE_BEGIN);
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            // 制御情報のサイズと対象列のオフセットを加える
-                            LARGE_INTEGER offset;
-                            offset.QuadPart = add(tableInfo_.offset(toLower(std::get<0>(e))), tableInfo_.controlDataSize());
-                            bErrorFlag = SetFilePointerEx(getHandle(transactionId), offset, NULL, FILE_CURRENT);
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            // 読み込んで値を戻り値に入れる
-                            buffer.clear();
-                            buffer.resize(tableInfo_.columnSize(toLower(std::get<0>(e))));
-                            assertSizeLimits<DWORD>(buffer.size());
-                            bResult = ReadFile(h, buffer.data(), buffer.size(), &dwBytesRead, NULL);
-                            if (FALSE == bResult) {
-                                throw std::runtime_error{"ReadFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            else {
-                                if (dwBytesRead == 0) {
-                                    break;
-                                }
-                                else if (dwBytesRead != buffer.size()) {
-                                    throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
-                                }
-                            }
-                            lines.insert(std::make_pair(toLower(std::get<0>(e)), buffer));
-                        } // Scoped Lock end
-                        result.push_back(lines);
+                }
+                if (matched.empty()) {
+                    if (wait.blocker >= 0) {
+                        // 待っている間に条件に合わなくなった
+                        std::lock_guard<std::mutex> lk{*pMt_};
+                        finishWait(transactionId, wait);
                     }
+                    position = tableInfo_.nextRow(position);
+                    continue;
                 }
-
-                // 次の行に進む
-                save.QuadPart = tableInfo_.nextRow(save.QuadPart);
-                bErrorFlag = SetFilePointerEx(getHandle(transactionId), save, NULL, FILE_BEGIN);
-                if (FALSE == bErrorFlag) {
-                    throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                // 他のトランザクションの更新対象でないかを確認する
+                const TRANSACTION_ID s = readTransactionId(h, position);
+                if (s >= 0 && s != transactionId) {
+                    if (!waitFor(transactionId, s, position, latch, lock, wait)) {
+                        return false;
+                    }
+                    // 待っている間に行が変更された可能性があるので同じ行を読み直す
+                    continue;
                 }
-            } // while loop end
-            return result;
-#pragma warning(pop)
+                writeControlData(h, position, ControlData{0, transactionId});
+                { // Scoped Lock start
+                    // 条件に合致した組の更新内容を組の順に追加する
+                    std::lock_guard<std::mutex> lk{*pMt_};
+                    for (const size_t i : matched) {
+                        temp_[transactionId].emplace_back(position, std::map<std::string, std::vector<std::byte>>{parsed[i].first}, true);
+                    }
+                    ++stampedRows_[transactionId];
+                    finishWait(transactionId, wait);
+                } // Scoped Lock end
+                latch.cond.notify_all();
+                if (shouldEscalate(transactionId)) {
+                    lock.unlock();
+                    if (!lockTable(transactionId, LockMode::X)) {
+                        return false;
+                    }
+                    // 組ごとの条件のみの記録にするとコミット時に前の組を適用した後の行で次の組の条件を評価してしまうので
+                    // 残りの行も行ロックの場合と同じく更新前の行で一度だけ評価して行ごとに記録する
+                    std::lock_guard<std::mutex> lk{*pMt_};
+                    addMatchedRows(transactionId, h, tableInfo_.nextRow(position), parsed);
+                    DB_LOG << "lock escalation. transactionId: " << transactionId << FILE_INFO;
+                    return true;
+                }
+                position = tableInfo_.nextRow(position);
+            }
+            return true;
         }
 
-        bool setToTerminate(const TRANSACTION_ID transactionId)
+        // 最新のコミット済みの内容を返す
+        std::vector<std::map<std::string, std::vector<std::byte>>> select(const TRANSACTION_ID transactionId, const std::vector<std::byte> &where)
         {
-            { // Scoped Lock start
-                std::lock_guard<std::mutex> lockControl{*pControlMt_};
-                std::lock_guard<std::mutex> lock{*pMt_};
-                if (std::find(toTerminateList_.begin(), toTerminateList_.end(), transactionId) == toTerminateList_.end()) {
-                    toTerminateList_.push_back(transactionId);
-                }
-            } //  Scoped Lock end
-            rollback(transactionId);
-            return true;
+            return select(transactionId, where, LLONG_MAX);
         }
 
-        bool commit(const TRANSACTION_ID transactionId)
+        // snapshotの時点でコミット済みであった内容を返す
+        // コミット処理中の行は退避された変更前の内容を読むのでwrite()の完了を待たない
+        std::vector<std::map<std::string, std::vector<std::byte>>> select(const TRANSACTION_ID transactionId,
+                                                                          const std::vector<std::byte> &where,
+                                                                          const TIMESTAMP snapshot)
         {
-            { // Scoped Lock start
-                std::lock_guard<std::mutex> lockControl{*pControlMt_};
-                std::lock_guard<std::mutex> lock{*pMt_};
-                for (TemporaryData &td : temp_) {
-                    if (td.transactionId() == transactionId) {
-                        td.setToCommit();
-                    }
-                }
-                std::lock_guard<std::shared_mutex> lockData{*pDataSharedMt_};
-                write(transactionId);
-            } // Scoped Lock end
-            pCond_->notify_all();
-            return true;
+            return select(transactionId, parseKeyValueVector(where), snapshot);
         }
 
-        bool rollback(const TRANSACTION_ID transactionId)
+        std::vector<std::map<std::string, std::vector<std::byte>>> select(const TRANSACTION_ID transactionId,
+                                                                          const std::map<std::string, std::vector<std::byte>> &mWhere,
+                                                                          const TIMESTAMP snapshot)
         {
-            { // Scoped Lock start
-                std::lock_guard<std::mutex> lockControl{*pControlMt_};
-                std::lock_guard<std::mutex> lock{*pMt_};
-                for (TemporaryData &td : temp_) {
-                    if (td.transactionId() == transactionId) {
-                        td.setToCommit(false);
-                    }
-                }
-                std::lock_guard<std::shared_mutex> lockData{*pDataSharedMt_};
-                write(transactionId);
-            } // Scoped Lock end
-            pCond_->notify_all();
-            return true;
+            std::vector<std::map<std::string, std::vector<std::byte>>> result;
+            selectEach(transactionId, mWhere, snapshot, [this, &result](const std::vector<std::byte> &row) {
+                result.push_back(columns(row));
+            });
+            return result;
         }
 
-        const std::string tableName() const
+        // selectと同じ行の制御情報を除いた内容をimagesの末尾に続けて並べて行数を返す
+        // 列は列の定義の順に固定長で並んでいるのでバイナリ形式の処理結果の行としてそのまま送ることができる
+        size_t selectImages(const TRANSACTION_ID transactionId,
+                            const std::map<std::string, std::vector<std::byte>> &mWhere,
+                            const TIMESTAMP snapshot,
+                            std::vector<std::byte> &images)
         {
-            return tableName_;
+            size_t count = 0;
+            selectEach(transactionId, mWhere, snapshot, [this, &images, &count](const std::vector<std::byte> &row) {
+                appendImage(row, images);
+                ++count;
+            });
+            return count;
         }
 
-        const std::string columnType(const std::string colName) const
+        // 読み取り専用トランザクション用のselect
+        // トランザクションIDを持たないのでトランザクションごとのハンドルではなく共有のハンドルを使う
+        std::vector<std::map<std::string, std::vector<std::byte>>> selectReadOnly(const std::vector<std::byte> &where, const TIMESTAMP snapshot)
         {
-            return tableInfo_.columnType(toLower(colName));
+            return selectReadOnly(parseKeyValueVector(where), snapshot);
         }
 
-        const int columnSize(const std::string colName) const
+        std::vector<std::map<std::string, std::vector<std::byte>>> selectReadOnly(const std::map<std::string, std::vector<std::byte>> &mWhere, const TIMESTAMP snapshot)
         {
-            return tableInfo_.columnSize(toLower(colName));
+            std::vector<std::map<std::string, std::vector<std::byte>>> result;
+            selectReadOnlyEach(mWhere, snapshot, [this, &result](const std::vector<std::byte> &row) {
+                result.push_back(columns(row));
+            });
+            return result;
         }
 
-        const int columnSizeTotal() const
+        size_t selectReadOnlyImages(const std::map<std::string, std::vector<std::byte>> &mWhere,
+                                    const TIMESTAMP snapshot,
+                                    std::vector<std::byte> &images)
         {
-            return tableInfo_.columnSizeTotal();
+            size_t count = 0;
+            selectReadOnlyEach(mWhere, snapshot, [this, &images, &count](const std::vector<std::byte> &row) {
+                appendImage(row, images);
+                ++count;
+            });
+            return count;
         }
 
-        bool isPermitted(const std::string operation, const std::string user) const
+        // 楽観的トランザクション用のselect
+        // 読み込んだ行をコミット時の検証対象として記録する
+        // SERIALIZABLEのトランザクションも依存関係の追跡のためにこちらを用い この文で読んだ行の位置をpPositionsに受け取る
+        std::vector<std::map<std::string, std::vector<std::byte>>> selectOptimistic(const TRANSACTION_ID transactionId,
+                                                                                    const std::vector<std::byte> &where,
+                                                                                    const TIMESTAMP snapshot)
         {
-            return tableInfo_.isPermitted(operation, user);
+            return selectOptimistic(transactionId, parseKeyValueVector(where), snapshot);
         }
 
-        std::string tableInfo() const
+        std::vector<std::map<std::string, std::vector<std::byte>>> selectOptimistic(const TRANSACTION_ID transactionId,
+                                                                                    const std::map<std::string, std::vector<std::byte>> &mWhere,
+                                                                                    const TIMESTAMP snapshot,
+                                                                                    std::vector<LONGLONG> *pPositions = nullptr)
         {
-            std::ostringstream oss{""};
-            for (const auto &e : tableInfo_.columnDefinitions()) {
-                for (const char c : std::get<0>(e)) {
-                    oss << c;
-                }
-                oss << '=';
-                oss << std::to_string(std::get<2>(e));
-                oss << ',';
-            }
-            std::string result = oss.str();
-            if (result.length() > 1) {
-                result.erase(result.end() - 1);
-            }
+            std::vector<std::map<std::string, std::vector<std::byte>>> result;
+            selectOptimisticEach(transactionId, mWhere, snapshot, pPositions, [this, &result](const std::vector<std::byte> &row) {
+                result.push_back(columns(row));
+            });
             return result;
         }
 
-    private:
-        class TableInfo {
-        public:
-            TableInfo(const std::vector<std::tuple<std::string, std::string, int, int>> &columnDefinitions,
-                      const std::map<std::string, std::vector<std::string>> &permissions)
-                : columnDefinitions_{columnDefinitions},
-                  permissions_{permissions}
-            {
-            }
-
+        size_t selectOptimisticImages(const TRANSACTION_ID transactionId,
+                                      const std::map<std::string, std::vector<std::byte>> &mWhere,
+                                      const TIMESTAMP snapshot,
+                                      std::vector<std::byte> &images,
+                                      std::vector<LONGLONG> *pPositions = nullptr)
+        {
+            size_t count = 0;
+            selectOptimisticEach(transactionId, mWhere, snapshot, pPositions, [this, &images, &count](const std::vector<std::byte> &row) {
+                appendImage(row, images);
+                ++count;
+            });
+            return count;
+        }
+
+        // 楽観的トランザクション用のupdate
+        // 行にトランザクションIDを書き込まずに変更内容のみを記録する
+        // 他のトランザクションとの競合はprepareで検証する
+        bool updateOptimistic(const TRANSACTION_ID transactionId,
+                              const std::vector<std::byte> &data,
+                              const std::vector<std::byte> &where,
+                              const TIMESTAMP snapshot)
+        {
+            return updateOptimistic(transactionId, parseKeyValueVector(data), parseKeyValueVector(where), snapshot);
+        }
+
+        bool updateOptimistic(const TRANSACTION_ID transactionId,
+                              const std::map<std::string, std::vector<std::byte>> &mData,
+                              const std::map<std::string, std::vector<std::byte>> &mWhere,
+                              const TIMESTAMP snapshot)
+        {
+            // 変更対象の行の位置をコミットまで保持するのでISを取得する IXへの変換はprepareで行う
+            if (!lockTable(transactionId, LockMode::IS)) {
+                return false;
+            }
+            HANDLE h;
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{*pMt_};
+                h = getHandle(transactionId);
+            } // Scoped Lock end
+            std::vector<LONGLONG> positions;
+            scan(h, mWhere, snapshot, [&positions](const LONGLONG position, const std::vector<std::byte> &) {
+                positions.push_back(position);
+            });
+            std::lock_guard<std::mutex> lock{*pMt_};
+            std::vector<TemporaryData> &pending = temp_[transactionId];
+            for (const LONGLONG position : positions) {
+                pending.emplace_back(position, std::map<std::string, std::vector<std::byte>>{mData}, false);
+            }
+            return true;
+        }
+
+        // 楽観的トランザクション用のdelete
+        bool updateOptimistic(const TRANSACTION_ID transactionId,
+                              const std::vector<std::byte> &where,
+                              const TIMESTAMP snapshot)
+        {
+            DEBUG_LOG << "delete operation";
+            return updateOptimistic(transactionId, std::vector<std::byte>{}, where, snapshot);
+        }
+
+        // 楽観的トランザクションのコミット前の検証
+        // 読み込んだ行と変更対象の行がsnapshotより後にコミットされた変更の対象でなく
+        // 他のトランザクションの更新対象でもなければ変更対象の行にトランザクションIDを書き込んでtrueを返す
+        // 検証に失敗した場合は何も書き込まずにfalseを返す
+        bool prepare(const TRANSACTION_ID transactionId, const TIMESTAMP snapshot)
+        {
+            auto latches = pRowLatches_->lockAll();
+            std::lock_guard<std::mutex> lock{*pMt_};
+            HANDLE h = getHandle(transactionId);
+            std::set<LONGLONG> positions;
+            auto readSet = readSets_.find(transactionId);
+            if (readSet != readSets_.end()) {
+                positions = readSet->second;
+            }
+            std::vector<TemporaryData> &pending = temp_[transactionId];
+            for (const TemporaryData &td : pending) {
+                if (td.position() != -1LL) {
+                    positions.insert(td.position());
+                }
+            }
+            // 行ラッチを持っているので表ロックは待たずに取得できなければ失敗とする
+            if (!pending.empty() && !pTableLock_->tryAcquire(transactionId, LockMode::IX)) {
+                DB_LOG << "validation failed. table is locked. transactionId: " << transactionId << FILE_INFO;
+                return false;
+            }
+            for (const LONGLONG position : positions) {
+                if (pVersions_->isModifiedAfter(position, snapshot)) {
+                    DB_LOG << "validation failed. row is modified after snapshot. transactionId: " << transactionId << FILE_INFO;
+                    return false;
+                }
+                const TRANSACTION_ID s = readTransactionId(h, position);
+                if (s >= 0 && s != transactionId) {
+                    DB_LOG << "validation failed. row is locked by transactionId: " << s << FILE_INFO;
+                    return false;
+                }
+            }
+            for (TemporaryData &td : pending) {
+                if (td.position() != -1LL && !td.isLocked()) {
+                    writeControlData(h, td.position(), ControlData{0, transactionId});
+                    td.setLocked();
+                }
+            }
+            return true;
+        }
+
+        // SERIALIZABLEの依存関係の追跡に用いる トランザクションが記録した変更1件
+        struct PendingWrite {
+            // 変更する行の行頭位置 追記する行は-1
+            LONGLONG position;
+            // 表ロック取得後の条件のみの記録であればtrue 行を特定できないので表全体への書き込みとして扱う
+            bool isTableLevel;
+            // 変更後の行の列名(小文字)と値 削除する行は空
+            std::map<std::string, std::vector<std::byte>> after;
+        };
+
+        // transactionIdがこのテーブルに記録した変更の数 文の前に取得してpendingWritesに渡す
+        size_t pendingCount(const TRANSACTION_ID transactionId)
+        {
+            std::lock_guard<std::mutex> lock{*pMt_};
+            auto pending = temp_.find(transactionId);
+            return pending == temp_.end() ? 0 : pending->second.size();
+        }
+
+        // transactionIdがfrom番目以降に記録した変更を返す
+        // 既存の行の変更後の内容はファイルの行にこのトランザクションのそれまでの変更を重ねて作る
+        std::vector<PendingWrite> pendingWrites(const TRANSACTION_ID transactionId, const size_t from)
+        {
+            std::vector<PendingWrite> result;
+            HANDLE h;
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{*pMt_};
+                auto pending = temp_.find(transactionId);
+                if (pending == temp_.end()) {
+                    return result;
+                }
+                h = getHandle(transactionId);
+                // key: 行頭位置, value: それまでの変更内容を重ねたもの
+                std::map<LONGLONG, std::map<std::string, std::vector<std::byte>>> changes;
+                std::set<LONGLONG> deleted;
+                for (size_t i = 0; i < pending->second.size(); ++i) {
+                    const TemporaryData &td = pending->second[i];
+                    if (td.isTableLevel()) {
+                        if (i >= from) {
+                            result.push_back(PendingWrite{td.position(), true, {}});
+                        }
+                        continue;
+                    }
+                    if (td.position() < 0) {
+                        // 追記する行は全ての列の値を持っている
+                        if (i >= from) {
+                            PendingWrite w{td.position(), false, {}};
+                            for (const auto &e : td.m()) {
+                                w.after[toLower(e.first)] = e.second;
+                            }
+                            result.push_back(std::move(w));
+                        }
+                        continue;
+                    }
+                    std::map<std::string, std::vector<std::byte>> &change = changes[td.position()];
+                    if (td.m().empty()) {
+                        deleted.insert(td.position());
+                    }
+                    for (const auto &e : td.m()) {
+                        change[toLower(e.first)] = e.second;
+                    }
+                    if (i >= from) {
+                        result.push_back(PendingWrite{td.position(), false, deleted.count(td.position()) > 0 ? std::map<std::string, std::vector<std::byte>>{} : change});
+                    }
+                }
+            } // Scoped Lock end
+            // 変更する行はこのトランザクションが確保しているのでファイルの内容はコミット済みのまま変わらない
+            std::shared_lock<std::shared_mutex> fileLock{*pFileMt_};
+            std::vector<std::byte> row;
+            for (PendingWrite &w : result) {
+                if (w.position < 0 || w.after.empty()) {
+                    continue;
+                }
+                if (readRow(h, w.position, row) != tableInfo_.rowSize()) {
+                    throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
+                }
+                std::map<std::string, std::vector<std::byte>> after = columns(row);
+                for (auto &e : w.after) {
+                    after[e.first] = std::move(e.second);
+                }
+                w.after = std::move(after);
+            }
+            return result;
+        }
+
+        // 列名(小文字)と値がwhereの全ての列で等しければtrue 空の場合(削除する行)はどの条件にも一致しない
+        bool matchesValues(const std::map<std::string, std::vector<std::byte>> &values, const std::map<std::string, std::vector<std::byte>> &mWhere)
+        {
+            if (values.empty()) {
+                return false;
+            }
+            for (const auto &e : mWhere) {
+                const std::string name = toLower(e.first);
+                auto it = values.find(name);
+                if (it == values.end() || !tableInfo_.isEqual(name, e.second, it->second)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // transactionIdが変更する行がsnapshotより後にコミットされた変更の対象であればtrue
+        // 表ロックに切り替えた記録は条件に合う行を特定しないので表内のいずれかの行が対象であればtrueとする
+        bool isUpdatedAfter(const TRANSACTION_ID transactionId, const TIMESTAMP snapshot)
+        {
+            std::lock_guard<std::mutex> lock{*pMt_};
+            auto pending = temp_.find(transactionId);
+            if (pending == temp_.end()) {
+                return false;
+            }
+            for (const TemporaryData &td : pending->second) {
+                if (td.isTableLevel()) {
+                    if (pVersions_->isAnyChangedAfter(snapshot)) {
+                        return true;
+                    }
+                }
+                else if (td.position() >= 0 && pVersions_->isChangedAfter(td.position(), snapshot)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // oldestSnapshotより古いスナップショットでしか参照されない版を破棄する
+        void purgeVersions(const TIMESTAMP oldestSnapshot)
+        {
+            pVersions_->purge(oldestSnapshot);
+        }
+
+        // 削除済みで参照されることのない行を取り除いてファイルを詰める
+        // 詰めた後の内容はSを持って作る SはISと両立するので読み込みは止めないが その間の書き込み(IX)は待たせる
+        // 表全体を止めるのはXに変換して詰めた内容を書き込む間だけで Xを待つ間は後続のISも待たせる
+        // 取り除いた行数を返す
+        size_t compact(const TRANSACTION_ID maintenanceId)
+        {
+            if (!lockTable(maintenanceId, LockMode::S)) {
+                return 0;
+            }
+            size_t removed = 0;
+            try {
+                // 最初に取り除く行の位置 以降の残す行を詰めた内容をimageに作る
+                LONGLONG from = -1;
+                LONGLONG writePosition = tableInfo_.firstRow();
+                std::vector<std::byte> image;
+                // key: 移動前の行頭位置, value: 移動後の行頭位置
+                std::map<LONGLONG, LONGLONG> moved;
+                HANDLE h = acquireReadHandle();
+                try {
+                    // Sを持っている間は他のトランザクションが書き込まないので行の内容は変わらない
+                    std::shared_lock<std::shared_mutex> fileLock{*pFileMt_};
+                    const LONGLONG rowSize = tableInfo_.rowSize();
+                    std::vector<std::byte> row;
+                    LONGLONG readPosition = tableInfo_.firstRow();
+                    while (true) {
+                        const DWORD dwBytesRead = readRow(h, readPosition, row);
+                        if (dwBytesRead == 0) {
+                            break;
+                        }
+                        if (dwBytesRead != rowSize) {
+                            throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
+                        }
+                        // 古いスナップショットから参照される可能性のある行は残す
+                        if (static_cast<unsigned char>(row[0]) != 0 && !pVersions_->isTracked(readPosition)) {
+                            if (from < 0) {
+                                from = readPosition;
+                            }
+                            ++removed;
+                        }
+                        else {
+                            if (from >= 0) {
+                                image.insert(image.end(), row.begin(), row.end());
+                                moved.insert(std::make_pair(readPosition, writePosition));
+                            }
+                            writePosition = tableInfo_.nextRow(writePosition);
+                        }
+                        readPosition = tableInfo_.nextRow(readPosition);
+                    }
+                }
+                catch (...) {
+                    releaseReadHandle(h);
+                    throw;
+                }
+                releaseReadHandle(h);
+                if (removed > 0) {
+                    // SからXに変換する 実行中の読み込みが終わるのを待つ
+                    if (!lockTable(maintenanceId, LockMode::X)) {
+                        std::lock_guard<std::mutex> lock{*pMt_};
+                        unlockTable(maintenanceId);
+                        return 0;
+                    }
+                    auto latches = pRowLatches_->lockAll();
+                    std::lock_guard<std::mutex> lock{*pMt_};
+                    std::unique_lock<std::shared_mutex> fileLock{*pFileMt_};
+                    if (!image.empty()) {
+                        writeBytes(hFile_, from, image);
+                    }
+                    LARGE_INTEGER li;
+                    li.QuadPart = writePosition;
+                    if (FALSE == SetFilePointerEx(hFile_, li, NULL, FILE_BEGIN)) {
+                        throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                    }
+                    if (FALSE == SetEndOfFile(hFile_)) {
+                        throw std::runtime_error{"SetEndOfFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                    }
+                    pVersions_->remap(moved);
+                }
+                std::lock_guard<std::mutex> lock{*pMt_};
+                unlockTable(maintenanceId);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock{*pMt_};
+                unlockTable(maintenanceId);
+                throw;
+            }
+            DB_LOG << tableName_ << " compacted. removed rows: " << removed << FILE_INFO;
+            return removed;
+        }
+
+        void setLockEventHistory(LockEventHistory *pLockEvents)
+        {
+            std::lock_guard<std::mutex> lock{*pMt_};
+            pLockEvents_ = pLockEvents;
+        }
+
+        void setEscalationThreshold(const size_t threshold)
+        {
+            std::lock_guard<std::mutex> lock{*pMt_};
+            escalationThreshold_ = threshold;
+        }
+
+        // 行の解放を待っているトランザクションの待ち先を返す
+        // key: 待っているトランザクションのID, value: 行を変更中のトランザクションのID
+        std::map<TRANSACTION_ID, TRANSACTION_ID> waitForEdges()
+        {
+            std::lock_guard<std::mutex> lock{*pMt_};
+            return waitsFor_;
+        }
+
+        // トランザクションがこのテーブルで行った未コミットの作業量を返す
+        PendingCost pendingCost(const TRANSACTION_ID transactionId)
+        {
+            PendingCost cost{0, 0};
+            std::lock_guard<std::mutex> lock{*pMt_};
+            auto pending = temp_.find(transactionId);
+            if (pending == temp_.end()) {
+                return cost;
+            }
+            for (const TemporaryData &td : pending->second) {
+                if (td.isLocked()) {
+                    ++cost.rowsStamped;
+                }
+                for (const auto &e : td.m()) {
+                    cost.pendingBytes += e.second.size();
+                }
+            }
+            return cost;
+        }
+
+        bool setToTerminate(const TRANSACTION_ID transactionId)
+        {
+            { // Scoped Lock start
+                auto latches = pRowLatches_->lockAll();
+                std::lock_guard<std::mutex> lock{*pMt_};
+                if (std::find(toTerminateList_.begin(), toTerminateList_.end(), transactionId) == toTerminateList_.end()) {
+                    toTerminateList_.push_back(transactionId);
+                }
+            } //  Scoped Lock end
+            // 表ロックを待っている場合も起こす
+            pTableLockCond_->notify_all();
+            rollback(transactionId);
+            return true;
+        }
+
+        // 再利用されたトランザクションIDが以前の停止要求で停止しないように取り除く
+        void clearTerminated(const TRANSACTION_ID transactionId)
+        {
+            std::lock_guard<std::mutex> lock{*pMt_};
+            auto result = std::remove(toTerminateList_.begin(), toTerminateList_.end(), transactionId);
+            toTerminateList_.erase(result, toTerminateList_.end());
+        }
+
+        // commitTimestampは上書きされる行の変更前の内容の有効期限として記録される
+        bool commit(const TRANSACTION_ID transactionId, const TIMESTAMP commitTimestamp)
+        {
+            { // Scoped Lock start
+                // ファイルへの書き込み中は全ての行ラッチを取得する
+                auto latches = pRowLatches_->lockAll();
+                std::lock_guard<std::mutex> lock{*pMt_};
+                auto pending = temp_.find(transactionId);
+                if (pending != temp_.end()) {
+                    for (TemporaryData &td : pending->second) {
+                        td.setToCommit();
+                    }
+                }
+                write(transactionId, commitTimestamp);
+                waitsFor_.erase(transactionId);
+            } // Scoped Lock end
+            pRowLatches_->notifyAll();
+            return true;
+        }
+
+        bool rollback(const TRANSACTION_ID transactionId)
+        {
+            { // Scoped Lock start
+                auto latches = pRowLatches_->lockAll();
+                std::lock_guard<std::mutex> lock{*pMt_};
+                auto pending = temp_.find(transactionId);
+                if (pending != temp_.end()) {
+                    for (TemporaryData &td : pending->second) {
+                        td.setToCommit(false);
+                    }
+                }
+                write(transactionId, 0);
+                waitsFor_.erase(transactionId);
+            } // Scoped Lock end
+            pRowLatches_->notifyAll();
+            return true;
+        }
+
+        const std::string tableName() const
+        {
+            return tableName_;
+        }
+
+        const std::string columnType(const std::string colName) const
+        {
+            return tableInfo_.columnType(toLower(colName));
+        }
+
+        const int columnSize(const std::string colName) const
+        {
+            return tableInfo_.columnSize(toLower(colName));
+        }
+
+        const int columnSizeTotal() const
+        {
+            return tableInfo_.columnSizeTotal();
+        }
+
+        bool isPermitted(const std::string operation, const std::string user) const
+        {
+            return tableInfo_.isPermitted(operation, user);
+        }
+
+        std::string tableInfo() const
+        {
+            std::ostringstream oss{""};
+            for (const auto &e : tableInfo_.columnDefinitions()) {
+                for (const char c : std::get<0>(e)) {
+                    oss << c;
+                }
+                oss << '=';
+                oss << std::to_string(std::get<2>(e));
+                oss << ',';
+            }
+            std::string result = oss.str();
+            if (result.length() > 1) {
+                result.erase(result.end() - 1);
+            }
+            return result;
+        }
+
+        // バイナリ形式の処理結果の列の情報 tableInfo()と同じ順
+        std::vector<BinaryProtocol::ColumnDescriptor> columnDescriptors() const
+        {
+            std::vector<BinaryProtocol::ColumnDescriptor> result;
+            for (const auto &e : tableInfo_.columnDefinitions()) {
+                result.push_back(BinaryProtocol::ColumnDescriptor{std::get<0>(e), BinaryProtocol::toColumnType(std::get<1>(e)), static_cast<std::uint32_t>(std::get<2>(e))});
+            }
+            return result;
+        }
+
+        // key1="value1",key2="value2"...を列名と値のマップにする
+        std::map<std::string, std::vector<std::byte>> keyValues(const std::vector<std::byte> &vec)
+        {
+            return parseKeyValueVector(vec);
+        }
+
+        // PLEASE:PREPAREで解析した列と値
+        // parameterが0以上であれば値は実行時にその番号のパラメータで置き換える
+        struct PreparedColumn {
+            // 列の定義の列名
+            std::string name;
+            std::vector<std::byte> value;
+            int parameter;
+        };
+
+        // key1="value1",key2=?...を解析して列名を列の定義と照合する
+        // 引用符で囲まない?はパラメータとし nextParameterから順に番号を付ける
+        std::vector<PreparedColumn> prepareKeyValues(const std::vector<std::byte> &vec, int &nextParameter)
+        {
+            std::vector<PreparedColumn> result;
+            // 引用符の外のカンマで項目に分ける
+            std::vector<std::vector<std::byte>> items(1);
+            bool isESMode = false;
+            bool isInnerDq = false;
+            for (const std::byte b : vec) {
+                const char c = static_cast<char>(b);
+                if (c == ',' && !isInnerDq && !isESMode) {
+                    items.emplace_back();
+                    continue;
+                }
+                if (c == '"' && !isESMode) {
+                    isInnerDq = !isInnerDq;
+                }
+                isESMode = c == '\\' && !isESMode;
+                items.back().push_back(b);
+            }
+            for (const std::vector<std::byte> &item : items) {
+                const std::string text(reinterpret_cast<const char *>(item.data()), item.size());
+                if (trim(text, ' ') == "") {
+                    if (items.size() == 1) {
+                        break;
+                    }
+                    throw DatafileException{"parse error. key is empty." + FILE_INFO};
+                }
+                const size_t equal = text.find('=');
+                if (equal == std::string::npos) {
+                    throw DatafileException{"parse error. value is empty." + FILE_INFO};
+                }
+                const std::string name = resolveColumnName(trim(text.substr(0, equal), ' '));
+                if (trim(text.substr(equal + 1), ' ') == "?") {
+                    result.push_back(PreparedColumn{name, {}, nextParameter++});
+                    continue;
+                }
+                if (tableInfo_.columnType(name) == "password") {
+                    // パスワードは固定長のバイト列なので文の中には書かずにパラメータで渡す
+                    throw DatafileException{"column name: " + name + " must be a parameter in prepared statement." + FILE_INFO};
+                }
+                std::map<std::string, std::vector<std::byte>> m = parseKeyValueVector(item);
+                result.push_back(PreparedColumn{name, m.begin()->second, -1});
+            }
+            return result;
+        }
+
+    private:
+        // 大文字小文字を区別せずに列の定義と照合して列の定義の列名を返す
+        std::string resolveColumnName(const std::string &name) const
+        {
+            const std::string lower = toLower(name);
+            for (const auto &e : tableInfo_.columnDefinitions()) {
+                if (toLower(std::get<0>(e)) == lower) {
+                    return std::get<0>(e);
+                }
+            }
+            throw DatafileException{"cannot find column : " + name + FILE_INFO};
+        }
+
+        class TableInfo {
+        public:
+            TableInfo(const std::vector<std::tuple<std::string, std::string, int, int>> &columnDefinitions,
+                      const std::map<std::string, std::vector<std::string>> &permissions)
+                : columnDefinitions_{columnDefinitions},
+                  permissions_{permissions}
+            {
+            }
+
             TableInfo() : columnDefinitions_{}, permissions_{}
             {
             }
@@ -786,6 +1417,24 @@ namespace PapierMache::DbStuff {
                 return sizeof(ControlData);
             }
 
+            // 行頭から制御情報のトランザクションIDまでのオフセット
+            size_t transactionIdOffset() const
+            {
+                return offsetof(ControlData, transactionId_);
+            }
+
+            // 制御情報を含む1行のサイズ
+            LONGLONG rowSize() const
+            {
+                return controlDataSize() + columnSizeTotal();
+            }
+
+            // 先頭行の位置 ファイルの先頭にはヘッダがある
+            LONGLONG firstRow() const
+            {
+                return sizeof(FileHeader);
+            }
+
             // 現在の行における現在位置に対応する次の行の位置を返す
             LONGLONG nextRow(LONGLONG current) const
             {
@@ -798,6 +1447,15 @@ namespace PapierMache::DbStuff {
 #pragma warning(pop)
             }
 
+            // 引数の位置が含まれる行の番号を返す(先頭行は0)
+            LONGLONG rowIndex(LONGLONG position) const
+            {
+                if (position < firstRow()) {
+                    return 0;
+                }
+                return (position - firstRow()) / rowSize();
+            }
+
             // 引数の列名の行頭からのオフセットを返す
             LONGLONG offset(const std::string &colName) const
             {
@@ -821,41 +1479,57 @@ namespace PapierMache::DbStuff {
             std::map<std::string, std::vector<std::string>> permissions_;
         };
 
+        // データファイルの先頭に置くヘッダ
+        // バージョン1のファイルにはヘッダがなく制御情報のトランザクションIDが2バイトであった
+        struct FileHeader {
+            char magic_[8];
+            std::uint32_t version_;
+            std::uint32_t reserved_;
+        };
+        static constexpr char MAGIC[8] = {'P', 'M', 'D', 'B', 'D', 'A', 'T', 'A'};
+        static constexpr std::uint32_t FORMAT_VERSION = 2;
+
         struct ControlData {
             // 有効であれば0
             const unsigned char flag_;
-            const unsigned char alignment_;
+            const unsigned char alignment_[3];
             const TRANSACTION_ID transactionId_;
 
             ControlData(const unsigned char flag, const TRANSACTION_ID transactionId)
-                : flag_{flag}, alignment_{0}, transactionId_{transactionId}
+                : flag_{flag}, alignment_{0, 0, 0}, transactionId_{transactionId}
             {
             }
         };
+        static_assert(sizeof(ControlData) == 8, "ControlData is written to the data file.");
 
         class TemporaryData {
         public:
+            // 変更用データはムーブして受け取る
             TemporaryData(const LONGLONG position,
-                          const TRANSACTION_ID transactionId,
-                          const std::map<std::string, std::vector<std::byte>> &m)
+                          std::map<std::string, std::vector<std::byte>> &&m,
+                          const bool isLocked)
                 : position_{position},
-                  transactionId_{transactionId},
-                  m_{m},
+                  m_{std::move(m)},
+                  where_{},
+                  limit_{0},
                   toCommit_{false},
-                  isFinished_{false}
+                  isLocked_{isLocked},
+                  isTableLevel_{false}
             {
             }
 
-            TemporaryData(const LONGLONG position,
-                          const TRANSACTION_ID transactionId,
-                          const std::map<std::string, std::vector<std::byte>> &m,
-                          const bool toCommit,
-                          const bool isFinished)
-                : position_{position},
-                  transactionId_{transactionId},
-                  m_{m},
-                  toCommit_{toCommit},
-                  isFinished_{isFinished}
+            // 表ロック取得後の変更
+            // 行ごとには記録せずlimitより前にある条件whereに一致する全ての行を対象とする
+            TemporaryData(std::map<std::string, std::vector<std::byte>> &&m,
+                          std::map<std::string, std::vector<std::byte>> &&where,
+                          const LONGLONG limit)
+                : position_{-2LL},
+                  m_{std::move(m)},
+                  where_{std::move(where)},
+                  limit_{limit},
+                  toCommit_{false},
+                  isLocked_{false},
+                  isTableLevel_{true}
             {
             }
 
@@ -873,29 +1547,388 @@ namespace PapierMache::DbStuff {
                 toCommit_ = b;
             }
 
-            // このTemporaryDataを無効化する
-            void finish()
+            // 対象行の制御情報にトランザクションIDを書き込んだ
+            void setLocked()
             {
-                isFinished_ = true;
+                isLocked_ = true;
             }
 
             const LONGLONG position() const { return position_; }
-            const TRANSACTION_ID transactionId() const { return transactionId_; }
-            const std::map<std::string, std::vector<std::byte>> m() const { return m_; }
+            const std::map<std::string, std::vector<std::byte>> &m() const { return m_; }
             const bool toCommit() const { return toCommit_; }
-            const bool isFinished() const { return isFinished_; }
+            const bool isLocked() const { return isLocked_; }
+            const std::map<std::string, std::vector<std::byte>> &where() const { return where_; }
+            const LONGLONG limit() const { return limit_; }
+            const bool isTableLevel() const { return isTableLevel_; }
 
         private:
             // 変更対象行のファイルポインタの位置(ファイル先頭から数える)
             const LONGLONG position_;
-            // トランザクションID
-            const TRANSACTION_ID transactionId_;
-            // 変更用データ
-            const std::map<std::string, std::vector<std::byte>> m_;
+            // 変更用データ vectorの再配置時にコピーされないようconstにしない
+            std::map<std::string, std::vector<std::byte>> m_;
+            // 表ロック取得後の変更の対象行の条件
+            std::map<std::string, std::vector<std::byte>> where_;
+            // 表ロック取得後の変更の対象となる範囲の終端
+            LONGLONG limit_;
             // コミットする場合はtrue
             bool toCommit_;
-            // コミット後の廃棄に利用する 廃棄する場合はtrue
-            bool isFinished_;
+            // 対象行の制御情報にこのトランザクションのIDが書き込まれていればtrue
+            // 楽観的トランザクションではprepareまでfalse
+            bool isLocked_;
+            // 表ロック取得後の変更であればtrue
+            bool isTableLevel_;
+        };
+
+        // 1つの行の解放を待っている間の記録
+        // 条件変数で何度起こされても 行を取得するか諦めた時に1件のイベントとして記録する
+        struct RowWait {
+            // 最後の待ち先 待っていなければ-1
+            TRANSACTION_ID blocker = -1;
+            LONGLONG position = 0;
+            // 最初に待ち始めた時刻
+            std::chrono::steady_clock::time_point start{};
+            // 最初に待ち始めてから行を取得するか諦めるまでワーカーの代わりを用意させる
+            // 起こされるたびに作り直すと予備のワーカーの追加と終了を繰り返すことになる
+            std::unique_ptr<WorkerPool::BlockingScope> pBlocking{};
+        };
+
+        // 行の制御情報を保護するラッチの配列
+        // 行番号をストライプ数で割った余りで対応するラッチが決まるので
+        // 異なるストライプの行に対する更新は並行して進めることができる
+        class RowLatches {
+        public:
+            static constexpr size_t STRIPES = 64;
+
+            struct Latch {
+                std::mutex mt;
+                // この行ラッチで保護される行のトランザクションIDの変更を待つ条件変数
+                std::condition_variable cond;
+            };
+
+            Latch &latch(const LONGLONG rowIndex)
+            {
+                return latches_[static_cast<size_t>(rowIndex) % STRIPES];
+            }
+
+            // 全てのラッチを添字の順に取得する
+            // 取得順が常に同じなのでこの関数同士でデッドロックすることはない
+            std::vector<std::unique_lock<std::mutex>> lockAll()
+            {
+                std::vector<std::unique_lock<std::mutex>> locks;
+                locks.reserve(STRIPES);
+                for (Latch &l : latches_) {
+                    locks.emplace_back(l.mt);
+                }
+                return locks;
+            }
+
+            void notifyAll()
+            {
+                for (Latch &l : latches_) {
+                    l.cond.notify_all();
+                }
+            }
+
+        private:
+            std::array<Latch, STRIPES> latches_;
+        };
+
+        // 表ロックのモード
+        // IS: 行を読む IX: 行に書き込む S: 表全体を読む X: 表全体を書き換える
+        enum class LockMode {
+            IS,
+            IX,
+            S,
+            X
+        };
+
+        // 行ロックの上位にある表ロック
+        // 通常のトランザクションはIS/IXで 表全体を扱うメンテナンスや行ロックのエスカレーションはS/Xで取得する
+        // 排他制御はDatafileのpMt_で行う
+        class TableLock {
+        public:
+            // 引数のモード同士が両立すればtrue
+            static bool isCompatible(const LockMode lhs, const LockMode rhs)
+            {
+                if (lhs == LockMode::X || rhs == LockMode::X) {
+                    return false;
+                }
+                if (lhs == LockMode::IS || rhs == LockMode::IS) {
+                    return true;
+                }
+                return lhs == rhs;
+            }
+
+            // 既に持っているモードと要求するモードの両方を満たすモードを返す
+            static LockMode combine(const LockMode held, const LockMode requested)
+            {
+                if (held == requested || requested == LockMode::IS) {
+                    return held;
+                }
+                if (held == LockMode::IS) {
+                    return requested;
+                }
+                // IXとS またはどちらかがX
+                return LockMode::X;
+            }
+
+            // transactionIdが持つモード 持っていない場合もISを返すのでholds()と合わせて使う
+            LockMode mode(const TRANSACTION_ID transactionId) const
+            {
+                auto it = holders_.find(transactionId);
+                if (it == holders_.end()) {
+                    return LockMode::IS;
+                }
+                return it->second;
+            }
+
+            bool holds(const TRANSACTION_ID transactionId) const
+            {
+                return holders_.find(transactionId) != holders_.end();
+            }
+
+            // modeの取得を妨げているトランザクションのIDを返す 取得できる場合は-1
+            TRANSACTION_ID blocker(const TRANSACTION_ID transactionId, const LockMode mode) const
+            {
+                const LockMode requested = holds(transactionId) ? combine(this->mode(transactionId), mode) : mode;
+                for (const auto &e : holders_) {
+                    if (e.first != transactionId && !isCompatible(e.second, requested)) {
+                        return e.first;
+                    }
+                }
+                // Xを待っているトランザクションがあれば新たな取得はその後にする
+                if (!holds(transactionId) && requested != LockMode::X) {
+                    for (const TRANSACTION_ID id : exclusiveRequests_) {
+                        if (id != transactionId) {
+                            return id;
+                        }
+                    }
+                }
+                return -1;
+            }
+
+            void grant(const TRANSACTION_ID transactionId, const LockMode mode)
+            {
+                auto it = holders_.find(transactionId);
+                if (it == holders_.end()) {
+                    holders_.insert(std::make_pair(transactionId, mode));
+                }
+                else {
+                    it->second = combine(it->second, mode);
+                }
+            }
+
+            // 待たずに取得できれば取得してtrueを返す
+            bool tryAcquire(const TRANSACTION_ID transactionId, const LockMode mode)
+            {
+                if (blocker(transactionId, mode) >= 0) {
+                    return false;
+                }
+                grant(transactionId, mode);
+                return true;
+            }
+
+            void release(const TRANSACTION_ID transactionId)
+            {
+                holders_.erase(transactionId);
+                exclusiveRequests_.erase(transactionId);
+            }
+
+            void requestExclusive(const TRANSACTION_ID transactionId)
+            {
+                exclusiveRequests_.insert(transactionId);
+            }
+
+            void cancelExclusive(const TRANSACTION_ID transactionId)
+            {
+                exclusiveRequests_.erase(transactionId);
+            }
+
+            bool isExclusiveRequested() const
+            {
+                return !exclusiveRequests_.empty();
+            }
+
+        private:
+            // key: トランザクションID, value: 持っているモード
+            std::map<TRANSACTION_ID, LockMode> holders_;
+            // Xを待っているトランザクションのID
+            std::set<TRANSACTION_ID> exclusiveRequests_;
+        };
+
+        // コミットで上書きされた行の変更前の内容を保持する
+        // スナップショットより後にコミットされた変更はここに退避された内容で読み替える
+        class VersionStore {
+        public:
+            enum class Visibility {
+                // ファイルの内容がそのまま見える
+                CURRENT,
+                // 引数の行を変更前の内容に置き換えた
+                OLD_VERSION,
+                // スナップショットの時点では存在しない行
+                INVISIBLE
+            };
+
+            // validUntilのコミットで上書きされる前の行の内容を登録する
+            void add(const LONGLONG position, const TIMESTAMP validUntil, std::vector<std::byte> &&image)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                // タイムスタンプは昇順に発行されるので末尾に追加すれば昇順に並ぶ
+                versions_[position].push_back(Version{validUntil, std::move(image)});
+            }
+
+            bool contains(const LONGLONG position, const TIMESTAMP validUntil)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                auto it = versions_.find(position);
+                if (it == versions_.end()) {
+                    return false;
+                }
+                return std::any_of(it->second.begin(), it->second.end(),
+                                   [validUntil](const Version &v) { return v.validUntil == validUntil; });
+            }
+
+            // snapshotより後のコミットで上書きされた行であればtrue
+            bool isModifiedAfter(const LONGLONG position, const TIMESTAMP snapshot)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                auto it = versions_.find(position);
+                if (it == versions_.end()) {
+                    return false;
+                }
+                return it->second.back().validUntil > snapshot;
+            }
+
+            // 行がsnapshotより後にコミットで上書きまたは追記されていればtrue
+            bool isChangedAfter(const LONGLONG position, const TIMESTAMP snapshot)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                auto it = versions_.find(position);
+                if (it != versions_.end() && it->second.back().validUntil > snapshot) {
+                    return true;
+                }
+                auto inserted = inserted_.find(position);
+                return inserted != inserted_.end() && inserted->second > snapshot;
+            }
+
+            // いずれかの行がsnapshotより後にコミットで上書きまたは追記されていればtrue
+            bool isAnyChangedAfter(const TIMESTAMP snapshot)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                for (const auto &e : versions_) {
+                    if (e.second.back().validUntil > snapshot) {
+                        return true;
+                    }
+                }
+                for (const auto &e : inserted_) {
+                    if (e.second > snapshot) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // createdのコミットで追記される行を登録する
+            void addInserted(const LONGLONG position, const TIMESTAMP created)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                inserted_[position] = created;
+            }
+
+            // snapshotの時点での行の内容を判定する
+            // 変更前の内容を読むべき場合はrowをその内容に置き換える
+            Visibility resolve(const LONGLONG position, const TIMESTAMP snapshot, std::vector<std::byte> &row)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                auto inserted = inserted_.find(position);
+                if (inserted != inserted_.end() && inserted->second > snapshot) {
+                    return Visibility::INVISIBLE;
+                }
+                auto it = versions_.find(position);
+                if (it == versions_.end()) {
+                    return Visibility::CURRENT;
+                }
+                // snapshotより後のコミットで最初に上書きされる前の内容がsnapshotの時点の内容
+                for (const Version &v : it->second) {
+                    if (v.validUntil > snapshot) {
+                        row = v.image;
+                        return Visibility::OLD_VERSION;
+                    }
+                }
+                return Visibility::CURRENT;
+            }
+
+            // 変更前の内容か追記の記録が残っていればtrue
+            bool isTracked(const LONGLONG position)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                return versions_.find(position) != versions_.end() || inserted_.find(position) != inserted_.end();
+            }
+
+            // 行の移動に合わせて記録の位置を置き換える
+            // key: 移動前の行頭位置, value: 移動後の行頭位置
+            void remap(const std::map<LONGLONG, LONGLONG> &moved)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                std::map<LONGLONG, std::vector<Version>> versions;
+                for (auto &e : versions_) {
+                    auto it = moved.find(e.first);
+                    versions.insert(std::make_pair(it == moved.end() ? e.first : it->second, std::move(e.second)));
+                }
+                versions_ = std::move(versions);
+                std::map<LONGLONG, TIMESTAMP> inserted;
+                for (const auto &e : inserted_) {
+                    auto it = moved.find(e.first);
+                    inserted.insert(std::make_pair(it == moved.end() ? e.first : it->second, e.second));
+                }
+                inserted_ = std::move(inserted);
+            }
+
+            // 前回からoldestSnapshotが進んでいなければ破棄できる版はないので走査しない
+            void purge(const TIMESTAMP oldestSnapshot)
+            {
+                std::lock_guard<std::mutex> lock{mt_};
+                if (oldestSnapshot <= purged_) {
+                    return;
+                }
+                purged_ = oldestSnapshot;
+                for (auto it = versions_.begin(); it != versions_.end();) {
+                    auto &vec = it->second;
+                    vec.erase(std::remove_if(vec.begin(), vec.end(),
+                                             [oldestSnapshot](const Version &v) { return v.validUntil <= oldestSnapshot; }),
+                              vec.end());
+                    if (vec.empty()) {
+                        it = versions_.erase(it);
+                    }
+                    else {
+                        ++it;
+                    }
+                }
+                for (auto it = inserted_.begin(); it != inserted_.end();) {
+                    if (it->second <= oldestSnapshot) {
+                        it = inserted_.erase(it);
+                    }
+                    else {
+                        ++it;
+                    }
+                }
+            }
+
+        private:
+            struct Version {
+                // この内容を上書きしたコミットのタイムスタンプ
+                TIMESTAMP validUntil;
+                // 制御情報を含む1行分の内容
+                std::vector<std::byte> image;
+            };
+
+            std::mutex mt_;
+            // key: 行頭位置, value: 上書きされた順の変更前の内容
+            std::map<LONGLONG, std::vector<Version>> versions_;
+            // key: 追記された行の行頭位置, value: 追記したコミットのタイムスタンプ
+            std::map<LONGLONG, TIMESTAMP> inserted_;
+            // 最後にpurgeしたoldestSnapshot
+            TIMESTAMP purged_ = 0;
         };
 
         LONGLONG add(const LONGLONG value1, const LONGLONG value2)
@@ -916,10 +1949,100 @@ namespace PapierMache::DbStuff {
             throw DatafileException("arithmetic overflow" + FILE_INFO);
         }
 
+        std::filesystem::path dataFilePath(const std::string &dataFileName) const
+        {
+            return std::filesystem::path{"./database/data/" + dataFileName};
+        }
+
+        // データファイルのヘッダを確認する
+        // 空のファイルにはヘッダを書き込み 古い形式のファイルは現在の形式に移行する
+        void prepareFile()
+        {
+            if (fileSize(hFile_) == 0) {
+                writeHeader(hFile_);
+                return;
+            }
+            FileHeader header{};
+            LARGE_INTEGER zero;
+            zero.QuadPart = 0LL;
+            if (FALSE == SetFilePointerEx(hFile_, zero, NULL, FILE_BEGIN)) {
+                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            DWORD dwBytesRead = 0;
+            if (FALSE == ReadFile(hFile_, &header, sizeof(header), &dwBytesRead, NULL)) {
+                throw std::runtime_error{"ReadFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            if (dwBytesRead == sizeof(header) && std::equal(std::begin(MAGIC), std::end(MAGIC), std::begin(header.magic_))) {
+                if (header.version_ != FORMAT_VERSION) {
+                    throw DatafileException{tableName_ + ": unsupported data file version: " + std::to_string(header.version_) + FILE_INFO};
+                }
+                return;
+            }
+            // ヘッダがなければバージョン1のファイル
+            // 置き換えるファイルを開いたままにはできないので一度閉じる
+            CloseHandle(hFile_);
+            hFile_ = INVALID_HANDLE_VALUE;
+            migrateFromVersion1();
+            hFile_ = createHandle(tableName_);
+        }
+
+        void writeHeader(HANDLE h)
+        {
+            FileHeader header{};
+            std::copy(std::begin(MAGIC), std::end(MAGIC), std::begin(header.magic_));
+            header.version_ = FORMAT_VERSION;
+            LARGE_INTEGER zero;
+            zero.QuadPart = 0LL;
+            if (FALSE == SetFilePointerEx(h, zero, NULL, FILE_BEGIN)) {
+                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            DWORD dwBytesWritten = 0;
+            if (FALSE == WriteFile(h, &header, sizeof(header), &dwBytesWritten, NULL)) {
+                throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            if (dwBytesWritten != sizeof(header)) {
+                throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
+            }
+        }
+
+        // バージョン1の行は制御情報が<有効フラグ(1),アライメント(1),トランザクションID(2)>の4バイト
+        // 起動時には実行中のトランザクションはないのでトランザクションIDは-1として移行する
+        void migrateFromVersion1()
+        {
+            const size_t oldControlDataSize = 4;
+            const size_t columnSizeTotal = static_cast<size_t>(tableInfo_.columnSizeTotal());
+            const std::filesystem::path path = dataFilePath(tableName_);
+            const std::filesystem::path temporaryPath = dataFilePath(tableName_ + ".migrating");
+            DB_LOG << tableName_ << " migrate data file from version 1 to version " << FORMAT_VERSION << FILE_INFO;
+            if (std::filesystem::file_size(path) % (oldControlDataSize + columnSizeTotal) != 0) {
+                throw DatafileException{tableName_ + ": data file is broken. cannot migrate." + FILE_INFO};
+            }
+            { // ファイルを閉じてから置き換える
+                std::ifstream ifs{path, std::ios::binary};
+                std::ofstream ofs{temporaryPath, std::ios::binary | std::ios::trunc};
+                if (!ifs || !ofs) {
+                    throw DatafileException{tableName_ + ": cannot open data file to migrate." + FILE_INFO};
+                }
+                FileHeader header{};
+                std::copy(std::begin(MAGIC), std::end(MAGIC), std::begin(header.magic_));
+                header.version_ = FORMAT_VERSION;
+                ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+                std::vector<char> oldRow(oldControlDataSize + columnSizeTotal);
+                while (ifs.read(oldRow.data(), static_cast<std::streamsize>(oldRow.size()))) {
+                    const ControlData cd{static_cast<unsigned char>(oldRow[0]), -1};
+                    ofs.write(reinterpret_cast<const char *>(&cd), sizeof(cd));
+                    ofs.write(oldRow.data() + oldControlDataSize, static_cast<std::streamsize>(columnSizeTotal));
+                }
+                if (!ofs) {
+                    throw DatafileException{tableName_ + ": failed to write migrated data file." + FILE_INFO};
+                }
+            }
+            std::filesystem::rename(temporaryPath, path);
+        }
+
         HANDLE createHandle(const std::string &dataFileName)
         {
-            const std::string dataFilePath = "./database/data/" + dataFileName;
-            const std::filesystem::path p{dataFilePath};
+            const std::filesystem::path p = dataFilePath(dataFileName);
             HANDLE h = CreateFile(p.wstring().c_str(),                // ファイル名
                                   GENERIC_READ | GENERIC_WRITE,       // 読み書きアクセスモード
                                   FILE_SHARE_READ | FILE_SHARE_WRITE, // 読み書き共有モード
@@ -937,6 +2060,26 @@ namespace PapierMache::DbStuff {
             return h;
         }
 
+        // 読み取り専用のハンドルをプールから取り出す プールが空なら作成する
+        HANDLE acquireReadHandle()
+        {
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{*pMt_};
+                if (!readHandles_.empty()) {
+                    HANDLE h = readHandles_.back();
+                    readHandles_.pop_back();
+                    return h;
+                }
+            } // Scoped Lock end
+            return createHandle(tableName_);
+        }
+
+        void releaseReadHandle(HANDLE h)
+        {
+            std::lock_guard<std::mutex> lock{*pMt_};
+            readHandles_.push_back(h);
+        }
+
         HANDLE &getHandle(const TRANSACTION_ID transactionId)
         {
             if (handles_.find(transactionId) == handles_.end()) {
@@ -1057,14 +2200,20 @@ namespace PapierMache::DbStuff {
 
         // データファイルにトランザクションでコミットされた内容を書き込む
         // commit関数からのみ呼び出すこと
-        void write(const TRANSACTION_ID id)
+        void write(const TRANSACTION_ID id, const TIMESTAMP commitTimestamp)
         {
 #pragma warning(push)
 #pragma warning(disable : 4267)
             DWORD dwBytesWritten = 0;
             BOOL bErrorFlag = FALSE;
-            for (TemporaryData &td : temp_) {
-                if (td.transactionId() == id && td.toCommit()) {
+            auto pending = temp_.find(id);
+            if (pending == temp_.end()) {
+                readSets_.erase(id);
+                unlockTable(id);
+                return;
+            }
+            for (TemporaryData &td : pending->second) {
+                if (td.toCommit()) {
                     // ファイル操作そのものをトランザクション操作するのは今回は難しいので
                     // ここで事前に発生を予測できる例外は全て発生させる
                     // 可能な限りファイル操作後の例外発生を回避する
@@ -1077,10 +2226,13 @@ namespace PapierMache::DbStuff {
                         // 追記なので最初にシーケンスをファイル末尾に移動する
                         LARGE_INTEGER li;
                         li.QuadPart = 0LL;
-                        bErrorFlag = SetFilePointerEx(getHandle(id), li, NULL, FILE_END);
+                        LARGE_INTEGER rowHead;
+                        bErrorFlag = SetFilePointerEx(getHandle(id), li, &rowHead, FILE_END);
                         if (FALSE == bErrorFlag) {
                             throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
                         }
+                        // 書き込み前に登録してスナップショットより後に追記された行として扱わせる
+                        pVersions_->addInserted(rowHead.QuadPart, commitTimestamp);
                         // コントロールデータの作成
                         DEBUG_LOG << "-----------------------------" << id << FILE_INFO;
                         ControlData cd{0, -1};
@@ -1126,110 +2278,24 @@ namespace PapierMache::DbStuff {
                             }
                         }
                     }
-                    else {
-                        // 更新の場合
-                        if (td.m().size() > 0) {
-                            // td.position()には制御情報も含めた開始位置が入っているのでデータ部分の先頭に移動する
-                            LARGE_INTEGER li;
-                            li.QuadPart = add(td.position(), tableInfo_.controlDataSize());
-                            bErrorFlag = SetFilePointerEx(getHandle(id), li, NULL, FILE_BEGIN);
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            // データ部分の先頭位置退避
-                            LARGE_INTEGER save = li;
-                            for (const auto &e : td.m()) {
-                                // 更新対象列のオフセットを加える
-                                LARGE_INTEGER position;
-                                position.QuadPart = add(save.QuadPart, tableInfo_.offset(toLower(e.first)));
-                                bErrorFlag = SetFilePointerEx(getHandle(id), position, NULL, FILE_BEGIN);
-                                if (FALSE == bErrorFlag) {
-                                    throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                                }
-                                // 最初に0埋めする
-                                std::vector<std::byte> zeroSeq;
-                                zeroSeq.resize(tableInfo_.columnSize(toLower(e.first)));
-                                assertSizeLimits<DWORD>(zeroSeq.size());
-                                bErrorFlag = WriteFile(getHandle(id), zeroSeq.data(), zeroSeq.size(), &dwBytesWritten, NULL);
-                                if (FALSE == bErrorFlag) {
-                                    throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                                }
-                                else {
-                                    if (dwBytesWritten != zeroSeq.size()) {
-                                        throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
-                                    }
-                                    else {
-                                        DEBUG_LOG << "succeed. transactionId: " << id << FILE_INFO;
-                                    }
-                                }
-                                // データを書き込む
-                                bErrorFlag = SetFilePointerEx(getHandle(id), position, NULL, FILE_BEGIN);
-                                if (FALSE == bErrorFlag) {
-                                    throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                                }
-                                assertSizeLimits<DWORD>(e.second.size());
-                                bErrorFlag = WriteFile(getHandle(id), e.second.data(), e.second.size(), &dwBytesWritten, NULL);
-                                if (FALSE == bErrorFlag) {
-                                    throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                                }
-                                else {
-                                    if (dwBytesWritten != e.second.size()) {
-                                        throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
-                                    }
-                                    else {
-                                        DEBUG_LOG << "succeed. transactionId: " << id << FILE_INFO;
-                                    }
-                                }
-                            }
-                            // トランザクションIDを-1に戻す
-                            li.QuadPart = td.position();
-                            bErrorFlag = SetFilePointerEx(getHandle(id), li, NULL, FILE_BEGIN);
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            ControlData cd{0, -1};
-                            bErrorFlag = WriteFile(getHandle(id), &cd, sizeof(cd), &dwBytesWritten, NULL);
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            else {
-                                if (dwBytesWritten != sizeof(cd)) {
-                                    throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
-                                }
-                                else {
-                                    DEBUG_LOG << "succeed. transactionId: " << id << FILE_INFO;
-                                }
-                            }
-                        }
-                        else {
-                            // 削除の場合
-                            LARGE_INTEGER li;
-                            li.QuadPart = td.position();
-                            bErrorFlag = SetFilePointerEx(getHandle(id), li, NULL, FILE_BEGIN);
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            // 有効フラグを無効の状態にしてトランザクションIDを-1に戻す
-                            ControlData cd{1, -1};
-                            bErrorFlag = WriteFile(getHandle(id), &cd, sizeof(cd), &dwBytesWritten, NULL);
-                            if (FALSE == bErrorFlag) {
-                                throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
-                            }
-                            else {
-                                if (dwBytesWritten != sizeof(cd)) {
-                                    throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
-                                }
-                                else {
-                                    DEBUG_LOG << "delete-----------------------" << FILE_INFO;
-                                    DEBUG_LOG << "succeed. transactionId: " << id << FILE_INFO;
-                                }
+                    else if (td.isTableLevel()) {
+                        // 表ロック取得後の変更は条件に一致する行を探して全て書き込む
+                        std::vector<LONGLONG> positions;
+                        scan(getHandle(id), td.where(), LLONG_MAX, [&positions, limit = td.limit()](const LONGLONG position, const std::vector<std::byte> &) {
+                            if (position < limit) {
+                                positions.push_back(position);
                             }
+                        });
+                        for (const LONGLONG position : positions) {
+                            overwriteRow(id, position, td.m(), commitTimestamp);
                         }
                     }
+                    else {
+                        overwriteRow(id, td.position(), td.m(), commitTimestamp);
+                    }
                     td.setToCommit(false);
-                    td.finish();
                 }
-                else if (td.transactionId() == id) {
+                else if (td.isLocked()) {
                     // ロールバック処理
                     // このトランザクションでの更新対象となっている行のコントロールデータをデフォルト値に戻す
                     LARGE_INTEGER li;
@@ -1253,17 +2319,552 @@ namespace PapierMache::DbStuff {
                     }
                 }
             }
-            // temp_を更新する
-            std::vector<TemporaryData> v;
-            for (const TemporaryData &cRef : temp_) {
-                if (!cRef.isFinished() || (cRef.transactionId() != id)) {
-                    v.emplace_back(cRef.position(), cRef.transactionId(), cRef.m(), cRef.toCommit(), cRef.isFinished());
+            // コミットでもロールバックでもこのトランザクションの変更内容は全て不要になる
+            temp_.erase(pending);
+            readSets_.erase(id);
+            stampedRows_.erase(id);
+            unlockTable(id);
+#pragma warning(pop)
+        }
+
+        // latchの通知を待つ 停止対象になった場合は待ちを諦めたことを記録してfalseを返す
+        // 行を取得した場合の記録は呼び出し元がfinishWaitで行う
+        bool waitFor(const TRANSACTION_ID transactionId, const TRANSACTION_ID blocker, const LONGLONG position,
+                     RowLatches::Latch &latch, std::unique_lock<std::mutex> &lock, RowWait &wait)
+        {
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lk{*pMt_};
+                if (isToTerminate(transactionId)) {
+                    abandonWait(transactionId, wait);
+                    return false;
+                }
+                waitsFor_[transactionId] = blocker;
+            } // Scoped Lock end
+            if (wait.blocker < 0 || wait.position != position) {
+                wait.start = std::chrono::steady_clock::now();
+                wait.position = position;
+            }
+            wait.blocker = blocker;
+            if (wait.pBlocking == nullptr) {
+                wait.pBlocking = std::make_unique<WorkerPool::BlockingScope>();
+            }
+            DB_LOG << "wait start." << transactionId << " blocker: " << blocker << FILE_INFO;
+            latch.cond.wait(lock);
+            DB_LOG << "wait end." << transactionId << FILE_INFO;
+            std::lock_guard<std::mutex> lk{*pMt_};
+            waitsFor_.erase(transactionId);
+            if (isToTerminate(transactionId)) {
+                abandonWait(transactionId, wait);
+                return false;
+            }
+            return true;
+        }
+
+        // 待った後に行を取得したことを記録する pMt_を取得して呼び出す
+        void finishWait(const TRANSACTION_ID transactionId, RowWait &wait)
+        {
+            if (wait.blocker >= 0) {
+                recordWait(false, transactionId, wait.blocker, tableInfo_.rowIndex(wait.position), wait.start);
+                wait.blocker = -1;
+            }
+            wait.pBlocking.reset();
+        }
+
+        // 停止対象になり待ちを諦めたことを記録する pMt_を取得して呼び出す
+        void abandonWait(const TRANSACTION_ID transactionId, RowWait &wait)
+        {
+            if (wait.blocker >= 0) {
+                recordWait(true, transactionId, wait.blocker, tableInfo_.rowIndex(wait.position), wait.start);
+                wait.blocker = -1;
+            }
+            wait.pBlocking.reset();
+        }
+
+        // 待ちを記録する pMt_を取得して呼び出す
+        void recordWait(const bool isAbandoned, const TRANSACTION_ID transactionId, const TRANSACTION_ID blocker,
+                        const LONGLONG rowIndex, const std::chrono::steady_clock::time_point start)
+        {
+            if (pLockEvents_ == nullptr) {
+                return;
+            }
+            LockEvent e{};
+            e.type = isAbandoned ? LockEvent::Type::ABANDONED : LockEvent::Type::WAIT;
+            e.time = getLocalTimeStr();
+            e.tableName = tableName_;
+            e.transactions = {transactionId, blocker};
+            e.rowIndex = rowIndex;
+            e.waitMilliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            e.victim = -1;
+            pLockEvents_->record(std::move(e));
+        }
+
+        // 停止対象であればリストから取り除いてtrueを返す pMt_を取得して呼び出す
+        bool isToTerminate(const TRANSACTION_ID transactionId)
+        {
+            auto it = std::find(toTerminateList_.begin(), toTerminateList_.end(), transactionId);
+            if (it == toTerminateList_.end()) {
+                return false;
+            }
+            toTerminateList_.erase(it);
+            waitsFor_.erase(transactionId);
+            DB_LOG << "terminated transactionId: " << transactionId << FILE_INFO;
+            return true;
+        }
+
+        // 書き込んだ行数が閾値を超えていればXを要求してtrueを返す
+        // 他のトランザクションがXを待っている場合は変換同士のデッドロックを避けるため行ロックのまま続ける
+        // 確認と要求を同じpMt_の中で行うので 同時に閾値を超えた2つのトランザクションの一方だけが表ロックに切り替える
+        bool shouldEscalate(const TRANSACTION_ID transactionId)
+        {
+            std::lock_guard<std::mutex> lock{*pMt_};
+            if (stampedRows_[transactionId] <= escalationThreshold_ || pTableLock_->isExclusiveRequested()) {
+                return false;
+            }
+            pTableLock_->requestExclusive(transactionId);
+            return true;
+        }
+
+        // 表ロックを取得する 取得できるまで待ち 待っている間に停止対象になった場合はfalseを返す
+        bool lockTable(const TRANSACTION_ID transactionId, const LockMode mode)
+        {
+            std::unique_lock<std::mutex> lock{*pMt_};
+            if (mode == LockMode::X) {
+                // shouldEscalateで要求済みの場合もある
+                pTableLock_->requestExclusive(transactionId);
+            }
+            bool isGranted = false;
+            // 待った場合は最後の待ち先と待ち始めた時刻を記録する
+            TRANSACTION_ID lastBlocker = -1;
+            const auto start = std::chrono::steady_clock::now();
+            // 最初に待つ時から取得するか諦めるまでワーカーの代わりを用意させる
+            std::unique_ptr<WorkerPool::BlockingScope> pBlocking{};
+            while (true) {
+                if (isToTerminate(transactionId)) {
+                    break;
+                }
+                const TRANSACTION_ID blocker = pTableLock_->blocker(transactionId, mode);
+                if (blocker < 0) {
+                    pTableLock_->grant(transactionId, mode);
+                    isGranted = true;
+                    break;
+                }
+                waitsFor_[transactionId] = blocker;
+                lastBlocker = blocker;
+                DB_LOG << "table lock wait start." << transactionId << " blocker: " << blocker << FILE_INFO;
+                if (pBlocking == nullptr) {
+                    pBlocking = std::make_unique<WorkerPool::BlockingScope>();
+                }
+                pTableLockCond_->wait(lock);
+            }
+            waitsFor_.erase(transactionId);
+            if (lastBlocker >= 0) {
+                recordWait(!isGranted, transactionId, lastBlocker, -1, start);
+            }
+            if (mode == LockMode::X) {
+                pTableLock_->cancelExclusive(transactionId);
+                // Xを待っている間に止めていた他の要求を再開させる
+                pTableLockCond_->notify_all();
+            }
+            return isGranted;
+        }
+
+        // pMt_を取得して呼び出す
+        void unlockTable(const TRANSACTION_ID transactionId)
+        {
+            pTableLock_->release(transactionId);
+            pTableLockCond_->notify_all();
+        }
+
+        // 表ロック取得後にこの文で行ごとに記録したTemporaryDataを条件のみの記録1つに置き換える
+        void replaceWithTableLevel(const TRANSACTION_ID transactionId, HANDLE h, const size_t statementStart,
+                     const std::map<std::string, std::vector<std::byte>> &mData,
+                     const std::map<std::string, std::vector<std::byte>> &mWhere)
+        {
+            std::lock_guard<std::mutex> lock{*pMt_};
+            std::vector<TemporaryData> &pending = temp_[transactionId];
+            // Xを持っているので他のトランザクションが書き込むことはなく行のトランザクションIDは不要になる
+            // この文の記録は1行に1つなのでstampedRows_も記録の数だけ減らす
+            while (pending.size() > statementStart) {
+                writeControlData(h, pending.back().position(), ControlData{0, -1});
+                --stampedRows_[transactionId];
+                pending.pop_back();
+            }
+            pending.emplace_back(std::map<std::string, std::vector<std::byte>>{mData},
+                                 std::map<std::string, std::vector<std::byte>>{mWhere},
+                                 fileSize(h));
+        }
+
+        // Xを持った状態でfrom以降の行のうち条件に合致した組の更新内容を組の順に行ごとに記録する
+        // 他のトランザクションは書き込めないので行にトランザクションIDは書き込まない pMt_を取得して呼び出す
+        void addMatchedRows(const TRANSACTION_ID transactionId, HANDLE h, const LONGLONG from,
+                            const std::vector<std::pair<std::map<std::string, std::vector<std::byte>>, std::map<std::string, std::vector<std::byte>>>> &statements)
+        {
+            std::vector<TemporaryData> &pending = temp_[transactionId];
+            scan(h, std::map<std::string, std::vector<std::byte>>{}, LLONG_MAX,
+                 [this, &pending, &statements, from](const LONGLONG position, const std::vector<std::byte> &row) {
+                     if (position < from) {
+                         return;
+                     }
+                     for (const auto &e : statements) {
+                         if (matches(row, e.second)) {
+                             pending.emplace_back(position, std::map<std::string, std::vector<std::byte>>{e.first}, false);
+                         }
+                     }
+                 });
+        }
+
+        LONGLONG fileSize(HANDLE h)
+        {
+            LARGE_INTEGER size;
+            if (FALSE == GetFileSizeEx(h, &size)) {
+                throw std::runtime_error{"GetFileSizeEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            return size.QuadPart;
+        }
+
+        // 既存の行を更新する mが空であれば削除する
+        void overwriteRow(const TRANSACTION_ID id,
+                          const LONGLONG position,
+                          const std::map<std::string, std::vector<std::byte>> &m,
+                          const TIMESTAMP commitTimestamp)
+        {
+#pragma warning(push)
+#pragma warning(disable : 4267)
+            DWORD dwBytesWritten = 0;
+            BOOL bErrorFlag = FALSE;
+            // 上書きする前に変更前の内容を退避する
+            saveBeforeImage(id, position, commitTimestamp);
+            // 更新の場合
+            if (m.size() > 0) {
+                // positionには制御情報も含めた開始位置が入っているのでデータ部分の先頭に移動する
+                LARGE_INTEGER li;
+                li.QuadPart = add(position, tableInfo_.controlDataSize());
+                bErrorFlag = SetFilePointerEx(getHandle(id), li, NULL, FILE_BEGIN);
+                if (FALSE == bErrorFlag) {
+                    throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                }
+                // データ部分の先頭位置退避
+                LARGE_INTEGER save = li;
+                for (const auto &e : m) {
+                    // 更新対象列のオフセットを加える
+                    LARGE_INTEGER position;
+                    position.QuadPart = add(save.QuadPart, tableInfo_.offset(toLower(e.first)));
+                    bErrorFlag = SetFilePointerEx(getHandle(id), position, NULL, FILE_BEGIN);
+                    if (FALSE == bErrorFlag) {
+                        throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                    }
+                    // 最初に0埋めする
+                    std::vector<std::byte> zeroSeq;
+                    zeroSeq.resize(tableInfo_.columnSize(toLower(e.first)));
+                    assertSizeLimits<DWORD>(zeroSeq.size());
+                    bErrorFlag = WriteFile(getHandle(id), zeroSeq.data(), zeroSeq.size(), &dwBytesWritten, NULL);
+                    if (FALSE == bErrorFlag) {
+                        throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                    }
+                    else {
+                        if (dwBytesWritten != zeroSeq.size()) {
+                            throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
+                        }
+                        else {
+                            DEBUG_LOG << "succeed. transactionId: " << id << FILE_INFO;
+                        }
+                    }
+                    // データを書き込む
+                    bErrorFlag = SetFilePointerEx(getHandle(id), position, NULL, FILE_BEGIN);
+                    if (FALSE == bErrorFlag) {
+                        throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                    }
+                    assertSizeLimits<DWORD>(e.second.size());
+                    bErrorFlag = WriteFile(getHandle(id), e.second.data(), e.second.size(), &dwBytesWritten, NULL);
+                    if (FALSE == bErrorFlag) {
+                        throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                    }
+                    else {
+                        if (dwBytesWritten != e.second.size()) {
+                            throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
+                        }
+                        else {
+                            DEBUG_LOG << "succeed. transactionId: " << id << FILE_INFO;
+                        }
+                    }
+                }
+                // トランザクションIDを-1に戻す
+                li.QuadPart = position;
+                bErrorFlag = SetFilePointerEx(getHandle(id), li, NULL, FILE_BEGIN);
+                if (FALSE == bErrorFlag) {
+                    throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                }
+                ControlData cd{0, -1};
+                bErrorFlag = WriteFile(getHandle(id), &cd, sizeof(cd), &dwBytesWritten, NULL);
+                if (FALSE == bErrorFlag) {
+                    throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                }
+                else {
+                    if (dwBytesWritten != sizeof(cd)) {
+                        throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
+                    }
+                    else {
+                        DEBUG_LOG << "succeed. transactionId: " << id << FILE_INFO;
+                    }
+                }
+            }
+            else {
+                // 削除の場合
+                LARGE_INTEGER li;
+                li.QuadPart = position;
+                bErrorFlag = SetFilePointerEx(getHandle(id), li, NULL, FILE_BEGIN);
+                if (FALSE == bErrorFlag) {
+                    throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                }
+                // 有効フラグを無効の状態にしてトランザクションIDを-1に戻す
+                ControlData cd{1, -1};
+                bErrorFlag = WriteFile(getHandle(id), &cd, sizeof(cd), &dwBytesWritten, NULL);
+                if (FALSE == bErrorFlag) {
+                    throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+                }
+                else {
+                    if (dwBytesWritten != sizeof(cd)) {
+                        throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
+                    }
+                    else {
+                        DEBUG_LOG << "delete-----------------------" << FILE_INFO;
+                        DEBUG_LOG << "succeed. transactionId: " << id << FILE_INFO;
+                    }
                 }
             }
-            temp_.swap(v);
 #pragma warning(pop)
         }
 
+        // 行頭positionから1行分を読み込んで読み込んだバイト数を返す
+        DWORD readRow(HANDLE h, const LONGLONG position, std::vector<std::byte> &out)
+        {
+            LARGE_INTEGER li;
+            li.QuadPart = position;
+            BOOL bErrorFlag = SetFilePointerEx(h, li, NULL, FILE_BEGIN);
+            if (FALSE == bErrorFlag) {
+                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            out.clear();
+            out.resize(static_cast<size_t>(tableInfo_.rowSize()));
+            assertSizeLimits<DWORD>(out.size());
+            DWORD dwBytesRead = 0;
+            if (FALSE == ReadFile(h, out.data(), static_cast<DWORD>(out.size()), &dwBytesRead, NULL)) {
+                throw std::runtime_error{"ReadFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            return dwBytesRead;
+        }
+
+        // snapshotの時点で有効な行のうちwhereの全ての列で等しい行についてfを呼び出す
+        // fの引数は行頭位置とreadRowで読み込んだ形式の行
+        template <typename F>
+        void scan(HANDLE h, const std::map<std::string, std::vector<std::byte>> &mWhere, const TIMESTAMP snapshot, F f)
+        {
+            // 読んでいる間に行の位置が変わらないようにする
+            std::shared_lock<std::shared_mutex> fileLock{*pFileMt_};
+            const LONGLONG rowSize = tableInfo_.rowSize();
+            std::vector<std::byte> row;
+            LONGLONG position = tableInfo_.firstRow();
+            while (true) {
+                const DWORD dwBytesRead = readRow(h, position, row);
+                // ファイルを読んだ後で版を確認する
+                // 読み込みと並行して書き込まれた行は書き込み前に変更前の内容が登録されている
+                const VersionStore::Visibility visibility = pVersions_->resolve(position, snapshot, row);
+                if (visibility == VersionStore::Visibility::INVISIBLE) {
+                    // スナップショットより後に追記された行
+                    if (dwBytesRead != rowSize) {
+                        break;
+                    }
+                    position = tableInfo_.nextRow(position);
+                    continue;
+                }
+                if (visibility == VersionStore::Visibility::CURRENT) {
+                    if (dwBytesRead == 0) {
+                        DB_LOG << "------------------EOF" << FILE_INFO;
+                        break;
+                    }
+                    else if (dwBytesRead != rowSize) {
+                        throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
+                    }
+                }
+                // 有効なデータであれば処理
+                if (static_cast<unsigned char>(row[0]) == 0 && matches(row, mWhere)) {
+                    f(position, row);
+                }
+
+                // 次の行に進む
+                position = tableInfo_.nextRow(position);
+            } // while loop end
+        }
+
+        // selectの対象の行についてfを呼び出す fの引数はreadRowで読み込んだ形式の行
+        template <typename F>
+        void selectEach(const TRANSACTION_ID transactionId,
+                        const std::map<std::string, std::vector<std::byte>> &mWhere,
+                        const TIMESTAMP snapshot,
+                        F f)
+        {
+            // コミットまで表全体を変更するメンテナンスを待たせるのでISを取得する
+            if (!lockTable(transactionId, LockMode::IS)) {
+                throw DatafileException{"transaction is terminated." + FILE_INFO};
+            }
+            HANDLE h;
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{*pMt_};
+                h = getHandle(transactionId);
+            } // Scoped Lock end
+            scan(h, mWhere, snapshot, [&f](const LONGLONG, const std::vector<std::byte> &row) {
+                f(row);
+            });
+        }
+
+        template <typename F>
+        void selectReadOnlyEach(const std::map<std::string, std::vector<std::byte>> &mWhere, const TIMESTAMP snapshot, F f)
+        {
+            HANDLE h = acquireReadHandle();
+            try {
+                scan(h, mWhere, snapshot, [&f](const LONGLONG, const std::vector<std::byte> &row) {
+                    f(row);
+                });
+            }
+            catch (...) {
+                releaseReadHandle(h);
+                throw;
+            }
+            releaseReadHandle(h);
+        }
+
+        template <typename F>
+        void selectOptimisticEach(const TRANSACTION_ID transactionId,
+                                  const std::map<std::string, std::vector<std::byte>> &mWhere,
+                                  const TIMESTAMP snapshot,
+                                  std::vector<LONGLONG> *pPositions,
+                                  F f)
+        {
+            // 読み込んだ行の位置をコミットまで保持するのでISを取得する
+            if (!lockTable(transactionId, LockMode::IS)) {
+                throw DatafileException{"transaction is terminated." + FILE_INFO};
+            }
+            HANDLE h;
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{*pMt_};
+                h = getHandle(transactionId);
+            } // Scoped Lock end
+            std::vector<LONGLONG> positions;
+            scan(h, mWhere, snapshot, [&f, &positions](const LONGLONG position, const std::vector<std::byte> &row) {
+                f(row);
+                positions.push_back(position);
+            });
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{*pMt_};
+                readSets_[transactionId].insert(positions.begin(), positions.end());
+            } // Scoped Lock end
+            if (pPositions != nullptr) {
+                *pPositions = std::move(positions);
+            }
+        }
+
+        // readRowで読み込んだ行の制御情報を除いた内容をimagesの末尾に写す
+        void appendImage(const std::vector<std::byte> &row, std::vector<std::byte> &images) const
+        {
+            images.insert(images.end(), row.begin() + static_cast<std::ptrdiff_t>(tableInfo_.controlDataSize()), row.end());
+        }
+
+        // readRowで読み込んだ行がwhereの全ての列で等しければtrue
+        bool matches(const std::vector<std::byte> &row, const std::map<std::string, std::vector<std::byte>> &mWhere)
+        {
+            for (const auto &e : mWhere) {
+                if (!tableInfo_.isEqual(toLower(e.first), e.second, column(row, toLower(e.first)))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        std::map<std::string, std::vector<std::byte>> columns(const std::vector<std::byte> &row) const
+        {
+            std::map<std::string, std::vector<std::byte>> lines;
+            for (const auto &e : tableInfo_.columnDefinitions()) {
+                lines.insert(std::make_pair(toLower(std::get<0>(e)), column(row, toLower(std::get<0>(e)))));
+            }
+            return lines;
+        }
+
+        // positionからdataを書き込む
+        void writeBytes(HANDLE h, const LONGLONG position, const std::vector<std::byte> &data)
+        {
+            LARGE_INTEGER li;
+            li.QuadPart = position;
+            if (FALSE == SetFilePointerEx(h, li, NULL, FILE_BEGIN)) {
+                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            assertSizeLimits<DWORD>(data.size());
+            DWORD dwBytesWritten = 0;
+            if (FALSE == WriteFile(h, data.data(), static_cast<DWORD>(data.size()), &dwBytesWritten, NULL)) {
+                throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            if (dwBytesWritten != data.size()) {
+                throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
+            }
+        }
+
+        // 行頭positionの制御情報のトランザクションIDを返す
+        TRANSACTION_ID readTransactionId(HANDLE h, const LONGLONG position)
+        {
+            LARGE_INTEGER li;
+            li.QuadPart = position;
+            if (FALSE == SetFilePointerEx(h, li, NULL, FILE_BEGIN)) {
+                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            std::vector<std::byte> buffer;
+            buffer.resize(sizeof(ControlData));
+            DWORD dwBytesRead = 0;
+            if (FALSE == ReadFile(h, buffer.data(), static_cast<DWORD>(buffer.size()), &dwBytesRead, NULL)) {
+                throw std::runtime_error{"ReadFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            if (dwBytesRead != buffer.size()) {
+                throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
+            }
+            const auto first = buffer.begin() + static_cast<std::ptrdiff_t>(tableInfo_.transactionIdOffset());
+            return toTransactionId(std::vector<std::byte>(first, first + sizeof(TRANSACTION_ID)));
+        }
+
+        void writeControlData(HANDLE h, const LONGLONG position, const ControlData &cd)
+        {
+            LARGE_INTEGER li;
+            li.QuadPart = position;
+            if (FALSE == SetFilePointerEx(h, li, NULL, FILE_BEGIN)) {
+                throw std::runtime_error{"SetFilePointerEx() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            DWORD dwBytesWritten = 0;
+            if (FALSE == WriteFile(h, &cd, sizeof(cd), &dwBytesWritten, NULL)) {
+                throw std::runtime_error{"WriteFile() -> GetLastError() : " + std::to_string(GetLastError()) + FILE_INFO};
+            }
+            if (dwBytesWritten != sizeof(cd)) {
+                throw std::runtime_error{"WriteFile() : Error: number of bytes to write != number of bytes that were written" + FILE_INFO};
+            }
+        }
+
+        // readRowで読み込んだ行から列の値を取り出す
+        std::vector<std::byte> column(const std::vector<std::byte> &row, const std::string &colName) const
+        {
+            const auto first = row.begin() + static_cast<std::ptrdiff_t>(tableInfo_.controlDataSize() + tableInfo_.offset(colName));
+            return std::vector<std::byte>(first, first + tableInfo_.columnSize(colName));
+        }
+
+        // コミットで上書きする行の変更前の内容を版として登録する
+        // 同じトランザクションが同じ行を複数回変更する場合は最初の1回のみ登録する
+        void saveBeforeImage(const TRANSACTION_ID id, const LONGLONG position, const TIMESTAMP commitTimestamp)
+        {
+            if (pVersions_->contains(position, commitTimestamp)) {
+                return;
+            }
+            std::vector<std::byte> image;
+            if (readRow(getHandle(id), position, image) != image.size()) {
+                throw std::runtime_error{"ReadFile() : Error: number of bytes to read != number of bytes that were read" + FILE_INFO};
+            }
+            pVersions_->add(position, commitTimestamp, std::move(image));
+        }
+
         template <typename T>
         void assertSizeLimits(const size_t size) const
         {
@@ -1281,38 +2882,52 @@ namespace PapierMache::DbStuff {
             return *reinterpret_cast<const char *>(&bom) == 1;
         }
 
-        short toShort(const std::vector<std::byte> &bytes) const
+        TRANSACTION_ID toTransactionId(const std::vector<std::byte> &bytes) const
         {
-            if (bytes.size() != 2) {
-                throw DatafileException{"cannot parse to short from the bytes." + FILE_INFO};
+            if (bytes.size() != sizeof(TRANSACTION_ID)) {
+                throw DatafileException{"cannot parse to transaction id from the bytes." + FILE_INFO};
             }
-            short array[2];
-            for (int i = 0; i < 2; ++i) {
-                array[i] = static_cast<unsigned char>(bytes.at(i));
+            std::uint32_t value = 0;
+            for (size_t i = 0; i < bytes.size(); ++i) {
+                const size_t index = isLittleEndian() ? bytes.size() - 1 - i : i;
+                value = (value << 8) | static_cast<unsigned char>(bytes.at(index));
             }
-            if (isLittleEndian()) {
-                return (array[1] << 8) | array[0];
-            }
-            return (array[0] << 8) | array[1];
+            return static_cast<TRANSACTION_ID>(value);
         }
 
         std::string tableName_;
         TableInfo tableInfo_;
-        std::vector<TemporaryData> temp_;
+        // key: トランザクションID, value: そのトランザクションの未コミットの変更内容
+        std::map<TRANSACTION_ID, std::vector<TemporaryData>> temp_;
+        // key: 楽観的トランザクションのID, value: 読み込んだ行の行頭位置
+        std::map<TRANSACTION_ID, std::set<LONGLONG>> readSets_;
         // 何らかの原因で終了すべきトランザクションのリスト
         std::vector<TRANSACTION_ID> toTerminateList_;
+        // key: 行の解放を待っているトランザクションのID, value: その行を変更中のトランザクションのID
+        std::map<TRANSACTION_ID, TRANSACTION_ID> waitsFor_;
+        // key: トランザクションID, value: 制御情報にトランザクションIDを書き込んだ行数
+        std::map<TRANSACTION_ID, size_t> stampedRows_;
+        // 書き込んだ行数がこの値を超えたトランザクションは表ロックに切り替える
+        size_t escalationThreshold_;
         std::unique_ptr<std::mutex> pMt_;
-        // 制御情報用のミューテックス
-        std::unique_ptr<std::mutex> pControlMt_;
-        // 制御情報用の条件変数
-        std::unique_ptr<std::condition_variable> pCond_;
-
-        // データ用のミューテックス
-        std::unique_ptr<std::shared_mutex> pDataSharedMt_;
+        // 制御情報用の行ラッチ
+        std::unique_ptr<RowLatches> pRowLatches_;
+        // 行ロックの上位にある表ロック
+        std::unique_ptr<TableLock> pTableLock_;
+        // 表ロックの解放を待つ条件変数 pMt_と組み合わせて使う
+        std::unique_ptr<std::condition_variable> pTableLockCond_;
+        // 行の位置を変えるメンテナンスの間は行を読ませない
+        std::unique_ptr<std::shared_mutex> pFileMt_;
+        // ロックの待ちを記録する先 Databaseが所有する nullptrの場合は記録しない
+        LockEventHistory *pLockEvents_;
+        // コミットで上書きされた行の変更前の内容
+        std::unique_ptr<VersionStore> pVersions_;
 
         HANDLE hFile_;
         // key: トランザクションID, value: トランザクションごとのファイルハンドル
-        std::map<short, HANDLE> handles_;
+        std::map<TRANSACTION_ID, HANDLE> handles_;
+        // 読み取り専用トランザクションで使い回すファイルハンドル
+        std::vector<HANDLE> readHandles_;
     };
 
 } // namespace PapierMache::DbStuff
@@ -0,0 +1,248 @@
+#ifndef DEADLOCK_EXAMPLE_MAILBOX_INCLUDED
+#define DEADLOCK_EXAMPLE_MAILBOX_INCLUDED
+
+#include "General.h"
+
+#include "Common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace PapierMache::DbStuff {
+
+    class BufferPool;
+    class Mailbox;
+
+    // 参照カウント付きの送受信用バッファ
+    // コピーしても中身は共有され 最後の参照が破棄されると作成したプールに戻る
+    class Buffer {
+        friend BufferPool;
+        friend Mailbox;
+
+    public:
+        Buffer()
+            : pCell_{nullptr}
+        {
+        }
+
+        ~Buffer()
+        {
+            release();
+        }
+
+        Buffer(const Buffer &rhs)
+            : pCell_{rhs.pCell_}
+        {
+            if (pCell_ != nullptr) {
+                pCell_->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        Buffer &operator=(const Buffer &rhs)
+        {
+            if (this == &rhs) {
+                return *this;
+            }
+            if (rhs.pCell_ != nullptr) {
+                rhs.pCell_->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+            release();
+            pCell_ = rhs.pCell_;
+            return *this;
+        }
+
+        Buffer(Buffer &&rhs) noexcept
+            : pCell_{rhs.pCell_}
+        {
+            rhs.pCell_ = nullptr;
+        }
+
+        Buffer &operator=(Buffer &&rhs) noexcept
+        {
+            if (this == &rhs) {
+                return *this;
+            }
+            release();
+            pCell_ = rhs.pCell_;
+            rhs.pCell_ = nullptr;
+            return *this;
+        }
+
+        // 空のBufferに対して呼び出さないこと
+        std::vector<std::byte> &bytes() { return pCell_->bytes; }
+        const std::vector<std::byte> &bytes() const { return pCell_->bytes; }
+
+        bool empty() const { return pCell_ == nullptr; }
+
+        // 他に参照がなければtrue 中身を書き換えたり取り出したりしてよい
+        bool isUnique() const
+        {
+            return pCell_ != nullptr && pCell_->refs.load(std::memory_order_acquire) == 1;
+        }
+
+    private:
+        struct Cell {
+            std::vector<std::byte> bytes;
+            std::atomic<int> refs{0};
+            // 貸し出している間はプールを破棄しない
+            std::shared_ptr<BufferPool> pPool;
+        };
+
+        // 参照を1つ受け取る
+        explicit Buffer(Cell *pCell)
+            : pCell_{pCell}
+        {
+        }
+
+        // 参照を1つ手放してポインタを返す
+        Cell *detach()
+        {
+            Cell *p = pCell_;
+            pCell_ = nullptr;
+            return p;
+        }
+
+        void release();
+
+        Cell *pCell_;
+    };
+
+    // 使い終わったバッファを確保済みの領域ごと再利用する
+    // コネクションごとに持つので ロックを取り合うのはそのコネクションの送信側と受信側だけになる
+    class BufferPool : public std::enable_shared_from_this<BufferPool> {
+        friend Buffer;
+
+    public:
+        // 保持しておく使われていないバッファの数
+        static constexpr size_t MAX_CACHED_BUFFERS = 4;
+        // これより大きな領域を確保したバッファは再利用せず解放する
+        static constexpr size_t MAX_CACHED_CAPACITY = 1024 * 1024;
+
+        static std::shared_ptr<BufferPool> create()
+        {
+            return std::shared_ptr<BufferPool>{new BufferPool{}};
+        }
+
+        ~BufferPool()
+        {
+            for (Buffer::Cell *p : free_) {
+                delete p;
+            }
+        }
+
+        // コピー禁止
+        BufferPool(const BufferPool &) = delete;
+        BufferPool &operator=(const BufferPool &) = delete;
+        // ムーブ禁止
+        BufferPool(BufferPool &&) = delete;
+        BufferPool &operator=(BufferPool &&) = delete;
+
+        // 空のバッファを返す
+        Buffer acquire()
+        {
+            Buffer::Cell *p = nullptr;
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{mt_};
+                if (!free_.empty()) {
+                    p = free_.back();
+                    free_.pop_back();
+                }
+            } // Scoped Lock end
+            if (p == nullptr) {
+                p = new Buffer::Cell{};
+            }
+            p->bytes.clear();
+            p->refs.store(1, std::memory_order_relaxed);
+            p->pPool = shared_from_this();
+            return Buffer{p};
+        }
+
+    private:
+        BufferPool() = default;
+
+        void recycle(Buffer::Cell *p)
+        {
+            if (p->bytes.capacity() <= MAX_CACHED_CAPACITY) {
+                std::lock_guard<std::mutex> lock{mt_};
+                if (free_.size() < MAX_CACHED_BUFFERS) {
+                    free_.push_back(p);
+                    return;
+                }
+            }
+            delete p;
+        }
+
+        std::vector<Buffer::Cell *> free_;
+        std::mutex mt_;
+    };
+
+    inline void Buffer::release()
+    {
+        if (pCell_ == nullptr) {
+            return;
+        }
+        if (pCell_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            // recycleの間はプールが破棄されないようにローカル変数で保持する
+            std::shared_ptr<BufferPool> pPool = std::move(pCell_->pPool);
+            pPool->recycle(pCell_);
+        }
+        pCell_ = nullptr;
+    }
+
+    // コネクションとワーカーの間でバッファを受け渡す
+    // クライアントの送信とワーカーの応答は交互に行われるので 1つの枠を両方向で使う
+    // 枠はアトミックに交換するのでDatabaseのロックは不要で 中身もコピーしない
+    class Mailbox {
+    public:
+        Mailbox()
+            : pPool_{BufferPool::create()},
+              slot_{nullptr}
+        {
+        }
+
+        ~Mailbox()
+        {
+            // 取り出されていないバッファをプールに戻す
+            Buffer{slot_.exchange(nullptr, std::memory_order_acq_rel)};
+        }
+
+        // コピー禁止
+        Mailbox(const Mailbox &) = delete;
+        Mailbox &operator=(const Mailbox &) = delete;
+        // ムーブ禁止
+        Mailbox(Mailbox &&) = delete;
+        Mailbox &operator=(Mailbox &&) = delete;
+
+        // このメールボックスのプールから空のバッファを返す
+        Buffer newBuffer()
+        {
+            return pPool_->acquire();
+        }
+
+        // 枠にバッファを置く 取り出されていないバッファがあれば捨てる
+        void put(Buffer buffer)
+        {
+            Buffer{slot_.exchange(buffer.detach(), std::memory_order_acq_rel)};
+        }
+
+        // 枠のバッファを取り出す 置かれていなければ空のバッファを返す
+        Buffer take()
+        {
+            Buffer buffer{slot_.exchange(nullptr, std::memory_order_acq_rel)};
+            if (buffer.empty()) {
+                return newBuffer();
+            }
+            return buffer;
+        }
+
+    private:
+        std::shared_ptr<BufferPool> pPool_;
+        std::atomic<Buffer::Cell *> slot_;
+    };
+
+} // namespace PapierMache::DbStuff
+
+#endif // DEADLOCK_EXAMPLE_MAILBOX_INCLUDED
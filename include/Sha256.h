@@ -0,0 +1,469 @@
+#ifndef DEADLOCK_EXAMPLE_SHA256_INCLUDED
+#define DEADLOCK_EXAMPLE_SHA256_INCLUDED
+
+#include "General.h"
+
+#include "Common.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define DEADLOCK_EXAMPLE_SHA256_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// MSVCは組み込み関数をそのまま使えるが GCCとClangは関数ごとに命令セットを指定する
+#if defined(DEADLOCK_EXAMPLE_SHA256_X86) && !defined(_MSC_VER)
+#define DEADLOCK_EXAMPLE_SHA256_TARGET(t) __attribute__((target(t)))
+#else
+#define DEADLOCK_EXAMPLE_SHA256_TARGET(t)
+#endif
+
+namespace PapierMache::Sha256 {
+
+    // OSの暗号APIに依存しないSHA-256(FIPS 180-4)
+    // 実行時にCPUを調べて SHA命令(SHA-NI) AVX2で8つのメッセージを並べて処理する実装 汎用の実装から選ぶ
+    // どの実装でも結果は同じ
+    constexpr size_t DIGEST_SIZE = 32;
+    constexpr size_t BLOCK_SIZE = 64;
+    // AVX2の実装が1度に処理するメッセージの数
+    constexpr size_t LANES = 8;
+
+    using Digest = std::array<std::uint8_t, DIGEST_SIZE>;
+
+    enum class Kernel {
+        SCALAR,
+        SHA_NI,
+        AVX2
+    };
+
+    inline const char *kernelName(const Kernel kernel)
+    {
+        switch (kernel) {
+        case Kernel::SCALAR:
+            return "scalar";
+        case Kernel::SHA_NI:
+            return "sha-ni";
+        case Kernel::AVX2:
+            return "avx2";
+        }
+        return "unknown";
+    }
+
+    alignas(64) inline constexpr std::uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    inline constexpr std::uint32_t INITIAL_STATE[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    inline std::uint32_t loadBigEndian(const std::uint8_t *p)
+    {
+        return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+               (static_cast<std::uint32_t>(p[2]) << 8) | static_cast<std::uint32_t>(p[3]);
+    }
+
+    inline void storeBigEndian(std::uint8_t *p, const std::uint32_t v)
+    {
+        p[0] = static_cast<std::uint8_t>(v >> 24);
+        p[1] = static_cast<std::uint8_t>(v >> 16);
+        p[2] = static_cast<std::uint8_t>(v >> 8);
+        p[3] = static_cast<std::uint8_t>(v);
+    }
+
+    // メッセージのうちブロック単位で処理できない末尾にパディングとビット長を付けてtailに書き込む
+    // 戻り値はtailのブロック数(1か2)
+    inline size_t makeTail(const std::uint8_t *data, const size_t length, std::uint8_t (&tail)[BLOCK_SIZE * 2])
+    {
+        const size_t rest = length % BLOCK_SIZE;
+        const size_t blocks = rest < BLOCK_SIZE - 8 ? 1 : 2;
+        std::memset(tail, 0, sizeof(tail));
+        if (rest > 0) {
+            std::memcpy(tail, data + (length - rest), rest);
+        }
+        tail[rest] = 0x80;
+        const std::uint64_t bits = static_cast<std::uint64_t>(length) * 8;
+        for (int i = 0; i < 8; ++i) {
+            tail[blocks * BLOCK_SIZE - 1 - i] = static_cast<std::uint8_t>(bits >> (8 * i));
+        }
+        return blocks;
+    }
+
+    inline Digest toDigest(const std::uint32_t (&state)[8])
+    {
+        Digest digest{};
+        for (int i = 0; i < 8; ++i) {
+            storeBigEndian(digest.data() + 4 * i, state[i]);
+        }
+        return digest;
+    }
+
+    inline std::uint32_t rotr(const std::uint32_t x, const int n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    // 汎用の実装 どのCPUでも動く
+    inline void compressScalar(std::uint32_t (&state)[8], const std::uint8_t *data, size_t blocks)
+    {
+        std::uint32_t w[64];
+        for (; blocks > 0; --blocks, data += BLOCK_SIZE) {
+            for (int t = 0; t < 16; ++t) {
+                w[t] = loadBigEndian(data + 4 * t);
+            }
+            for (int t = 16; t < 64; ++t) {
+                const std::uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+                const std::uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+                w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+            }
+            std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int t = 0; t < 64; ++t) {
+                const std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+                const std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+        }
+    }
+
+#ifdef DEADLOCK_EXAMPLE_SHA256_X86
+
+    // SHA命令の実装 1つのメッセージを最も速く処理する
+    // 命令は状態をABEFとCDGHの組で扱うので 前後で並べ替える
+    DEADLOCK_EXAMPLE_SHA256_TARGET("sha,sse4.1,ssse3")
+    inline void compressShaNi(std::uint32_t (&state)[8], const std::uint8_t *data, size_t blocks)
+    {
+        const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0]));
+        __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4]));
+        tmp = _mm_shuffle_epi32(tmp, 0xB1);              // CDAB
+        state1 = _mm_shuffle_epi32(state1, 0x1B);        // EFGH
+        __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);     // CDGH
+
+        for (; blocks > 0; --blocks, data += BLOCK_SIZE) {
+            const __m128i abefSave = state0;
+            const __m128i cdghSave = state1;
+            __m128i w[4];
+            for (int i = 0; i < 16; ++i) {
+                if (i < 4) {
+                    w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * i)), byteSwap);
+                }
+                else {
+                    // W[t] = σ1(W[t-2]) + W[t-7] + σ0(W[t-15]) + W[t-16] を4語ずつ計算する
+                    __m128i m = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                    m = _mm_add_epi32(m, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                    w[i & 3] = _mm_sha256msg2_epu32(m, w[(i + 3) & 3]);
+                }
+                __m128i m = _mm_add_epi32(w[i & 3], _mm_load_si128(reinterpret_cast<const __m128i *>(&K[4 * i])));
+                state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+                m = _mm_shuffle_epi32(m, 0x0E);
+                state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+            }
+            state0 = _mm_add_epi32(state0, abefSave);
+            state1 = _mm_add_epi32(state1, cdghSave);
+        }
+
+        tmp = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+        state1 = _mm_shuffle_epi32(state1, 0xB1);    // DCHG
+        state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+        state1 = _mm_alignr_epi8(state1, tmp, 8);    // ABEF
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+    }
+
+    DEADLOCK_EXAMPLE_SHA256_TARGET("avx2")
+    inline __m256i rotr8(const __m256i x, const int n)
+    {
+        return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+    }
+
+    // AVX2の実装 レーンごとに別のメッセージを持ち 8つのメッセージを同時に処理する
+    // blocks[lane][b]がレーンのb番目のブロック ブロック数がcounts[lane]に満たないレーンは状態を更新しない
+    DEADLOCK_EXAMPLE_SHA256_TARGET("avx2")
+    inline void compressAvx2(std::uint32_t (&states)[LANES][8], const std::uint8_t *const *const (&blocks)[LANES],
+                             const size_t (&counts)[LANES])
+    {
+        size_t maxCount = 0;
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            if (counts[lane] > maxCount) {
+                maxCount = counts[lane];
+            }
+        }
+        __m256i s[8];
+        for (int i = 0; i < 8; ++i) {
+            s[i] = _mm256_setr_epi32(states[0][i], states[1][i], states[2][i], states[3][i],
+                                     states[4][i], states[5][i], states[6][i], states[7][i]);
+        }
+        static const std::uint8_t zeros[BLOCK_SIZE] = {};
+        for (size_t b = 0; b < maxCount; ++b) {
+            const std::uint8_t *p[LANES];
+            std::int32_t active[LANES];
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                const bool isActive = b < counts[lane];
+                p[lane] = isActive ? blocks[lane][b] : zeros;
+                active[lane] = isActive ? -1 : 0;
+            }
+            __m256i w[16];
+            for (int t = 0; t < 16; ++t) {
+                w[t] = _mm256_setr_epi32(loadBigEndian(p[0] + 4 * t), loadBigEndian(p[1] + 4 * t),
+                                         loadBigEndian(p[2] + 4 * t), loadBigEndian(p[3] + 4 * t),
+                                         loadBigEndian(p[4] + 4 * t), loadBigEndian(p[5] + 4 * t),
+                                         loadBigEndian(p[6] + 4 * t), loadBigEndian(p[7] + 4 * t));
+            }
+            __m256i a = s[0], bb = s[1], c = s[2], d = s[3];
+            __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+            for (int t = 0; t < 64; ++t) {
+                if (t >= 16) {
+                    const __m256i w15 = w[(t - 15) & 15];
+                    const __m256i w2 = w[(t - 2) & 15];
+                    const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w15, 7), rotr8(w15, 18)), _mm256_srli_epi32(w15, 3));
+                    const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w2, 17), rotr8(w2, 19)), _mm256_srli_epi32(w2, 10));
+                    w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0), _mm256_add_epi32(w[(t - 7) & 15], s1));
+                }
+                const __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(e, 6), rotr8(e, 11)), rotr8(e, 25));
+                const __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+                const __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(h, sigma1), _mm256_add_epi32(ch, w[t & 15])),
+                                                    _mm256_set1_epi32(static_cast<int>(K[t])));
+                const __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(a, 2), rotr8(a, 13)), rotr8(a, 22));
+                const __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, bb), _mm256_and_si256(a, c)), _mm256_and_si256(bb, c));
+                const __m256i t2 = _mm256_add_epi32(sigma0, maj);
+                h = g;
+                g = f;
+                f = e;
+                e = _mm256_add_epi32(d, t1);
+                d = c;
+                c = bb;
+                bb = a;
+                a = _mm256_add_epi32(t1, t2);
+            }
+            const __m256i mask = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(active));
+            const __m256i updated[8] = {a, bb, c, d, e, f, g, h};
+            for (int i = 0; i < 8; ++i) {
+                s[i] = _mm256_blendv_epi8(s[i], _mm256_add_epi32(s[i], updated[i]), mask);
+            }
+        }
+        for (int i = 0; i < 8; ++i) {
+            alignas(32) std::uint32_t v[LANES];
+            _mm256_store_si256(reinterpret_cast<__m256i *>(v), s[i]);
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                states[lane][i] = v[lane];
+            }
+        }
+    }
+
+    inline void cpuid(const int leaf, const int subleaf, std::uint32_t (&regs)[4])
+    {
+#ifdef _MSC_VER
+        int r[4] = {};
+        __cpuidex(r, leaf, subleaf);
+        for (int i = 0; i < 4; ++i) {
+            regs[i] = static_cast<std::uint32_t>(r[i]);
+        }
+#else
+        regs[0] = regs[1] = regs[2] = regs[3] = 0;
+        __get_cpuid_count(static_cast<unsigned int>(leaf), static_cast<unsigned int>(subleaf), &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+    }
+
+    // OSがYMMレジスタを保存するか
+    inline bool isYmmEnabled()
+    {
+#ifdef _MSC_VER
+        return (_xgetbv(0) & 0x6) == 0x6;
+#else
+        std::uint32_t eax = 0;
+        std::uint32_t edx = 0;
+        __asm__ volatile("xgetbv"
+                         : "=a"(eax), "=d"(edx)
+                         : "c"(0));
+        return (eax & 0x6) == 0x6;
+#endif
+    }
+
+#endif // DEADLOCK_EXAMPLE_SHA256_X86
+
+    // CPUとOSが対応している命令セット 最初の呼び出しで1度だけ調べる
+    struct Features {
+        bool sha = false;
+        bool avx2 = false;
+    };
+
+    inline const Features &features()
+    {
+        static const Features f = [] {
+            Features result{};
+#ifdef DEADLOCK_EXAMPLE_SHA256_X86
+            std::uint32_t leaf0[4];
+            cpuid(0, 0, leaf0);
+            if (leaf0[0] < 7) {
+                return result;
+            }
+            std::uint32_t leaf1[4];
+            std::uint32_t leaf7[4];
+            cpuid(1, 0, leaf1);
+            cpuid(7, 0, leaf7);
+            const bool ssse3 = (leaf1[2] & (1u << 9)) != 0;
+            const bool sse41 = (leaf1[2] & (1u << 19)) != 0;
+            const bool osxsave = (leaf1[2] & (1u << 27)) != 0;
+            const bool avx = (leaf1[2] & (1u << 28)) != 0;
+            result.sha = ssse3 && sse41 && (leaf7[1] & (1u << 29)) != 0;
+            result.avx2 = osxsave && avx && (leaf7[1] & (1u << 5)) != 0 && isYmmEnabled();
+#endif
+            return result;
+        }();
+        return f;
+    }
+
+    // このCPUとOSで使える実装であればtrue
+    inline bool isSupported(const Kernel kernel)
+    {
+        switch (kernel) {
+        case Kernel::SCALAR:
+            return true;
+        case Kernel::SHA_NI:
+            return features().sha;
+        case Kernel::AVX2:
+            return features().avx2;
+        }
+        return false;
+    }
+
+    // 1つのメッセージに使う実装 最初の呼び出しで決める
+    inline Kernel singleKernel()
+    {
+        static const Kernel kernel = isSupported(Kernel::SHA_NI) ? Kernel::SHA_NI : Kernel::SCALAR;
+        return kernel;
+    }
+
+    // 複数のメッセージに使う実装 SHA命令はレーンを並べるより速いので優先する
+    inline Kernel multiKernel()
+    {
+        static const Kernel kernel = isSupported(Kernel::SHA_NI) ? Kernel::SHA_NI
+                                     : isSupported(Kernel::AVX2) ? Kernel::AVX2
+                                                                 : Kernel::SCALAR;
+        return kernel;
+    }
+
+    // messagesのハッシュ値をkernelで計算してdigestsに書き込む
+    // kernelがこのCPUで使えない場合はstd::runtime_errorを投げる
+    inline void hashMany(const std::string *messages, const size_t count, Digest *digests, const Kernel kernel)
+    {
+        if (!isSupported(kernel)) {
+            throw std::runtime_error{std::string{"SHA-256 kernel is not supported: "} + kernelName(kernel) + FILE_INFO};
+        }
+#ifdef DEADLOCK_EXAMPLE_SHA256_X86
+        if (kernel == Kernel::AVX2) {
+            for (size_t first = 0; first < count; first += LANES) {
+                std::uint32_t states[LANES][8];
+                std::uint8_t tails[LANES][BLOCK_SIZE * 2];
+                std::vector<const std::uint8_t *> blockList[LANES];
+                const std::uint8_t *const *blocks[LANES];
+                size_t counts[LANES] = {};
+                for (size_t lane = 0; lane < LANES; ++lane) {
+                    std::memcpy(states[lane], INITIAL_STATE, sizeof(INITIAL_STATE));
+                    if (first + lane < count) {
+                        const std::string &message = messages[first + lane];
+                        const std::uint8_t *data = reinterpret_cast<const std::uint8_t *>(message.data());
+                        const size_t full = message.size() / BLOCK_SIZE;
+                        const size_t tailBlocks = makeTail(data, message.size(), tails[lane]);
+                        blockList[lane].reserve(full + tailBlocks);
+                        for (size_t b = 0; b < full; ++b) {
+                            blockList[lane].push_back(data + b * BLOCK_SIZE);
+                        }
+                        for (size_t b = 0; b < tailBlocks; ++b) {
+                            blockList[lane].push_back(tails[lane] + b * BLOCK_SIZE);
+                        }
+                    }
+                    blocks[lane] = blockList[lane].data();
+                    counts[lane] = blockList[lane].size();
+                }
+                compressAvx2(states, blocks, counts);
+                for (size_t lane = 0; lane < LANES && first + lane < count; ++lane) {
+                    digests[first + lane] = toDigest(states[lane]);
+                }
+            }
+            return;
+        }
+#endif
+        for (size_t i = 0; i < count; ++i) {
+            const std::uint8_t *data = reinterpret_cast<const std::uint8_t *>(messages[i].data());
+            const size_t length = messages[i].size();
+            std::uint32_t state[8];
+            std::memcpy(state, INITIAL_STATE, sizeof(INITIAL_STATE));
+            std::uint8_t tail[BLOCK_SIZE * 2];
+            const size_t tailBlocks = makeTail(data, length, tail);
+#ifdef DEADLOCK_EXAMPLE_SHA256_X86
+            if (kernel == Kernel::SHA_NI) {
+                compressShaNi(state, data, length / BLOCK_SIZE);
+                compressShaNi(state, tail, tailBlocks);
+                digests[i] = toDigest(state);
+                continue;
+            }
+#endif
+            compressScalar(state, data, length / BLOCK_SIZE);
+            compressScalar(state, tail, tailBlocks);
+            digests[i] = toDigest(state);
+        }
+    }
+
+    inline std::vector<Digest> hashMany(const std::vector<std::string> &messages, const Kernel kernel)
+    {
+        std::vector<Digest> digests(messages.size());
+        hashMany(messages.data(), messages.size(), digests.data(), kernel);
+        return digests;
+    }
+
+    // 起動時の初期ユーザーの作成など まとめて計算できる場合に用いる
+    inline std::vector<Digest> hashMany(const std::vector<std::string> &messages)
+    {
+        return hashMany(messages, multiKernel());
+    }
+
+    inline Digest hash(const std::string &message, const Kernel kernel)
+    {
+        Digest digest{};
+        hashMany(&message, 1, &digest, kernel);
+        return digest;
+    }
+
+    inline Digest hash(const std::string &message)
+    {
+        return hash(message, singleKernel());
+    }
+
+} // namespace PapierMache::Sha256
+
+#endif // DEADLOCK_EXAMPLE_SHA256_INCLUDED
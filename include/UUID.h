@@ -3,74 +3,226 @@
 
 #include "General.h"
 
-#pragma comment(lib, "Rpcrt4.lib")
+#include "Common.h"
 
-#include <rpc.h>
-
-#include <exception>
-#include <sstream>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
 #include <string>
 
 namespace PapierMache {
 
+    // 128ビットのUUID(RFC 9562) 2つの64ビット整数で保持する
+    // 文字列にせずに比較とハッシュ値の計算ができるので コネクションの検索にはこちらを用いる
     class UUID {
     public:
+        // 全て0のUUID
+        UUID()
+            : high_{0},
+              low_{0}
+        {
+        }
+
         ~UUID() {}
 
+        // ランダムなv4
+        // スレッドごとに1度だけstd::random_deviceで初期化した疑似乱数で生成するのでロックもシステムコールもない
+        // 推測されてはいけない値にはcreateSecureを用いること
         static UUID create()
         {
-            ::UUID uuid;
-            switch (UuidCreate(&uuid)) {
-            case RPC_S_OK: {
-                try {
-                    std::ostringstream oss{""};
-                    oss << std::hex << uuid.Data1;
-                    oss << std::dec << '-';
-                    oss << std::hex << uuid.Data2;
-                    oss << std::dec << '-';
-                    oss << std::hex << uuid.Data3;
-                    oss << std::dec << '-';
-                    oss << std::hex;
-                    unsigned short s[8];
-                    for (int i = 0; i < 2; ++i) {
-                        s[i] = uuid.Data4[i];
-                    }
-                    unsigned short fh = (s[0] << 8) | s[1];
-                    oss << fh;
-                    oss << std::dec << '-';
-                    oss << std::hex;
-                    for (int i = 2; i < 8; ++i) {
-                        s[i] = uuid.Data4[i];
-                    }
-                    for (int i = 2; i < 8; i = i + 2) {
-                        unsigned short lh = (s[i] << 8) | s[i + 1];
-                        oss << lh;
+            Random &r = random();
+            const std::uint64_t high = r.next();
+            const std::uint64_t low = r.next();
+            return UUID{(high & ~0xF000ULL) | 0x4000ULL, (low & ~(0x3ULL << 62)) | (0x2ULL << 62)};
+        }
+
+        // 先頭48ビットがUNIX時刻のミリ秒のv7 時刻の順に並ぶ
+        // 同じスレッドで同じミリ秒に生成したものは続く12ビットのカウンタで生成した順に並ぶ
+        static UUID createV7()
+        {
+            V7State &s = v7State();
+            std::uint64_t ms = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                              std::chrono::system_clock::now().time_since_epoch())
+                                                              .count());
+            Random &r = random();
+            if (ms <= s.lastMs) {
+                // 時刻が進んでいないか戻った場合は前の時刻のままカウンタを進める
+                ms = s.lastMs;
+                ++s.counter;
+                if (s.counter > 0xFFF) {
+                    ++ms;
+                    s.counter = 0;
+                }
+            }
+            else {
+                // 次のカウンタの余地を残して下位11ビットを乱数にする
+                s.counter = static_cast<std::uint16_t>(r.next() & 0x7FF);
+            }
+            s.lastMs = ms;
+            const std::uint64_t high = ((ms & 0xFFFFFFFFFFFFULL) << 16) | 0x7000ULL | s.counter;
+            const std::uint64_t low = (r.next() & ~(0x3ULL << 62)) | (0x2ULL << 62);
+            return UUID{high, low};
+        }
+
+        // 暗号論的な乱数によるv4 セッションのトークンなどに用いる
+        // 呼び出すたびにstd::random_deviceを用いるのでcreateより遅い
+        static UUID createSecure()
+        {
+            std::random_device device{};
+            std::uint64_t v[2] = {0, 0};
+            for (std::uint64_t &x : v) {
+                x = (static_cast<std::uint64_t>(device()) << 32) | static_cast<std::uint64_t>(device());
+            }
+            return UUID{(v[0] & ~0xF000ULL) | 0x4000ULL, (v[1] & ~(0x3ULL << 62)) | (0x2ULL << 62)};
+        }
+
+        // 8-4-4-4-12形式の文字列から作成する 大文字小文字は問わない
+        static UUID parse(const std::string &s)
+        {
+            if (s.length() != 36) {
+                throw std::runtime_error{"UUID::parse() : invalid length: " + s + FILE_INFO};
+            }
+            std::uint64_t v[2] = {0, 0};
+            int digits = 0;
+            for (size_t i = 0; i < s.length(); ++i) {
+                if (i == 8 || i == 13 || i == 18 || i == 23) {
+                    if (s[i] != '-') {
+                        throw std::runtime_error{"UUID::parse() : invalid format: " + s + FILE_INFO};
                     }
-                    return UUID{oss.str()};
+                    continue;
                 }
-                catch (...) {
-                    throw std::runtime_error{"UUID::create() : " + std::string{"unexpected error."}};
+                const int n = hexValue(s[i]);
+                if (n < 0) {
+                    throw std::runtime_error{"UUID::parse() : invalid character: " + s + FILE_INFO};
                 }
+                std::uint64_t &x = v[digits / 16];
+                x = (x << 4) | static_cast<std::uint64_t>(n);
+                ++digits;
             }
-            case RPC_S_UUID_LOCAL_ONLY:
-                throw std::runtime_error{"UUID::create() : " + std::string{"error RPC_S_UUID_LOCAL_ONLY"}};
-            case RPC_S_UUID_NO_ADDRESS:
-                throw std::runtime_error{"UUID::create() : " + std::string{"error RPC_S_UUID_NO_ADDRESS"}};
-            }
-            throw std::runtime_error{"UUID::create() : " + std::string{"should not reach here."}};
+            return UUID{v[0], v[1]};
         }
 
-        std::string str()
+        // 小文字の8-4-4-4-12形式
+        std::string str() const
         {
-            return std::string{str_};
+            static const char hex[] = "0123456789abcdef";
+            std::string s(36, '-');
+            size_t position = 0;
+            for (int i = 0; i < 32; ++i) {
+                if (position == 8 || position == 13 || position == 18 || position == 23) {
+                    ++position;
+                }
+                const std::uint64_t x = i < 16 ? high_ : low_;
+                s[position++] = hex[(x >> (60 - 4 * (i % 16))) & 0xF];
+            }
+            return s;
+        }
+
+        std::uint64_t high() const { return high_; }
+        std::uint64_t low() const { return low_; }
+        int version() const { return static_cast<int>((high_ >> 12) & 0xF); }
+        bool isNil() const { return high_ == 0 && low_ == 0; }
+
+        bool operator==(const UUID &rhs) const { return high_ == rhs.high_ && low_ == rhs.low_; }
+        bool operator!=(const UUID &rhs) const { return !(*this == rhs); }
+        bool operator<(const UUID &rhs) const { return high_ < rhs.high_ || (high_ == rhs.high_ && low_ < rhs.low_); }
+
+        // std::unordered_map用
+        // v7は上位ビットが時刻で偏るので両方の語を混ぜる
+        struct Hash {
+            size_t operator()(const UUID &u) const noexcept
+            {
+                std::uint64_t x = u.high_ ^ (u.low_ * 0x9E3779B97F4A7C15ULL);
+                x ^= x >> 33;
+                x *= 0xFF51AFD7ED558CCDULL;
+                x ^= x >> 33;
+                return static_cast<size_t>(x);
+            }
         };
 
     private:
-        UUID(const std::string &str) : str_{str} {}
-        // uuidの文字列表現
-        std::string str_;
+        UUID(const std::uint64_t high, const std::uint64_t low)
+            : high_{high},
+              low_{low}
+        {
+        }
+
+        // xoshiro256**
+        class Random {
+        public:
+            Random()
+            {
+                // std::random_deviceの値をsplitmix64で広げて状態を初期化する
+                std::random_device device{};
+                std::uint64_t seed = (static_cast<std::uint64_t>(device()) << 32) | static_cast<std::uint64_t>(device());
+                for (std::uint64_t &x : s_) {
+                    seed += 0x9E3779B97F4A7C15ULL;
+                    std::uint64_t z = seed;
+                    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                    x = z ^ (z >> 31);
+                }
+            }
+
+            std::uint64_t next()
+            {
+                const std::uint64_t result = rotl(s_[1] * 5, 7) * 9;
+                const std::uint64_t t = s_[1] << 17;
+                s_[2] ^= s_[0];
+                s_[3] ^= s_[1];
+                s_[1] ^= s_[2];
+                s_[0] ^= s_[3];
+                s_[2] ^= t;
+                s_[3] = rotl(s_[3], 45);
+                return result;
+            }
+
+        private:
+            static std::uint64_t rotl(const std::uint64_t x, const int k)
+            {
+                return (x << k) | (x >> (64 - k));
+            }
+
+            std::uint64_t s_[4];
+        };
+
+        struct V7State {
+            std::uint64_t lastMs = 0;
+            std::uint16_t counter = 0;
+        };
+
+        static Random &random()
+        {
+            thread_local Random r{};
+            return r;
+        }
+
+        static V7State &v7State()
+        {
+            thread_local V7State s{};
+            return s;
+        }
+
+        static int hexValue(const char c)
+        {
+            if (c >= '0' && c <= '9') {
+                return c - '0';
+            }
+            if (c >= 'a' && c <= 'f') {
+                return c - 'a' + 10;
+            }
+            if (c >= 'A' && c <= 'F') {
+                return c - 'A' + 10;
+            }
+            return -1;
+        }
+
+        std::uint64_t high_;
+        std::uint64_t low_;
     };
 
 } // namespace PapierMache
 
-#endif DEADLOCK_EXAMPLE_UUID_INCLUDED
\ No newline at end of file
+#endif // DEADLOCK_EXAMPLE_UUID_INCLUDED
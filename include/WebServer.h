@@ -5,6 +5,7 @@
 
 #pragma comment(lib, "ws2_32.lib")
 
+#include "AdminRequestHandler.h"
 #include "Common.h"
 #include "DLEXRequestHandler.h"
 #include "Http.h"
@@ -676,6 +677,10 @@ namespace PapierMache {
                 handlerTree_.findHandlerNode(getValue<std::string>(webConfiguration, "sites", "ROOT_DLEX")).addChildNode({"addorder", std::make_unique<DLEXAddOrderHandler>(std::initializer_list<HttpRequestMethod>({HttpRequestMethod::POST}))});
                 handlerTree_.findHandlerNode(getValue<std::string>(webConfiguration, "sites", "ROOT_DLEX")).addChildNode({"operation", std::make_unique<DLEXOperationHandler>(std::initializer_list<HttpRequestMethod>({HttpRequestMethod::POST}))});
                 handlerTree_.findHandlerNode(getValue<std::string>(webConfiguration, "sites", "ROOT_DLEX")).addChildNode({"delete", std::make_unique<DLEXDeleteOrderHandler>(std::initializer_list<HttpRequestMethod>({HttpRequestMethod::POST}))});
+                // 管理用のRequestHandlerのセット
+                handlerTree_.addRootNode({getValue<std::string>(webConfiguration, "sites", "ROOT_ADMIN"), nullptr});
+                handlerTree_.findHandlerNode(getValue<std::string>(webConfiguration, "sites", "ROOT_ADMIN")).addChildNode({"lockevents", std::make_unique<AdminLockEventsHandler>(std::initializer_list<HttpRequestMethod>({HttpRequestMethod::GET}))});
+                handlerTree_.findHandlerNode(getValue<std::string>(webConfiguration, "sites", "ROOT_ADMIN")).addChildNode({"heatmap", std::make_unique<AdminHeatmapHandler>(std::initializer_list<HttpRequestMethod>({HttpRequestMethod::GET}))});
                 // helloworldのRequestHandlerのセット
                 handlerTree_.addRootNode({getValue<std::string>(webConfiguration, "sites", "ROOT_HELLOWORLD"), nullptr});
                 handlerTree_.findHandlerNode(getValue<std::string>(webConfiguration, "sites", "ROOT_HELLOWORLD")).addChildNode({"top", std::make_unique<HelloWorldRootHandler>(std::initializer_list<HttpRequestMethod>({HttpRequestMethod::GET}))});
@@ -0,0 +1,352 @@
+#ifndef DEADLOCK_EXAMPLE_WORKER_POOL_INCLUDED
+#define DEADLOCK_EXAMPLE_WORKER_POOL_INCLUDED
+
+#include "General.h"
+
+#include "Common.h"
+#include "Logger.h"
+#include "ThreadsMap.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace PapierMache {
+
+    // 決まった数のワーカースレッドでキューに入れられた処理を順に実行する
+    // ワーカーごとにキューを持ち 自分のキューが空になったワーカーは無作為に選んだ他のキューから処理を盗む
+    // 同じaffinityで入れた処理は同じキューに入るので 盗まれない限り同じワーカーが実行する
+    // 処理の途中で他のトランザクションを待つワーカーはBlockingScopeで知らせる
+    // 待っていないワーカーが常にsize個あるように予備のワーカーを追加し 待ちが終われば余った分は終了する
+    // (待っているワーカーだけになると 待ち先のコミット要求を実行するワーカーがいなくなるため)
+    class WorkerPool {
+    public:
+        // このオブジェクトが存在する間 現在のワーカーは待っているものとして扱う
+        // ワーカー以外のスレッドでは何もしない
+        class BlockingScope {
+        public:
+            BlockingScope()
+                : pPool_{current()}
+            {
+                if (pPool_ != nullptr) {
+                    pPool_->beginBlocking();
+                }
+            }
+
+            ~BlockingScope()
+            {
+                CATCH_ALL_EXCEPTIONS({
+                    if (pPool_ != nullptr) {
+                        pPool_->endBlocking();
+                    }
+                })
+            }
+
+            // コピー禁止
+            BlockingScope(const BlockingScope &) = delete;
+            BlockingScope &operator=(const BlockingScope &) = delete;
+            // ムーブ禁止
+            BlockingScope(BlockingScope &&) = delete;
+            BlockingScope &operator=(BlockingScope &&) = delete;
+
+        private:
+            WorkerPool *pPool_;
+        };
+
+        explicit WorkerPool(const size_t size)
+            : size_{size == 0 ? 1 : size},
+              workers_{0},
+              blocked_{0},
+              toBeStopped_{false},
+              pending_{0},
+              sleepers_{0},
+              next_{0}
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            for (size_t i = 0; i < size_; ++i) {
+                slots_.push_back(std::make_unique<Slot>());
+                freeSlots_.push_back(size_ - 1 - i);
+            }
+            for (size_t i = 0; i < size_; ++i) {
+                addWorker();
+            }
+        }
+
+        // キューに残っている処理は実行してからワーカーを終了する
+        // 呼び出す前に新たな処理を入れないようにすること
+        ~WorkerPool()
+        {
+            CATCH_ALL_EXCEPTIONS({
+                std::lock_guard<std::mutex> lock{mt_};
+                toBeStopped_ = true;
+                wakeAll();
+            })
+            // 全てのワーカーはthreadsMap_のデストラクタでjoinする
+        }
+
+        // コピー禁止
+        WorkerPool(const WorkerPool &) = delete;
+        WorkerPool &operator=(const WorkerPool &) = delete;
+        // ムーブ禁止
+        WorkerPool(WorkerPool &&) = delete;
+        WorkerPool &operator=(WorkerPool &&) = delete;
+
+        // 処理をaffinityで決まるワーカーのキューに入れる
+        void submit(std::function<void()> task, const size_t affinity)
+        {
+            Slot &slot = *slots_[affinity % size_];
+            // キューに入れる前に数える 入れた後ではワーカーが先に取り出して減らし0を下回ることがある
+            pending_.fetch_add(1);
+            try {
+                std::lock_guard<std::mutex> lock{slot.mt};
+                slot.tasks.push_back(std::move(task));
+            }
+            catch (...) {
+                pending_.fetch_sub(1);
+                throw;
+            }
+            // 眠っているワーカーがいる場合だけ起こす
+            // ワーカーはsleepers_を増やしてからpending_を確認するので どちらかが必ず相手の変更を見る
+            if (sleepers_.load() > 0) {
+                std::lock_guard<std::mutex> lock{mt_};
+                if (slot.isOwnerSleeping) {
+                    // 持ち主が眠っていれば持ち主に実行させる
+                    slot.cond.notify_one();
+                    return;
+                }
+                // 持ち主が処理中であれば眠っている他のワーカーに盗ませる
+                for (auto &pSlot : slots_) {
+                    if (pSlot->isOwnerSleeping) {
+                        pSlot->cond.notify_one();
+                        return;
+                    }
+                }
+                cond_.notify_one();
+            }
+        }
+
+        // 処理を順番にワーカーのキューに入れる
+        void submit(std::function<void()> task)
+        {
+            submit(std::move(task), next_.fetch_add(1, std::memory_order_relaxed));
+        }
+
+        // 待っていないワーカーの数
+        size_t size() const { return size_; }
+
+        // 予備を含む現在のワーカーの数
+        size_t workers()
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            return workers_;
+        }
+
+    private:
+        // ワーカーごとのキュー
+        // 持ち主のワーカーは先頭から取り出し 他のワーカーは末尾から盗む
+        struct Slot {
+            std::mutex mt;
+            std::deque<std::function<void()>> tasks;
+            // 以下はWorkerPoolのmt_で保護する
+            // 持ち主のワーカーはこの条件変数で眠る
+            std::condition_variable cond;
+            bool isOwnerSleeping = false;
+        };
+
+        // 現在のスレッドを実行しているWorkerPool ワーカー以外ではnullptr
+        static WorkerPool *&current()
+        {
+            thread_local WorkerPool *pPool = nullptr;
+            return pPool;
+        }
+
+        // mt_を取得して呼び出す
+        void addWorker()
+        {
+            ++workers_;
+            threadsMap_.addThread(std::thread{[this] { run(); }});
+            // 終了した予備のワーカーをjoinする
+            threadsMap_.cleanUp();
+        }
+
+        // 待っていないワーカーがsize_個より多ければtrue mt_を取得して呼び出す
+        bool isSurplus() const
+        {
+            return workers_ - blocked_ > size_;
+        }
+
+        void beginBlocking()
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            ++blocked_;
+            if (!toBeStopped_.load() && workers_ - blocked_ < size_) {
+                addWorker();
+            }
+        }
+
+        void endBlocking()
+        {
+            std::lock_guard<std::mutex> lock{mt_};
+            --blocked_;
+            if (isSurplus()) {
+                // 処理を待っているワーカーを起こして余った分を終了させる
+                wakeAll();
+            }
+        }
+
+        // 眠っている全てのワーカーを起こす mt_を取得して呼び出す
+        void wakeAll()
+        {
+            for (auto &pSlot : slots_) {
+                pSlot->cond.notify_all();
+            }
+            cond_.notify_all();
+        }
+
+        void run()
+        {
+            current() = this;
+            std::mt19937 engine{std::random_device{}()};
+            // このワーカーのキューの添字 持ち主のいないキューがなければ-1(予備のワーカー)
+            long long slot = -1;
+            bool isRetired = false;
+            while (true) {
+                if (slot < 0) {
+                    std::lock_guard<std::mutex> lock{mt_};
+                    slot = claimSlot();
+                }
+                std::function<void()> task;
+                if (pop(slot, task) || steal(slot, engine, task)) {
+                    pending_.fetch_sub(1);
+                    execute(task);
+                    continue;
+                }
+                // 停止する場合もキューに残っている処理を全て実行してから終了する
+                if (toBeStopped_.load()) {
+                    break;
+                }
+                std::unique_lock<std::mutex> lock{mt_};
+                // キューを持つワーカーはそのキューの条件変数で 予備のワーカーはcond_で眠る
+                std::condition_variable &cond = slot >= 0 ? slots_[static_cast<size_t>(slot)]->cond : cond_;
+                if (slot >= 0) {
+                    slots_[static_cast<size_t>(slot)]->isOwnerSleeping = true;
+                }
+                ++sleepers_;
+                cond.wait(lock, [this] { return toBeStopped_.load() || isSurplus() || pending_.load() > 0; });
+                --sleepers_;
+                if (slot >= 0) {
+                    slots_[static_cast<size_t>(slot)]->isOwnerSleeping = false;
+                }
+                if (!toBeStopped_.load() && isSurplus()) {
+                    // 余ったワーカーとして終了する 他のワーカーが続けて終了しないように同じロックの中で数を減らす
+                    --workers_;
+                    if (slot >= 0) {
+                        freeSlots_.push_back(static_cast<size_t>(slot));
+                    }
+                    isRetired = true;
+                    break;
+                }
+            }
+            if (!isRetired) {
+                std::lock_guard<std::mutex> lock{mt_};
+                --workers_;
+            }
+            // mt_を解放してから設定する(addWorkerがmt_を保持したままjoinするため)
+            threadsMap_.setFinishedFlag(std::this_thread::get_id());
+        }
+
+        // 持ち主のいないキューを1つ受け持つ なければ-1 mt_を取得して呼び出す
+        long long claimSlot()
+        {
+            if (freeSlots_.empty()) {
+                return -1;
+            }
+            const size_t index = freeSlots_.back();
+            freeSlots_.pop_back();
+            return static_cast<long long>(index);
+        }
+
+        // 自分のキューの先頭から取り出す
+        bool pop(const long long slot, std::function<void()> &out)
+        {
+            if (slot < 0) {
+                return false;
+            }
+            Slot &s = *slots_[static_cast<size_t>(slot)];
+            std::lock_guard<std::mutex> lock{s.mt};
+            if (s.tasks.empty()) {
+                return false;
+            }
+            out = std::move(s.tasks.front());
+            s.tasks.pop_front();
+            return true;
+        }
+
+        // 無作為に選んだキューから順に他のキューを調べて末尾から盗む
+        bool steal(const long long slot, std::mt19937 &engine, std::function<void()> &out)
+        {
+            const size_t start = std::uniform_int_distribution<size_t>{0, size_ - 1}(engine);
+            for (size_t i = 0; i < size_; ++i) {
+                const size_t victim = (start + i) % size_;
+                if (static_cast<long long>(victim) == slot) {
+                    continue;
+                }
+                Slot &s = *slots_[victim];
+                std::lock_guard<std::mutex> lock{s.mt};
+                if (!s.tasks.empty()) {
+                    out = std::move(s.tasks.back());
+                    s.tasks.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void execute(std::function<void()> &task)
+        {
+            try {
+                task();
+            }
+            catch (std::exception &e) {
+                CATCH_ALL_EXCEPTIONS(LOG << e.what() << FILE_INFO;)
+            }
+            catch (...) {
+                CATCH_ALL_EXCEPTIONS(LOG << "unexpected error or SEH exception." << FILE_INFO;)
+            }
+        }
+
+        // 待っていないワーカーの数
+        const size_t size_;
+        // 予備を含むワーカーの数
+        size_t workers_;
+        // BlockingScopeの中にいるワーカーの数
+        size_t blocked_;
+        // 終了すべき場合にtrue
+        std::atomic_bool toBeStopped_;
+        // 全てのキューにある処理の数
+        std::atomic<size_t> pending_;
+        // cond_で眠っているワーカーの数
+        std::atomic<size_t> sleepers_;
+        // affinityを指定しない処理を入れる次のキュー
+        std::atomic<size_t> next_;
+        // ワーカーごとのキュー 数はsize_で変わらない
+        std::vector<std::unique_ptr<Slot>> slots_;
+        // 持ち主のいないキューの添字
+        std::vector<size_t> freeSlots_;
+        // 以下はワーカーの数と待ちの管理 および眠っているワーカーを起こす際に用いる
+        std::mutex mt_;
+        // キューを持たない予備のワーカーが眠る条件変数
+        std::condition_variable cond_;
+        // 最後に宣言して最初に破棄する(ワーカーのjoinはmt_とcond_が有効な間に行う)
+        ThreadsMap threadsMap_;
+    };
+
+} // namespace PapierMache
+
+#endif // DEADLOCK_EXAMPLE_WORKER_POOL_INCLUDED
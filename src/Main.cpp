@@ -8,7 +8,9 @@
 #include "Utils.h"
 #include "WebServer.h"
 
+#include <chrono>
 #include <iostream>
+#include <memory>
 #include <string>
 
 PapierMache::Logger<std::ostream> logger{std::cout};
@@ -41,6 +43,16 @@ int main()
 
         LOG << "database initialization start.";
         PapierMache::DbStuff::Database db{};
+        db.setVictimSelectionPolicy(std::make_unique<PapierMache::DbStuff::LeastWorkVictimPolicy>(
+            PapierMache::getValue<long long>(webConfiguration, "deadlock", "ROW_WEIGHT"),
+            PapierMache::getValue<long long>(webConfiguration, "deadlock", "BYTE_WEIGHT"),
+            PapierMache::getValue<long long>(webConfiguration, "deadlock", "MILLISECOND_WEIGHT")));
+        db.setLockEscalationThreshold(PapierMache::getValue<unsigned long>(webConfiguration, "database", "LOCK_ESCALATION_THRESHOLD"));
+        db.setLockEventCapacity(PapierMache::getValue<unsigned long>(webConfiguration, "database", "LOCK_EVENT_CAPACITY"));
+        db.setConnectionPoolSize(PapierMache::getValue<unsigned long>(webConfiguration, "database", "MINIMUM_CONNECTIONS"),
+                                 PapierMache::getValue<unsigned long>(webConfiguration, "database", "CONNECTION_BATCH_SIZE"));
+        db.setWorkerThreads(PapierMache::getValue<unsigned long>(webConfiguration, "database", "WORKER_THREADS"));
+        db.setSessionTimeout(std::chrono::seconds{PapierMache::getValue<long long>(webConfiguration, "database", "SESSION_TIMEOUT_SECONDS")});
         db.start();
         LOG << "database initialization end.";
         // グローバル変数にこのデータベースをセット
@@ -56,6 +68,22 @@ int main()
                 break;
             }
             else if (c == 'd') {
+                // 循環待ちごとに作業量の最も少ないトランザクションだけを停止する
+                std::vector<std::string> victims = db.resolveDeadlocks();
+                if (victims.empty()) {
+                    LOG << "deadlock is not detected.";
+                }
+                for (const std::string &v : victims) {
+                    LOG << "terminated connection id: " << v;
+                }
+            }
+            else if (c == 'c') {
+                // 各テーブルの削除済みの行を取り除く 実行中のトランザクションの終了を待つが他のテーブルは止めない
+                for (const std::string &tableName : db.tableNames()) {
+                    LOG << tableName << " removed rows: " << db.compact(tableName);
+                }
+            }
+            else if (c == 'a') {
                 controller.terminateAll();
                 LOG << "controller.terminateAll";
             }
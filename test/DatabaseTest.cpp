@@ -13,8 +13,10 @@
 #include "Logger.h"
 
 #include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <fstream>
+#include <memory>
 #include <random>
 #include <string>
 #include <thread>
@@ -63,6 +65,85 @@ namespace PapierMache::DbStuff {
         db.start();
     }
 
+    TEST_F(DatabaseTest, connection_pool_001)
+    {
+        Database db{};
+        db.setConnectionPoolSize(3, 2);
+        db.start();
+        // start()から戻った時点で最小数のコネクションが作成済みなので最初のgetConnectionは待たない
+        ASSERT_LE(3, db.idleConnectionCount());
+        std::vector<PapierMache::DbStuff::Connection> connections;
+        for (int i = 0; i < 3; ++i) {
+            connections.push_back(db.getConnection());
+        }
+        // 空きがなくなってもまとめて作成されるので取得できる
+        for (int i = 0; i < 7; ++i) {
+            connections.push_back(db.getConnection());
+        }
+        std::vector<std::string> ids;
+        for (const auto &c : connections) {
+            ids.push_back(c.id());
+        }
+        std::sort(ids.begin(), ids.end());
+        ASSERT_EQ(ids.end(), std::unique(ids.begin(), ids.end()));
+        Driver driver{connections.back()};
+        Driver::Result r = driver.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_TRUE(r.isSucceed);
+    }
+
+    TEST_F(DatabaseTest, worker_pool_001)
+    {
+        // ワーカーが1つでも行の解放を待つ間は予備のワーカーが他のコネクションの要求を処理する
+        Database db{};
+        db.setWorkerThreads(1);
+        db.start();
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver1{con1};
+        Driver driver2{con2};
+        Driver::Result r = driver1.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq("order1") + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品1") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        Driver::Result r2{false, {}, ""};
+        std::thread t2{[&] {
+            r2 = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order1") + ")");
+        }};
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        // con2の要求を処理しているワーカーは待っているのでcon1のコミットは予備のワーカーが処理する
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_TRUE(r.isSucceed);
+        t2.join();
+        LOG << r2.isSucceed << ": " << r2.message;
+        ASSERT_TRUE(r2.isSucceed);
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+    }
+
     TEST_F(DatabaseTest, insert_001)
     {
         Database db{};
@@ -359,6 +440,1309 @@ namespace PapierMache::DbStuff {
         ASSERT_EQ(0, r.rows.size());
     }
 
+    TEST_F(DatabaseTest, select_001)
+    {
+        // トランザクション開始後に他のトランザクションがコミットした変更は見えない
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con = db.getConnection();
+        Driver driver{con};
+        Driver::Result r = driver.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:transaction   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:insert  order (ORDER_NAME=" + dq("order1") + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:insert  order (ORDER_NAME=" + dq("order2") + ", CUSTOMER_NAME=" + dq("お客様B") + ", PRODUCT_NAME=" + dq("商品えひもせすん") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 読み込み側のトランザクションを先に開始する
+        r = driver.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver2{con2};
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品XYZ") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:delete order (ORDER_NAME=" + dq("order2") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:insert  order (ORDER_NAME=" + dq("order3") + ", CUSTOMER_NAME=" + dq("お客様C") + ", PRODUCT_NAME=" + dq("商品ABC") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        r = driver.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(2, r.rows.size());
+        std::sort(r.rows.begin(), r.rows.end(),
+                  [](std::map<std::string, std::string> a, std::map<std::string, std::string> b) {
+                      return a.at("order_name") < b.at("order_name");
+                  });
+        ASSERT_STREQ("order1", r.rows[0].at("order_name").c_str());
+        ASSERT_STREQ("商品いろはにほへと", r.rows[0].at("product_name").c_str());
+        ASSERT_STREQ("order2", r.rows[1].at("order_name").c_str());
+        r = driver.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 新しく開始したトランザクションからはコミット済みの変更が見える
+        r = driver.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(2, r.rows.size());
+        std::sort(r.rows.begin(), r.rows.end(),
+                  [](std::map<std::string, std::string> a, std::map<std::string, std::string> b) {
+                      return a.at("order_name") < b.at("order_name");
+                  });
+        ASSERT_STREQ("order1", r.rows[0].at("order_name").c_str());
+        ASSERT_STREQ("商品XYZ", r.rows[0].at("product_name").c_str());
+        ASSERT_STREQ("order3", r.rows[1].at("order_name").c_str());
+    }
+
+    TEST_F(DatabaseTest, binary_protocol_001)
+    {
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver textDriver{con1};
+        Driver binaryDriver{con2};
+        Driver::Result r = binaryDriver.useBinaryProtocol();
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (Driver *d : {&textDriver, &binaryDriver}) {
+            r = d->sendQuery("please:user admin adminpass");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+            r = d->sendQuery("please:transaction");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        for (const std::string name : {"order1", "order2", "order3"}) {
+            r = binaryDriver.sendQuery("please:insert  order (ORDER_NAME=" + dq(name) + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品=いろは,にほへと") + ")");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        r = binaryDriver.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (Driver *d : {&textDriver, &binaryDriver}) {
+            if (d == &textDriver) {
+                r = d->sendQuery("please:commit");
+                LOG << r.isSucceed << ": " << r.message;
+                if (!r.isSucceed) FAIL();
+            }
+            r = d->sendQuery("please:transaction");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+
+        // どちらの形式でも同じ結果になる
+        Driver::Result text = textDriver.sendQuery("please: select order (CUSTOMER_NAME=" + dq("お客様A") + ")");
+        Driver::Result binary = binaryDriver.sendQuery("please: select order (CUSTOMER_NAME=" + dq("お客様A") + ")");
+        ASSERT_TRUE(text.isSucceed);
+        ASSERT_TRUE(binary.isSucceed);
+        // バイナリ形式の行はマップにせずにviewで読む
+        ASSERT_TRUE(binary.rows.empty());
+        ASSERT_EQ(3, binary.view.size());
+        ASSERT_EQ(text.rows.size(), binary.view.size());
+        for (size_t i = 0; i < binary.view.size(); ++i) {
+            ASSERT_EQ(text.rows[i].size(), binary.view.columns().size());
+            for (const auto &e : text.rows[i]) {
+                ASSERT_EQ(e.second, std::string{binary.view.value(i, e.first)});
+            }
+        }
+        ASSERT_EQ("商品=いろは,にほへと", binary.view.str(0, "product_name"));
+        ASSERT_THROW(binary.view.value(0, "unknown"), std::runtime_error);
+        ASSERT_THROW(binary.view.value(3, 0), std::runtime_error);
+        text = textDriver.sendQuery("please:unknown order");
+        binary = binaryDriver.sendQuery("please:unknown order");
+        ASSERT_FALSE(binary.isSucceed);
+        ASSERT_EQ(text.message, binary.message);
+        ASSERT_EQ(text.code, binary.code);
+        text = textDriver.sendQuery("please:commit");
+        binary = binaryDriver.sendQuery("please:commit");
+        ASSERT_TRUE(binary.isSucceed);
+        ASSERT_EQ(text.message, binary.message);
+
+        // 途中で切れたフレームは読み込まない
+        BinaryProtocol::Frame frame{};
+        frame.code = 1;
+        frame.message = "message";
+        std::vector<std::byte> bytes = BinaryProtocol::encode(frame);
+        ASSERT_EQ("message", BinaryProtocol::decode(bytes).message);
+        bytes.pop_back();
+        ASSERT_THROW(BinaryProtocol::decode(bytes), std::runtime_error);
+    }
+
+    TEST_F(DatabaseTest, batch_001)
+    {
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con = db.getConnection();
+        Driver driver{con};
+        // ユーザーの設定からコミットまでを1回で送る 文の中の区切り文字はそのまま渡る
+        std::vector<Driver::Result> results = driver.sendBatch({"please:user admin adminpass",
+                                                                "please:transaction",
+                                                                "please:insert  order (ORDER_NAME=" + dq("batch1") + ", CUSTOMER_NAME=" + dq("お客様B") + ", PRODUCT_NAME=" + dq("商品=いろは,にほへと") + ")",
+                                                                "please:insert  order (ORDER_NAME=" + dq("batch2") + ", CUSTOMER_NAME=" + dq("お客様B") + ", PRODUCT_NAME=" + dq("商品2") + ")",
+                                                                "please:commit"});
+        ASSERT_EQ(5, results.size());
+        for (const Driver::Result &r : results) {
+            LOG << r.isSucceed << ": " << r.message;
+            ASSERT_TRUE(r.isSucceed);
+        }
+        results = driver.sendBatch({"please:transaction", "please: select order (CUSTOMER_NAME=" + dq("お客様B") + ")", "please:commit"});
+        ASSERT_EQ(3, results.size());
+        ASSERT_TRUE(results[2].isSucceed);
+        ASSERT_EQ(2, results[1].rows.size());
+        ASSERT_STREQ("商品=いろは,にほへと", results[1].rows[0].at("product_name").c_str());
+
+        // 失敗した文で止まり 以降の文は実行しない
+        results = driver.sendBatch({"please:transaction",
+                                    "please:insert  order (ORDER_NAME=" + dq("batch3") + ", CUSTOMER_NAME=" + dq("お客様B") + ")",
+                                    "please:unknown order",
+                                    "please:commit"});
+        ASSERT_EQ(3, results.size());
+        ASSERT_TRUE(results[1].isSucceed);
+        ASSERT_FALSE(results[2].isSucceed);
+        Driver::Result r = driver.sendQuery("please:rollback");
+        ASSERT_TRUE(r.isSucceed);
+
+        // バッチの中で処理結果の形式は切り替えられない
+        results = driver.sendBatch({"please:protocol binary"});
+        ASSERT_EQ(1, results.size());
+        ASSERT_FALSE(results[0].isSucceed);
+
+        // バイナリ形式でも同じ結果になる
+        r = driver.useBinaryProtocol();
+        ASSERT_TRUE(r.isSucceed);
+        r = driver.executeBatchTransaction({"please: select order (CUSTOMER_NAME=" + dq("お客様B") + ")"});
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_TRUE(r.isSucceed);
+        ASSERT_EQ(2, r.view.size());
+        r = driver.executeBatchTransaction({"please:update  order (PRODUCT_NAME=" + dq("商品3") + ") (ORDER_NAME=" + dq("batch2") + ")"});
+        ASSERT_TRUE(r.isSucceed);
+        r = driver.executeBatchTransaction({"please: select order (PRODUCT_NAME=" + dq("商品3") + ")"});
+        ASSERT_TRUE(r.isSucceed);
+        ASSERT_EQ(1, r.view.size());
+        // 失敗した場合はロールバックしているので次のトランザクションを開始できる
+        r = driver.executeBatchTransaction({"please:delete  order (ORDER_NAME=" + dq("batch1") + ")", "please:unknown order"});
+        ASSERT_FALSE(r.isSucceed);
+        r = driver.executeBatchTransaction({"please: select order (CUSTOMER_NAME=" + dq("お客様B") + ")"});
+        ASSERT_TRUE(r.isSucceed);
+        ASSERT_EQ(2, r.view.size());
+    }
+
+    TEST_F(DatabaseTest, prepare_001)
+    {
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con = db.getConnection();
+        Driver driver{con};
+        Driver::Result r = driver.sendQuery("please:user admin adminpass");
+        if (!r.isSucceed) FAIL();
+        // トランザクションの外で準備できる 列名の大文字小文字は問わない
+        r = driver.prepare("addOrder", "insert order (order_name=?, CUSTOMER_NAME=\"お客様C\", PRODUCT_NAME=?)");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_TRUE(r.isSucceed);
+        r = driver.prepare("setProduct", "update order (PRODUCT_NAME=?) (ORDER_NAME=?)");
+        ASSERT_TRUE(r.isSucceed);
+        r = driver.prepare("findOrder", "select order (CUSTOMER_NAME=?)");
+        ASSERT_TRUE(r.isSucceed);
+        r = driver.prepare("removeOrder", "delete order (ORDER_NAME=?)");
+        ASSERT_TRUE(r.isSucceed);
+        // 存在しない列やテーブルは準備の時点で失敗する
+        r = driver.prepare("bad", "select order (NO_SUCH_COLUMN=?)");
+        ASSERT_FALSE(r.isSucceed);
+        r = driver.prepare("bad", "select no_such_table (ORDER_NAME=?)");
+        ASSERT_FALSE(r.isSucceed);
+
+        r = driver.executeBatchTransaction({Driver::executeQuery("addOrder", {"prepared1", "商品=いろは,にほへと"}),
+                                            Driver::executeQuery("addOrder", {"prepared2", "商品 \"2\""})});
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_TRUE(r.isSucceed);
+        r = driver.executeBatchTransaction({Driver::executeQuery("findOrder", {"お客様C"})});
+        ASSERT_TRUE(r.isSucceed);
+        ASSERT_EQ(2, r.rows.size());
+        // テキストの文と同じ結果になる
+        Driver::Result text = driver.executeBatchTransaction({"please: select order (CUSTOMER_NAME=" + dq("お客様C") + ")"});
+        ASSERT_TRUE(text.isSucceed);
+        ASSERT_EQ(text.rows, r.rows);
+
+        r = driver.executeBatchTransaction({Driver::executeQuery("setProduct", {"商品3", "prepared2"})});
+        ASSERT_TRUE(r.isSucceed);
+        r = driver.executeBatchTransaction({"please: select order (PRODUCT_NAME=" + dq("商品3") + ")"});
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_EQ(0, r.rows[0].at("order_name").find("prepared2"));
+
+        // パラメータの数が合わない場合と存在しない文は失敗する
+        r = driver.executeBatchTransaction({Driver::executeQuery("setProduct", {"商品4"})});
+        ASSERT_FALSE(r.isSucceed);
+        r = driver.executeBatchTransaction({Driver::executeQuery("noSuchStatement", {})});
+        ASSERT_FALSE(r.isSucceed);
+
+        r = driver.executeBatchTransaction({Driver::executeQuery("removeOrder", {"prepared1"}), Driver::executeQuery("findOrder", {"お客様C"})});
+        ASSERT_TRUE(r.isSucceed);
+        r = driver.executeBatchTransaction({Driver::executeQuery("findOrder", {"お客様C"})});
+        ASSERT_EQ(1, r.rows.size());
+    }
+
+    TEST_F(DatabaseTest, session_001)
+    {
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con = db.getConnection();
+        Driver driver{con};
+        // パスワードで認証した際に発行したセッションは他のコネクションで使える
+        Driver::Result r = driver.openSession("admin", "adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_TRUE(r.isSucceed);
+        const std::string token = r.message;
+        ASSERT_NE("", token);
+        con.close();
+
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver2{con2};
+        r = driver2.resumeSession(token);
+        ASSERT_TRUE(r.isSucceed);
+        r = driver2.executeBatchTransaction({"please: select order"});
+        ASSERT_TRUE(r.isSucceed);
+        // 設定済みのコネクションでは使えない
+        r = driver2.resumeSession(token);
+        ASSERT_FALSE(r.isSucceed);
+
+        // 送信の先頭に加えて認証からコミットまでを1度に送れる
+        PapierMache::DbStuff::Connection con3 = db.getConnection();
+        Driver driver3{con3};
+        r = driver3.executeBatchTransaction({"please: select order"}, "", Driver::RetryPolicy{1, std::chrono::milliseconds{0}, std::chrono::milliseconds{0}},
+                                            {"please:session " + token});
+        ASSERT_TRUE(r.isSucceed);
+
+        // 存在しないセッションと誤ったパスワードは失敗する
+        PapierMache::DbStuff::Connection con4 = db.getConnection();
+        Driver driver4{con4};
+        r = driver4.resumeSession("no-such-token");
+        ASSERT_FALSE(r.isSucceed);
+        ASSERT_EQ(static_cast<char>(ResultCode::UNAUTHENTICATED), r.code);
+        r = driver4.openSession("admin", "wrongpass");
+        ASSERT_FALSE(r.isSucceed);
+        r = driver4.executeBatchTransaction({"please: select order"});
+        ASSERT_FALSE(r.isSucceed);
+
+        // 期限切れのセッションは使えない
+        db.setSessionTimeout(std::chrono::seconds{0});
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        r = driver4.resumeSession(token);
+        ASSERT_FALSE(r.isSucceed);
+        ASSERT_EQ(static_cast<char>(ResultCode::UNAUTHENTICATED), r.code);
+    }
+
+    TEST_F(DatabaseTest, optimistic_001)
+    {
+        // 同じ行を更新した楽観的トランザクションは後からコミットした方が失敗する
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con = db.getConnection();
+        Driver driver{con};
+        Driver::Result r = driver.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:transaction optimistic");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:insert  order (ORDER_NAME=" + dq("order1") + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver2{con2};
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        r = driver.sendQuery("please:transaction OPTIMISTIC");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction OPTIMISTIC");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        // 悲観的トランザクションであればここで待機になる
+        r = driver.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品XYZ") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品ABC") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_FALSE(r.isSucceed);
+
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_STREQ("商品XYZ", r.rows[0].at("product_name").c_str());
+        // 失敗したトランザクションの行ロックは残らない
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品ABC") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+    }
+
+    TEST_F(DatabaseTest, read_only_001)
+    {
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con = db.getConnection();
+        Driver driver{con};
+        Driver::Result r = driver.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:insert  order (ORDER_NAME=" + dq("order1") + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        r = driver.sendQuery("please:transaction read only");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please: select order (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_STREQ("商品いろはにほへと", r.rows[0].at("product_name").c_str());
+        // 読み取り専用トランザクションでは変更できない
+        r = driver.sendQuery("please:insert  order (ORDER_NAME=" + dq("order2") + ", CUSTOMER_NAME=" + dq("お客様B") + ", PRODUCT_NAME=" + dq("商品えひもせすん") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_FALSE(r.isSucceed);
+        r = driver.sendQuery("please:delete order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_FALSE(r.isSucceed);
+        r = driver.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        r = driver.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+    }
+
+    TEST_F(DatabaseTest, deadlock_001)
+    {
+        Database db{};
+        db.start();
+        // 書き込んだ行数のみで犠牲者を選ぶ
+        db.setVictimSelectionPolicy(std::make_unique<LeastWorkVictimPolicy>(1, 0, 0));
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver1{con1};
+        Driver driver2{con2};
+        Driver::Result r = driver1.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (const std::string name : {"order1", "order2", "order3"}) {
+            r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq(name) + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // con1はorder1を con2はorder2とorder3を変更中にする
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品1") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order2") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order3") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_TRUE(db.resolveDeadlocks().empty());
+
+        // 互いの行を待たせてデッドロックにする
+        Driver::Result r1{false, {}, ""};
+        Driver::Result r2{false, {}, ""};
+        std::thread t1{[&] {
+            r1 = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品1") + ") (ORDER_NAME=" + dq("order2") + ")");
+        }};
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        std::thread t2{[&] {
+            r2 = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order1") + ")");
+        }};
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        // 書き込んだ行数の少ないcon1が犠牲者になる
+        std::vector<std::string> victims = db.resolveDeadlocks();
+        t1.join();
+        t2.join();
+        ASSERT_EQ(1, victims.size());
+        ASSERT_EQ(con1.id(), victims[0]);
+        LOG << r1.isSucceed << ": " << r1.message;
+        ASSERT_FALSE(r1.isSucceed);
+        LOG << r2.isSucceed << ": " << r2.message;
+        ASSERT_TRUE(r2.isSucceed);
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please: select order (PRODUCT_NAME=" + dq("商品2") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(3, r.rows.size());
+
+        // 待ちとデッドロックが記録されている
+        std::vector<LockEvent> events = db.lockEvents();
+        auto deadlock = std::find_if(events.begin(), events.end(), [](const LockEvent &e) { return e.type == LockEvent::Type::DEADLOCK; });
+        ASSERT_NE(events.end(), deadlock);
+        ASSERT_EQ(2, deadlock->transactions.size());
+        ASSERT_NE(deadlock->transactions.end(), std::find(deadlock->transactions.begin(), deadlock->transactions.end(), deadlock->victim));
+        // con1はorder2(2行目)を待っている間に停止した
+        auto abandoned = std::find_if(events.begin(), events.end(), [](const LockEvent &e) { return e.type == LockEvent::Type::ABANDONED; });
+        ASSERT_NE(events.end(), abandoned);
+        ASSERT_EQ("order", abandoned->tableName);
+        ASSERT_EQ(1, abandoned->rowIndex);
+        ASSERT_EQ(deadlock->victim, abandoned->transactions[0]);
+        auto heatmap = db.lockHeatmap();
+        ASSERT_LE(1, heatmap.at("order").at(0).waits);
+        ASSERT_LE(1, heatmap.at("order").at(1).waits);
+    }
+
+    TEST_F(DatabaseTest, retry_001)
+    {
+        Database db{};
+        db.start();
+        db.setVictimSelectionPolicy(std::make_unique<LeastWorkVictimPolicy>(1, 0, 0));
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver1{con1};
+        Driver driver2{con2};
+        Driver::Result r = driver1.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (const std::string name : {"order1", "order2", "order3"}) {
+            r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq(name) + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order2") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order3") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // con1はorder1 -> order2の順に con2はorder1を変更してデッドロックにする
+        std::atomic<int> attempts{0};
+        Driver::Result r1{false, {}, ""};
+        std::thread t1{[&] {
+            r1 = driver1.executeTransaction([&](Driver &d) {
+                ++attempts;
+                Driver::Result result = d.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品1") + ") (ORDER_NAME=" + dq("order1") + ")");
+                if (!result.isSucceed) {
+                    return result;
+                }
+                return d.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品1") + ") (ORDER_NAME=" + dq("order2") + ")");
+            },
+                                            "", Driver::RetryPolicy{3, std::chrono::milliseconds{10}, std::chrono::milliseconds{100}});
+        }};
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        Driver::Result r2{false, {}, ""};
+        std::thread t2{[&] {
+            r2 = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order1") + ")");
+        }};
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        std::vector<std::string> victims = db.resolveDeadlocks();
+        ASSERT_EQ(1, victims.size());
+        ASSERT_EQ(con1.id(), victims[0]);
+        t2.join();
+        LOG << r2.isSucceed << ": " << r2.message;
+        ASSERT_TRUE(r2.isSucceed);
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        // 犠牲者のcon1はcon2のコミット後にやり直して成功する
+        t1.join();
+        LOG << r1.isSucceed << ": " << r1.message;
+        ASSERT_TRUE(r1.isSucceed);
+        ASSERT_EQ(2, attempts.load());
+
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please: select order (PRODUCT_NAME=" + dq("商品1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(2, r.rows.size());
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 再実行できない失敗はそのまま返す
+        r = driver2.executeTransaction([](Driver &d) {
+            return d.sendQuery("please:unknown order");
+        });
+        ASSERT_FALSE(r.isSucceed);
+        ASSERT_FALSE(r.isRetryable());
+    }
+
+    TEST_F(DatabaseTest, update_many_001)
+    {
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver1{con1};
+        Driver driver2{con2};
+        Driver::Result r = driver1.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (const std::string name : {"order1", "order2", "order3"}) {
+            r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq(name) + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 組の順が逆でも行はファイル上の位置の順にロックされるので互いを待ち合うことはない
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update many order (PRODUCT_NAME=" + dq("商品1") + ") (ORDER_NAME=" + dq("order3") + ") (PRODUCT_NAME=" + dq("商品1") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        Driver::Result r2{false, {}, ""};
+        std::thread t2{[&] {
+            r2 = driver2.sendQuery("please:update many order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order1") + ") (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order3") + ")");
+        }};
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        ASSERT_TRUE(db.resolveDeadlocks().empty());
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        t2.join();
+        LOG << r2.isSucceed << ": " << r2.message;
+        ASSERT_TRUE(r2.isSucceed);
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order (PRODUCT_NAME=" + dq("商品2") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(2, r.rows.size());
+        // 更新内容と条件が組になっていなければエラー
+        r = driver1.sendQuery("please:update many order (PRODUCT_NAME=" + dq("商品3") + ") (ORDER_NAME=" + dq("order2") + ") (PRODUCT_NAME=" + dq("商品3") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_FALSE(r.isSucceed);
+    }
+
+    TEST_F(DatabaseTest, lockEventHistory_001)
+    {
+        LockEventHistory history{3};
+        for (LONGLONG i = 0; i < 5; ++i) {
+            LockEvent e{};
+            e.type = LockEvent::Type::WAIT;
+            e.tableName = "order";
+            e.transactions = {1, 2};
+            e.rowIndex = i % 2;
+            e.waitMilliseconds = 10;
+            e.victim = -1;
+            history.record(std::move(e));
+        }
+        // 古いものから上書きされる
+        std::vector<LockEvent> events = history.events();
+        ASSERT_EQ(3, events.size());
+        ASSERT_EQ(0, events[0].rowIndex);
+        ASSERT_EQ(1, events[1].rowIndex);
+        ASSERT_EQ(0, events[2].rowIndex);
+        auto heatmap = history.heatmap();
+        ASSERT_EQ(2, heatmap.at("order").at(0).waits);
+        ASSERT_EQ(20, heatmap.at("order").at(0).waitMilliseconds);
+        ASSERT_EQ(1, heatmap.at("order").at(1).waits);
+        // 容量を減らすと新しいものが残る
+        history.setCapacity(1);
+        events = history.events();
+        ASSERT_EQ(1, events.size());
+        ASSERT_EQ(0, events[0].rowIndex);
+    }
+
+    TEST_F(DatabaseTest, escalation_001)
+    {
+        Database db{};
+        db.start();
+        db.setLockEscalationThreshold(3);
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver1{con1};
+        Driver driver2{con2};
+        Driver::Result r = driver1.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (int i = 0; i < 10; ++i) {
+            r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq("order" + std::to_string(i)) + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 閾値を超える行を更新して表ロックに切り替えた後でロールバックする
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:rollback");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please: select order (PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(10, r.rows.size());
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 表ロックを持つトランザクションの後続の文は条件のみを記録する
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:delete order (ORDER_NAME=" + dq("order3") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 他のトランザクションは表ロックが解放されるまで行に書き込めない
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        std::atomic<bool> isUpdated{false};
+        Driver::Result r2{false, {}, ""};
+        std::thread t{[&] {
+            r2 = driver2.sendQuery("please:update order (CUSTOMER_NAME=" + dq("お客様B") + ") (ORDER_NAME=" + dq("order5") + ")");
+            isUpdated.store(true);
+        }};
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        ASSERT_FALSE(isUpdated.load());
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        t.join();
+        LOG << r2.isSucceed << ": " << r2.message;
+        ASSERT_TRUE(r2.isSucceed);
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order (PRODUCT_NAME=" + dq("商品1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(9, r.rows.size());
+        r = driver1.sendQuery("please: select order (ORDER_NAME=" + dq("order5") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_STREQ("お客様B", r.rows[0].at("customer_name").c_str());
+    }
+
+    TEST_F(DatabaseTest, escalation_002)
+    {
+        Database db{};
+        db.start();
+        db.setLockEscalationThreshold(3);
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        Driver driver1{con1};
+        Driver::Result r = driver1.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (int i = 0; i < 10; ++i) {
+            r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq("order" + std::to_string(i)) + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq(i % 2 == 0 ? "商品1" : "商品2") + ")");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        auto count = [&driver1, this](const std::string &productName) {
+            Driver::Result result = driver1.sendQuery("please: select order (PRODUCT_NAME=" + dq(productName) + ")");
+            return result.isSucceed ? static_cast<int>(result.rows.size()) : -1;
+        };
+
+        // 条件が前の組の更新内容と重なる組を 閾値を超えて表ロックに切り替えた後も更新前の行で評価する
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update many order (PRODUCT_NAME=" + dq("商品2") + ") (PRODUCT_NAME=" + dq("商品1") + ") (PRODUCT_NAME=" + dq("商品3") + ") (PRODUCT_NAME=" + dq("商品2") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(0, count("商品1"));
+        ASSERT_EQ(5, count("商品2"));
+        ASSERT_EQ(5, count("商品3"));
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 既に表ロックを持っている場合も同じ
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (CUSTOMER_NAME=" + dq("お客様B") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update many order (PRODUCT_NAME=" + dq("商品3") + ") (PRODUCT_NAME=" + dq("商品2") + ") (PRODUCT_NAME=" + dq("商品4") + ") (PRODUCT_NAME=" + dq("商品3") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(0, count("商品2"));
+        ASSERT_EQ(5, count("商品3"));
+        ASSERT_EQ(5, count("商品4"));
+        r = driver1.sendQuery("please: select order (CUSTOMER_NAME=" + dq("お客様B") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(10, r.rows.size());
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+    }
+
+    TEST_F(DatabaseTest, compaction_001)
+    {
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver1{con1};
+        Driver driver2{con2};
+        Driver::Result r = driver1.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (int i = 0; i < 5; ++i) {
+            r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq("order" + std::to_string(i)) + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:delete order (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:delete order (ORDER_NAME=" + dq("order3") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        const auto sizeBefore = std::filesystem::file_size("./database/data/order");
+
+        // 実行中のトランザクションがIXを持つ間はメンテナンスはSを取得できない
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (CUSTOMER_NAME=" + dq("お客様B") + ") (ORDER_NAME=" + dq("order4") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        std::atomic<bool> isCompacted{false};
+        size_t removed = 0;
+        std::thread t{[&] {
+            removed = db.compact("order");
+            isCompacted.store(true);
+        }};
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        ASSERT_FALSE(isCompacted.load());
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        t.join();
+        ASSERT_EQ(2, removed);
+        ASSERT_LT(std::filesystem::file_size("./database/data/order"), sizeBefore);
+
+        // 詰めた後のファイルを読み書きできること
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(3, r.rows.size());
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品ちりぬるを") + ") (ORDER_NAME=" + dq("order4") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq("order5") + ", CUSTOMER_NAME=" + dq("お客様C") + ", PRODUCT_NAME=" + dq("商品わかよたれそ") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order (ORDER_NAME=" + dq("order4") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_STREQ("お客様B", r.rows[0].at("customer_name").c_str());
+        ASSERT_STREQ("商品ちりぬるを", r.rows[0].at("product_name").c_str());
+        r = driver1.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(4, r.rows.size());
+    }
+
+    TEST_F(DatabaseTest, serializable_001)
+    {
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver1{con1};
+        Driver driver2{con2};
+        Driver::Result r = driver1.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (int i = 0; i < 2; ++i) {
+            r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq("order" + std::to_string(i)) + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction unknown");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_FALSE(r.isSucceed);
+
+        // 互いに相手が変更する行を読んで判断する(write skew)場合は後からコミットする方を中止する
+        r = driver1.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction isolation level serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品1") + ") (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_FALSE(r.isSucceed);
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order (PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_STREQ("order1", r.rows[0].at("order_name").c_str());
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 読むだけのトランザクションは後から書き込まれても直列化できる
+        r = driver1.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order (PRODUCT_NAME=" + dq("商品2") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(0, r.rows.size());
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // スナップショットより後にコミットされた行を変更する場合は先にコミットした方を優先する
+        r = driver1.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品3") + ") (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品4") + ") (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_FALSE(r.isSucceed);
+
+        // SNAPSHOTでは従来どおり最新の行を上書きする
+        r = driver1.sendQuery("please:transaction snapshot");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品5") + ") (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品6") + ") (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+    }
+
+    TEST_F(DatabaseTest, serializable_002)
+    {
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con1 = db.getConnection();
+        PapierMache::DbStuff::Connection con2 = db.getConnection();
+        Driver driver1{con1};
+        Driver driver2{con2};
+        Driver::Result r = driver1.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        for (int i = 0; i < 2; ++i) {
+            r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq("order" + std::to_string(i)) + ", CUSTOMER_NAME=" + dq("お客様A") + ", PRODUCT_NAME=" + dq("商品いろはにほへと") + ")");
+            LOG << r.isSucceed << ": " << r.message;
+            if (!r.isSucceed) FAIL();
+        }
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 互いに相手が変更しない行だけを読んで変更する場合はどちらもコミットできる
+        r = driver1.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品1") + ") (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品2") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // update manyの条件も同じ
+        r = driver1.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update many order (PRODUCT_NAME=" + dq("商品3") + ") (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update many order (PRODUCT_NAME=" + dq("商品4") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        // 条件付きの読み込みで相手が変更する行を読んで判断する場合はwrite skewとして後からコミットする方を中止する
+        r = driver1.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please: select order (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品5") + ") (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品6") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_FALSE(r.isSucceed);
+
+        // 互いに相手の条件に合う行を追記する場合(phantom)も後からコミットする方を中止する
+        r = driver1.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:transaction serializable");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order (CUSTOMER_NAME=" + dq("お客様B") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(0, r.rows.size());
+        r = driver2.sendQuery("please: select order (CUSTOMER_NAME=" + dq("お客様C") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(0, r.rows.size());
+        r = driver1.sendQuery("please:insert  order (ORDER_NAME=" + dq("order2") + ", CUSTOMER_NAME=" + dq("お客様C") + ", PRODUCT_NAME=" + dq("商品7") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:insert  order (ORDER_NAME=" + dq("order3") + ", CUSTOMER_NAME=" + dq("お客様B") + ", PRODUCT_NAME=" + dq("商品8") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver2.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        ASSERT_FALSE(r.isSucceed);
+
+        r = driver1.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver1.sendQuery("please: select order (ORDER_NAME=" + dq("order0") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_STREQ("商品5", r.rows[0].at("product_name").c_str());
+        r = driver1.sendQuery("please: select order (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_STREQ("商品4", r.rows[0].at("product_name").c_str());
+        r = driver1.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(3, r.rows.size());
+        r = driver1.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+    }
+
+    TEST_F(DatabaseTest, migration_001)
+    {
+        // バージョン1形式(ヘッダなし 制御情報4バイト)のデータファイルを作成する
+        {
+            std::ofstream ofs{"./database/data/order", std::ios::binary | std::ios::trunc};
+            auto writeRow = [&ofs](const char flag, const std::vector<std::pair<std::string, size_t>> &values) {
+                const char controlData[4] = {flag, 0, static_cast<char>(-1), static_cast<char>(-1)};
+                ofs.write(controlData, sizeof(controlData));
+                for (const auto &[value, size] : values) {
+                    std::string column = value;
+                    column.resize(size, '\0');
+                    ofs.write(column.data(), static_cast<std::streamsize>(column.size()));
+                }
+            };
+            writeRow(0, {{"order1", 128}, {"お客様A", 128}, {"商品いろはにほへと", 256}, {"2023/01/01 00:00:00.000", 24}});
+            // 削除済みの行
+            writeRow(1, {{"order2", 128}, {"お客様B", 128}, {"商品えひもせすん", 256}, {"2023/01/01 00:00:00.000", 24}});
+        }
+
+        Database db{};
+        db.start();
+        PapierMache::DbStuff::Connection con = db.getConnection();
+        Driver driver{con};
+        Driver::Result r = driver.sendQuery("please:user admin adminpass");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_STREQ("商品いろはにほへと", r.rows[0].at("product_name").c_str());
+        // 移行後のファイルに書き込めること
+        r = driver.sendQuery("please:update order (PRODUCT_NAME=" + dq("商品ちりぬるを") + ") (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:insert  order (ORDER_NAME=" + dq("order3") + ", CUSTOMER_NAME=" + dq("お客様C") + ", PRODUCT_NAME=" + dq("商品わかよたれそ") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please:commit");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+
+        r = driver.sendQuery("please:transaction");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        r = driver.sendQuery("please: select order (ORDER_NAME=" + dq("order1") + ")");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(1, r.rows.size());
+        ASSERT_STREQ("商品ちりぬるを", r.rows[0].at("product_name").c_str());
+        r = driver.sendQuery("please: select order   ");
+        LOG << r.isSucceed << ": " << r.message;
+        if (!r.isSucceed) FAIL();
+        ASSERT_EQ(2, r.rows.size());
+    }
+
     TEST_F(DatabaseTest, parallel_operation_001)
     {
         try {
@@ -12,7 +12,9 @@
 #include "Database.h"
 #include "Logger.h"
 
+#include <atomic>
 #include <chrono>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -273,4 +275,141 @@ namespace PapierMache::DbStuff {
         ASSERT_EQ(1, id);
     }
 
+    TEST_F(IdGeneratorTest, lockFreeGetId_001)
+    {
+        LockFreeIdGenerator<short> idg{10, 100};
+        ASSERT_EQ(10, idg.getId());
+        ASSERT_EQ(11, idg.getId());
+        ASSERT_EQ(12, idg.getId());
+    }
+
+    TEST_F(IdGeneratorTest, lockFreeGetId_002)
+    {
+        // IdGeneratorの再利用モードと同じくcharの最大値 - 1まで払い出す
+        LockFreeIdGenerator<char> idg{0, 1000};
+        for (char c = 0; c < 120; ++c) {
+            idg.getId();
+        }
+        ASSERT_EQ(120, idg.getId());
+        ASSERT_EQ(121, idg.getId());
+        ASSERT_EQ(122, idg.getId());
+        ASSERT_EQ(123, idg.getId());
+        ASSERT_EQ(124, idg.getId());
+        ASSERT_EQ(125, idg.getId());
+        ASSERT_EQ(126, idg.getId());
+
+        idg.release(3);
+        idg.release(122);
+        idg.release(125);
+        char id = -1;
+        try {
+            ASSERT_EQ(3, idg.getId());
+            ASSERT_EQ(122, idg.getId());
+            ASSERT_EQ(125, idg.getId());
+            id = idg.getId();
+            FAIL() << "We shouldn't get here.";
+        }
+        catch (const std::exception &e) {
+            LOG << e.what();
+        }
+        ASSERT_EQ(-1, id);
+    }
+
+    TEST_F(IdGeneratorTest, lockFreeGetId_003)
+    {
+        // 同時に使用できるidの数はcapacityまで
+        LockFreeIdGenerator<int> idg{0, 70};
+        for (int i = 0; i < 70; ++i) {
+            ASSERT_EQ(i, idg.getId());
+        }
+        ASSERT_THROW(idg.getId(), std::runtime_error);
+        // 範囲外のidのリリースは無視する
+        idg.release(-1);
+        idg.release(70);
+        ASSERT_THROW(idg.getId(), std::runtime_error);
+        // 前回払い出したidより前のidも一周して再利用する
+        idg.release(5);
+        idg.release(64);
+        ASSERT_EQ(5, idg.getId());
+        ASSERT_EQ(64, idg.getId());
+    }
+
+    TEST_F(IdGeneratorTest, lockFreeGetId_004)
+    {
+        LockFreeIdGenerator<int> idg{0, 100};
+        std::vector<int> counts(100, 0);
+        std::vector<std::thread> threads;
+        std::mutex mt;
+        for (int i = 0; i < 10; ++i) {
+            std::thread t{
+                [&idg, &counts, &mt] {
+                    std::vector<int> ids;
+                    for (int j = 0; j < 10; ++j) {
+                        ids.push_back(idg.getId());
+                    }
+                    std::lock_guard<std::mutex> lock{mt};
+                    for (const int id : ids) {
+                        ++counts.at(id);
+                    }
+                }};
+            threads.push_back(std::move(t));
+        }
+        for (std::thread &ref : threads) {
+            ref.join();
+        }
+        // 10(スレッド数) * 10(各スレッドでのgetId実行回数) = 100のidが重複なく払い出されている
+        for (const int c : counts) {
+            ASSERT_EQ(1, c);
+        }
+        ASSERT_THROW(idg.getId(), std::runtime_error);
+    }
+
+    // 取得とリリースを繰り返すスレッドを競合させて所要時間を比較する
+    // 同じidが同時に2つのスレッドに払い出されていないことも確認する
+    template <typename generatorT>
+    long long contention(generatorT &idg, const int threadCount, const int loopCount)
+    {
+        std::vector<std::atomic<int>> owners(32768);
+        for (auto &o : owners) {
+            o.store(0);
+        }
+        std::atomic<bool> isDuplicated{false};
+        std::vector<std::thread> threads;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < threadCount; ++i) {
+            std::thread t{
+                [&idg, &owners, &isDuplicated, loopCount] {
+                    for (int j = 0; j < loopCount; ++j) {
+                        const int id = idg.getId();
+                        if (owners.at(id).fetch_add(1) != 0) {
+                            isDuplicated.store(true);
+                        }
+                        owners.at(id).fetch_sub(1);
+                        idg.release(id);
+                    }
+                }};
+            threads.push_back(std::move(t));
+        }
+        for (std::thread &ref : threads) {
+            ref.join();
+        }
+        const auto end = std::chrono::steady_clock::now();
+        EXPECT_FALSE(isDuplicated.load());
+        return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    }
+
+    TEST_F(IdGeneratorTest, contention_001)
+    {
+        IdGenerator<short> idg{0, true};
+        const long long us = contention(idg, 8, 20000);
+        LOG << "IdGenerator: 8 threads * 20000 getId/release: " << us << " us";
+    }
+
+    TEST_F(IdGeneratorTest, contention_002)
+    {
+        LockFreeIdGenerator<short> idg{0, 1024};
+        const long long us = contention(idg, 8, 20000);
+        LOG << "LockFreeIdGenerator: 8 threads * 20000 getId/release: " << us << " us";
+    }
+
 } // namespace PapierMache::DbStuff
@@ -0,0 +1,124 @@
+#include <gtest/gtest.h>
+
+#ifdef GTEST_IS_THREADSAFE
+#pragma message("pthread is available")
+#else
+#pragma message("pthread is NOT available")
+#endif
+
+#include "General.h"
+
+#include "Common.h"
+#include "Mailbox.h"
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace PapierMache::DbStuff {
+
+    class MailboxTest : public ::testing::Test {
+    protected:
+        MailboxTest()
+        {
+        }
+
+        ~MailboxTest() override
+        {
+        }
+
+        void SetUp() override
+        {
+        }
+
+        void TearDown() override
+        {
+        }
+    };
+
+    TEST_F(MailboxTest, put_001)
+    {
+        Mailbox mailbox{};
+        Buffer sent = mailbox.newBuffer();
+        sent.bytes().push_back(std::byte{1});
+        sent.bytes().push_back(std::byte{2});
+        const std::byte *p = sent.bytes().data();
+        Buffer kept = sent;
+        ASSERT_FALSE(sent.isUnique());
+        mailbox.put(std::move(sent));
+        // 置いたバッファがコピーされずにそのまま取り出せる
+        Buffer received = mailbox.take();
+        ASSERT_EQ(p, received.bytes().data());
+        ASSERT_EQ(2, received.bytes().size());
+        ASSERT_EQ(std::byte{2}, received.bytes()[1]);
+        kept = Buffer{};
+        ASSERT_TRUE(received.isUnique());
+        // 何も置かれていなければ空のバッファを返す
+        Buffer empty = mailbox.take();
+        ASSERT_FALSE(empty.empty());
+        ASSERT_EQ(0, empty.bytes().size());
+    }
+
+    TEST_F(MailboxTest, reuse_001)
+    {
+        Mailbox mailbox{};
+        const std::byte *p = nullptr;
+        { // 使い終わったバッファは確保済みの領域ごとプールに戻る
+            Buffer buffer = mailbox.newBuffer();
+            buffer.bytes().resize(4096);
+            p = buffer.bytes().data();
+        }
+        Buffer reused = mailbox.newBuffer();
+        ASSERT_EQ(0, reused.bytes().size());
+        ASSERT_LE(4096, reused.bytes().capacity());
+        ASSERT_EQ(p, reused.bytes().data());
+        // メールボックスを破棄した後に手放してもよい
+        Buffer outlived;
+        {
+            Mailbox other{};
+            outlived = other.newBuffer();
+            Buffer left = other.newBuffer();
+            left.bytes().resize(16);
+            other.put(std::move(left));
+        }
+        outlived.bytes().push_back(std::byte{1});
+        ASSERT_EQ(1, outlived.bytes().size());
+    }
+
+    TEST_F(MailboxTest, pingpong_001)
+    {
+        Mailbox mailbox{};
+        // 送信側と応答側が交互に同じ枠を使う 順番はDatabaseのrequestとwaitに相当するturnで渡す
+        const int n = 10000;
+        std::atomic<int> turn{0};
+        std::thread responder{[&mailbox, &turn, n] {
+            for (int i = 0; i < n; ++i) {
+                while (turn.load() != 1) {
+                    std::this_thread::yield();
+                }
+                Buffer request = mailbox.take();
+                request.bytes().push_back(std::byte{0x7F});
+                mailbox.put(std::move(request));
+                turn = 0;
+            }
+        }};
+        int answered = 0;
+        for (int i = 0; i < n; ++i) {
+            Buffer request = mailbox.newBuffer();
+            request.bytes().push_back(static_cast<std::byte>(i & 0x3F));
+            mailbox.put(std::move(request));
+            turn = 1;
+            while (turn.load() != 0) {
+                std::this_thread::yield();
+            }
+            Buffer response = mailbox.take();
+            if (response.bytes().size() == 2 && response.bytes()[0] == static_cast<std::byte>(i & 0x3F)) {
+                ++answered;
+            }
+        }
+        responder.join();
+        ASSERT_EQ(n, answered);
+    }
+
+} // namespace PapierMache::DbStuff
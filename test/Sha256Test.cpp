@@ -0,0 +1,154 @@
+#include <gtest/gtest.h>
+
+#ifdef GTEST_IS_THREADSAFE
+#pragma message("pthread is available")
+#else
+#pragma message("pthread is NOT available")
+#endif
+
+#include "General.h"
+
+#include "BCryptHash.h"
+#include "Common.h"
+#include "Logger.h"
+#include "Sha256.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace PapierMache::Sha256 {
+
+    class Sha256Test : public ::testing::Test {
+    protected:
+        Sha256Test()
+        {
+        }
+
+        ~Sha256Test() override
+        {
+        }
+
+        void SetUp() override
+        {
+        }
+
+        void TearDown() override
+        {
+        }
+
+        std::string toHex(const Digest &digest)
+        {
+            std::string s;
+            char buf[3];
+            for (const std::uint8_t b : digest) {
+                std::snprintf(buf, sizeof(buf), "%02x", b);
+                s += buf;
+            }
+            return s;
+        }
+
+        // このCPUで使える実装
+        std::vector<Kernel> kernels()
+        {
+            std::vector<Kernel> v;
+            for (const Kernel k : {Kernel::SCALAR, Kernel::SHA_NI, Kernel::AVX2}) {
+                if (isSupported(k)) {
+                    v.push_back(k);
+                }
+            }
+            return v;
+        }
+
+        // n個のパスワードをrepeat回計算するのにかかった時間
+        long long measure(const Kernel kernel, const std::vector<std::string> &passwords, const int repeat)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < repeat; ++i) {
+                std::vector<Digest> digests = hashMany(passwords, kernel);
+                if (digests.size() != passwords.size()) {
+                    return -1;
+                }
+            }
+            const auto end = std::chrono::steady_clock::now();
+            return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        }
+    };
+
+    TEST_F(Sha256Test, hash_001)
+    {
+        // FIPS 180-4の例
+        const std::vector<std::pair<std::string, std::string>> vectors = {
+            {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+            {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+            {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+            {std::string(1000000, 'a'), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"}};
+        for (const Kernel k : kernels()) {
+            for (const auto &v : vectors) {
+                ASSERT_EQ(v.second, toHex(hash(v.first, k))) << kernelName(k);
+            }
+        }
+        ASSERT_EQ(vectors[1].second, toHex(hash(vectors[1].first)));
+    }
+
+    TEST_F(Sha256Test, kernels_001)
+    {
+        // パディングが1ブロックと2ブロックになる境界を含む長さで全ての実装が同じ結果になる
+        // AVX2はレーンごとにブロック数が違い 端数のレーンがある場合も同じ
+        std::mt19937 engine{12345};
+        std::vector<std::string> messages;
+        for (size_t length = 0; length < 300; ++length) {
+            std::string m(length, '\0');
+            for (char &c : m) {
+                c = static_cast<char>(engine());
+            }
+            messages.push_back(m);
+        }
+        const std::vector<Digest> expected = hashMany(messages, Kernel::SCALAR);
+        for (const Kernel k : kernels()) {
+            ASSERT_EQ(expected, hashMany(messages, k)) << kernelName(k);
+            for (size_t i = 0; i < messages.size(); i += 37) {
+                ASSERT_EQ(expected[i], hash(messages[i], k)) << kernelName(k);
+            }
+        }
+        ASSERT_EQ(expected, hashMany(messages));
+        if (!isSupported(Kernel::AVX2)) {
+            ASSERT_THROW(hash("abc", Kernel::AVX2), std::runtime_error);
+        }
+    }
+
+    TEST_F(Sha256Test, password_001)
+    {
+        // 以前のCNGの結果と同じなので保存済みのユーザーのパスワードをそのまま照合できる
+        std::string result;
+        toBCryptHash("adminpass", result);
+        ASSERT_EQ(DIGEST_SIZE, result.size());
+        Digest digest{};
+        std::copy(result.begin(), result.end(), digest.begin());
+        ASSERT_EQ("713bfda78870bf9d1b261f565286f85e97ee614efe5f0faf7c34e7ca4f65baca", toHex(digest));
+    }
+
+    TEST_F(Sha256Test, benchmark_001)
+    {
+        // ログインが集中した場合を想定して パスワードの長さのメッセージを実装ごとに計算する
+        std::vector<std::string> passwords;
+        for (int i = 0; i < 1024; ++i) {
+            passwords.push_back("password" + std::to_string(i));
+        }
+        for (const Kernel k : kernels()) {
+            const long long us = measure(k, passwords, 100);
+            ASSERT_LE(0, us);
+            LOG << "Sha256 " << kernelName(k) << ": 100 * 1024 passwords: " << us << " us";
+        }
+        std::vector<std::string> pages(64, std::string(16 * 1024, 'x'));
+        for (const Kernel k : kernels()) {
+            const long long us = measure(k, pages, 10);
+            ASSERT_LE(0, us);
+            LOG << "Sha256 " << kernelName(k) << ": 10 * 64 * 16KiB: " << us << " us";
+        }
+    }
+
+} // namespace PapierMache::Sha256
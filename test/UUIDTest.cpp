@@ -0,0 +1,139 @@
+#include <gtest/gtest.h>
+
+#ifdef GTEST_IS_THREADSAFE
+#pragma message("pthread is available")
+#else
+#pragma message("pthread is NOT available")
+#endif
+
+#include "General.h"
+
+#include "Common.h"
+#include "Logger.h"
+#include "UUID.h"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace PapierMache {
+
+    class UUIDTest : public ::testing::Test {
+    protected:
+        UUIDTest()
+        {
+        }
+
+        ~UUIDTest() override
+        {
+        }
+
+        void SetUp() override
+        {
+        }
+
+        void TearDown() override
+        {
+        }
+
+        // 版と変種のビットが正しいこと
+        void assertLayout(const UUID &u, const int version)
+        {
+            ASSERT_EQ(version, u.version());
+            ASSERT_EQ(0x2ULL, u.low() >> 62);
+            const std::string s = u.str();
+            ASSERT_EQ(36, s.length());
+            ASSERT_EQ(static_cast<char>('0' + version), s[14]);
+            ASSERT_NE(std::string::npos, std::string{"89ab"}.find(s[19]));
+        }
+    };
+
+    TEST_F(UUIDTest, format_001)
+    {
+        assertLayout(UUID::create(), 4);
+        assertLayout(UUID::createV7(), 7);
+        assertLayout(UUID::createSecure(), 4);
+
+        // 文字列との間で変換しても同じ値になる
+        const UUID u = UUID::parse("0123ABCD-4567-89ab-cdef-0123456789AB");
+        ASSERT_EQ(0x0123abcd456789abULL, u.high());
+        ASSERT_EQ(0xcdef0123456789abULL, u.low());
+        ASSERT_EQ("0123abcd-4567-89ab-cdef-0123456789ab", u.str());
+        for (int i = 0; i < 100; ++i) {
+            const UUID v = UUID::create();
+            ASSERT_EQ(v, UUID::parse(v.str()));
+        }
+        ASSERT_TRUE(UUID{}.isNil());
+        ASSERT_EQ("00000000-0000-0000-0000-000000000000", UUID{}.str());
+        ASSERT_THROW(UUID::parse("0123abcd-4567-89ab-cdef-0123456789a"), std::runtime_error);
+        ASSERT_THROW(UUID::parse("0123abcd+4567-89ab-cdef-0123456789ab"), std::runtime_error);
+        ASSERT_THROW(UUID::parse("0123abcd-4567-89ab-cdef-0123456789ag"), std::runtime_error);
+    }
+
+    TEST_F(UUIDTest, unique_001)
+    {
+        // 複数のスレッドで生成しても重複しない
+        std::unordered_set<UUID, UUID::Hash> ids;
+        std::mutex mt;
+        std::vector<std::thread> threads;
+        const int n = 20000;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&ids, &mt, n, t] {
+                std::vector<UUID> v;
+                for (int i = 0; i < n; ++i) {
+                    v.push_back(t % 2 == 0 ? UUID::create() : UUID::createV7());
+                }
+                std::lock_guard<std::mutex> lock{mt};
+                ids.insert(v.begin(), v.end());
+            });
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        ASSERT_EQ(4 * n, ids.size());
+    }
+
+    TEST_F(UUIDTest, v7_001)
+    {
+        // 同じスレッドで生成したv7は同じミリ秒の中でも生成した順に並ぶ
+        const long long before = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        UUID previous = UUID::createV7();
+        for (int i = 0; i < 10000; ++i) {
+            const UUID u = UUID::createV7();
+            ASSERT_TRUE(previous < u);
+            ASSERT_TRUE(previous.str() < u.str());
+            previous = u;
+        }
+        // 先頭48ビットは現在時刻
+        const long long ms = static_cast<long long>(previous.high() >> 16);
+        ASSERT_LE(before, ms);
+        ASSERT_GE(before + 60000, ms);
+    }
+
+    TEST_F(UUIDTest, benchmark_001)
+    {
+        const int n = 100000;
+        auto measure = [n](auto f) {
+            const auto start = std::chrono::steady_clock::now();
+            size_t total = 0;
+            for (int i = 0; i < n; ++i) {
+                total += f();
+            }
+            const auto end = std::chrono::steady_clock::now();
+            return std::make_pair(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(), total);
+        };
+        auto v4 = measure([] { return UUID::Hash{}(UUID::create()); });
+        auto v7 = measure([] { return UUID::Hash{}(UUID::createV7()); });
+        auto str = measure([] { return UUID::create().str().size(); });
+        auto secure = measure([] { return UUID::Hash{}(UUID::createSecure()); });
+        ASSERT_EQ(36u * n, str.second);
+        LOG << "UUID create: " << n << " ids: " << v4.first << " us";
+        LOG << "UUID createV7: " << n << " ids: " << v7.first << " us";
+        LOG << "UUID create().str(): " << n << " ids: " << str.first << " us";
+        LOG << "UUID createSecure: " << n << " ids: " << secure.first << " us";
+    }
+
+} // namespace PapierMache
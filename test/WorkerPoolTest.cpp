@@ -0,0 +1,185 @@
+#include <gtest/gtest.h>
+
+#ifdef GTEST_IS_THREADSAFE
+#pragma message("pthread is available")
+#else
+#pragma message("pthread is NOT available")
+#endif
+
+#include "General.h"
+
+#include "Common.h"
+#include "Logger.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace PapierMache {
+
+    class WorkerPoolTest : public ::testing::Test {
+    protected:
+        WorkerPoolTest()
+        {
+        }
+
+        ~WorkerPoolTest() override
+        {
+        }
+
+        void SetUp() override
+        {
+        }
+
+        void TearDown() override
+        {
+        }
+
+        // 条件が満たされるまで最大timeout待つ
+        template <typename F>
+        bool waitUntil(F f, const std::chrono::milliseconds timeout = std::chrono::milliseconds{5000})
+        {
+            const auto limit = std::chrono::steady_clock::now() + timeout;
+            while (!f()) {
+                if (std::chrono::steady_clock::now() > limit) {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return true;
+        }
+    };
+
+    TEST_F(WorkerPoolTest, submit_001)
+    {
+        std::atomic<int> count{0};
+        WorkerPool pool{4};
+        const int n = 10000;
+        // 複数のスレッドから入れた処理が全て1回ずつ実行される
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&pool, &count, n] {
+                for (int i = 0; i < n / 4; ++i) {
+                    pool.submit([&count] { ++count; });
+                }
+            });
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        ASSERT_TRUE(waitUntil([&count, n] { return count.load() == n; }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ASSERT_EQ(n, count.load());
+    }
+
+    TEST_F(WorkerPoolTest, affinity_001)
+    {
+        // 処理が参照する変数はpoolより先に宣言する
+        // ASSERTでテストを抜けてもpoolのデストラクタが残りの処理を実行し終えてから破棄される
+        std::vector<std::thread::id> executed;
+        std::mutex mt;
+        std::atomic<int> done{0};
+        WorkerPool pool{4};
+        // 持ち主のワーカーが空いていれば同じaffinityの処理は同じワーカーが実行する
+        for (int i = 0; i < 20; ++i) {
+            pool.submit([&] {
+                std::lock_guard<std::mutex> lock{mt};
+                executed.push_back(std::this_thread::get_id());
+                ++done;
+            },
+                        1);
+            ASSERT_TRUE(waitUntil([&done, i] { return done.load() == i + 1; }));
+        }
+        std::map<std::thread::id, int> counts;
+        for (const auto &id : executed) {
+            ++counts[id];
+        }
+        int most = 0;
+        for (const auto &e : counts) {
+            if (e.second > most) {
+                most = e.second;
+            }
+        }
+        ASSERT_LE(18, most);
+    }
+
+    TEST_F(WorkerPoolTest, steal_001)
+    {
+        std::atomic_bool toRelease{false};
+        std::atomic_bool isStarted{false};
+        std::atomic<int> count{0};
+        WorkerPool pool{4};
+        // 持ち主のワーカーが処理中であれば他のワーカーが盗んで実行する
+        pool.submit([&] {
+            isStarted = true;
+            while (!toRelease.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        },
+                    0);
+        if (!waitUntil([&isStarted] { return isStarted.load(); })) {
+            toRelease = true;
+            FAIL();
+        }
+        for (int i = 0; i < 10; ++i) {
+            pool.submit([&count] { ++count; }, 0);
+        }
+        const bool isStolen = waitUntil([&count] { return count.load() == 10; });
+        toRelease = true;
+        ASSERT_TRUE(isStolen);
+    }
+
+    TEST_F(WorkerPoolTest, blocking_001)
+    {
+        // 処理が参照する変数はpoolより先に宣言する
+        // 最初の処理はisDoneを設定した後でmtを解放するので poolが処理を実行し終えるまで破棄しない
+        std::mutex mt;
+        std::condition_variable cond;
+        bool isReleased = false;
+        std::atomic_bool isDone{false};
+        WorkerPool pool{1};
+        // 唯一のワーカーが待っている間は予備のワーカーが待ち先の処理を実行する
+        pool.submit([&] {
+            std::unique_lock<std::mutex> lock{mt};
+            WorkerPool::BlockingScope blocking{};
+            cond.wait(lock, [&isReleased] { return isReleased; });
+            isDone = true;
+        });
+        pool.submit([&] {
+            { // Scoped Lock start
+                std::lock_guard<std::mutex> lock{mt};
+                isReleased = true;
+            } // Scoped Lock end
+            cond.notify_all();
+        });
+        ASSERT_TRUE(waitUntil([&isDone] { return isDone.load(); }));
+        // 待ちが終われば予備のワーカーは終了する
+        ASSERT_TRUE(waitUntil([&pool] { return pool.workers() == 1; }));
+    }
+
+    TEST_F(WorkerPoolTest, stop_001)
+    {
+        // 停止する時にキューに残っている処理も全て実行してから終了する
+        std::atomic_bool isStarted{false};
+        std::atomic<int> count{0};
+        {
+            WorkerPool pool{1};
+            pool.submit([&isStarted] {
+                isStarted = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            });
+            ASSERT_TRUE(waitUntil([&isStarted] { return isStarted.load(); }));
+            for (int i = 0; i < 10; ++i) {
+                pool.submit([&count] { ++count; });
+            }
+        }
+        ASSERT_EQ(10, count.load());
+    }
+
+} // namespace PapierMache